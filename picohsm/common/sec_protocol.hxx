@@ -0,0 +1,98 @@
+/**
+ * This file is part of picoHSM
+ * 
+ * picoHSM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Ledger SAS, written by Olivier Hériveaux
+ */
+
+/**
+ * Protocol between the STM32 and the secure MCU, over USART2 on the STM32
+ * side and the UART on the ATmega side. Shared by firmware-mcu, firmware-sec
+ * and the host tools which talk to either of them.
+ *
+ * Each instruction is a byte followed by its parameters. Multi-byte counts
+ * are little-endian. Instructions taking a PIN get its 8 digits in ASCII.
+ * Block instructions return a status byte, then, when it is SEC_STATUS_OK,
+ * exchange one output block per input block. Stream, session, CTR and CBC
+ * instructions use flow control: the secure MCU first sends the number of
+ * blocks which may be sent ahead (credits), and each returned block gives one
+ * credit back.
+ */
+
+#ifndef _SEC_PROTOCOL_HXX_
+#define _SEC_PROTOCOL_HXX_
+
+
+#include <stdint.h>
+
+
+#define AES_BLOCK_SIZE 16
+#define KEY_COUNT 8
+/** Number of ASCII digits of a PIN. */
+#define SEC_PIN_SIZE 8
+/** Flag of the key slot types returned by SEC_INS_KEY_INFO. */
+#define SEC_KEY_LOCKED 0x80
+/** Maximum number of AES blocks of one operation (16-bit count). */
+#define MAX_BLOCK_COUNT 0xffff
+/** Number of CBC contexts of the security MCU. */
+#define CBC_CONTEXT_COUNT 8
+/** Free bytes of the reception buffer of the secure MCU per credit. */
+#define SEC_CREDIT_SIZE 16
+/** Maximum number of credits granted at once (one byte). */
+#define SEC_MAX_CREDITS 255
+
+
+enum sec_ins_t {
+    /** PIN. Returns a status, opens a session on success. */
+    SEC_INS_VERIFY_PIN = 1,
+    /** PIN, key, 8-bit block count. Statuses for the PIN and key. */
+    SEC_INS_ENCRYPT = 2,
+    SEC_INS_DECRYPT = 3,
+    /** Returns a status and 4 little-endian 32-bit counters. */
+    SEC_INS_STATS = 4,
+    /** PIN, key, 16-bit block count. Statuses, then credits. */
+    SEC_INS_ENCRYPT_STREAM = 5,
+    SEC_INS_DECRYPT_STREAM = 6,
+    /** Key, 16-bit block count. Requires a session. */
+    SEC_INS_SESSION_ENCRYPT = 7,
+    SEC_INS_SESSION_DECRYPT = 8,
+    /** Key, initial counter block. Requires a session. */
+    SEC_INS_CTR_NONCE = 9,
+    /** Key, 16-bit block count. Requires a nonce. */
+    SEC_INS_CTR_XCRYPT = 10,
+    /** Context, key, IV. Requires a session. */
+    SEC_INS_CBC_INIT = 11,
+    /** Context, 16-bit block count. Requires an initialized context. */
+    SEC_INS_CBC_ENCRYPT = 12,
+    SEC_INS_CBC_DECRYPT = 13,
+    /** Key, 16-bit message length in bytes. Returns credits, then a
+     * credit byte after each group of half of them, then the tag. */
+    SEC_INS_CMAC = 14,
+    /** Returns a status and the type of each key slot. */
+    SEC_INS_KEY_INFO = 15
+};
+
+
+enum sec_status_t {
+    SEC_STATUS_OK = 1,
+    SEC_STATUS_BAD_PIN = 2,
+    SEC_STATUS_KEY_LOCKED = 3,
+    SEC_STATUS_NO_SESSION = 4,
+    SEC_STATUS_NO_NONCE = 5,
+    SEC_STATUS_NO_CONTEXT = 6
+};
+
+
+#endif
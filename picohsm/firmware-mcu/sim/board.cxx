@@ -0,0 +1,398 @@
+/**
+ * This file is part of picoHSM
+ * 
+ * picoHSM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Ledger SAS, written by Olivier Hériveaux
+ */
+
+/**
+ * Memory map of the simulated board. Peripheral registers are found by
+ * address by sim_periph, and their reads and writes are dispatched to the
+ * simulated peripheral which owns them.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <termios.h>
+#include <unistd.h>
+#include <mutex>
+#include <vector>
+#include "periph.hxx"
+#include "sec_model.hxx"
+#include "sim.hxx"
+#include "usart.hxx"
+#include "usart_sim.hxx"
+#include "w5500_sim.hxx"
+
+
+/** Bit-band alias region of the peripherals. */
+const uint32_t bitband_periph_base = 0x40000000;
+const uint32_t bitband_alias_base = 0x42000000;
+const uint32_t bitband_alias_size = 0x02000000;
+
+
+/**
+ * Reset and clock control. Oscillators and PLL are ready as soon as they are
+ * enabled, and the clock switch is immediate.
+ */
+class rcc_sim_t: public sim_periph_t {
+    public:
+        rcc_sim_t(): sim_periph_t(0x40023800, 0x400){}
+
+        uint32_t read(uint32_t offset) override {
+            uint32_t value = get(offset);
+            switch (offset){
+                case 0x00: // CR: HSIRDY, HSERDY, PLLRDY follow HSION, HSEON, PLLON
+                    return value | ((value & ((1 << 0) | (1 << 16) | (1 << 24))) << 1);
+                case 0x08: // CFGR: SWS follows SW
+                    return (value & ~(3 << 2)) | ((value & 3) << 2);
+                default:
+                    return value;
+            }
+        }
+};
+
+
+/**
+ * SPI1, where the W5500 is connected. Transfers complete instantly.
+ */
+class spi_sim_t: public sim_periph_t {
+    public:
+        spi_sim_t(w5500_sim_t* w5500_):
+            sim_periph_t(0x40013000, 0x400),
+            w5500(w5500_),
+            rx_data(0){}
+
+        uint32_t read(uint32_t offset) override {
+            switch (offset){
+                case 0x08: return 3; // SR: TXE and RXNE
+                case 0x0c: return rx_data;
+                default: return get(offset);
+            }
+        }
+
+        void write(uint32_t offset, uint32_t value) override {
+            if (offset == 0x0c){
+                rx_data = w5500->transfer((uint8_t)value);
+            } else {
+                set(offset, value);
+            }
+        }
+
+    private:
+        w5500_sim_t* w5500;
+        /** Last received byte. */
+        uint8_t rx_data;
+};
+
+
+/**
+ * Random number generator, fed by the host.
+ */
+class rng_sim_t: public sim_periph_t {
+    public:
+        rng_sim_t(): sim_periph_t(0x50060800, 0x400){}
+
+        uint32_t read(uint32_t offset) override {
+            switch (offset){
+                case 0x04: return 1; // SR: DRDY
+                case 0x08: {
+                    uint32_t x;
+                    if (getrandom(&x, sizeof(x), 0) != sizeof(x))
+                        sim_fail("getrandom failed");
+                    return x;
+                }
+                default: return get(offset);
+            }
+        }
+};
+
+
+/**
+ * Data watchpoint and trace unit. The cycle counter follows the host time at
+ * the system frequency.
+ */
+class dwt_sim_t: public sim_periph_t {
+    public:
+        dwt_sim_t(): sim_periph_t(0xe0001000, 0x1000), epoch(sim_time_ns()){}
+
+        uint32_t read(uint32_t offset) override {
+            if (offset == 0x04)
+                return (uint32_t)((sim_time_ns() - epoch) * (sys_freq / 1000000)
+                    / 1000);
+            return get(offset);
+        }
+
+        void write(uint32_t offset, uint32_t value) override {
+            if (offset == 0x04){
+                epoch = sim_time_ns() - (uint64_t)value * 1000 /
+                    (sys_freq / 1000000);
+            } else {
+                set(offset, value);
+            }
+        }
+
+    private:
+        /** Host time when the cycle counter was 0. */
+        uint64_t epoch;
+};
+
+
+/**
+ * System control space: NVIC and SCB. A system reset request ends the
+ * simulation.
+ */
+class scs_sim_t: public sim_periph_t {
+    public:
+        scs_sim_t(): sim_periph_t(0xe000e000, 0x1000){}
+
+        void write(uint32_t offset, uint32_t value) override {
+            if ((offset == 0xd0c) && ((value >> 16) == 0x5fa) &&
+                (value & (1 << 2))){
+                fprintf(stderr, "sim: system reset requested\n");
+                exit(1);
+            }
+            set(offset, value);
+        }
+};
+
+
+/**
+ * Bit-band alias of a single bit of a peripheral register.
+ */
+class bitband_sim_t: public sim_periph_t {
+    public:
+        bitband_sim_t(uint32_t alias):
+            sim_periph_t(alias, 4),
+            target(bitband_periph_base +
+                (((alias - bitband_alias_base) >> 5) & ~3)),
+            bit(((alias - bitband_alias_base) >> 2) & 31){}
+
+        uint32_t read(uint32_t) override {
+            return (sim_reg_read(reg()) >> bit) & 1;
+        }
+
+        void write(uint32_t, uint32_t value) override {
+            uint32_t x = sim_reg_read(reg()) & ~(1 << bit);
+            sim_reg_write(reg(), x | ((value & 1) << bit));
+        }
+
+    private:
+        /** Address of the register. */
+        uint32_t target;
+        /** Bit number in the register. */
+        uint32_t bit;
+
+        volatile sim_reg_t* reg() const {
+            return (volatile sim_reg_t*)sim_periph(target);
+        }
+};
+
+
+/**
+ * The simulated board: STM32F205 peripherals, the W5500 on SPI1, the secure
+ * MCU on USART2.
+ */
+class board_t: public gpio_listener_t {
+    public:
+        board_t();
+        volatile sim_reg_t* find(uint32_t);
+        sim_periph_t* owner(const volatile sim_reg_t*);
+        void pin_changed(uint32_t, bool) override;
+
+    private:
+        w5500_sim_t w5500;
+        usart_sim_t* usart_sec;
+        /** Model of the secure MCU, when it is used instead of a device. */
+        sec_model_t* sec_model;
+        std::vector<sim_periph_t*> periphs;
+        /** Protects periphs. Interrupt handlers run in the USART reception
+         * threads, and access registers from there. */
+        std::recursive_mutex mutex;
+
+        void attach_sec();
+};
+
+
+/**
+ * Constructor. Builds the memory map and connects the USARTs.
+ */
+board_t::board_t(): sec_model(0){
+    // Output data registers are reset to 0: W5500 held in reset and selected.
+    w5500.set_reset(true);
+    w5500.select(true);
+    periphs.push_back(new rcc_sim_t());
+    periphs.push_back(new sim_periph_t(0x40023c00, 0x400)); // Flash
+    periphs.push_back(new sim_periph_t(0x40003000, 0x400)); // IWDG
+    periphs.push_back(new sim_periph_t(0x40002c00, 0x400)); // WWDG
+    periphs.push_back(new gpio_sim_t(gpioa_base, this));
+    periphs.push_back(new gpio_sim_t(gpiob_base, 0));
+    periphs.push_back(new gpio_sim_t(gpioc_base, 0));
+    periphs.push_back(new spi_sim_t(&w5500));
+    periphs.push_back(new rng_sim_t());
+    periphs.push_back(new dwt_sim_t());
+    periphs.push_back(new scs_sim_t());
+    usart_sim_t* usart_debug = new usart_sim_t(0x40011000, usart1_handler);
+    periphs.push_back(usart_debug);
+    usart_sec = new usart_sim_t(0x40004400, usart2_handler);
+    periphs.push_back(usart_sec);
+    usart_debug->attach(-1, STDERR_FILENO);
+    attach_sec();
+}
+
+
+/**
+ * Connect USART2 to the secure MCU: the host model of its firmware if
+ * PICOHSM_SIM_SEC_MODEL is set, the serial device named by
+ * PICOHSM_SIM_SEC_TTY, or a new pseudo-terminal where the secure MCU
+ * simulation can be attached. PICOHSM_SIM_SEC_LINK gives a fixed path for the
+ * pseudo-terminal.
+ */
+void board_t::attach_sec(){
+    if (sim_env_u32("PICOHSM_SIM_SEC_MODEL", 0)){
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds))
+            sim_fail("cannot create the secure MCU model socket");
+        sec_model_config_t config;
+        config.byte_ns = sim_env_u32("PICOHSM_SIM_SEC_BYTE_NS",
+            config.byte_ns);
+        config.block_ns = sim_env_u32("PICOHSM_SIM_SEC_BLOCK_NS",
+            config.block_ns);
+        uint32_t rx_buffer_size = sim_env_u32("PICOHSM_SIM_SEC_RX_BUFFER",
+            config.rx_buffer_size);
+        if ((rx_buffer_size < 32) || (rx_buffer_size > 0xffff))
+            sim_fail("PICOHSM_SIM_SEC_RX_BUFFER must be 32 to 65535");
+        config.rx_buffer_size = rx_buffer_size;
+        sec_model = new sec_model_t(fds[1], config);
+        // Output data registers are reset to 0: secure MCU held in reset.
+        sec_model->set_reset(true);
+        fprintf(stderr, "USART2: secure MCU model\n");
+        usart_sec->attach(fds[0], fds[0]);
+        return;
+    }
+    const char* tty = sim_env("PICOHSM_SIM_SEC_TTY", 0);
+    int fd;
+    if (tty){
+        fd = open(tty, O_RDWR | O_NOCTTY);
+        if (fd < 0)
+            sim_fail("cannot open PICOHSM_SIM_SEC_TTY");
+    } else {
+        fd = posix_openpt(O_RDWR | O_NOCTTY);
+        if ((fd < 0) || grantpt(fd) || unlockpt(fd))
+            sim_fail("cannot create a pseudo-terminal");
+        tty = ptsname(fd);
+        // Kept open, so the master side does not see a hang up while the
+        // secure MCU is not attached.
+        if (open(tty, O_RDWR | O_NOCTTY) < 0)
+            sim_fail("cannot open the pseudo-terminal");
+        const char* link = sim_env("PICOHSM_SIM_SEC_LINK", 0);
+        if (link){
+            unlink(link);
+            if (symlink(tty, link))
+                sim_fail("cannot create PICOHSM_SIM_SEC_LINK");
+            tty = link;
+        }
+    }
+    termios t;
+    if (tcgetattr(fd, &t) == 0){
+        cfmakeraw(&t);
+        tcsetattr(fd, TCSANOW, &t);
+    }
+    fprintf(stderr, "USART2: secure MCU on %s\n", tty);
+    usart_sec->attach(fd, fd);
+}
+
+
+/**
+ * @return Register at an address of the memory map. Fails if the address is
+ *     not mapped.
+ * @param addr Address.
+ */
+volatile sim_reg_t* board_t::find(uint32_t addr){
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    for (sim_periph_t* p: periphs){
+        if (p->covers(addr))
+            return p->reg(addr);
+    }
+    if ((addr >= bitband_alias_base) &&
+        (addr - bitband_alias_base < bitband_alias_size)){
+        sim_periph_t* p = new bitband_sim_t(addr & ~3);
+        periphs.push_back(p);
+        return p->reg(addr);
+    }
+    char msg[64];
+    snprintf(msg, sizeof(msg), "access to unmapped address 0x%08x", addr);
+    sim_fail(msg);
+}
+
+
+/**
+ * @return Peripheral owning a register. Fails if there is none.
+ * @param r Register.
+ */
+sim_periph_t* board_t::owner(const volatile sim_reg_t* r){
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    for (sim_periph_t* p: periphs){
+        if (p->contains(r))
+            return p;
+    }
+    sim_fail("access to a register outside of the peripherals");
+}
+
+
+/**
+ * Wires GPIOA outputs: PA1 is the W5500 reset, PA4 the W5500 chip select,
+ * PA11 the secure MCU reset. The latter only has an effect on the model, an
+ * external secure MCU is not reset.
+ */
+void board_t::pin_changed(uint32_t pin, bool level){
+    switch (pin){
+        case 1: w5500.set_reset(!level); break;
+        case 4: w5500.select(!level); break;
+        case 11:
+            if (sec_model)
+                sec_model->set_reset(!level);
+            break;
+    }
+}
+
+
+/**
+ * @return The board, built at the first peripheral access.
+ */
+static board_t& board(){
+    static board_t instance;
+    return instance;
+}
+
+
+volatile void* sim_periph(uint32_t addr){
+    return board().find(addr);
+}
+
+
+uint32_t sim_reg_read(const volatile sim_reg_t* r){
+    sim_periph_t* p = board().owner(r);
+    return p->read(p->offset(r));
+}
+
+
+void sim_reg_write(volatile sim_reg_t* r, uint32_t value){
+    sim_periph_t* p = board().owner(r);
+    p->write(p->offset(r), value);
+}
@@ -0,0 +1,175 @@
+/**
+ * This file is part of picoHSM
+ * 
+ * picoHSM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Ledger SAS, written by Olivier Hériveaux
+ */
+
+#include "periph.hxx"
+
+
+/**
+ * Constructor.
+ *
+ * @param base_ Address of the first register in the memory map.
+ * @param size_ Size of the register block, in bytes.
+ */
+sim_periph_t::sim_periph_t(uint32_t base_, uint32_t size_):
+    base(base_),
+    size(size_),
+    regs(new sim_reg_t[size_ / 4]()){}
+
+
+sim_periph_t::~sim_periph_t(){
+    delete[] regs;
+}
+
+
+/**
+ * Called when the firmware reads a register.
+ *
+ * @param offset Offset of the register in the block.
+ * @return Register value.
+ */
+uint32_t sim_periph_t::read(uint32_t offset){
+    return get(offset);
+}
+
+
+/**
+ * Called when the firmware writes a register.
+ *
+ * @param offset Offset of the register in the block.
+ * @param value Written value.
+ */
+void sim_periph_t::write(uint32_t offset, uint32_t value){
+    set(offset, value);
+}
+
+
+/**
+ * @return true if a register belongs to this peripheral.
+ * @param r Register.
+ */
+bool sim_periph_t::contains(const volatile sim_reg_t* r) const {
+    return (r >= regs) && (r < regs + size / 4);
+}
+
+
+/**
+ * @return true if an address of the memory map belongs to this peripheral.
+ * @param addr Address.
+ */
+bool sim_periph_t::covers(uint32_t addr) const {
+    return (addr >= base) && (addr - base < size);
+}
+
+
+/**
+ * @return Register at an address of the memory map.
+ * @param addr Address. Must be covered by the peripheral.
+ */
+volatile sim_reg_t* sim_periph_t::reg(uint32_t addr){
+    return regs + (addr - base) / 4;
+}
+
+
+/**
+ * @return Offset in the block of a register of this peripheral.
+ * @param r Register.
+ */
+uint32_t sim_periph_t::offset(const volatile sim_reg_t* r) const {
+    return (uint32_t)(r - regs) * 4;
+}
+
+
+/**
+ * @return Stored value of a register.
+ * @param offset Offset of the register in the block.
+ */
+uint32_t sim_periph_t::get(uint32_t offset) const {
+    return regs[offset / 4].value;
+}
+
+
+/**
+ * Change the stored value of a register.
+ *
+ * @param offset Offset of the register in the block.
+ * @param value New value.
+ */
+void sim_periph_t::set(uint32_t offset, uint32_t value){
+    regs[offset / 4].value = value;
+}
+
+
+/** Offsets of the GPIO registers. */
+enum {
+    GPIO_IDR = 0x10,
+    GPIO_ODR = 0x14,
+    GPIO_BSRR = 0x18
+};
+
+
+/**
+ * Constructor.
+ *
+ * @param base Address of the port registers.
+ * @param listener_ Notified of the output changes. Can be null.
+ */
+gpio_sim_t::gpio_sim_t(uint32_t base, gpio_listener_t* listener_):
+    sim_periph_t(base, 0x400),
+    listener(listener_){}
+
+
+uint32_t gpio_sim_t::read(uint32_t offset){
+    // Nothing is connected to the inputs: outputs are read back.
+    if (offset == GPIO_IDR)
+        return get(GPIO_ODR);
+    return get(offset);
+}
+
+
+void gpio_sim_t::write(uint32_t offset, uint32_t value){
+    switch (offset){
+        case GPIO_ODR:
+            set_odr(value & 0xffff);
+            break;
+        case GPIO_BSRR:
+            // Set has priority over reset when both bits are written.
+            set_odr((get(GPIO_ODR) & ~(value >> 16)) | (value & 0xffff));
+            break;
+        default:
+            set(offset, value);
+    }
+}
+
+
+/**
+ * Change the output data register and notify the listener of each pin which
+ * changed.
+ *
+ * @param odr New value.
+ */
+void gpio_sim_t::set_odr(uint32_t odr){
+    uint32_t changed = get(GPIO_ODR) ^ odr;
+    set(GPIO_ODR, odr);
+    if (!listener)
+        return;
+    for (uint32_t pin = 0; pin < 16; ++pin){
+        if (changed & (1 << pin))
+            listener->pin_changed(pin, (odr >> pin) & 1);
+    }
+}
@@ -0,0 +1,86 @@
+/**
+ * This file is part of picoHSM
+ * 
+ * picoHSM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Ledger SAS, written by Olivier Hériveaux
+ */
+
+#ifndef _PERIPH_HXX_
+#define _PERIPH_HXX_
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include "sim_reg.hxx"
+
+
+/**
+ * A simulated peripheral: a block of registers at an address of the STM32F205
+ * memory map. By default, registers behave as plain memory. Peripherals with
+ * side effects override read and write.
+ */
+class sim_periph_t {
+    public:
+        sim_periph_t(uint32_t, uint32_t);
+        virtual ~sim_periph_t();
+        virtual uint32_t read(uint32_t);
+        virtual void write(uint32_t, uint32_t);
+        bool contains(const volatile sim_reg_t*) const;
+        bool covers(uint32_t) const;
+        volatile sim_reg_t* reg(uint32_t);
+        uint32_t offset(const volatile sim_reg_t*) const;
+
+    protected:
+        uint32_t get(uint32_t) const;
+        void set(uint32_t, uint32_t);
+
+    private:
+        /** Address of the first register in the memory map. */
+        uint32_t base;
+        /** Size of the register block, in bytes. */
+        uint32_t size;
+        /** Storage of the registers. */
+        sim_reg_t* regs;
+};
+
+
+/**
+ * Observer of the output pins of a GPIO port.
+ */
+class gpio_listener_t {
+    public:
+        virtual void pin_changed(uint32_t, bool) = 0;
+};
+
+
+/**
+ * GPIO port. Outputs written with ODR or BSRR are notified to a listener, and
+ * read back by IDR.
+ */
+class gpio_sim_t: public sim_periph_t {
+    public:
+        gpio_sim_t(uint32_t, gpio_listener_t*);
+        uint32_t read(uint32_t) override;
+        void write(uint32_t, uint32_t) override;
+
+    private:
+        /** Notified of the output changes. Can be null. */
+        gpio_listener_t* listener;
+
+        void set_odr(uint32_t);
+};
+
+
+#endif
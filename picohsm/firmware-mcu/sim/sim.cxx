@@ -0,0 +1,75 @@
+/**
+ * This file is part of picoHSM
+ * 
+ * picoHSM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Ledger SAS, written by Olivier Hériveaux
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "sim.hxx"
+
+
+/**
+ * @return Host monotonic time, in nanoseconds.
+ */
+uint64_t sim_time_ns(){
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/**
+ * @return Value of an environment variable of the simulation.
+ * @param name Variable name.
+ * @param def Value returned if the variable is not set.
+ */
+const char* sim_env(const char* name, const char* def){
+    const char* value = getenv(name);
+    return value ? value : def;
+}
+
+
+/**
+ * @return Value of a numeric environment variable of the simulation. Fails if
+ *     the value is not a number.
+ * @param name Variable name.
+ * @param def Value returned if the variable is not set.
+ */
+uint32_t sim_env_u32(const char* name, uint32_t def){
+    const char* value = getenv(name);
+    if (!value)
+        return def;
+    char* end;
+    unsigned long x = strtoul(value, &end, 0);
+    if ((*value == 0) || (*end != 0)){
+        fprintf(stderr, "sim: %s is not a number\n", name);
+        exit(1);
+    }
+    return (uint32_t)x;
+}
+
+
+/**
+ * Stop the simulation because of an error which the hardware would not have.
+ *
+ * @param msg Error message.
+ */
+void sim_fail(const char* msg){
+    fprintf(stderr, "sim: %s\n", msg);
+    exit(1);
+}
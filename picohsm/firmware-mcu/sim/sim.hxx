@@ -0,0 +1,33 @@
+/**
+ * This file is part of picoHSM
+ * 
+ * picoHSM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Ledger SAS, written by Olivier Hériveaux
+ */
+
+#ifndef _SIM_HXX_
+#define _SIM_HXX_
+
+
+#include <stdint.h>
+
+
+uint64_t sim_time_ns();
+const char* sim_env(const char*, const char*);
+uint32_t sim_env_u32(const char*, uint32_t);
+[[noreturn]] void sim_fail(const char*);
+
+
+#endif
@@ -0,0 +1,69 @@
+/**
+ * This file is part of picoHSM
+ * 
+ * picoHSM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Ledger SAS, written by Olivier Hériveaux
+ */
+
+#ifndef _SIM_REG_HXX_
+#define _SIM_REG_HXX_
+
+
+#include <stdint.h>
+
+
+class sim_reg_t;
+
+uint32_t sim_reg_read(const volatile sim_reg_t*);
+void sim_reg_write(volatile sim_reg_t*, uint32_t);
+volatile void* sim_periph(uint32_t);
+
+
+/**
+ * A 32-bits peripheral register of the host simulation. It has the size of a
+ * hardware register, so the register structures of stm32f205.hxx keep their
+ * layout, but reads and writes are forwarded to the simulated peripheral which
+ * owns the register.
+ */
+class sim_reg_t {
+    public:
+        operator uint32_t() const volatile {
+            return sim_reg_read(this);
+        }
+
+        // Assignments return nothing: a volatile reference result would be
+        // read again when the statement is evaluated.
+        void operator=(uint32_t x) volatile {
+            sim_reg_write(this, x);
+        }
+
+        void operator|=(uint32_t x) volatile {
+            *this = (uint32_t)*this | x;
+        }
+
+        void operator&=(uint32_t x) volatile {
+            *this = (uint32_t)*this & x;
+        }
+
+        void operator^=(uint32_t x) volatile {
+            *this = (uint32_t)*this ^ x;
+        }
+
+        /** Stored value, for registers without side effects. */
+        uint32_t value;
+};
+
+
+#endif
@@ -0,0 +1,150 @@
+/**
+ * This file is part of picoHSM
+ * 
+ * picoHSM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Ledger SAS, written by Olivier Hériveaux
+ */
+
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include "usart_sim.hxx"
+#include "sim.hxx"
+#include "system.hxx"
+
+
+/** Offsets of the USART registers. */
+enum {
+    USART_SR = 0x00,
+    USART_DR = 0x04,
+    USART_BRR = 0x08,
+    USART_CR1 = 0x0c
+};
+
+/** Status register flags. */
+const uint32_t usart_sr_rxne = 1 << 5;
+const uint32_t usart_sr_tc = 1 << 6;
+const uint32_t usart_sr_txe = 1 << 7;
+/** RXNE interrupt enable bit of CR1. */
+const uint32_t usart_cr1_rxneie = 1 << 5;
+
+
+/**
+ * Constructor. Nothing is connected until attach is called.
+ *
+ * @param base Address of the USART registers.
+ * @param handler_ Interrupt handler of the firmware for this USART.
+ */
+usart_sim_t::usart_sim_t(uint32_t base, void (*handler_)()):
+    sim_periph_t(base, 0x400),
+    handler(handler_),
+    fd_in(-1),
+    fd_out(-1),
+    tx_end(0),
+    rx_data(0),
+    rx_full(false){}
+
+
+/**
+ * Connect the USART. Must be called once.
+ *
+ * @param fd_in_ Where received bytes come from. -1 for none.
+ * @param fd_out_ Where transmitted bytes go. -1 for none.
+ */
+void usart_sim_t::attach(int fd_in_, int fd_out_){
+    fd_in = fd_in_;
+    fd_out = fd_out_;
+    if (fd_in >= 0){
+        rx_thread = std::thread(&usart_sim_t::rx_loop, this);
+        rx_thread.detach();
+    }
+}
+
+
+uint32_t usart_sim_t::read(uint32_t offset){
+    switch (offset){
+        case USART_SR: {
+            uint32_t sr = 0;
+            if (sim_time_ns() >= tx_end)
+                sr |= usart_sr_tc | usart_sr_txe;
+            if (rx_full)
+                sr |= usart_sr_rxne;
+            return sr;
+        }
+        case USART_DR:
+            rx_full = false;
+            return rx_data;
+        default:
+            return get(offset);
+    }
+}
+
+
+void usart_sim_t::write(uint32_t offset, uint32_t value){
+    if (offset != USART_DR){
+        set(offset, value);
+        return;
+    }
+    uint64_t now = sim_time_ns();
+    tx_end = ((tx_end > now) ? (uint64_t)tx_end : now) + byte_time();
+    if (fd_out < 0)
+        return;
+    uint8_t byte = (uint8_t)value;
+    while ((::write(fd_out, &byte, 1) < 0) && (errno == EINTR)){}
+}
+
+
+/**
+ * @return Duration of one byte on the line, in nanoseconds: a start bit, 8
+ *     data bits and a stop bit at the baudrate set in BRR.
+ */
+uint64_t usart_sim_t::byte_time() const {
+    // BRR = Fck / Baudrate, see usart_t::init
+    return 10 * (uint64_t)get(USART_BRR) * 1000000000 / sys_freq;
+}
+
+
+/**
+ * Deliver the received bytes to the firmware, no faster than the baudrate.
+ * Bytes received while the RXNE interrupt is disabled are lost.
+ */
+void usart_sim_t::rx_loop(){
+    uint64_t slot = 0;
+    for (;;){
+        uint8_t buf[64];
+        ssize_t n = ::read(fd_in, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return;
+        for (ssize_t i = 0; i < n; ++i){
+            // Sleep only when far ahead of the line rate: the sleep
+            // granularity of the host is coarser than the byte duration.
+            uint64_t now = sim_time_ns();
+            if (slot < now){
+                slot = now;
+            } else if (slot - now > 100000){
+                timespec ts = {0, (long)(slot - now)};
+                nanosleep(&ts, 0);
+            }
+            slot += byte_time();
+            if ((get(USART_CR1) & usart_cr1_rxneie) == 0)
+                continue;
+            rx_data = buf[i];
+            rx_full = true;
+            handler();
+        }
+    }
+}
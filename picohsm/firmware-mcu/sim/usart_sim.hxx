@@ -0,0 +1,63 @@
+/**
+ * This file is part of picoHSM
+ * 
+ * picoHSM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Ledger SAS, written by Olivier Hériveaux
+ */
+
+#ifndef _USART_SIM_HXX_
+#define _USART_SIM_HXX_
+
+
+#include <atomic>
+#include <thread>
+#include "periph.hxx"
+
+
+/**
+ * USART connected to a file descriptor. Bytes are transmitted and received at
+ * the baudrate configured in BRR, as on the board. Received bytes are
+ * delivered by a thread which calls the interrupt handler of the firmware, like
+ * the NVIC would.
+ */
+class usart_sim_t: public sim_periph_t {
+    public:
+        usart_sim_t(uint32_t, void (*)());
+        uint32_t read(uint32_t) override;
+        void write(uint32_t, uint32_t) override;
+        void attach(int, int);
+
+    private:
+        /** Interrupt handler of the firmware. */
+        void (*handler)();
+        /** Where received bytes come from. -1 if nothing is connected. */
+        int fd_in;
+        /** Where transmitted bytes go. -1 if nothing is connected. */
+        int fd_out;
+        /** Time when the transmission of the last byte completes. */
+        std::atomic<uint64_t> tx_end;
+        /** Received byte, until read from DR. */
+        std::atomic<uint8_t> rx_data;
+        /** RXNE flag. */
+        std::atomic<bool> rx_full;
+        /** Delivers the received bytes. */
+        std::thread rx_thread;
+
+        uint64_t byte_time() const;
+        void rx_loop();
+};
+
+
+#endif
@@ -0,0 +1,608 @@
+/**
+ * This file is part of picoHSM
+ * 
+ * picoHSM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Ledger SAS, written by Olivier Hériveaux
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include "w5500_sim.hxx"
+#include "sim.hxx"
+#include "w5500.hxx"
+
+
+/** Offsets of the common registers. */
+enum {
+    COMMON_RTR = 0x19,
+    COMMON_RCR = 0x1b,
+    COMMON_PHYCFGR = 0x2e,
+    COMMON_VERSIONR = 0x39
+};
+
+/** Offsets of the socket registers. */
+enum {
+    SN_MR = 0x00,
+    SN_CR = 0x01,
+    SN_IR = 0x02,
+    SN_SR = 0x03,
+    SN_PORT = 0x04,
+    SN_DIPR = 0x0c,
+    SN_DPORT = 0x10,
+    SN_TTL = 0x16,
+    SN_RXBUF_SIZE = 0x1e,
+    SN_TXBUF_SIZE = 0x1f,
+    SN_TX_FSR = 0x20,
+    SN_TX_RD = 0x22,
+    SN_TX_WR = 0x24,
+    SN_RX_RSR = 0x26,
+    SN_RX_RD = 0x28,
+    SN_RX_WR = 0x2a,
+    SN_IMR = 0x2c,
+    SN_FRAG = 0x2d
+};
+
+
+/**
+ * Wait for an event on a host socket.
+ *
+ * @param fd Socket.
+ * @param events Events, as for poll.
+ * @param timeout_ms Maximum waiting time, in milliseconds.
+ * @return true if an event occured.
+ */
+static bool wait_fd(int fd, short events, int timeout_ms){
+    pollfd p = {fd, events, 0};
+    return poll(&p, 1, timeout_ms) > 0;
+}
+
+
+/**
+ * @return true if a socket call failed only because it would block.
+ */
+static bool would_block(){
+    return (errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR);
+}
+
+
+/**
+ * Constructor. The chip starts in its reset state.
+ */
+w5500_sim_t::w5500_sim_t():
+    in_reset(false),
+    selected(false),
+    frame_pos(0),
+    address(0),
+    control(0){
+    for (int sn = 0; sn < socket_count; ++sn)
+        sockets[sn].fd = -1;
+    reset();
+}
+
+
+/**
+ * Drive the reset pin. Asserting it closes all the connections and restores
+ * the default register values.
+ *
+ * @param active true while the reset pin is low.
+ */
+void w5500_sim_t::set_reset(bool active){
+    in_reset = active;
+    if (active)
+        reset();
+}
+
+
+/**
+ * Drive the chip select pin. Each selection starts a new SPI frame.
+ *
+ * @param active true while the chip select pin is low.
+ */
+void w5500_sim_t::select(bool active){
+    selected = active;
+    frame_pos = 0;
+}
+
+
+/**
+ * Exchange a byte on the SPI bus. A frame has a 16-bit address, a control byte
+ * and the data, the address being incremented after each data byte.
+ *
+ * @param mosi Byte sent to the W5500.
+ * @return Byte received from the W5500.
+ */
+uint8_t w5500_sim_t::transfer(uint8_t mosi){
+    if (!selected || in_reset)
+        return 0;
+    switch (frame_pos++){
+        case 0:
+            address = (uint16_t)mosi << 8;
+            return 0x01;
+        case 1:
+            address |= mosi;
+            return 0x02;
+        case 2:
+            control = mosi;
+            return 0x03;
+    }
+    uint8_t block = control >> 3;
+    if (control & (1 << 2)){
+        write_byte(block, address++, mosi);
+        return 0;
+    }
+    return read_byte(block, address++);
+}
+
+
+/**
+ * Restore the reset values of the registers. Established connections are
+ * closed.
+ */
+void w5500_sim_t::reset(){
+    memset(common, 0, sizeof(common));
+    common[COMMON_RTR] = 0x07; // 200 ms
+    common[COMMON_RTR + 1] = 0xd0;
+    common[COMMON_RCR] = 8;
+    common[COMMON_PHYCFGR] = 0xb8;
+    common[COMMON_VERSIONR] = 4;
+    for (int sn = 0; sn < socket_count; ++sn){
+        socket_sim_t& s = sockets[sn];
+        if (s.fd >= 0)
+            ::close(s.fd);
+        s.fd = -1;
+        s.rx_rd = 0;
+        memset(s.regs, 0, sizeof(s.regs));
+        s.regs[SN_TTL] = 0x80;
+        s.regs[SN_RXBUF_SIZE] = 2;
+        s.regs[SN_TXBUF_SIZE] = 2;
+        s.regs[SN_IMR] = 0xff;
+        s.regs[SN_FRAG] = 0x40;
+        set_u16(sn, SN_TX_FSR, buf_size(sn, true));
+    }
+}
+
+
+/**
+ * Read a byte of a register block.
+ *
+ * @param block Block select field of the control byte.
+ * @param addr Offset in the block.
+ * @return Value.
+ */
+uint8_t w5500_sim_t::read_byte(uint8_t block, uint16_t addr){
+    if (block == 0){
+        if (addr == COMMON_PHYCFGR)
+            return read_phycfgr();
+        return (addr < sizeof(common)) ? common[addr] : 0;
+    }
+    int sn = (block - 1) >> 2;
+    if (sn >= socket_count)
+        return 0;
+    socket_sim_t& s = sockets[sn];
+    switch ((block - 1) & 3){
+        case 0:
+            if (addr >= sizeof(s.regs))
+                return 0;
+            // Polled registers reflect the host socket. Reading them while
+            // the socket is idle waits a little for activity, so the polling
+            // loops of the firmware do not spin.
+            if ((addr == SN_SR) || (addr == SN_RX_RSR))
+                update(sn, true);
+            return s.regs[addr];
+        case 1: return s.tx[addr & (buf_size(sn, true) - 1)];
+        case 2: return s.rx[addr & (buf_size(sn, false) - 1)];
+        default: return 0;
+    }
+}
+
+
+/**
+ * Write a byte of a register block.
+ *
+ * @param block Block select field of the control byte.
+ * @param addr Offset in the block.
+ * @param value Value.
+ */
+void w5500_sim_t::write_byte(uint8_t block, uint16_t addr, uint8_t value){
+    if (block == 0){
+        if ((addr < sizeof(common)) && (addr != COMMON_VERSIONR))
+            common[addr] = value;
+        return;
+    }
+    int sn = (block - 1) >> 2;
+    if (sn >= socket_count)
+        return;
+    socket_sim_t& s = sockets[sn];
+    switch ((block - 1) & 3){
+        case 0:
+            switch (addr){
+                case SN_CR:
+                    command(sn, value);
+                    return;
+                case SN_IR:
+                    // Writing 1 clears the flag
+                    s.regs[SN_IR] &= ~value;
+                    return;
+                // Read-only registers
+                case SN_SR:
+                case SN_TX_FSR: case SN_TX_FSR + 1:
+                case SN_TX_RD: case SN_TX_RD + 1:
+                case SN_RX_RSR: case SN_RX_RSR + 1:
+                case SN_RX_WR: case SN_RX_WR + 1:
+                    return;
+            }
+            if (addr >= sizeof(s.regs))
+                return;
+            s.regs[addr] = value;
+            if (addr == SN_TX_WR + 1)
+                set_u16(sn, SN_TX_FSR, buf_size(sn, true) -
+                    (uint16_t)(get_u16(sn, SN_TX_WR) - get_u16(sn, SN_TX_RD)));
+            break;
+        case 1:
+            s.tx[addr & (buf_size(sn, true) - 1)] = value;
+            break;
+        case 2:
+            s.rx[addr & (buf_size(sn, false) - 1)] = value;
+            break;
+    }
+}
+
+
+/**
+ * @return PHYCFGR value. The link is always up, with the speed and duplex of
+ *     the configured operation mode.
+ */
+uint8_t w5500_sim_t::read_phycfgr() const {
+    uint8_t cfg = common[COMMON_PHYCFGR];
+    // Without OPMD, the mode is set by pins: all capable, auto-negotiation.
+    phy_mode_t mode = phy_mode_t::auto_all;
+    if (cfg & (1 << 6))
+        mode = (phy_mode_t)((cfg >> 3) & 7);
+    bool link = mode != phy_mode_t::power_down;
+    bool speed_100 = (mode != phy_mode_t::base10_half) &&
+        (mode != phy_mode_t::base10_full);
+    bool full_duplex = (mode == phy_mode_t::base10_full) ||
+        (mode == phy_mode_t::base100_full) || (mode == phy_mode_t::auto_all);
+    return (cfg & 0xf8) | (link && full_duplex ? (1 << 2) : 0) |
+        (link && speed_100 ? (1 << 1) : 0) | (link ? 1 : 0);
+}
+
+
+/**
+ * Execute a socket command.
+ *
+ * @param sn Socket number.
+ * @param cmd Value written to Sn_CR.
+ */
+void w5500_sim_t::command(int sn, uint8_t cmd){
+    socket_sim_t& s = sockets[sn];
+    socket_status_t status = (socket_status_t)s.regs[SN_SR];
+    bool connected = (status == socket_status_t::established) ||
+        (status == socket_status_t::close_wait);
+    switch ((socket_command_t)cmd){
+        case socket_command_t::open:
+            close(sn, 0);
+            s.regs[SN_IR] = 0;
+            s.rx_rd = 0;
+            set_u16(sn, SN_TX_RD, 0);
+            set_u16(sn, SN_TX_WR, 0);
+            set_u16(sn, SN_TX_FSR, buf_size(sn, true));
+            set_u16(sn, SN_RX_RD, 0);
+            set_u16(sn, SN_RX_WR, 0);
+            set_u16(sn, SN_RX_RSR, 0);
+            if ((s.regs[SN_MR] & 0x0f) == 1){
+                s.regs[SN_SR] = (uint8_t)socket_status_t::init;
+            } else {
+                fprintf(stderr, "W5500: only TCP sockets are simulated.\n");
+            }
+            break;
+        case socket_command_t::listen:
+            if (status == socket_status_t::init){
+                listener(get_u16(sn, SN_PORT));
+                s.regs[SN_SR] = (uint8_t)socket_status_t::listen;
+            }
+            break;
+        case socket_command_t::connect: {
+            if (status != socket_status_t::init)
+                break;
+            sockaddr_in addr = {};
+            addr.sin_family = AF_INET;
+            memcpy(&addr.sin_addr, s.regs + SN_DIPR, 4);
+            addr.sin_port = htons(get_u16(sn, SN_DPORT));
+            s.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+            if ((s.fd >= 0) && ((::connect(s.fd, (sockaddr*)&addr,
+                sizeof(addr)) == 0) || (errno == EINPROGRESS))){
+                s.regs[SN_SR] = (uint8_t)socket_status_t::synsent;
+            } else {
+                close(sn, sn_ir_timeout);
+            }
+            break;
+        }
+        case socket_command_t::discon:
+            if (connected){
+                // FIN is sent, and the peer has a W5500 timeout to answer.
+                shutdown(s.fd, SHUT_WR);
+                s.regs[SN_SR] = (uint8_t)socket_status_t::fin_wait;
+                uint32_t rtr = ((uint32_t)common[COMMON_RTR] << 8) |
+                    common[COMMON_RTR + 1];
+                s.discon_deadline = sim_time_ns() +
+                    (uint64_t)rtr * 100000 * (common[COMMON_RCR] + 1);
+            } else {
+                close(sn, 0);
+            }
+            break;
+        case socket_command_t::close:
+            close(sn, 0);
+            break;
+        case socket_command_t::send:
+        case socket_command_t::send_keep:
+            if (connected)
+                send(sn);
+            break;
+        case socket_command_t::recv:
+            s.rx_rd = get_u16(sn, SN_RX_RD);
+            set_u16(sn, SN_RX_RSR, get_u16(sn, SN_RX_WR) - s.rx_rd);
+            receive(sn, false);
+            break;
+        default:;
+    }
+}
+
+
+/**
+ * Update the socket registers with the state of the host socket.
+ *
+ * @param sn Socket number.
+ * @param wait true to wait up to 1 ms for activity if there is none.
+ */
+void w5500_sim_t::update(int sn, bool wait){
+    socket_sim_t& s = sockets[sn];
+    switch ((socket_status_t)s.regs[SN_SR]){
+        case socket_status_t::listen:
+            accept(sn, wait);
+            break;
+        case socket_status_t::synsent: {
+            if (!wait_fd(s.fd, POLLOUT, wait ? 1 : 0))
+                break;
+            int err = 0;
+            socklen_t len = sizeof(err);
+            getsockopt(s.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+            if (err){
+                close(sn, sn_ir_timeout);
+            } else {
+                int one = 1;
+                setsockopt(s.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                s.regs[SN_SR] = (uint8_t)socket_status_t::established;
+                s.regs[SN_IR] |= sn_ir_con;
+            }
+            break;
+        }
+        case socket_status_t::established:
+        case socket_status_t::close_wait:
+            receive(sn, wait);
+            break;
+        case socket_status_t::fin_wait: {
+            // Data received after the disconnection request is dropped.
+            uint8_t buf[256];
+            ssize_t n;
+            while ((n = recv(s.fd, buf, sizeof(buf), 0)) > 0){}
+            if ((n == 0) || !would_block() ||
+                (sim_time_ns() >= s.discon_deadline)){
+                close(sn, sn_ir_discon);
+            } else if (wait){
+                wait_fd(s.fd, POLLIN, 1);
+            }
+            break;
+        }
+        default:;
+    }
+}
+
+
+/**
+ * Accept a pending connection on the listening port of a socket.
+ *
+ * @param sn Socket number.
+ * @param wait true to wait up to 1 ms for a connection if there is none.
+ */
+void w5500_sim_t::accept(int sn, bool wait){
+    socket_sim_t& s = sockets[sn];
+    int lfd = listener(get_u16(sn, SN_PORT));
+    sockaddr_in addr = {};
+    socklen_t len = sizeof(addr);
+    int fd = accept4(lfd, (sockaddr*)&addr, &len, SOCK_NONBLOCK);
+    if ((fd < 0) && wait && wait_fd(lfd, POLLIN, 1))
+        fd = accept4(lfd, (sockaddr*)&addr, &len, SOCK_NONBLOCK);
+    if (fd < 0)
+        return;
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    s.fd = fd;
+    memcpy(s.regs + SN_DIPR, &addr.sin_addr, 4);
+    set_u16(sn, SN_DPORT, ntohs(addr.sin_port));
+    s.regs[SN_SR] = (uint8_t)socket_status_t::established;
+    s.regs[SN_IR] |= sn_ir_con;
+}
+
+
+/**
+ * Move data received by the host socket to the RX buffer of a socket, as
+ * long as there is room for it.
+ *
+ * @param sn Socket number.
+ * @param wait true to wait up to 1 ms for data if the RX buffer is empty.
+ */
+void w5500_sim_t::receive(int sn, bool wait){
+    socket_sim_t& s = sockets[sn];
+    uint16_t size = buf_size(sn, false);
+    uint16_t wr = get_u16(sn, SN_RX_WR);
+    bool waited = !wait;
+    while (s.fd >= 0){
+        uint16_t used = wr - s.rx_rd;
+        if (used >= size)
+            break;
+        // Contiguous free space, up to the end of the buffer
+        uint16_t pos = wr & (size - 1);
+        size_t n = std::min((uint16_t)(size - used), (uint16_t)(size - pos));
+        ssize_t r = recv(s.fd, s.rx + pos, n, 0);
+        if (r > 0){
+            wr += r;
+            s.regs[SN_IR] |= sn_ir_recv;
+        } else if (r == 0){
+            // FIN received
+            if (s.regs[SN_SR] == (uint8_t)socket_status_t::established){
+                s.regs[SN_SR] = (uint8_t)socket_status_t::close_wait;
+                s.regs[SN_IR] |= sn_ir_discon;
+            }
+            break;
+        } else if (would_block()){
+            if (used || waited)
+                break;
+            waited = true;
+            wait_fd(s.fd, POLLIN, 1);
+        } else {
+            close(sn, sn_ir_discon);
+            break;
+        }
+    }
+    set_u16(sn, SN_RX_WR, wr);
+    set_u16(sn, SN_RX_RSR, wr - s.rx_rd);
+}
+
+
+/**
+ * Send the data of the TX buffer, between Sn_TX_RD and Sn_TX_WR. Blocks until
+ * the host socket has taken all of it, or the W5500 timeout expires.
+ *
+ * @param sn Socket number.
+ */
+void w5500_sim_t::send(int sn){
+    socket_sim_t& s = sockets[sn];
+    uint16_t size = buf_size(sn, true);
+    uint16_t rd = get_u16(sn, SN_TX_RD);
+    uint16_t wr = get_u16(sn, SN_TX_WR);
+    uint32_t rtr = ((uint32_t)common[COMMON_RTR] << 8) |
+        common[COMMON_RTR + 1];
+    int timeout_ms = rtr * (common[COMMON_RCR] + 1) / 10;
+    while ((rd != wr) && (s.fd >= 0)){
+        uint16_t pos = rd & (size - 1);
+        size_t n = std::min((uint16_t)(wr - rd), (uint16_t)(size - pos));
+        ssize_t r = ::send(s.fd, s.tx + pos, n, MSG_NOSIGNAL);
+        if (r > 0){
+            rd += r;
+        } else if (!would_block()){
+            close(sn, sn_ir_discon);
+        } else if ((errno != EINTR) && !wait_fd(s.fd, POLLOUT, timeout_ms)){
+            close(sn, sn_ir_timeout);
+        }
+    }
+    set_u16(sn, SN_TX_RD, wr);
+    set_u16(sn, SN_TX_FSR, size);
+    s.regs[SN_IR] |= sn_ir_sendok;
+}
+
+
+/**
+ * Close the host socket of a socket.
+ *
+ * @param sn Socket number.
+ * @param ir Flags to be set in Sn_IR.
+ */
+void w5500_sim_t::close(int sn, uint8_t ir){
+    socket_sim_t& s = sockets[sn];
+    if (s.fd >= 0)
+        ::close(s.fd);
+    s.fd = -1;
+    s.regs[SN_SR] = (uint8_t)socket_status_t::closed;
+    s.regs[SN_IR] |= ir;
+}
+
+
+/**
+ * Get the host listening socket of a port, which is created the first time.
+ *
+ * @param port Port set in Sn_PORT.
+ * @return Host socket.
+ */
+int w5500_sim_t::listener(uint16_t port){
+    auto it = listeners.find(port);
+    if (it != listeners.end())
+        return it->second;
+    const char* bind_ip = sim_env("PICOHSM_SIM_BIND", "127.0.0.1");
+    uint16_t host_port = port + sim_env_u32("PICOHSM_SIM_PORT_OFFSET", 0);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(host_port);
+    if (inet_pton(AF_INET, bind_ip, &addr.sin_addr) != 1)
+        sim_fail("PICOHSM_SIM_BIND is not an IPv4 address");
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if ((fd < 0) || bind(fd, (sockaddr*)&addr, sizeof(addr)) ||
+        ::listen(fd, SOMAXCONN))
+        sim_fail("cannot listen on the host port");
+    fprintf(stderr, "W5500: port %u listening on %s:%u\n", port, bind_ip,
+        host_port);
+    listeners[port] = fd;
+    return fd;
+}
+
+
+/**
+ * @return Size of a socket buffer in bytes, from Sn_TXBUF_SIZE or
+ *     Sn_RXBUF_SIZE. Sizes not supported by the W5500 are not simulated and
+ *     give the default 2 KB.
+ * @param sn Socket number.
+ * @param tx true for the TX buffer, false for the RX buffer.
+ */
+uint16_t w5500_sim_t::buf_size(int sn, bool tx) const {
+    uint8_t kb = sockets[sn].regs[tx ? SN_TXBUF_SIZE : SN_RXBUF_SIZE];
+    if ((kb == 0) || (kb > 16) || (kb & (kb - 1)))
+        kb = 2;
+    return (uint16_t)kb * 1024;
+}
+
+
+/**
+ * @return Value of a 16-bits socket register (big-endian).
+ * @param sn Socket number.
+ * @param offset Offset of the register.
+ */
+uint16_t w5500_sim_t::get_u16(int sn, uint8_t offset) const {
+    const uint8_t* regs = sockets[sn].regs;
+    return ((uint16_t)regs[offset] << 8) | regs[offset + 1];
+}
+
+
+/**
+ * Change the value of a 16-bits socket register (big-endian).
+ *
+ * @param sn Socket number.
+ * @param offset Offset of the register.
+ * @param value New value.
+ */
+void w5500_sim_t::set_u16(int sn, uint8_t offset, uint16_t value){
+    uint8_t* regs = sockets[sn].regs;
+    regs[offset] = (uint8_t)(value >> 8);
+    regs[offset + 1] = (uint8_t)(value & 0xff);
+}
@@ -0,0 +1,95 @@
+/**
+ * This file is part of picoHSM
+ * 
+ * picoHSM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Ledger SAS, written by Olivier Hériveaux
+ */
+
+#ifndef _W5500_SIM_HXX_
+#define _W5500_SIM_HXX_
+
+
+#include <stdint.h>
+#include <map>
+
+
+/**
+ * W5500 Ethernet controller on the SPI bus, with its sockets mapped to TCP
+ * sockets of the host. Listening sockets are bound to PICOHSM_SIM_BIND
+ * (default 127.0.0.1), on the port set by the firmware plus
+ * PICOHSM_SIM_PORT_OFFSET. Only TCP mode is simulated.
+ */
+class w5500_sim_t {
+    public:
+        /** Number of sockets of the W5500. */
+        static const int socket_count = 8;
+        /** Maximum size of a socket buffer, in bytes. */
+        static const int max_buf_size = 16 * 1024;
+
+        w5500_sim_t();
+        void set_reset(bool);
+        void select(bool);
+        uint8_t transfer(uint8_t);
+
+    private:
+        /** Registers and buffers of a socket. */
+        struct socket_sim_t {
+            uint8_t regs[0x30];
+            uint8_t tx[max_buf_size];
+            uint8_t rx[max_buf_size];
+            /** Host socket of the connection. -1 if none. */
+            int fd;
+            /** Value of Sn_RX_RD at the last RECV command. */
+            uint16_t rx_rd;
+            /** Time when a disconnection being done gives up waiting for
+             * the peer. */
+            uint64_t discon_deadline;
+        };
+
+        /** Common registers. */
+        uint8_t common[0x40];
+        socket_sim_t sockets[socket_count];
+        /** Host listening sockets, by W5500 port. Kept open across W5500
+         * socket openings, so connections queue in the host backlog. */
+        std::map<uint16_t, int> listeners;
+        /** true while the W5500 is held in reset. */
+        bool in_reset;
+        /** true while the W5500 is selected on the SPI bus. */
+        bool selected;
+        /** Number of bytes received since the chip select. */
+        uint32_t frame_pos;
+        /** Offset of the address phase, incremented in the data phase. */
+        uint16_t address;
+        /** Control phase byte: block select, read/write and mode bits. */
+        uint8_t control;
+
+        void reset();
+        uint8_t read_byte(uint8_t, uint16_t);
+        void write_byte(uint8_t, uint16_t, uint8_t);
+        uint8_t read_phycfgr() const;
+        void command(int, uint8_t);
+        void update(int, bool);
+        void accept(int, bool);
+        void receive(int, bool);
+        void send(int);
+        void close(int, uint8_t);
+        int listener(uint16_t);
+        uint16_t buf_size(int, bool) const;
+        uint16_t get_u16(int, uint8_t) const;
+        void set_u16(int, uint8_t, uint16_t);
+};
+
+
+#endif
@@ -0,0 +1,300 @@
+/**
+ * This file is part of picoHSM
+ * 
+ * picoHSM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Ledger SAS, written by Olivier Hériveaux
+ */
+
+#include "bench.hxx"
+#include "delay.hxx"
+#include "panic.hxx"
+#include "sec.hxx"
+#include "system.hxx"
+#include "util.hxx"
+
+
+/** Number of register reads averaged for the SPI latency. */
+const uint32_t bench_spi_reads = 1000;
+/** Size of the SPI bursts and of the hexadecimal codec buffers, in bytes. */
+const size_t bench_buf_size = 2048;
+/** Size of the data exchanged for the socket bandwidth, in bytes. */
+const uint32_t bench_socket_bytes = 65536;
+/** Number of round trips averaged for the security MCU latency. */
+const uint32_t bench_sec_round_trips = 100;
+/** Number of blocks encrypted end to end. */
+const uint16_t bench_crypt_blocks = 256;
+
+
+extern w5500_t w5500;
+
+static uint8_t bench_buf[bench_buf_size];
+static char bench_hex[2 * bench_buf_size + 1];
+
+
+/**
+ * Send a result line to the client and to the debug USART.
+ *
+ * @param sock Client socket.
+ * @param name Name of the measurement.
+ * @param value Measured value.
+ * @param unit Unit of the value.
+ */
+static void report(socket_t& sock, const char* name, uint32_t value,
+    const char* unit){
+    sock.print("result ");
+    sock.print(name);
+    sock.print(" ");
+    sock.print_u32(value);
+    sock.print(" ");
+    sock.print(unit);
+    sock.print("\n");
+    debug_print(name);
+    debug_print(": ");
+    debug_print_u32(value);
+    debug_print(" ");
+    debug_println(unit);
+}
+
+
+/**
+ * Send a line announcing a transfer: "data N" or "send N".
+ *
+ * @param sock Client socket.
+ * @param word First word of the line.
+ * @param len Number of bytes of the transfer.
+ */
+static void announce(socket_t& sock, const char* word, uint32_t len){
+    sock.print(word);
+    sock.print(" ");
+    sock.print_u32(len);
+    sock.print("\n");
+}
+
+
+/**
+ * Convert a count of items processed in a number of cycles to a rate.
+ *
+ * @param count Number of items. Must be below 85000.
+ * @param cycles Number of CPU cycles.
+ * @return Items per second.
+ */
+static uint32_t per_second(uint32_t count, uint32_t cycles){
+    uint32_t ms_cycles = sys_freq / 1000;
+    uint32_t ms_count = cycles / 1000;
+    if (ms_count == 0)
+        ms_count = 1;
+    return count * ms_cycles / ms_count;
+}
+
+
+/**
+ * Send data to the client, waiting for room in the TX buffer of the W5500.
+ *
+ * @param sock Client socket.
+ * @param data Data to be sent.
+ * @param len Number of bytes.
+ * @return false if the connection is lost.
+ */
+static bool write_all(socket_t& sock, const uint8_t* data, size_t len){
+    const size_t chunk_size = 1024;
+    while (len){
+        size_t n = min(len, chunk_size);
+        while (w5500.read_u16_stable(w5500_reg_t::sn_tx_fsr0, sock.get_no())
+            <= n){
+            if (sock.get_status() != socket_status_t::established)
+                return false;
+        }
+        sock.write(data, n);
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+
+/**
+ * Measure SPI transfers with the W5500: latency of a register read, and
+ * throughput of bursts in the socket buffers.
+ *
+ * @param sock Client socket.
+ */
+static void bench_spi(socket_t& sock){
+    uint32_t start = ticks();
+    for (uint32_t i = 0; i < bench_spi_reads; ++i)
+        w5500.read_u8(w5500_reg_t::versionr, 0);
+    report(sock, "spi_read_u8", (ticks() - start) / bench_spi_reads,
+        "cycles");
+
+    // The buffers of an unused socket are read and written.
+    const uint8_t no = w5500_t::max_sockets - 1;
+    start = ticks();
+    w5500.read(w5500_reg_t::rx_buf, no, bench_buf, bench_buf_size);
+    report(sock, "spi_read_burst", per_second(bench_buf_size, ticks() - start),
+        "B/s");
+    start = ticks();
+    w5500.write(w5500_reg_t::tx_buf, no, bench_buf, bench_buf_size);
+    report(sock, "spi_write_burst", per_second(bench_buf_size,
+        ticks() - start), "B/s");
+}
+
+
+/**
+ * Measure the hexadecimal codec.
+ *
+ * @param sock Client socket.
+ */
+static void bench_hex_codec(socket_t& sock){
+    for (size_t i = 0; i < bench_buf_size; ++i)
+        bench_buf[i] = (uint8_t)i;
+    uint32_t start = ticks();
+    bytes_to_hex(bench_buf, bench_buf_size, bench_hex);
+    report(sock, "hex_encode", per_second(bench_buf_size, ticks() - start),
+        "B/s");
+    bench_hex[2 * bench_buf_size] = 0;
+    size_t len;
+    start = ticks();
+    if (hex_to_bytes(bench_hex, bench_buf, &len) || (len != bench_buf_size))
+        panic("hex codec benchmark failed");
+    report(sock, "hex_decode", per_second(bench_buf_size, ticks() - start),
+        "B/s");
+}
+
+
+/**
+ * Measure the socket bandwidth, in both directions.
+ *
+ * @param sock Client socket.
+ * @return false if the connection is lost.
+ */
+static bool bench_socket(socket_t& sock){
+    announce(sock, "data", bench_socket_bytes);
+    uint32_t start = ticks();
+    for (uint32_t sent = 0; sent < bench_socket_bytes; sent += bench_buf_size){
+        if (!write_all(sock, bench_buf, bench_buf_size))
+            return false;
+    }
+    report(sock, "socket_send", per_second(bench_socket_bytes / 1024,
+        ticks() - start), "KiB/s");
+
+    announce(sock, "send", bench_socket_bytes);
+    start = ticks();
+    for (uint32_t received = 0; received < bench_socket_bytes;
+        received += bench_buf_size){
+        if (sock.read_exact(bench_buf, bench_buf_size) != bench_buf_size)
+            return false;
+    }
+    report(sock, "socket_recv", per_second(bench_socket_bytes / 1024,
+        ticks() - start), "KiB/s");
+    return true;
+}
+
+
+/**
+ * Measure the exchanges with the security MCU: round trip latency, and
+ * encryption throughput of the encrypt command path (hexadecimal decoding,
+ * encryption, encoding and sending to the client).
+ *
+ * @param sock Client socket.
+ * @param pin PIN. 8 digits.
+ * @param key_id Key number.
+ * @return false if the connection is lost.
+ */
+static bool bench_sec(socket_t& sock, const char* pin, uint8_t key_id){
+    uint8_t key_info[KEY_COUNT];
+    uint32_t start = ticks();
+    for (uint32_t i = 0; i < bench_sec_round_trips; ++i){
+        if (!sec_key_info(key_info))
+            panic("security MCU error");
+    }
+    report(sock, "sec_round_trip", (ticks() - start) / bench_sec_round_trips,
+        "cycles");
+
+    if (!pin)
+        return true;
+    const size_t chunk_blocks = 16;
+    const size_t chunk_size = chunk_blocks * AES_BLOCK_SIZE;
+    bytes_to_hex(bench_buf, chunk_size, bench_hex);
+    start = ticks();
+    sec_status_t status = sec_crypt_begin(SEC_OP_ENCRYPT, pin, key_id,
+        bench_crypt_blocks);
+    if (status != SEC_STATUS_OK){
+        // Wrong PIN or locked key: the client is told, and gets no data.
+        report(sock, "encrypt_status", status, "status");
+        return true;
+    }
+    announce(sock, "data", bench_crypt_blocks * 2 * AES_BLOCK_SIZE);
+    for (size_t i = 0; i < bench_crypt_blocks; i += chunk_blocks){
+        for (size_t j = 0; j < chunk_size; ++j)
+            hex_to_byte(bench_hex + 2 * j, bench_buf + j);
+        sec_crypt_blocks(bench_buf, bench_buf, chunk_blocks);
+        bytes_to_hex(bench_buf, chunk_size, bench_hex + 2 * chunk_size);
+        if (!write_all(sock, (const uint8_t*)(bench_hex + 2 * chunk_size),
+            2 * chunk_size))
+            return false;
+    }
+    report(sock, "encrypt", per_second(bench_crypt_blocks, ticks() - start),
+        "blocks/s");
+    return true;
+}
+
+
+/**
+ * Run the benchmarks for one client.
+ *
+ * @param sock Client socket, connected.
+ */
+static void run_bench(socket_t& sock){
+    // "PIN KEYID", or an empty line
+    char line[16];
+    size_t len = sock.read_line((uint8_t*)line, sizeof(line), 15 * sys_freq);
+    const char* pin = 0;
+    uint8_t key_id = 0;
+    if ((len >= 10) && (line[8] == ' ') && (line[9] >= '0') &&
+        (line[9] < '0' + KEY_COUNT)){
+        pin = line;
+        key_id = line[9] - '0';
+    }
+
+    announce(sock, "bench", bench_version);
+    bench_spi(sock);
+    bench_hex_codec(sock);
+    iwdg.kr = 0xaaaa; // Reload watchdog
+    if (!bench_socket(sock))
+        return;
+    iwdg.kr = 0xaaaa; // Reload watchdog
+    if (!bench_sec(sock, pin, key_id))
+        return;
+    sock.print("end\n");
+}
+
+
+/**
+ * Serve benchmark clients. Never returns.
+ *
+ * @param sock Socket 0 of the W5500, closed.
+ */
+void serve_bench(socket_t& sock){
+    for (;;){
+        sec_reset();
+        usart_sec.flush();
+        debug_println("Waiting for benchmark client...");
+        if (sock.listen(1234)){
+            iwdg.kr = 0xaaaa; // Reload watchdog
+            run_bench(sock);
+            debug_println("Benchmark done.");
+        }
+        sock.disconnect();
+    }
+}
@@ -0,0 +1,54 @@
+/**
+ * This file is part of picoHSM
+ * 
+ * picoHSM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Ledger SAS, written by Olivier Hériveaux
+ */
+
+#ifndef _BENCH_HXX_
+#define _BENCH_HXX_
+
+
+#include "w5500.hxx"
+
+
+/**
+ * Benchmark service, replacing the commands in the firmware-mcu-bench build.
+ *
+ * The client connects on port 1234 and sends a line with a PIN and a key
+ * number ("13372020 1"), or an empty line to skip the benchmarks which need
+ * them. The firmware then sends lines:
+ * - "bench VERSION" first,
+ * - "result NAME VALUE UNIT" for each measurement, VALUE being an integer,
+ *   or "result encrypt_status STATUS status" instead of the encryption
+ *   measurement if the security MCU refuses the PIN or key (see
+ *   sec_status_t),
+ * - "data N", followed by N bytes which the client must read and drop,
+ * - "send N", after which the client must send N bytes,
+ * - "end" when done, before closing the connection.
+ *
+ * Results are printed on the debug USART as well.
+ */
+
+
+/** Incremented when measurements change, so results are only compared with
+ * results of the same version. */
+const uint32_t bench_version = 1;
+
+
+void serve_bench(socket_t&);
+
+
+#endif
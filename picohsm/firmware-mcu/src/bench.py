@@ -0,0 +1,100 @@
+#!/usr/bin/python3
+"""
+Client of the firmware-mcu-bench firmware. Runs the benchmarks and saves the
+results as JSON, to be compared with the results of another firmware version.
+See bench.hxx for the protocol.
+"""
+import json
+import socket
+import click
+
+
+def read_line(f):
+    line = f.readline()
+    if not line:
+        raise click.ClickException('connection closed by the firmware')
+    return line.decode().strip()
+
+
+def run_bench(host, port, pin, key):
+    sock = socket.create_connection((host, port))
+    f = sock.makefile('rwb')
+    f.write((f'{pin} {key}' if pin else '').encode() + b'\n')
+    f.flush()
+    results = {}
+    version = None
+    while True:
+        words = read_line(f).split()
+        if words[0] == 'bench':
+            version = int(words[1])
+        elif words[0] == 'result' and words[1] == 'encrypt_status':
+            # No encryption measurement
+            print(f'encryption refused by the security MCU, status {words[2]}'
+                ' (2: wrong PIN, 3: key locked)')
+        elif words[0] == 'result':
+            results[words[1]] = {'value': int(words[2]), 'unit': words[3]}
+            print(f'{words[1]:20} {words[2]:>12} {words[3]}')
+        elif words[0] == 'data':
+            n = int(words[1])
+            if len(f.read(n)) != n:
+                raise click.ClickException('connection closed by the firmware')
+        elif words[0] == 'send':
+            f.write(bytes(int(words[1])))
+            f.flush()
+        elif words[0] == 'end':
+            break
+    sock.close()
+    return {'version': version, 'results': results}
+
+
+@click.group()
+def cli():
+    pass
+
+
+@cli.command(help='Run the benchmarks')
+@click.argument('host')
+@click.option('--port', default=1234, help='TCP port.')
+@click.option('--pin', help='PIN, for the encryption benchmark.')
+@click.option('--key', default=0, help='Key number, for the encryption '
+    'benchmark.')
+@click.option('-o', '--output', type=click.File('w'), help='Save the '
+    'results as JSON.')
+def run(host, port, pin, key, output):
+    results = run_bench(host, port, pin, key)
+    if output:
+        json.dump(results, output, indent=4)
+
+
+@cli.command(help='Compare two results files. Exits with an error if a '
+    'measurement is worse than the reference by more than the threshold.')
+@click.argument('reference', type=click.File('r'))
+@click.argument('new', type=click.File('r'))
+@click.option('--threshold', default=5.0, help='Tolerance, in percent.')
+def compare(reference, new, threshold):
+    ref = json.load(reference)
+    new = json.load(new)
+    if ref['version'] != new['version']:
+        raise click.ClickException('results of different benchmark versions')
+    regressions = 0
+    for name, r in ref['results'].items():
+        if name not in new['results']:
+            print(f'{name:20} {r["value"]:>12} {"missing":>12}')
+            regressions += 1
+            continue
+        a = r['value']
+        b = new['results'][name]['value']
+        # Cycles are better when lower, rates when higher
+        change = (b - a) / a * 100 if a else 0
+        worse = change if r['unit'] == 'cycles' else -change
+        flag = ''
+        if worse > threshold:
+            flag = ' REGRESSION'
+            regressions += 1
+        print(f'{name:20} {a:>12} {b:>12} {r["unit"]:8} {change:+7.1f}%{flag}')
+    if regressions:
+        raise click.ClickException(f'{regressions} regression(s)')
+
+
+if __name__ == '__main__':
+    cli()
@@ -91,7 +91,7 @@ empty_irq:
     mov pc, lr
 
 mystart:
-    b main
+    b startup
 
 usart1_irq:
     b usart1_handler
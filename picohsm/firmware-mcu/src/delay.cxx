@@ -18,9 +18,41 @@
  */
 
 #include "delay.hxx"
+#include "stm32f205.hxx"
 
 void delay(uint32_t duration){
     volatile uint32_t t = duration;
     while (t){ t--; };
 }
 
+
+/**
+ * Enable the DWT cycle counter, which is used as the time base for timeouts.
+ */
+void ticks_init(){
+    scb_demcr |= (1 << 24); // TRCENA
+    dwt.cyccnt = 0;
+    dwt.ctrl |= 1; // CYCCNTENA
+}
+
+
+/**
+ * @return Current value of the cycle counter. Wraps around every 2^32 cycles
+ *     (about 85 seconds at 50 MHz).
+ */
+uint32_t ticks(){
+    return dwt.cyccnt;
+}
+
+
+/**
+ * Tells if a given duration has elapsed since a reference time. Handles the
+ * wrap around of the cycle counter.
+ *
+ * @param start Reference time, as returned by ticks().
+ * @param duration Duration in CPU cycles.
+ * @return true if the duration has elapsed.
+ */
+bool ticks_elapsed(uint32_t start, uint32_t duration){
+    return (ticks() - start) >= duration;
+}
@@ -23,5 +23,8 @@
 #include <stdint.h>
 
 void delay(uint32_t);
+void ticks_init();
+uint32_t ticks();
+bool ticks_elapsed(uint32_t, uint32_t);
 
 #endif
@@ -0,0 +1,159 @@
+/**
+ * This file is part of picoHSM
+ * 
+ * picoHSM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Ledger SAS, written by Olivier Hériveaux
+ */
+
+#include "macraw.hxx"
+#include "panic.hxx"
+#include "sec.hxx"
+#include "util.hxx"
+
+
+/** Size of the Ethernet header: destination, source and EtherType. */
+#define ETH_HEADER_SIZE 14
+/** Size of the request header, following the Ethernet header. */
+#define REQUEST_HEADER_SIZE 13
+/** Size of the response header, following the Ethernet header. */
+#define RESPONSE_HEADER_SIZE 4
+/** Minimum Ethernet frame size, without the FCS. */
+#define ETH_MIN_FRAME_SIZE 60
+
+
+extern uint8_t mac[6];
+
+
+/**
+ * Compare two request frames from the source MAC address, as the destination
+ * may be ours or the broadcast address.
+ *
+ * @return true if frames are equal.
+ */
+static bool frame_equal(const uint8_t* a, size_t a_len, const uint8_t* b,
+    size_t b_len){
+
+    if (a_len != b_len)
+        return false;
+    for (size_t i = 6; i < a_len; ++i){
+        if (a[i] != b[i])
+            return false;
+    }
+    return true;
+}
+
+
+/**
+ * Execute a request and build the response frame.
+ *
+ * @param req Request frame.
+ * @param req_len Request frame length.
+ * @param resp Buffer where the response frame is built.
+ * @return Response frame length. 0 if the request is invalid and must be
+ *     ignored.
+ */
+static size_t execute_request(const uint8_t* req, size_t req_len,
+    uint8_t* resp){
+
+    const uint8_t* payload = req + ETH_HEADER_SIZE;
+    uint8_t op = payload[2];
+    uint8_t key_id = payload[3];
+    const char* pin = (const char*)(payload + 4);
+    uint8_t block_count = payload[12];
+    if ((op != MACRAW_OP_ENCRYPT) && (op != MACRAW_OP_DECRYPT))
+        return 0;
+    if ((key_id >= KEY_COUNT) || (block_count > macraw_max_blocks))
+        return 0;
+    if (req_len < ETH_HEADER_SIZE + REQUEST_HEADER_SIZE +
+        (size_t)block_count * AES_BLOCK_SIZE)
+        return 0;
+
+    // Response goes back to the sender
+    for (int i = 0; i < 6; ++i){
+        resp[i] = req[6 + i];
+        resp[6 + i] = mac[i];
+    }
+    resp[12] = (uint8_t)(macraw_ethertype >> 8);
+    resp[13] = (uint8_t)(macraw_ethertype & 0xff);
+    uint8_t* resp_payload = resp + ETH_HEADER_SIZE;
+    resp_payload[0] = payload[0];
+    resp_payload[1] = payload[1];
+
+    usart_sec.flush();
+    sec_status_t status = sec_crypt_begin(
+        (op == MACRAW_OP_ENCRYPT) ? SEC_OP_ENCRYPT : SEC_OP_DECRYPT, pin,
+        key_id, block_count);
+    resp_payload[2] = (uint8_t)status;
+    if (status != SEC_STATUS_OK)
+        block_count = 0;
+    resp_payload[3] = block_count;
+    sec_crypt_blocks(payload + REQUEST_HEADER_SIZE,
+        resp_payload + RESPONSE_HEADER_SIZE, block_count);
+
+    size_t len = ETH_HEADER_SIZE + RESPONSE_HEADER_SIZE +
+        (size_t)block_count * AES_BLOCK_SIZE;
+    // Pad to the minimum Ethernet frame size
+    for (; len < ETH_MIN_FRAME_SIZE; ++len)
+        resp[len] = 0;
+    return len;
+}
+
+
+/**
+ * Serve requests received as raw Ethernet frames. Never returns.
+ *
+ * @param sock Socket 0 of the W5500, closed.
+ */
+void serve_macraw(socket_t& sock){
+    if (!sock.open_macraw())
+        panic("MACRAW socket opening failed");
+    debug_println("MACRAW service ready.");
+    sec_wait_ready();
+
+    const size_t max_frame_size = ETH_HEADER_SIZE + REQUEST_HEADER_SIZE +
+        macraw_max_blocks * AES_BLOCK_SIZE;
+    static uint8_t req[max_frame_size];
+    // Last request executed and its response, kept for retransmissions.
+    static uint8_t last_req[max_frame_size];
+    size_t last_req_len = 0;
+    static uint8_t resp[max_frame_size];
+    size_t resp_len = 0;
+
+    for (;;){
+        iwdg.kr = 0xaaaa; // Reload watchdog
+        size_t len = sock.recv_frame(req, sizeof(req));
+        if (len < ETH_HEADER_SIZE + REQUEST_HEADER_SIZE)
+            continue;
+        uint16_t ethertype = ((uint16_t)req[12] << 8) | req[13];
+        if (ethertype != macraw_ethertype)
+            continue;
+
+        // A retransmitted request, identical to the last one, gets the same
+        // response again.
+        if (resp_len && frame_equal(req, len, last_req, last_req_len)){
+            sock.write(resp, resp_len);
+            continue;
+        }
+
+        size_t n = execute_request(req, len, resp);
+        if (n){
+            resp_len = n;
+            for (size_t i = 0; i < len; ++i)
+                last_req[i] = req[i];
+            last_req_len = len;
+            sock.write(resp, resp_len);
+        }
+    }
+}
@@ -0,0 +1,70 @@
+/**
+ * This file is part of picoHSM
+ * 
+ * picoHSM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Ledger SAS, written by Olivier Hériveaux
+ */
+
+#ifndef _MACRAW_HXX_
+#define _MACRAW_HXX_
+
+
+#include <stdint.h>
+#include "w5500.hxx"
+
+
+/**
+ * Raw Ethernet service, for clients on the same network segment.
+ *
+ * Requests and responses are Ethernet frames with the macraw_ethertype
+ * EtherType. Request payload:
+ * - sequence number (2 bytes, big-endian),
+ * - operation (1 byte, see macraw_op_t),
+ * - key id (1 byte),
+ * - PIN (8 bytes),
+ * - number of AES blocks (1 byte, 16 maximum),
+ * - data blocks.
+ *
+ * Response payload:
+ * - sequence number of the request (2 bytes, big-endian),
+ * - status (1 byte, see sec_status_t),
+ * - number of AES blocks (1 byte, 0 if the status is an error),
+ * - data blocks.
+ *
+ * There is no acknowledge: clients retransmit a request with the same
+ * sequence number if no response is received in time. The last request and
+ * its response are kept, so a retransmission of the same request is answered
+ * without being executed twice. A different request is executed, even with
+ * the same sequence number.
+ */
+
+
+/** EtherType of the frames (IEEE 802 local experimental EtherType 1). */
+const uint16_t macraw_ethertype = 0x88b5;
+
+/** Maximum number of AES blocks in a request. */
+const uint8_t macraw_max_blocks = 16;
+
+
+enum macraw_op_t {
+    MACRAW_OP_ENCRYPT = 1,
+    MACRAW_OP_DECRYPT = 2
+};
+
+
+void serve_macraw(socket_t&);
+
+
+#endif
@@ -25,29 +25,21 @@
 #include "usart.hxx"
 #include "panic.hxx"
 #include "util.hxx"
+#include "system.hxx"
+#include "sec.hxx"
+#include "macraw.hxx"
+#include "bench.hxx"
+#include "mem.hxx"
 
 
-#define AES_BLOCK_SIZE 16
-#define KEY_COUNT 8
-
-
-enum sec_ins_t {
-    SEC_INS_VERIFY_PIN = 1,
-    SEC_INS_ENCRYPT = 2,
-    SEC_INS_DECRYPT = 3
-};
-
-
-enum sec_status_t {
-    SEC_STATUS_OK = 1,
-    SEC_STATUS_BAD_PIN = 2,
-    SEC_STATUS_KEY_LOCKED = 3
-};
+/** Maximum duration of a connection, in CPU cycles. The watchdog is only
+ * reloaded when a client connects, so all its commands must fit in the
+ * watchdog period. */
+const uint32_t request_timeout = 15 * sys_freq;
 
 
 w5500_t w5500(&spi1);
 usart_t usart_debug_inst;
-usart_t usart_sec;
 // Mark it volatile to avoid possible compiler optimization (there is no way
 // to set it to true, except with a vuln)
 volatile bool debug_enabled = false;
@@ -66,8 +58,43 @@ uint8_t gateway[] = {192, 168, 0, 1};
 uint8_t ip[] = {192, 168, 0, 10};
 #endif
 uint8_t mask[] = {255, 255, 255, 0};
+#ifdef PHY_FORCE_100_FULL
+// Only for switch ports also forced to 100BASE-TX full duplex, otherwise the
+// switch will fall back to half duplex.
+const phy_mode_t phy_mode = phy_mode_t::base100_full;
+#else
+const phy_mode_t phy_mode = phy_mode_t::auto_all;
+#endif
 uint8_t mac[] = {0x00, 0x08, 0xdc, 0x01, 0x02, 0x03};
 
+/**
+ * Boot phase timestamps, in CPU cycles since the cycle counter was started,
+ * right after the clock configuration. Printed by the stats command.
+ */
+struct boot_times_t {
+    /** W5500 out of reset. */
+    uint32_t w5500;
+    /** Network configured. */
+    uint32_t network;
+    /** First connection awaited. */
+    uint32_t listen;
+    /** Security MCU started. */
+    uint32_t sec;
+};
+boot_times_t boot_times;
+/** Time at which the current client connected, in CPU cycles. */
+uint32_t connection_start;
+
+
+/**
+ * @return Time left to the current client, in CPU cycles. 0 if its
+ *     connection has lasted request_timeout.
+ */
+uint32_t connection_time_left(){
+    uint32_t elapsed = ticks() - connection_start;
+    return (elapsed < request_timeout) ? (request_timeout - elapsed) : 0;
+}
+
 
 /**
  * Turn LED ON or OFF.
@@ -75,12 +102,8 @@ uint8_t mac[] = {0x00, 0x08, 0xdc, 0x01, 0x02, 0x03};
  * @param state false to turn-off. true to turn-on.
  */
 void led(bool state){
-    // LED is connected to PB0
-    if (state) {
-        gpiob.odr &= ~(1 << 0);
-    } else {
-        gpiob.odr |= (1 << 0);
-    }
+    // LED is connected to PB0, active low
+    gpio_pin_t<gpiob_base, 0>::write(!state);
 }
 
 
@@ -95,17 +118,6 @@ uint32_t rand_u32(){
 }
 
 
-/**
- * Resets the security MCU.
- */
-void sec_reset(){
-    gpioa.odr &= ~(1 << 11);
-    delay(1000000);
-    gpioa.odr |= (1 << 11);
-    delay(1000000);
-}
-
-
 /**
  * Parse input string to extract the arguments separated by space. Inputs ends
  * with \n, \0 or \r. The input string is modified to place a terminal 0 at the
@@ -148,21 +160,6 @@ size_t parse_args(char* buf, size_t input_size, char** args,
 }
 
 
-/**
- * Process PIN verification.
- *
- * @param pin Input PIN. 8 digits.
- * @return true if PIN is valid.
- */
-bool verify_pin(char* pin){
-    usart_sec.flush();
-    usart_sec.tx(SEC_INS_VERIFY_PIN);
-    usart_sec.tx_buf((uint8_t*)pin, 8);
-    uint8_t result = usart_sec.rx();
-    return (result == SEC_STATUS_OK);
-}
-
-
 /**
  * Verify an hex string is valid and is a multiple of AES block size.
  *
@@ -192,14 +189,106 @@ bool hex_string_valid(socket_t& sock, const char* s, size_t max_bytes){
 
 
 /**
- * Execute the encrypt or decrypt command.
+ * Verify the PIN and key id arguments of a command.
+ *
+ * @param sock Socket where error messages are printed.
+ * @param arg_pin PIN argument.
+ * @param arg_key Key id argument, or CBC context number.
+ * @param key_id Where the parsed key id is written.
+ * @param context true if arg_key is a CBC context number.
+ * @return true if both are valid.
+ */
+bool parse_pin_key(socket_t& sock, const char* arg_pin, const char* arg_key,
+    uint32_t* key_id, bool context = false){
+
+    // Verify PIN format
+    if (strlen(arg_pin) != 8){
+        sock.print("PIN must have 8 characters.\n");
+        return false;
+    }
+
+    // Get key id.
+    if (str_to_u32(arg_key, key_id)){
+        sock.print(context ? "Invalid context format.\n" :
+            "Invalid key format.\n");
+        sock.print(arg_key);
+        return false;
+    }
+    if (*key_id >= (context ? CBC_CONTEXT_COUNT : KEY_COUNT)){
+        sock.print(context ? "Context must be in [0, 7].\n" :
+            "Key must be in [0, 7].\n");
+        return false;
+    }
+    return true;
+}
+
+
+/**
+ * Print the error message for a status returned by the security MCU.
+ *
+ * @param sock A socket object from the W5500.
+ * @param status Status returned by the security MCU.
+ * @return true if status is SEC_STATUS_OK.
+ */
+bool check_sec_status(socket_t& sock, sec_status_t status){
+    switch (status){
+        case SEC_STATUS_OK: return true;
+        case SEC_STATUS_BAD_PIN:
+            sock.print("Invalid PIN.\n");
+            return false;
+        case SEC_STATUS_KEY_LOCKED:
+            sock.print("Key is locked and cannot be used.\n");
+            return false;
+        case SEC_STATUS_NO_NONCE:
+            sock.print("No nonce set for this key.\n");
+            return false;
+        case SEC_STATUS_NO_CONTEXT:
+            sock.print("CBC context is not initialized.\n");
+            return false;
+        default:
+            sock.print("Unexpected error.\n");
+            return false;
+    }
+}
+
+
+/**
+ * Process the blocks of an operation started with sec_crypt_begin, and print
+ * the results in hexadecimal, followed by a line return.
  *
- * @param enc true to encrypt, false to decrypt.
+ * @param sock A socket object from the W5500.
+ * @param hex Input blocks, as a valid hex string.
+ * @param block_count Number of blocks.
+ */
+void crypt_hex_blocks(socket_t& sock, const char* hex, size_t block_count){
+    // Blocks are pipelined to the security MCU, results replace the input
+    const size_t chunk_blocks = 16;
+    uint8_t buf[chunk_blocks * AES_BLOCK_SIZE];
+    for (size_t i = 0; i < block_count; i += chunk_blocks){
+        size_t n = min(chunk_blocks, block_count - i);
+        const char* hex_in = hex + i * 2 * AES_BLOCK_SIZE;
+        for (size_t j = 0; j < n * AES_BLOCK_SIZE; ++j)
+            hex_to_byte(hex_in + 2 * j, buf + j);
+        sec_crypt_blocks(buf, buf, n);
+        for (size_t j = 0; j < n; ++j){
+            char hex_out[32];
+            bytes_to_hex(buf + j * AES_BLOCK_SIZE, AES_BLOCK_SIZE, hex_out);
+            sock.write((const uint8_t*)hex_out, 32);
+        }
+    }
+    sock.print("\n");
+}
+
+
+/**
+ * Execute the encrypt, decrypt, ctr, cbcenc or cbcdec command.
+ *
+ * @param op Operation executed by the security MCU.
  * @param sock A socket object from the W5500.
  * @param args Arguments
  * @param argc Number of arguments
  */
-void execute_command_encrypt_decrypt(bool enc, socket_t& sock, char** args,
+void execute_command_crypt(sec_op_t op, socket_t& sock, char** args,
     size_t argc){
 
     // Check number of arguments
@@ -212,70 +301,318 @@ void execute_command_encrypt_decrypt(bool enc, socket_t& sock, char** args,
     const char* arg_key = args[1];
     const char* arg_data = args[2];
 
-    // Verify PIN format
-    if (strlen(arg_pin) != 8){
-        sock.print("PIN must have 8 characters.\n");
+    // CBC context operations take a context number instead of a key id.
+    bool context = (op == SEC_OP_CBC_ENCRYPT) || (op == SEC_OP_CBC_DECRYPT);
+    uint32_t key_id;
+    if (!parse_pin_key(sock, arg_pin, arg_key, &key_id, context))
+        return;
+
+    // Verify data is a valid hex string. It is decoded by chunks while it is
+    // processed, so its size is only limited by the command line.
+    if (!hex_string_valid(sock, arg_data, MAX_BLOCK_COUNT * AES_BLOCK_SIZE))
+        return;
+    size_t block_count = strlen(arg_data) / (2 * AES_BLOCK_SIZE);
+
+    if (!check_sec_status(sock, sec_crypt_begin(op, arg_pin, (uint8_t)key_id,
+        (uint16_t)block_count)))
+        return;
+    crypt_hex_blocks(sock, arg_data, block_count);
+}
+
+
+/**
+ * Execute the nonce command, which sets the initial counter block of a key for
+ * the ctr command.
+ *
+ * @param sock A socket object from the W5500.
+ * @param args Arguments
+ * @param argc Number of arguments
+ */
+void execute_command_nonce(socket_t& sock, char** args, size_t argc){
+    if (argc != 3){
+        sock.print("Expected 3 arguments.\n");
         return;
     }
 
-    // Get key id.
     uint32_t key_id;
-    if (str_to_u32(arg_key, &key_id)){
-        sock.print("Invalid key format.\n");
-        sock.print(arg_key);
+    if (!parse_pin_key(sock, args[0], args[1], &key_id))
+        return;
+    if (strlen(args[2]) != 2 * AES_BLOCK_SIZE){
+        sock.print("Nonce must have 16 bytes.\n");
         return;
     }
-    if (key_id >= KEY_COUNT){
-        sock.print("Key must be in [0, 7].\n");
+    uint8_t nonce[AES_BLOCK_SIZE];
+    if (!hex_string_valid(sock, args[2], sizeof(nonce)))
+        return;
+    size_t len;
+    hex_to_bytes(args[2], nonce, &len);
+
+    if (check_sec_status(sock, sec_ctr_nonce(args[0], (uint8_t)key_id, nonce)))
+        sock.print("Nonce set.\n");
+}
+
+
+/**
+ * Execute the cbcinit command, which sets the key and IV of a CBC context for
+ * the cbcenc and cbcdec commands.
+ *
+ * @param sock A socket object from the W5500.
+ * @param args Arguments
+ * @param argc Number of arguments
+ */
+void execute_command_cbcinit(socket_t& sock, char** args, size_t argc){
+    if (argc != 4){
+        sock.print("Expected 4 arguments.\n");
         return;
     }
 
-    // Parse data as hex string input
-    uint8_t buf[256];
-    if (!hex_string_valid(sock, arg_data, sizeof(buf)))
+    uint32_t ctx_id;
+    uint32_t key_id;
+    if (!parse_pin_key(sock, args[0], args[1], &ctx_id, true) ||
+        !parse_pin_key(sock, args[0], args[2], &key_id))
         return;
-    size_t byte_count;
-    hex_to_bytes(arg_data, buf, &byte_count);
-
-    // Transmit to the security MCU the op-code and the PIN.
-    // Expect acknowledge after PIN verification
-    usart_sec.tx(enc ? SEC_INS_ENCRYPT : SEC_INS_DECRYPT);
-    usart_sec.tx_buf((uint8_t*)arg_pin, 8);
-    uint8_t ack = usart_sec.rx();
-    switch (ack){
-        case SEC_STATUS_OK: break;
-        case SEC_STATUS_BAD_PIN:
-            sock.print("Invalid PIN.\n");
+    if (strlen(args[3]) != 2 * AES_BLOCK_SIZE){
+        sock.print("IV must have 16 bytes.\n");
+        return;
+    }
+    uint8_t iv[AES_BLOCK_SIZE];
+    if (!hex_string_valid(sock, args[3], sizeof(iv)))
+        return;
+    size_t len;
+    hex_to_bytes(args[3], iv, &len);
+
+    if (check_sec_status(sock, sec_cbc_init(args[0], (uint8_t)ctx_id,
+        (uint8_t)key_id, iv)))
+        sock.print("Context initialized.\n");
+}
+
+
+/**
+ * Execute the mac command: computes the AES-CMAC of a data blob. Only the tag
+ * comes back from the security MCU.
+ *
+ * @param sock A socket object from the W5500.
+ * @param args Arguments
+ * @param argc Number of arguments
+ */
+void execute_command_mac(socket_t& sock, char** args, size_t argc){
+    if (argc != 3){
+        sock.print("Expected 3 arguments.\n");
+        return;
+    }
+
+    uint32_t key_id;
+    if (!parse_pin_key(sock, args[0], args[1], &key_id))
+        return;
+
+    // Any number of bytes
+    const char* arg_data = args[2];
+    size_t l = strlen(arg_data);
+    if ((l % 2 != 0) || (l / 2 > 0xffff)){
+        sock.print("Invalid data length.\n");
+        return;
+    }
+    for (size_t i = 0; i < l; i += 2){
+        uint8_t a;
+        if (hex_to_byte(arg_data + i, &a)){
+            sock.print("Invalid data format.\n");
             return;
-        default:
-            sock.print("Unexpected error.\n");
+        }
+    }
+    size_t byte_count = l / 2;
+
+    if (!check_sec_status(sock, sec_cmac_begin(args[0], (uint8_t)key_id,
+        (uint16_t)byte_count)))
+        return;
+
+    uint8_t buf[256];
+    for (size_t i = 0; i < byte_count; i += sizeof(buf)){
+        size_t n = min(sizeof(buf), byte_count - i);
+        for (size_t j = 0; j < n; ++j)
+            hex_to_byte(arg_data + 2 * (i + j), buf + j);
+        sec_cmac_update(buf, n);
+    }
+    uint8_t tag[AES_BLOCK_SIZE];
+    sec_cmac_final(tag);
+    char hex[2 * AES_BLOCK_SIZE];
+    bytes_to_hex(tag, sizeof(tag), hex);
+    sock.write((const uint8_t*)hex, sizeof(hex));
+    sock.print("\n");
+}
+
+
+/** Status of a binary batch record whose operation or size is invalid. */
+const uint8_t batch_status_invalid = 0x80;
+/** Status of the binary batch records following a failed one. */
+const uint8_t batch_status_skipped = 0x81;
+
+
+/**
+ * Execute the text form of the batch command: "batch PIN ITEMS", ITEMS being
+ * comma separated "OP:KEYID:HEX" operations, OP being "e" to encrypt or "d"
+ * to decrypt. The items are all checked first, then executed back to back
+ * with a single PIN verification. Each result is printed on its own line. The
+ * batch stops at the first error, whose message is the last line.
+ *
+ * @param sock A socket object from the W5500.
+ * @param arg_pin PIN argument.
+ * @param items Items argument. Modified.
+ */
+void execute_batch_text(socket_t& sock, const char* arg_pin, char* items){
+    // Terminate each field of the items, and check them.
+    size_t len = strlen(items);
+    for (size_t i = 0; i < len; ++i){
+        if ((items[i] == ',') || (items[i] == ':'))
+            items[i] = '\0';
+    }
+    char* end = items + len;
+    size_t item_count = 0;
+    for (char* p = items; p < end; ++item_count){
+        char* arg_key = p + strlen(p) + 1;
+        char* arg_data = (arg_key < end) ? arg_key + strlen(arg_key) + 1 :
+            end;
+        if ((strlen(p) != 1) || ((*p != 'e') && (*p != 'd')) ||
+            (arg_data >= end)){
+            sock.print("Invalid batch item format.\n");
+            return;
+        }
+        uint32_t key_id;
+        if (!parse_pin_key(sock, arg_pin, arg_key, &key_id))
             return;
+        if (!hex_string_valid(sock, arg_data, MAX_BLOCK_COUNT *
+            AES_BLOCK_SIZE))
+            return;
+        p = arg_data + strlen(arg_data) + 1;
+    }
+    if (item_count == 0){
+        sock.print("Empty batch.\n");
+        return;
     }
 
-    // Transmit key id and expect acknowledge
-    usart_sec.tx((uint8_t)key_id);
-    ack = usart_sec.rx();
-    switch (ack){
-        case SEC_STATUS_OK: break;
-        case SEC_STATUS_KEY_LOCKED:
-            sock.print("Key is locked and cannot be used.\n");
+    char* p = items;
+    for (size_t i = 0; i < item_count; ++i){
+        sec_op_t op = (*p == 'e') ? SEC_OP_ENCRYPT : SEC_OP_DECRYPT;
+        char* arg_key = p + 2;
+        char* arg_data = arg_key + strlen(arg_key) + 1;
+        uint32_t key_id;
+        str_to_u32(arg_key, &key_id);
+        size_t block_count = strlen(arg_data) / (2 * AES_BLOCK_SIZE);
+        if (!check_sec_status(sock, sec_crypt_begin(op, arg_pin,
+            (uint8_t)key_id, (uint16_t)block_count)))
             return;
-        default:
-            sock.print("Unexpected error.\n");
+        crypt_hex_blocks(sock, arg_data, block_count);
+        p = arg_data + strlen(arg_data) + 1;
+    }
+}
+
+
+/**
+ * Execute the binary form of the batch command: "batch PIN bin", followed by
+ * binary records. Each record has a 4 bytes header: the operation ('e' to
+ * encrypt, 'd' to decrypt, 0 to end the batch), the key id, and the number of
+ * blocks (big endian), followed by the blocks. The response to each record
+ * is a status byte (a sec_status_t, batch_status_invalid or
+ * batch_status_skipped), followed by the result blocks if the status is
+ * SEC_STATUS_OK. After the first failed record, the following ones are only
+ * read and answered with batch_status_skipped. The end record is answered
+ * with SEC_STATUS_OK, and the text commands resume. The batch is stopped
+ * without answer when the connection has lasted request_timeout, since the
+ * watchdog is not reloaded during the connection.
+ *
+ * @param sock A socket object from the W5500.
+ * @param arg_pin PIN argument.
+ */
+void execute_batch_binary(socket_t& sock, const char* arg_pin){
+    const size_t chunk_blocks = 16;
+    uint8_t buf[chunk_blocks * AES_BLOCK_SIZE];
+    bool failed = false;
+    for (;;){
+        uint8_t header[4];
+        if ((connection_time_left() == 0) || (sock.read(header,
+            sizeof(header), connection_time_left()) != sizeof(header)))
+            return;
+        uint8_t op = header[0];
+        uint8_t key_id = header[1];
+        size_t block_count = ((size_t)header[2] << 8) | header[3];
+        if (op == 0){
+            uint8_t status = SEC_STATUS_OK;
+            sock.write(&status, 1);
             return;
+        }
+
+        uint8_t status;
+        if (failed){
+            status = batch_status_skipped;
+        } else if (((op != 'e') && (op != 'd')) || (key_id >= KEY_COUNT) ||
+            (block_count == 0)){
+            status = batch_status_invalid;
+        } else {
+            status = sec_crypt_begin((op == 'e') ? SEC_OP_ENCRYPT :
+                SEC_OP_DECRYPT, arg_pin, key_id, (uint16_t)block_count);
+        }
+        failed = status != SEC_STATUS_OK;
+        sock.write(&status, 1);
+
+        // Blocks are processed by chunks as they arrive, or dropped after a
+        // failure.
+        for (size_t i = 0; i < block_count; i += chunk_blocks){
+            size_t n = min(chunk_blocks, block_count - i);
+            if ((connection_time_left() == 0) || (sock.read(buf,
+                n * AES_BLOCK_SIZE, connection_time_left()) !=
+                n * AES_BLOCK_SIZE)){
+                // The security MCU still expects the remaining blocks.
+                if (!failed)
+                    sec_reset();
+                return;
+            }
+            if (!failed){
+                sec_crypt_blocks(buf, buf, n);
+                sock.write(buf, n * AES_BLOCK_SIZE);
+            }
+        }
     }
+}
+
 
-    usart_sec.tx((uint8_t)(byte_count / AES_BLOCK_SIZE));
-    // For each AES block
-    for (size_t i = 0; i < byte_count; i += AES_BLOCK_SIZE){
-        usart_sec.tx_buf(buf + i, AES_BLOCK_SIZE);
-        uint8_t response[AES_BLOCK_SIZE];
-        usart_sec.rx_buf(response, sizeof(response));
-        char hex[32];
-        bytes_to_hex(response, sizeof(response), hex);
-        sock.write((const uint8_t*)hex, 32);
+/**
+ * Execute the batch command, which runs several encrypt and decrypt
+ * operations with one PIN.
+ *
+ * @param sock A socket object from the W5500.
+ * @param args Arguments
+ * @param argc Number of arguments
+ */
+void execute_command_batch(socket_t& sock, char** args, size_t argc){
+    if (argc != 2){
+        sock.print("Expected 2 arguments.\n");
+        return;
+    }
+    const char* arg_pin = args[0];
+    if (strlen(arg_pin) != 8){
+        sock.print("PIN must have 8 characters.\n");
+        return;
+    }
+    if (!strcmp(args[1], "bin"))
+        execute_batch_binary(sock, arg_pin);
+    else
+        execute_batch_text(sock, arg_pin, args[1]);
+}
+
+
+/**
+ * Print the state of the Ethernet link.
+ *
+ * @param sock A socket object from the W5500.
+ */
+void print_link_status(socket_t& sock){
+    phy_status_t phy = w5500.get_phy_status();
+    sock.print("Link: ");
+    if (phy.link){
+        sock.print(phy.speed_100 ? "100 Mb/s " : "10 Mb/s ");
+        sock.print(phy.full_duplex ? "full duplex\n" : "half duplex\n");
+    } else {
+        sock.print("down\n");
     }
-    sock.print("\n");
 }
 
 
@@ -293,15 +630,101 @@ void execute_command(socket_t& sock, char** args, size_t argc){
         sock.print(
             "help - print the list of commands.\n"
             "info - print equipment info.\n"
+            "stats - print statistics.\n"
+            "mem - print RAM and stack usage.\n"
+            "keys - print the type of each key.\n"
             "getflag [DEBUGKEY] - you already know what this is for...\n"
             "pin - verify pin.\n"
             "encrypt [PIN] [KEYID] [HEX] - encrypt a data blob.\n"
             "decrypt [PIN] [KEYID] [HEX] - decrypt a data blob.\n"
+            "nonce [PIN] [KEYID] [HEX] - set the CTR initial counter block.\n"
+            "ctr [PIN] [KEYID] [HEX] - encrypt or decrypt in CTR mode.\n"
+            "cbcinit [PIN] [CTX] [KEYID] [IV] - set a CBC context.\n"
+            "cbcenc [PIN] [CTX] [HEX] - encrypt, chained in a CBC context.\n"
+            "cbcdec [PIN] [CTX] [HEX] - decrypt, chained in a CBC context.\n"
+            "mac [PIN] [KEYID] [HEX] - compute the AES-CMAC of a data blob.\n"
+            "batch [PIN] [OP:KEYID:HEX,...] - encrypt (e) or decrypt (d)"
+            " several blobs.\n"
+            "batch [PIN] bin - same, with binary records.\n"
         );
     } else if (!strcmp(command, "info")){
         sock.print(
             "picoHSM v1.0\n"
             "Ledger Donjon CTF 2020\n");
+        print_link_status(sock);
+    } else if (!strcmp(command, "stats")){
+        print_link_status(sock);
+        sock.print("Link flaps: ");
+        sock.print_u32(w5500.get_link_flaps());
+        sock.print("\n");
+        sock.print("UART drops: ");
+        sock.print_u32(usart_sec.drops());
+        sec_stats_t sec_stats;
+        bool sec_stats_valid = sec_get_stats(&sec_stats);
+        if (sec_stats_valid){
+            sock.print(" (secure MCU: ");
+            sock.print_u32(sec_stats.rx_drops);
+            sock.print(")");
+        }
+        sock.print("\n");
+        sock.print("Boot (us): W5500 ");
+        sock.print_u32(boot_times.w5500 / (sys_freq / 1000000));
+        sock.print(", network ");
+        sock.print_u32(boot_times.network / (sys_freq / 1000000));
+        sock.print(", listening ");
+        sock.print_u32(boot_times.listen / (sys_freq / 1000000));
+        sock.print(", secure MCU ");
+        sock.print_u32(boot_times.sec / (sys_freq / 1000000));
+        sock.print("\n");
+        if (sec_stats_valid){
+            sock.print("CTR keystream: ");
+            sock.print_u32(sec_stats.ctr_fills);
+            sock.print(" precomputed, ");
+            sock.print_u32(sec_stats.ctr_hits);
+            sock.print(" hits, ");
+            sock.print_u32(sec_stats.ctr_misses);
+            sock.print(" misses\n");
+        }
+    } else if (!strcmp(command, "mem")){
+        mem_stats_t mem_stats;
+        if (mem_get_stats(&mem_stats)){
+            sock.print("RAM: ");
+            sock.print_u32(mem_stats.ram_size);
+            sock.print(" bytes, BSS ");
+            sock.print_u32(mem_stats.bss_size);
+            sock.print(", stack ");
+            sock.print_u32(mem_stats.ram_size - mem_stats.bss_size);
+            sock.print("\n");
+            sock.print("Stack used: ");
+            sock.print_u32(mem_stats.stack_peak);
+            sock.print(" peak, ");
+            sock.print_u32(mem_stats.stack_last);
+            sock.print(" last command\n");
+            sock.print("Stack free: ");
+            sock.print_u32(mem_stats.ram_size - mem_stats.bss_size -
+                mem_stats.stack_peak);
+            sock.print("\n");
+            sock.print("SRAM functions: ");
+            sock.print_u32(mem_stats.ramfunc_size);
+            sock.print("\n");
+        } else {
+            sock.print("Not measured in the host simulation.\n");
+        }
+    } else if (!strcmp(command, "keys")){
+        uint8_t types[KEY_COUNT];
+        if (sec_key_info(types)){
+            for (int i = 0; i < KEY_COUNT; ++i){
+                sock.print("Key ");
+                sock.print_u32(i);
+                sock.print(": AES-");
+                sock.print_u32((types[i] & ~SEC_KEY_LOCKED) * 8);
+                if (types[i] & SEC_KEY_LOCKED)
+                    sock.print(" (locked)");
+                sock.print("\n");
+            }
+        } else {
+            sock.print("Unexpected error.\n");
+        }
     } else if (!strcmp(command, "getflag")) {
         if (argc == 2) {
             uint32_t key;
@@ -321,9 +744,23 @@ void execute_command(socket_t& sock, char** args, size_t argc){
             sock.print("Expected 2 arguments.\n");
         }
     } else if (!strcmp(command, "encrypt")) {
-        execute_command_encrypt_decrypt(true, sock, args+1, argc-1);
+        execute_command_crypt(SEC_OP_ENCRYPT, sock, args+1, argc-1);
     } else if (!strcmp(command, "decrypt")) {
-        execute_command_encrypt_decrypt(false, sock, args+1, argc-1);
+        execute_command_crypt(SEC_OP_DECRYPT, sock, args+1, argc-1);
+    } else if (!strcmp(command, "nonce")) {
+        execute_command_nonce(sock, args+1, argc-1);
+    } else if (!strcmp(command, "ctr")) {
+        execute_command_crypt(SEC_OP_CTR, sock, args+1, argc-1);
+    } else if (!strcmp(command, "cbcinit")) {
+        execute_command_cbcinit(sock, args+1, argc-1);
+    } else if (!strcmp(command, "cbcenc")) {
+        execute_command_crypt(SEC_OP_CBC_ENCRYPT, sock, args+1, argc-1);
+    } else if (!strcmp(command, "cbcdec")) {
+        execute_command_crypt(SEC_OP_CBC_DECRYPT, sock, args+1, argc-1);
+    } else if (!strcmp(command, "mac")) {
+        execute_command_mac(sock, args+1, argc-1);
+    } else if (!strcmp(command, "batch")) {
+        execute_command_batch(sock, args+1, argc-1);
     } else if (!strcmp(command, "pin")) {
         if (argc == 2) {
             if (strlen(args[1]) == 8) {
@@ -348,8 +785,9 @@ void execute_command(socket_t& sock, char** args, size_t argc){
 
 
 /**
- * Waits for an incoming connection, process client command, closes the
- * connection and returns.
+ * Process client commands, one per line, until the client sends an empty line,
+ * closes the connection or the connection has lasted request_timeout. The
+ * security MCU session opened by a command is kept for the following ones.
  *
  * @param sock A socket object from the W5500.
  */
@@ -358,19 +796,31 @@ void handle_client(socket_t& sock){
         "Hello from picoHSM!\n"
         "Waiting for command...\n"
         "Timeout in 15 seconds...\n");
-    // TODO: implement timeout
-    while (sock.avail() == 0){}
+    // The security MCU may still be starting after the previous client.
+    sec_wait_ready();
     char buf[768];
-    memset(buf, 0, sizeof(buf));
-    // Ooops, a wild vuln appears...
-    size_t size = sock.read_avail((uint8_t*)buf, sizeof(buf)+256);
-
-    // Parse command to extract arguments separated by ' '.
-    const size_t max_args = 8;
-    char* args[max_args];
-    int argc = parse_args(buf, size, args, max_args);
+    for (;;){
+        if (connection_time_left() == 0)
+            return;
+        memset(buf, 0, sizeof(buf));
+        // Ooops, a wild vuln appears...
+        size_t size = sock.read_line((uint8_t*)buf, sizeof(buf)+256,
+            connection_time_left());
+
+        // Parse command to extract arguments separated by ' '.
+        const size_t max_args = 8;
+        char* args[max_args];
+        int argc = parse_args(buf, size, args, max_args);
+        if (argc == 0)
+            return;
 
-    execute_command(sock, args, argc);
+        mem_probe_begin();
+        // The response is sent in as few segments as possible.
+        sock.batch_begin();
+        execute_command(sock, args, argc);
+        sock.batch_end();
+        mem_probe_end();
+    }
 }
 
 
@@ -399,7 +849,7 @@ void set_mco1_prescaler(){
 void configure_clock(){
     // Enable High Speed External crystal and wait it to be ready.
     rcc.cr |= (1 << 16);
-    while (rcc.cr & (1 << 17) == 0){}
+    while ((rcc.cr & (1 << 17)) == 0){}
     // Disable PLL
     rcc.cr &= ~(1 << 24);
     // HSE = 25 MHz
@@ -416,7 +866,7 @@ void configure_clock(){
         (1 << 22); // PLLSRC set to HSE
     // Enable PLL and wait it to be locked
     rcc.cr |= (1 << 24);
-    while (rcc.cr & (1 << 25) == 0){}
+    while ((rcc.cr & (1 << 25)) == 0){}
     // Switch to PLL clock source for the system
     rcc.cfgr = (0b11 << 21) | // PLL on MCO1
         0b10; // Switch to PLL clock source for the system
@@ -429,14 +879,17 @@ void configure_clock(){
  */
 void setup_network(){
     w5500.reset();
+    boot_times.w5500 = ticks();
     uint8_t version = 0;
     w5500.read(w5500_reg_t::versionr, 0, &version, 1);
     assert(version == 4);
 
+    w5500.set_phy_mode(phy_mode);
     w5500.set_mac(mac);
     w5500.set_gateway(gateway);
     w5500.set_mask(mask);
     w5500.set_ip(ip);
+    boot_times.network = ticks();
 }
 
 
@@ -455,18 +908,6 @@ int main(){
     // Set vector table address
     scb_vtor = 0x08000000;
 
-    // Clear BSS
-    extern uint32_t __bss_start;
-    extern uint32_t __bss_end;
-    for (uint32_t addr = (uint32_t)&__bss_start; addr < (uint32_t)&__bss_end; ++addr)
-        *((uint8_t*)addr) = 0;
-
-    // Call the static initializers functions
-    extern void (*__init_array_start)();
-    extern void (*__init_array_end)();
-    for (void (**p)() = &__init_array_start; p < &__init_array_end; ++p)
-        (*p)();
-
     // Enable clock for PORT A and PORT B peripherals.
     rcc.ahb1enr |= (1 << 1) | (1 << 0);
     // Enable clock for SPI1
@@ -516,6 +957,7 @@ int main(){
 
     configure_flash();
     configure_clock();
+    ticks_init();
     usart_debug_inst.init(1, 115200);
     usart_debug = &usart_debug_inst;
     debug_println("Booting...");
@@ -543,17 +985,28 @@ int main(){
     // Turn on LED
     led(true);
 
+    // The security MCU and the W5500 are held in reset since the GPIO
+    // configuration. The start-up of the security MCU is the longest: it runs
+    // during the network setup and until a client connects.
+    sec_reset_start();
+    boot_times.sec = sec_ready_time();
     setup_network();
     init_wdg();
 
     socket_t sock(&w5500, 0);
+#ifdef MACRAW_SERVICE
+    serve_macraw(sock);
+#endif
+#ifdef BENCH_SERVICE
+    serve_bench(sock);
+#endif
+    boot_times.listen = ticks();
     for (;;){
-        sec_reset();
-        usart_sec.flush();
         debug_println("Waiting for connection...");
         if (sock.listen(1234)){
             debug_println("Connection established!");
             iwdg.kr = 0xaaaa; // Reload watchdog
+            connection_start = ticks();
             handle_client(sock);
             debug_println("Client has been served!");
         } else {
@@ -561,6 +1014,9 @@ int main(){
         }
         sock.disconnect();
         debug_println("Connection closed.");
+        // The start-up of the security MCU overlaps the wait for the next
+        // client.
+        sec_reset_start();
     }
     for (;;) {}
 }
@@ -0,0 +1,132 @@
+/**
+ * This file is part of picoHSM
+ * 
+ * picoHSM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Ledger SAS, written by Olivier Hériveaux
+ */
+
+#include "mem.hxx"
+
+
+#ifndef PICOHSM_HOST
+
+
+// Defined by the linker script.
+extern uint32_t __bss_start;
+extern uint32_t __bss_end;
+extern uint32_t __ramfunc_start;
+extern uint32_t __ramfunc_end;
+extern uint32_t stack_top;
+
+
+/** Lowest stack word written, found by the last scan. nullptr until the
+ * first scan. */
+static uint32_t* stack_low = nullptr;
+static uint32_t stack_peak = 0;
+static uint32_t stack_last = 0;
+
+
+/**
+ * @return Current stack pointer.
+ */
+static inline uint32_t* stack_pointer(){
+    uint32_t* sp;
+    asm volatile ("mov %0, sp" : "=r" (sp));
+    return sp;
+}
+
+
+/**
+ * @return Lowest stack word which does not hold the paint. The stack grows
+ *     down from stack_top to the end of BSS.
+ */
+static uint32_t* stack_scan(){
+    uint32_t* p = &__bss_end;
+    while ((p < &stack_top) && (*p == stack_paint))
+        ++p;
+    return p;
+}
+
+
+/**
+ * Paint the stack below the current stack pointer. Called at boot, before
+ * main.
+ */
+void mem_paint_stack(){
+    uint32_t* sp = stack_pointer();
+    for (uint32_t* p = &__bss_end; p < sp; ++p)
+        *p = stack_paint;
+}
+
+
+/**
+ * Start measuring the stack used by a command: paint again the words used
+ * since the last measure. Only these words are written, but the first call
+ * scans the whole stack to account for the boot.
+ */
+void mem_probe_begin(){
+    if (stack_low == nullptr){
+        stack_low = stack_scan();
+        stack_peak = (&stack_top - stack_low) * 4;
+    }
+    uint32_t* sp = stack_pointer();
+    for (uint32_t* p = stack_low; p < sp; ++p)
+        *p = stack_paint;
+}
+
+
+/**
+ * End measuring the stack used by a command. The scan reads the free stack,
+ * about 100 us.
+ */
+void mem_probe_end(){
+    stack_low = stack_scan();
+    stack_last = (&stack_top - stack_low) * 4;
+    if (stack_last > stack_peak)
+        stack_peak = stack_last;
+}
+
+
+/**
+ * Get the RAM usage.
+ *
+ * @param stats Filled with the usage.
+ * @return false in the host simulation, where it is not measured.
+ */
+bool mem_get_stats(mem_stats_t* stats){
+    stats->ram_size = (&stack_top - &__bss_start) * 4;
+    stats->bss_size = (&__bss_end - &__bss_start) * 4;
+    stats->ramfunc_size = (&__ramfunc_end - &__ramfunc_start) * 4;
+    stats->stack_peak = stack_peak;
+    stats->stack_last = stack_last;
+    return true;
+}
+
+
+#else
+
+
+// The host simulation runs on the stack of the host, which is not measured.
+
+void mem_paint_stack(){}
+void mem_probe_begin(){}
+void mem_probe_end(){}
+
+bool mem_get_stats(mem_stats_t*){
+    return false;
+}
+
+
+#endif
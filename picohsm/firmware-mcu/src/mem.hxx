@@ -0,0 +1,54 @@
+/**
+ * This file is part of picoHSM
+ * 
+ * picoHSM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Ledger SAS, written by Olivier Hériveaux
+ */
+
+#ifndef _MEM_HXX_
+#define _MEM_HXX_
+
+#include <stdint.h>
+
+
+/**
+ * Value written in the free stack at boot. Words still holding it have never
+ * been used by the stack.
+ */
+const uint32_t stack_paint = 0xc5c5c5c5;
+
+
+/** RAM usage, in bytes. */
+struct mem_stats_t {
+    /** Size of the RAM holding BSS and the stack. */
+    uint32_t ram_size;
+    /** Static variables. */
+    uint32_t bss_size;
+    /** Functions copied to SRAM, in their own region. */
+    uint32_t ramfunc_size;
+    /** Deepest stack use since boot. */
+    uint32_t stack_peak;
+    /** Deepest stack use during the last command. */
+    uint32_t stack_last;
+};
+
+
+void mem_paint_stack();
+void mem_probe_begin();
+void mem_probe_end();
+bool mem_get_stats(mem_stats_t*);
+
+
+#endif
@@ -0,0 +1,78 @@
+#!/usr/bin/python3
+"""
+Static RAM usage of the firmware-mcu ELF: symbols in RAM and in the SRAM
+functions region by size, and the space left to the stack. With --su-dir, the
+largest stack frames are listed as well, from the .su files written by GCC
+with -fstack-usage. The mem command reports the stack use measured on the
+board.
+"""
+import os
+import subprocess
+import click
+
+# See linker_script
+RAM = (0x20000000, 0x20002000)
+RAMCODE = (0x20010000, 0x20020000)
+
+
+def read_symbols(elf, nm):
+    """ :return: List of (address, size, name) of the sized symbols. """
+    out = subprocess.run([nm, '--print-size', '--size-sort', '--demangle',
+        elf], check=True, capture_output=True, text=True).stdout
+    symbols = []
+    for line in out.splitlines():
+        words = line.split(maxsplit=3)
+        if len(words) == 4:
+            symbols.append((int(words[0], 16), int(words[1], 16), words[3]))
+    return symbols
+
+
+def read_frames(su_dir):
+    """ :return: List of (size, function, qualifiers), largest first. """
+    frames = []
+    for root, _, files in os.walk(su_dir):
+        for name in files:
+            if not name.endswith('.su'):
+                continue
+            with open(os.path.join(root, name)) as f:
+                for line in f:
+                    # file:line:column:function, size, qualifiers
+                    location, size, qualifiers = line.rstrip('\n').split('\t')
+                    function = location.split(':', 3)[-1]
+                    frames.append((int(size), function, qualifiers))
+    return sorted(frames, reverse=True)
+
+
+def print_region(title, region, symbols, top):
+    inside = [s for s in symbols if region[0] <= s[0] < region[1]]
+    inside.sort(key=lambda s: -s[1])
+    total = sum(s[1] for s in inside)
+    print(f'{title}: {total} bytes in {len(inside)} symbols')
+    for address, size, name in inside[:top]:
+        print(f'    {size:6} 0x{address:08x} {name}')
+    return total
+
+
+@click.command(help='Print the static RAM usage of the firmware.')
+@click.argument('elf', type=click.Path(exists=True))
+@click.option('--su-dir', type=click.Path(exists=True), help='Build '
+    'directory with the .su files.')
+@click.option('--nm', default='arm-none-eabi-nm', help='nm tool.')
+@click.option('--top', default=20, help='Number of symbols and frames '
+    'listed.')
+def cli(elf, su_dir, nm, top):
+    symbols = read_symbols(elf, nm)
+    bss = print_region('RAM', RAM, symbols, top)
+    ram_size = RAM[1] - RAM[0]
+    print(f'Stack: {ram_size - bss} bytes left of {ram_size}')
+    print()
+    print_region('SRAM functions', RAMCODE, symbols, top)
+    if su_dir:
+        print()
+        print('Largest stack frames:')
+        for size, function, qualifiers in read_frames(su_dir)[:top]:
+            print(f'    {size:6} {function} ({qualifiers})')
+
+
+if __name__ == '__main__':
+    cli()
@@ -29,7 +29,8 @@ template <uint32_t Size> class ring_buffer_t
          */
         ring_buffer_t():
             write(0),
-            read(0)
+            read(0),
+            dropped(0)
         {}
 
         /**
@@ -39,10 +40,11 @@ template <uint32_t Size> class ring_buffer_t
          */
         bool put(uint8_t data)
         {
-            uint8_t write_next = next(write);
+            uint32_t write_next = next(write);
             if (write_next == read)
             {
                 /* Buffer is full. Drop byte. */
+                ++dropped;
                 return false;
             }
             else
@@ -93,6 +95,14 @@ template <uint32_t Size> class ring_buffer_t
                 return (Size - read) + write;
         }
 
+        /**
+         * @return Number of bytes dropped because the buffer was full.
+         */
+        uint32_t drops() const
+        {
+            return dropped;
+        }
+
         /**
          * @return Byte at a given offset in the buffer. Used to read data
          *     without poping it. Returns 0 if the offset is too big.
@@ -114,6 +124,8 @@ template <uint32_t Size> class ring_buffer_t
         /** Index of the next byte to be read.
          * If equal to write, this means no bytes are available. */
         volatile uint32_t read;
+        /** Number of bytes dropped by put. */
+        volatile uint32_t dropped;
 
         /**
          * Next value of an index in the circular buffer.
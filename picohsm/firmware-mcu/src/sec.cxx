@@ -0,0 +1,387 @@
+/**
+ * This file is part of picoHSM
+ * 
+ * picoHSM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Ledger SAS, written by Olivier Hériveaux
+ */
+
+#include "sec.hxx"
+#include "delay.hxx"
+#include "panic.hxx"
+#include "stm32f205.hxx"
+#include "util.hxx"
+
+
+/** Reset pin of the security MCU (active low). */
+typedef gpio_pin_t<gpioa_base, 11> sec_rst_pin;
+
+
+usart_t usart_sec;
+
+/**
+ * PIN which opened the session on the security MCU. Operations with this PIN
+ * skip the PIN verification exchange. Cleared when the security MCU is reset.
+ */
+static char session_pin[8];
+static bool session_open = false;
+
+/** Number of credit bytes the security MCU will still send during a CMAC. */
+static uint32_t cmac_grants_pending = 0;
+
+
+/**
+ * Compare a PIN with the session PIN. Runs in constant time.
+ *
+ * @param pin PIN. 8 digits.
+ * @return true if a session is open with this PIN.
+ */
+static bool session_pin_equal(const char* pin){
+    uint8_t diff = 0;
+    for (int i = 0; i < 8; ++i)
+        diff |= pin[i] ^ session_pin[i];
+    return session_open && (diff == 0);
+}
+
+
+/**
+ * Start-up time of the security MCU after its reset is released, in CPU
+ * cycles. Its fuses select 14 clock cycles and 65 ms; 70 ms leaves a margin.
+ */
+const uint32_t sec_startup_time = 70 * (sys_freq / 1000);
+
+/** Time when the reset of the security MCU was released. */
+static uint32_t sec_release_time;
+/** true until sec_wait_ready has waited for the end of the start-up. */
+static bool sec_starting = false;
+
+
+/**
+ * Resets the security MCU, and returns without waiting for its start-up, so
+ * other work overlaps it. sec_wait_ready must be called before talking to
+ * it.
+ */
+void sec_reset_start(){
+    sec_rst_pin::low();
+    // Datasheet: 2.5 us at least.
+    uint32_t start = ticks();
+    while (!ticks_elapsed(start, sys_freq / 100000)){}
+    sec_rst_pin::high();
+    sec_release_time = ticks();
+    sec_starting = true;
+    session_open = false;
+}
+
+
+/**
+ * Waits until the security MCU has started after sec_reset_start, and drops
+ * what was received from it meanwhile. If the cycle counter wrapped around in
+ * between, this may wait up to the start-up time again.
+ */
+void sec_wait_ready(){
+    if (sec_starting){
+        while (!ticks_elapsed(sec_release_time, sec_startup_time)){}
+        sec_starting = false;
+    }
+    usart_sec.flush();
+}
+
+
+/**
+ * @return Time when the security MCU is ready after its last reset, as
+ *     returned by ticks().
+ */
+uint32_t sec_ready_time(){
+    return sec_release_time + sec_startup_time;
+}
+
+
+/**
+ * Resets the security MCU, and waits for its start-up.
+ */
+void sec_reset(){
+    sec_reset_start();
+    sec_wait_ready();
+}
+
+
+/**
+ * Process PIN verification. On success, the security MCU opens a session for
+ * this PIN.
+ *
+ * @param pin Input PIN. 8 digits.
+ * @return true if PIN is valid.
+ */
+bool verify_pin(char* pin){
+    usart_sec.flush();
+    usart_sec.tx(SEC_INS_VERIFY_PIN);
+    usart_sec.tx_buf((uint8_t*)pin, 8);
+    uint8_t result = usart_sec.rx();
+    session_open = (result == SEC_STATUS_OK);
+    for (int i = 0; i < 8; ++i)
+        session_pin[i] = session_open ? pin[i] : 0;
+    return session_open;
+}
+
+
+/**
+ * Make sure a session is open on the security MCU for a PIN.
+ *
+ * @param pin PIN. 8 digits.
+ * @param expired true if the security MCU reported the session as expired.
+ * @return false if the PIN is invalid.
+ */
+static bool sec_session_open(const char* pin, bool expired){
+    if (!expired && session_pin_equal(pin))
+        return true;
+    return verify_pin((char*)pin);
+}
+
+
+/**
+ * Sends an instruction which runs in the session opened on the security MCU,
+ * and reads its status. The PIN is verified only if no session is open with
+ * it, or if the session has expired on the security MCU: the instruction is
+ * then sent again.
+ *
+ * @param pin PIN. 8 digits.
+ * @param frame Instruction, followed by its parameters.
+ * @param len Length of the frame, in bytes.
+ * @return Status returned by the security MCU, or SEC_STATUS_BAD_PIN if the
+ *     PIN is invalid.
+ */
+static sec_status_t sec_session_instruction(const char* pin,
+    const uint8_t* frame, size_t len){
+    sec_status_t status = SEC_STATUS_NO_SESSION;
+    for (int i = 0; (i < 2) && (status == SEC_STATUS_NO_SESSION); ++i){
+        if (!sec_session_open(pin, i > 0))
+            return SEC_STATUS_BAD_PIN;
+        usart_sec.tx_buf(frame, len);
+        status = (sec_status_t)usart_sec.rx();
+    }
+    return status;
+}
+
+
+/**
+ * Starts an encryption or decryption operation on the security MCU. When
+ * successful, the blocks must then be processed with sec_crypt_block or
+ * sec_crypt_blocks. The security MCU grants credits telling how many blocks
+ * can be sent ahead without overflowing its reception buffer.
+ *
+ * The PIN is verified once to open a session, which is then reused by the
+ * following operations with the same PIN.
+ *
+ * @param op Operation.
+ * @param pin PIN. 8 digits.
+ * @param key_id Key number, or context number for the CBC context operations.
+ * @param block_count Number of AES blocks which will be processed.
+ * @return SEC_STATUS_OK if the operation has been accepted, otherwise the
+ *     status returned by the security MCU.
+ */
+sec_status_t sec_crypt_begin(sec_op_t op, const char* pin, uint8_t key_id,
+    uint16_t block_count){
+    // Key number and block count are sent in a single frame, answered by the
+    // status and the credits.
+    uint8_t frame[4] = {0, key_id, (uint8_t)(block_count & 0xff),
+        (uint8_t)(block_count >> 8)};
+    switch (op){
+        case SEC_OP_ENCRYPT: frame[0] = SEC_INS_SESSION_ENCRYPT; break;
+        case SEC_OP_DECRYPT: frame[0] = SEC_INS_SESSION_DECRYPT; break;
+        case SEC_OP_CTR: frame[0] = SEC_INS_CTR_XCRYPT; break;
+        case SEC_OP_CBC_ENCRYPT: frame[0] = SEC_INS_CBC_ENCRYPT; break;
+        case SEC_OP_CBC_DECRYPT: frame[0] = SEC_INS_CBC_DECRYPT; break;
+    }
+    sec_status_t status = sec_session_instruction(pin, frame, sizeof(frame));
+    if (status != SEC_STATUS_OK)
+        return status;
+    usart_sec.set_credit(usart_sec.rx() * AES_BLOCK_SIZE);
+    return SEC_STATUS_OK;
+}
+
+
+/**
+ * Set the initial counter block used by SEC_OP_CTR operations with a key. The
+ * security MCU precomputes the keystream while it is idle, and the counter
+ * continues from one operation to the next.
+ *
+ * @param pin PIN. 8 digits.
+ * @param key_id Key number.
+ * @param nonce Initial counter block. 16 bytes.
+ * @return Status returned by the security MCU.
+ */
+sec_status_t sec_ctr_nonce(const char* pin, uint8_t key_id,
+    const uint8_t* nonce){
+    uint8_t frame[2 + AES_BLOCK_SIZE] = {SEC_INS_CTR_NONCE, key_id};
+    for (int i = 0; i < AES_BLOCK_SIZE; ++i)
+        frame[2 + i] = nonce[i];
+    return sec_session_instruction(pin, frame, sizeof(frame));
+}
+
+
+/**
+ * Process one AES block of an operation started with sec_crypt_begin.
+ *
+ * @param in Input block.
+ * @param out Output block. Can be the same buffer as the input.
+ */
+void sec_crypt_block(const uint8_t* in, uint8_t* out){
+    sec_crypt_blocks(in, out, 1);
+}
+
+
+/**
+ * Process AES blocks of an operation started with sec_crypt_begin. Input
+ * blocks are sent ahead as long as the security MCU has granted credits, so
+ * it does not wait for the next block after each result.
+ *
+ * @param in Input blocks.
+ * @param out Output blocks. Can be the same buffer as the input.
+ * @param block_count Number of blocks.
+ */
+void sec_crypt_blocks(const uint8_t* in, uint8_t* out, size_t block_count){
+    size_t sent = 0;
+    for (size_t received = 0; received < block_count; ++received){
+        while ((sent < block_count) &&
+            (usart_sec.credit() >= AES_BLOCK_SIZE)){
+            usart_sec.tx_buf_credit(in + sent * AES_BLOCK_SIZE,
+                AES_BLOCK_SIZE);
+            ++sent;
+        }
+        // An input block has been consumed when its result comes back
+        usart_sec.rx_buf(out + received * AES_BLOCK_SIZE, AES_BLOCK_SIZE);
+        usart_sec.add_credit(AES_BLOCK_SIZE);
+    }
+}
+
+
+/**
+ * Initialize a CBC context of the security MCU. SEC_OP_CBC_ENCRYPT and
+ * SEC_OP_CBC_DECRYPT operations in this context then chain from one call to
+ * the next, so a message can be processed in several parts.
+ *
+ * @param pin PIN. 8 digits.
+ * @param ctx_id Context number.
+ * @param key_id Key number.
+ * @param iv Initial IV. 16 bytes.
+ * @return Status returned by the security MCU.
+ */
+sec_status_t sec_cbc_init(const char* pin, uint8_t ctx_id, uint8_t key_id,
+    const uint8_t* iv){
+    uint8_t frame[3 + AES_BLOCK_SIZE] = {SEC_INS_CBC_INIT, ctx_id, key_id};
+    for (int i = 0; i < AES_BLOCK_SIZE; ++i)
+        frame[3 + i] = iv[i];
+    return sec_session_instruction(pin, frame, sizeof(frame));
+}
+
+
+/**
+ * Starts an AES-CMAC computation on the security MCU. The message is then
+ * sent with sec_cmac_update, and the tag is read with sec_cmac_final.
+ *
+ * @param pin PIN. 8 digits.
+ * @param key_id Key number.
+ * @param len Message length in bytes.
+ * @return Status returned by the security MCU.
+ */
+sec_status_t sec_cmac_begin(const char* pin, uint8_t key_id, uint16_t len){
+    uint8_t frame[4] = {SEC_INS_CMAC, key_id, (uint8_t)(len & 0xff),
+        (uint8_t)(len >> 8)};
+    sec_status_t status = sec_session_instruction(pin, frame, sizeof(frame));
+    if (status != SEC_STATUS_OK)
+        return status;
+    // Nothing is returned per block: the security MCU gives credits back in
+    // groups of half the initial credits, except after the last block.
+    uint8_t credits = usart_sec.rx();
+    usart_sec.set_credit(credits * AES_BLOCK_SIZE);
+    uint32_t group = (credits + 1) / 2;
+    uint32_t block_count = (len + AES_BLOCK_SIZE - 1) / AES_BLOCK_SIZE;
+    cmac_grants_pending = block_count ? (block_count - 1) / group : 0;
+    return SEC_STATUS_OK;
+}
+
+
+/**
+ * Send a part of the message of a CMAC computation, within the credits granted
+ * by the security MCU.
+ *
+ * @param data Message part.
+ * @param len Length in bytes. Any length.
+ */
+void sec_cmac_update(const uint8_t* data, size_t len){
+    while (len){
+        if (usart_sec.credit() == 0){
+            assert(cmac_grants_pending);
+            usart_sec.add_credit(usart_sec.rx() * AES_BLOCK_SIZE);
+            --cmac_grants_pending;
+        }
+        size_t n = min((size_t)usart_sec.credit(), len);
+        usart_sec.tx_buf_credit(data, n);
+        data += n;
+        len -= n;
+    }
+}
+
+
+/**
+ * Read the result of a CMAC computation, once the whole message has been
+ * sent.
+ *
+ * @param tag Where the 16-byte tag is written.
+ */
+void sec_cmac_final(uint8_t* tag){
+    for (; cmac_grants_pending; --cmac_grants_pending)
+        usart_sec.rx();
+    usart_sec.rx_buf(tag, AES_BLOCK_SIZE);
+}
+
+
+/**
+ * Query the security MCU for its statistics.
+ *
+ * @param stats Where the statistics are written.
+ * @return true on success.
+ */
+bool sec_get_stats(sec_stats_t* stats){
+    usart_sec.flush();
+    usart_sec.tx(SEC_INS_STATS);
+    if (usart_sec.rx() != SEC_STATUS_OK)
+        return false;
+    uint32_t* fields[] = {&stats->rx_drops, &stats->ctr_fills,
+        &stats->ctr_hits, &stats->ctr_misses};
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); ++i){
+        uint8_t buf[4];
+        usart_sec.rx_buf(buf, sizeof(buf));
+        *fields[i] = buf[0] | (buf[1] << 8) | (buf[2] << 16) |
+            ((uint32_t)buf[3] << 24);
+    }
+    return true;
+}
+
+
+/**
+ * Query the security MCU for the type of each key slot.
+ *
+ * @param types Where the KEY_COUNT slot types are written: key length in
+ *     bytes (16, 24 or 32), with SEC_KEY_LOCKED set if the key is locked.
+ * @return true on success.
+ */
+bool sec_key_info(uint8_t* types){
+    usart_sec.flush();
+    usart_sec.tx(SEC_INS_KEY_INFO);
+    if (usart_sec.rx() != SEC_STATUS_OK)
+        return false;
+    usart_sec.rx_buf(types, KEY_COUNT);
+    return true;
+}
@@ -0,0 +1,73 @@
+/**
+ * This file is part of picoHSM
+ * 
+ * picoHSM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Ledger SAS, written by Olivier Hériveaux
+ */
+
+#ifndef _SEC_HXX_
+#define _SEC_HXX_
+
+
+#include <stdint.h>
+#include "usart.hxx"
+#include "sec_protocol.hxx"
+
+
+/** Operations processing blocks on the security MCU. */
+enum sec_op_t {
+    SEC_OP_ENCRYPT,
+    SEC_OP_DECRYPT,
+    /** Counter mode, with the nonce set by sec_ctr_nonce. */
+    SEC_OP_CTR,
+    /** CBC in a context set by sec_cbc_init, chaining across operations. */
+    SEC_OP_CBC_ENCRYPT,
+    SEC_OP_CBC_DECRYPT
+};
+
+
+/** Statistics reported by the security MCU since its reset. */
+struct sec_stats_t {
+    /** Bytes dropped by its UART. */
+    uint32_t rx_drops;
+    /** CTR keystream blocks precomputed while idle. */
+    uint32_t ctr_fills;
+    /** CTR blocks served from precomputed keystream. */
+    uint32_t ctr_hits;
+    /** CTR blocks whose keystream was computed on demand. */
+    uint32_t ctr_misses;
+};
+
+
+extern usart_t usart_sec;
+
+void sec_reset();
+void sec_reset_start();
+void sec_wait_ready();
+uint32_t sec_ready_time();
+bool verify_pin(char*);
+sec_status_t sec_crypt_begin(sec_op_t, const char*, uint8_t, uint16_t);
+sec_status_t sec_ctr_nonce(const char*, uint8_t, const uint8_t*);
+sec_status_t sec_cbc_init(const char*, uint8_t, uint8_t, const uint8_t*);
+sec_status_t sec_cmac_begin(const char*, uint8_t, uint16_t);
+void sec_cmac_update(const uint8_t*, size_t);
+void sec_cmac_final(uint8_t*);
+void sec_crypt_block(const uint8_t*, uint8_t*);
+void sec_crypt_blocks(const uint8_t*, uint8_t*, size_t);
+bool sec_get_stats(sec_stats_t*);
+bool sec_key_info(uint8_t*);
+
+
+#endif
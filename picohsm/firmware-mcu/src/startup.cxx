@@ -0,0 +1,58 @@
+/**
+ * This file is part of picoHSM
+ * 
+ * picoHSM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Ledger SAS, written by Olivier Hériveaux
+ */
+
+#include <stdint.h>
+#include "mem.hxx"
+
+
+int main();
+
+
+/**
+ * Entry point after reset, called by boot.s. Prepares the memory for the C++
+ * runtime and calls main. This is not part of the host simulation, where the
+ * system does it.
+ */
+extern "C" void startup(){
+    // Copy the functions which run from SRAM
+    extern uint32_t __ramfunc_start;
+    extern uint32_t __ramfunc_end;
+    extern uint32_t __ramfunc_load;
+    uint32_t* ramfunc_src = &__ramfunc_load;
+    for (uint32_t* p = &__ramfunc_start; p < &__ramfunc_end; ++p)
+        *p = *ramfunc_src++;
+
+    // Clear BSS, a word at a time: the linker script aligns it on 4 bytes.
+    // Initialized data stays in flash and has nothing to copy.
+    extern uint32_t __bss_start;
+    extern uint32_t __bss_end;
+    for (uint32_t* p = &__bss_start; p < &__bss_end; ++p)
+        *p = 0;
+
+    // Paint the free stack, for its high-water mark
+    mem_paint_stack();
+
+    // Call the static initializers functions
+    extern void (*__init_array_start)();
+    extern void (*__init_array_end)();
+    for (void (**p)() = &__init_array_start; p < &__init_array_end; ++p)
+        (*p)();
+
+    main();
+}
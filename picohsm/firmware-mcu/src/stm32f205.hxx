@@ -22,6 +22,20 @@
 
 
 #include <stdint.h>
+#ifdef PICOHSM_HOST
+#include "sim_reg.hxx"
+#endif
+
+
+/**
+ * A peripheral register. In the host simulation (see sim/), register accesses
+ * are forwarded to the simulated peripherals.
+ */
+#ifdef PICOHSM_HOST
+typedef sim_reg_t reg32_t;
+#else
+typedef uint32_t reg32_t;
+#endif
 
 
 /**
@@ -29,62 +43,62 @@
  */
 struct rcc_regs_t {
     /** Clock Control Register */
-    uint32_t cr;
+    reg32_t cr;
     /** PLL Configuration Register */
-    uint32_t pllcfgr;
+    reg32_t pllcfgr;
     /** Clock Configuration Register */
-    uint32_t cfgr;
+    reg32_t cfgr;
     /** Clock Interrupt Register */
-    uint32_t cir;
+    reg32_t cir;
     /** AHB1 Peripheral Reset Register */
-    uint32_t ahb1rstr;
+    reg32_t ahb1rstr;
     /** AHB2 Peripheral Reset Register */
-    uint32_t ahb2rstr;
+    reg32_t ahb2rstr;
     /** AHB3 Peripheral Reset Register */
-    uint32_t ahb3rstr;
-    uint32_t reserved_1c;
+    reg32_t ahb3rstr;
+    reg32_t reserved_1c;
     /** APB1 Peripheral Reset Register */
-    uint32_t apb1rstr;
+    reg32_t apb1rstr;
     /** APB2 Peripheral Reset Register */
-    uint32_t apb2rstr;
-    uint32_t reserved_28;
-    uint32_t reserved_2c;
+    reg32_t apb2rstr;
+    reg32_t reserved_28;
+    reg32_t reserved_2c;
     /** AHB1 Peripheral Clock Enable Register */
-    uint32_t ahb1enr;
+    reg32_t ahb1enr;
     /** AHB2 Peripheral Clock Enable Register */
-    uint32_t ahb2enr;
+    reg32_t ahb2enr;
     /** AHB3 Peripheral Clock Enable Register */
-    uint32_t ahb3enr;
-    uint32_t reserved_3c;
+    reg32_t ahb3enr;
+    reg32_t reserved_3c;
     /** APB1 Peripheral Clock Enable Register */
-    uint32_t apb1enr;
+    reg32_t apb1enr;
     /** APB2 Peripheral Clock Enable Register */
-    uint32_t apb2enr;
-    uint32_t reserved_48;
-    uint32_t reserved_4c;
+    reg32_t apb2enr;
+    reg32_t reserved_48;
+    reg32_t reserved_4c;
     /** AHB1 Peripheral Clock Enable in Low Power Mode Register */
-    uint32_t ahb1lpenr;
+    reg32_t ahb1lpenr;
     /** AHB2 Peripheral Clock Enable in Low Power Mode Register */
-    uint32_t ahb2lpenr;
+    reg32_t ahb2lpenr;
     /** AHB3 Peripheral Clock Enable in Low Power Mode Register */
-    uint32_t ahb3lpenr;
-    uint32_t reserved_5c;
+    reg32_t ahb3lpenr;
+    reg32_t reserved_5c;
     /** APB1 Peripheral Clock Enable in Low Power Mode Register */
-    uint32_t apb1lpenr;
+    reg32_t apb1lpenr;
     /** APB2 Peripheral Clock Enable in Low Power Mode Register */
-    uint32_t apb2lpenr;
-    uint32_t reserved_68;
-    uint32_t reserved_6c;
+    reg32_t apb2lpenr;
+    reg32_t reserved_68;
+    reg32_t reserved_6c;
     /** Backup Domain Control Register */
-    uint32_t bdcr;
+    reg32_t bdcr;
     /** Clock Control & Status Register */
-    uint32_t csr;
-    uint32_t reserved_78;
-    uint32_t reserved_7c;
+    reg32_t csr;
+    reg32_t reserved_78;
+    reg32_t reserved_7c;
     /** Spread Spectrum Clock Generation Register */
-    uint32_t sscgr;
+    reg32_t sscgr;
     /** PLLI2S Configuration Register */
-    uint32_t plli2scfgr;
+    reg32_t plli2scfgr;
 };
 
 
@@ -93,25 +107,25 @@ struct rcc_regs_t {
  */
 struct gpio_regs_t {
     /** Port Mode Register */
-    uint32_t moder;
+    reg32_t moder;
     /** Port Output Type Register */
-    uint32_t otyper;
+    reg32_t otyper;
     /** Port Output Speed Register */
-    uint32_t ospeedr;
+    reg32_t ospeedr;
     /** Pull-up / Pull-down Register */
-    uint32_t pupdr;
+    reg32_t pupdr;
     /** Input Data Register */
-    uint32_t idr;
+    reg32_t idr;
     /** Output Data Register */
-    uint32_t odr;
+    reg32_t odr;
     /** Bit Set / Register Reset Register */
-    uint32_t bsrr;
+    reg32_t bsrr;
     /** Port Configuration Lock Register */
-    uint32_t lckr;
+    reg32_t lckr;
     /** Alternate Function Register Low */
-    uint32_t afrl;
+    reg32_t afrl;
     /** Alternate Function Register High */
-    uint32_t afrh;
+    reg32_t afrh;
 };
 
 
@@ -140,23 +154,23 @@ struct gpio_speed_t {
  */
 struct spi_regs_t {
     /** Control Register 1 */
-    uint32_t cr1;
+    reg32_t cr1;
     /** Control Register 2 */
-    uint32_t cr2;
+    reg32_t cr2;
     /** Status Register */
-    uint32_t sr;
+    reg32_t sr;
     /** Data Register */
-    uint32_t dr;
+    reg32_t dr;
     /** CRC Polynomial Register */
-    uint32_t crcpr;
+    reg32_t crcpr;
     /** RX CRC Register */
-    uint32_t rxcrcr;
+    reg32_t rxcrcr;
     /** TX CRC Register */
-    uint32_t txcrcr;
+    reg32_t txcrcr;
     /** I²S Configuration Register */
-    uint32_t i2scfgr;
+    reg32_t i2scfgr;
     /** I²S Prescaler Register */
-    uint32_t i2spr;
+    reg32_t i2spr;
 };
 
 
@@ -165,19 +179,19 @@ struct spi_regs_t {
  */
 struct usart_regs_t {
     /** Status Register */
-    uint32_t sr;
+    reg32_t sr;
     /** Data Register */
-    uint32_t dr;
+    reg32_t dr;
     /** Baud rate Register */
-    uint32_t brr;
+    reg32_t brr;
     /** Control Register 1 */
-    uint32_t cr1;
+    reg32_t cr1;
     /** Control Register 2 */
-    uint32_t cr2;
+    reg32_t cr2;
     /** Control Register 3 */
-    uint32_t cr3;
+    reg32_t cr3;
     /** Guard Time and Prescaler Register */
-    uint32_t gtpr;
+    reg32_t gtpr;
 };
 
 
@@ -186,13 +200,13 @@ struct usart_regs_t {
  */
 struct iwdg_regs_t {
     /** Key register */
-    uint32_t kr;
+    reg32_t kr;
     /** Prescaler register */
-    uint32_t pr;
+    reg32_t pr;
     /** Reload register */
-    uint32_t rlr;
+    reg32_t rlr;
     /** Status register */
-    uint32_t sr;
+    reg32_t sr;
 };
 
 
@@ -201,11 +215,11 @@ struct iwdg_regs_t {
  */
 struct wwdg_regs_t {
     /** Control Register */
-    uint32_t cr;
+    reg32_t cr;
     /** Configuraton Register */
-    uint32_t cfr;
+    reg32_t cfr;
     /** Status Register */
-    uint32_t sr;
+    reg32_t sr;
 };
 
 
@@ -214,87 +228,159 @@ struct wwdg_regs_t {
  */
 struct rng_regs_t {
     /** Control Register */
-    uint32_t cr;
+    reg32_t cr;
     /** Status Register */
-    uint32_t sr;
+    reg32_t sr;
     /** Data Register */
-    uint32_t dr;
+    reg32_t dr;
 };
 
 
 struct dwt_regs_t {
     /** Control Register */
-    uint32_t ctrl;
+    reg32_t ctrl;
     /** Cycle Count Register */
-    uint32_t cyccnt;
+    reg32_t cyccnt;
     /** CPI Count Register */
-    uint32_t cpicnt;
+    reg32_t cpicnt;
     /** Exception Overhead Count Register */
-    uint32_t exccnt;
+    reg32_t exccnt;
     /** Sleep Count Register */
-    uint32_t sleepcnt;
+    reg32_t sleepcnt;
     /** LSU Count Register */
-    uint32_t lsucnt;
+    reg32_t lsucnt;
     /** Folder-instruction Count Register */
-    uint32_t foldcnt;
+    reg32_t foldcnt;
     /** Program Counter Sample Register */
-    uint32_t pcsr;
+    reg32_t pcsr;
     /** Comparator Register 0 */
-    uint32_t comp0;
+    reg32_t comp0;
     /** Mask Register 0 */
-    uint32_t mask0;
+    reg32_t mask0;
     /** Function Register 0 */
-    uint32_t function0;
-    uint32_t unused0;
+    reg32_t function0;
+    reg32_t unused0;
     /** Comparator Register 1 */
-    uint32_t comp1;
+    reg32_t comp1;
     /** Mask Register 1 */
-    uint32_t mask1;
+    reg32_t mask1;
     /** Function Register 1 */
-    uint32_t function1;
-    uint32_t unused1;
+    reg32_t function1;
+    reg32_t unused1;
     /** Comparator Register 2 */
-    uint32_t comp2;
+    reg32_t comp2;
     /** Mask Register 2 */
-    uint32_t mask2;
+    reg32_t mask2;
     /** Function Register 2 */
-    uint32_t function2;
-    uint32_t unused2;
+    reg32_t function2;
+    reg32_t unused2;
     /** Comparator Register 3 */
-    uint32_t comp3;
+    reg32_t comp3;
     /** Mask Register 3 */
-    uint32_t mask3;
+    reg32_t mask3;
     /** Function Register 3 */
-    uint32_t function3;
+    reg32_t function3;
 };
 
 
-#define rcc (*((volatile rcc_regs_t*)0x40023800))
-#define gpioa (*((volatile gpio_regs_t*)0x40020000))
-#define gpiob (*((volatile gpio_regs_t*)0x40020400))
-#define gpioc (*((volatile gpio_regs_t*)0x40020800))
-#define spi1 (*((volatile spi_regs_t*)0x40013000))
-#define usart1 (*((volatile usart_regs_t*)0x40011000))
-#define usart2 (*((volatile usart_regs_t*)0x40004400))
-#define iwdg (*((volatile iwdg_regs_t*)0x40003000))
-#define wwdg (*((volatile wwdg_regs_t*)0x40002c00))
-#define rng (*((volatile rng_regs_t*)0x50060800))
-
-#define scb_icsr (*((volatile uint32_t*)0xe000ed04))
-#define scb_vtor (*((volatile uint32_t*)0xe000ed08))
-#define scb_aircr (*((volatile uint32_t*)0xe000ed0c))
-#define scb_demcr (*((volatile uint32_t*)0xe000edfc))
-#define dwt (*((volatile dwt_regs_t*)0xe0001000))
-
-#define flash_acr (*((volatile uint32_t*)0x40023c00))
-
-#define nvic_iser ((volatile uint32_t*)0xe000e100)
-#define nvic_icer ((volatile uint32_t*)0xe000e180)
-#define nvic_ispr ((volatile uint32_t*)0xe000e200)
-#define nvic_icpr ((volatile uint32_t*)0xe000e280)
-#define nvic_iabr ((volatile uint32_t*)0xe000e300)
-#define nvic_ipr ((volatile uint32_t*)0xe000e400)
-#define nvic_stic (*((volatile uint32_t*)0xe000ef00))
+const uint32_t gpioa_base = 0x40020000;
+const uint32_t gpiob_base = 0x40020400;
+const uint32_t gpioc_base = 0x40020800;
+
+/** Registers of the given type at a peripheral address. */
+#ifdef PICOHSM_HOST
+#define PERIPH(type, addr) (*((volatile type*)sim_periph(addr)))
+#else
+#define PERIPH(type, addr) (*((volatile type*)(addr)))
+#endif
+
+#define rcc PERIPH(rcc_regs_t, 0x40023800)
+#define gpioa PERIPH(gpio_regs_t, gpioa_base)
+#define gpiob PERIPH(gpio_regs_t, gpiob_base)
+#define gpioc PERIPH(gpio_regs_t, gpioc_base)
+#define spi1 PERIPH(spi_regs_t, 0x40013000)
+#define usart1 PERIPH(usart_regs_t, 0x40011000)
+#define usart2 PERIPH(usart_regs_t, 0x40004400)
+#define iwdg PERIPH(iwdg_regs_t, 0x40003000)
+#define wwdg PERIPH(wwdg_regs_t, 0x40002c00)
+#define rng PERIPH(rng_regs_t, 0x50060800)
+
+#define scb_icsr PERIPH(reg32_t, 0xe000ed04)
+#define scb_vtor PERIPH(reg32_t, 0xe000ed08)
+#define scb_aircr PERIPH(reg32_t, 0xe000ed0c)
+#define scb_demcr PERIPH(reg32_t, 0xe000edfc)
+#define dwt PERIPH(dwt_regs_t, 0xe0001000)
+
+#define flash_acr PERIPH(reg32_t, 0x40023c00)
+
+#define nvic_iser (&PERIPH(reg32_t, 0xe000e100))
+#define nvic_icer (&PERIPH(reg32_t, 0xe000e180))
+#define nvic_ispr (&PERIPH(reg32_t, 0xe000e200))
+#define nvic_icpr (&PERIPH(reg32_t, 0xe000e280))
+#define nvic_iabr (&PERIPH(reg32_t, 0xe000e300))
+#define nvic_ipr (&PERIPH(reg32_t, 0xe000e400))
+#define nvic_stic PERIPH(reg32_t, 0xe000ef00)
+
+
+/**
+ * Calculate the address of the bit-band alias of a bit in the SRAM or
+ * peripheral regions of the Cortex-M3.
+ *
+ * @param addr Address of the 32-bits word holding the bit.
+ * @param bit Bit number in the word.
+ * @return Address of the alias word.
+ */
+constexpr uint32_t bitband_alias(uint32_t addr, uint32_t bit){
+    return (addr & 0xf0000000) + 0x02000000 + ((addr & 0x000fffff) << 5) +
+        (bit << 2);
+}
+
+
+/**
+ * A single bit of a register, accessed through its bit-band alias. Reads and
+ * writes are single load or store instructions: there is no read-modify-write
+ * of the whole register, so this is safe against interrupts.
+ *
+ * @tparam Addr Address of the register.
+ * @tparam Bit Bit number in the register.
+ */
+template <uint32_t Addr, uint32_t Bit> struct reg_bit_t {
+    static void set(){ alias() = 1; }
+    static void clear(){ alias() = 0; }
+    static void write(bool state){ alias() = state; }
+    static bool read(){ return alias() != 0; }
+
+    static volatile reg32_t& alias(){
+        return PERIPH(reg32_t, bitband_alias(Addr, Bit));
+    }
+};
+
+
+/**
+ * A GPIO pin. The output is changed with the BSRR register, so setting or
+ * clearing the pin is a single store, atomic with respect to interrupts and to
+ * the other pins of the port.
+ *
+ * @tparam Port Base address of the GPIO port.
+ * @tparam Pin Pin number in the port.
+ */
+template <uint32_t Port, uint32_t Pin> struct gpio_pin_t {
+    static void high(){ port().bsrr = (1 << Pin); }
+    static void low(){ port().bsrr = (1 << (Pin + 16)); }
+    static void write(bool state){
+        if (state) {
+            high();
+        } else {
+            low();
+        }
+    }
+    /** @return Input level of the pin, read from IDR bit-band alias. */
+    static bool read(){ return reg_bit_t<Port + 0x10, Pin>::read(); }
+
+    static volatile gpio_regs_t& port(){
+        return PERIPH(gpio_regs_t, Port);
+    }
+};
 
 
 #endif
@@ -20,6 +20,21 @@
 #ifndef _SYSTEM_HXX_
 #define _SYSTEM_HXX_
 
+#include <stdint.h>
+
 const uint32_t sys_freq = 50000000;
 
+/**
+ * Places a function in SRAM, where it runs without flash wait states. The
+ * section is copied from flash at startup, before main is called. SRAM is
+ * out of reach of BL instructions in flash, hence long_call. The attribute must
+ * be set on the declaration of the function. Define NO_RAMFUNC to keep all the
+ * code in flash.
+ */
+#ifndef NO_RAMFUNC
+#define RAMFUNC __attribute__((section(".ramfunc"), long_call, noinline))
+#else
+#define RAMFUNC
+#endif
+
 #endif
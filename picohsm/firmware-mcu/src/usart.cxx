@@ -46,7 +46,8 @@ extern "C" void usart2_handler(){
  * USART is not initialized.
  */
 usart_t::usart_t():
-    dev(0){}
+    dev(0),
+    tx_credit(0){}
 
 
 /**
@@ -198,6 +199,57 @@ size_t usart_t::avail() const {
 }
 
 
+/**
+ * @return Number of received bytes dropped because the reception buffer was
+ *     full.
+ */
+uint32_t usart_t::drops() const {
+    return buf->drops();
+}
+
+
+/**
+ * Set the number of bytes the peer can receive, as advertised by it.
+ *
+ * @param bytes Free space in the peer reception buffer.
+ */
+void usart_t::set_credit(uint32_t bytes){
+    tx_credit = bytes;
+}
+
+
+/**
+ * Give back credit, when the peer has signaled it consumed received data.
+ *
+ * @param bytes Number of bytes freed in the peer reception buffer.
+ */
+void usart_t::add_credit(uint32_t bytes){
+    tx_credit += bytes;
+}
+
+
+/**
+ * @return Number of bytes which can be sent without overflowing the peer.
+ */
+uint32_t usart_t::credit() const {
+    return tx_credit;
+}
+
+
+/**
+ * Transmit bytes under flow control. Panics if this exceeds the credit
+ * granted by the peer, since the peer would drop bytes.
+ *
+ * @param buf Data to be sent.
+ * @param len Number of bytes.
+ */
+void usart_t::tx_buf_credit(const uint8_t* buf, size_t len){
+    assert(len <= tx_credit);
+    tx_credit -= len;
+    tx_buf(buf, len);
+}
+
+
 /**
  * Print a null terminated string to the debug USART (if defined).
  *
@@ -24,6 +24,7 @@
 #include <unistd.h>
 #include "stm32f205.hxx"
 #include "ring_buffer.hxx"
+#include "system.hxx"
 
 
 /**
@@ -34,7 +35,7 @@ class usart_t {
         usart_t();
         void init(int, uint32_t);
         void flush();
-        void tx(uint8_t);
+        RAMFUNC void tx(uint8_t);
         void tx_buf(const uint8_t*, size_t);
         uint8_t rx();
         void rx_buf(uint8_t*, size_t);
@@ -43,13 +44,23 @@ class usart_t {
         void print_i32(int32_t);
         void print_u32(uint32_t);
         size_t avail() const;
+        uint32_t drops() const;
+        void set_credit(uint32_t);
+        void add_credit(uint32_t);
+        uint32_t credit() const;
+        void tx_buf_credit(const uint8_t*, size_t);
 
     private:
         volatile usart_regs_t* dev;
         ring_buffer_t<256>* buf;
+        /** Number of bytes the peer has told it can still receive. */
+        uint32_t tx_credit;
 };
 
 
+extern "C" RAMFUNC void usart1_handler();
+extern "C" RAMFUNC void usart2_handler();
+
 extern usart_t* usart_debug;
 void debug_print(const char*);
 void debug_println(const char*);
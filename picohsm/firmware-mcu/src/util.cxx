@@ -29,6 +29,7 @@ int strcmp(const char* s1, const char* s2){
 void * memset(void* s, int c, size_t n){
     for (size_t i = 0; i < n; ++i)
         ((uint8_t*)s)[i] = (uint8_t)c;
+    return s;
 }
 
 size_t strlen(const char *s){
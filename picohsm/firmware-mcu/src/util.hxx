@@ -21,6 +21,7 @@
 #define _UTIL_HXX_
 
 #include <unistd.h>
+#include "system.hxx"
 
 template <typename T> T min(T a, T b){
     return a < b ? a : b;
@@ -37,10 +38,10 @@ void reverse_str(char*);
 void u32_to_str(uint32_t, char*);
 void i32_to_str(int32_t, char*);
 int str_to_u32(const char*, uint32_t*);
-void byte_to_hex(uint8_t, char*);
-void bytes_to_hex(const uint8_t*, size_t, char*);
-int hex_char_to_byte(char, uint8_t*);
-int hex_to_byte(const char*, uint8_t*);
-int hex_to_bytes(const char*, uint8_t*, size_t*);
+RAMFUNC void byte_to_hex(uint8_t, char*);
+RAMFUNC void bytes_to_hex(const uint8_t*, size_t, char*);
+RAMFUNC int hex_char_to_byte(char, uint8_t*);
+RAMFUNC int hex_to_byte(const char*, uint8_t*);
+RAMFUNC int hex_to_bytes(const char*, uint8_t*, size_t*);
 
 #endif
@@ -24,26 +24,51 @@
 #include "util.hxx"
 
 
+/** Reset pin of the Ethernet controller (active low). */
+typedef gpio_pin_t<gpioa_base, 1> w5500_rst_pin;
+/** SPI chip select pin of the Ethernet controller (active low). */
+typedef gpio_pin_t<gpioa_base, 4> w5500_cs_pin;
+/** Maximum wait for room in a TX buffer, or for a SEND to complete, in CPU
+ * cycles. */
+const uint32_t tx_timeout = sys_freq * 2;
+
+
 /**
  * Constructor.
  *
  * @param spi_ SPI peripheral used for the communication.
  */
 w5500_t::w5500_t(volatile spi_regs_t* spi_):
-    spi(spi_){
+    spi(spi_),
+    phy_mode(phy_mode_t::auto_all),
+    phy_mode_set(false),
+    link_up(false),
+    link_flaps(0){
+    for (uint8_t i = 0; i < max_sockets; ++i)
+        tx[i] = {0, 0, false, false};
 }
 
 
 /**
- * Reset the Ethernet controller (hard reset).
+ * Reset the Ethernet controller (hard reset), and wait until it answers on
+ * the SPI bus, with its PLL locked. Gives up after 10 ms: setup_network then
+ * checks the version.
  * Also fore chip select to high.
  */
 void w5500_t::reset(){
+    // Datasheet: reset low for 500 us at least, and 1 ms at most until the
+    // PLL is locked after its release.
+    const uint32_t pulse = sys_freq / 2000;
+    const uint32_t timeout = sys_freq / 100;
     rst(true);
-    delay(100000);
     sel(false);
+    uint32_t start = ticks();
+    while (!ticks_elapsed(start, pulse)){}
     rst(false);
-    delay(100000);
+    start = ticks();
+    uint8_t version = 0;
+    while ((version != 4) && !ticks_elapsed(start, timeout))
+        read(w5500_reg_t::versionr, 0, &version, 1);
 }
 
 
@@ -87,6 +112,81 @@ void w5500_t::set_ip(uint8_t ip[4]){
 }
 
 
+/**
+ * Configure the operation mode of the PHY and restart it. The mode is applied
+ * again by poll_link each time the link comes up, if the PHY lost it.
+ *
+ * @param mode Forced speed and duplex, or auto-negotiation.
+ */
+void w5500_t::set_phy_mode(phy_mode_t mode){
+    phy_mode = mode;
+    phy_mode_set = true;
+    // OPMD selects configuration by software. Writing RST to 0 resets the PHY
+    // so the new mode is taken into account.
+    uint8_t cfg = (1 << 6) | ((uint8_t)mode << 3);
+    write_u8(w5500_reg_t::phycfgr, 0, cfg);
+    write_u8(w5500_reg_t::phycfgr, 0, cfg | (1 << 7));
+}
+
+
+/**
+ * @return Current link state: link up, speed and duplex.
+ */
+phy_status_t w5500_t::get_phy_status(){
+    uint8_t cfg = read_u8(w5500_reg_t::phycfgr, 0);
+    phy_status_t status;
+    status.link = cfg & (1 << 0);
+    status.speed_100 = cfg & (1 << 1);
+    status.full_duplex = cfg & (1 << 2);
+    return status;
+}
+
+
+/**
+ * Check the link state and track its changes. When the link comes up, the PHY
+ * mode set with set_phy_mode is applied again if the PHY configuration has
+ * been lost.
+ *
+ * @return true if the link just came up.
+ */
+bool w5500_t::poll_link(){
+    uint8_t cfg = read_u8(w5500_reg_t::phycfgr, 0);
+    bool up = cfg & (1 << 0);
+    if (up == link_up)
+        return false;
+    link_up = up;
+    if (!up){
+        link_flaps++;
+        debug_println("Link down.");
+        return false;
+    }
+    debug_println("Link up.");
+    uint8_t expected = (1 << 6) | ((uint8_t)phy_mode << 3);
+    if (phy_mode_set && ((cfg & 0x78) != expected)){
+        debug_println("Restoring PHY configuration.");
+        set_phy_mode(phy_mode);
+    }
+    return true;
+}
+
+
+/**
+ * @return Number of times the link went down since boot.
+ */
+uint32_t w5500_t::get_link_flaps() const {
+    return link_flaps;
+}
+
+
+/**
+ * @param no Socket number.
+ * @return Transmission state of the socket.
+ */
+socket_tx_t& w5500_t::tx_state(uint8_t no){
+    return tx[no];
+}
+
+
 /**
  * Transmit the beginning of a read or write transmission with the W5500.
  *
@@ -239,11 +339,7 @@ uint16_t w5500_t::read_u16_stable(w5500_reg_t reg, uint8_t sn){
  *     (PA1 will go high).
  */
 void w5500_t::rst(bool state) const {
-    if (state) {
-        gpioa.odr &= ~(1 << 1);
-    } else {
-        gpioa.odr |= (1 << 1);
-    }
+    w5500_rst_pin::write(!state);
 }
 
 
@@ -254,11 +350,7 @@ void w5500_t::rst(bool state) const {
  *     high).
  */
 void w5500_t::sel(bool state) const {
-    if (state) {
-        gpioa.odr &= ~(1 << 4);
-    } else {
-        gpioa.odr |= (1 << 4);
-    }
+    w5500_cs_pin::write(!state);
 }
 
 
@@ -324,6 +416,7 @@ bool socket_t::listen(uint16_t port){
     dev->write_u16(w5500_reg_t::sn_port0, no, port);
     command(socket_command_t::open);
     assert(get_status() == socket_status_t::init);
+    tx_reset();
     command(socket_command_t::listen);
     for (;;){
         socket_status_t st = get_status();
@@ -346,6 +439,7 @@ bool socket_t::listen(uint16_t port){
         }
         // Reload watchdog
         iwdg.kr = 0xaaaa;
+        dev->poll_link();
     }
 }
 
@@ -363,6 +457,7 @@ bool socket_t::connect(uint8_t* ip, uint16_t port){
     dev->write_u8(w5500_reg_t::sn_mr, no, 1);
     command(socket_command_t::open);
     assert(get_status() == socket_status_t::init);
+    tx_reset();
     // Clear interrupts
     dev->write_u8(w5500_reg_t::sn_ir, no, 0xff);
     dev->write_u16(w5500_reg_t::sn_port0, no, port);
@@ -399,22 +494,145 @@ bool socket_t::connect(uint8_t* ip, uint16_t port){
 
 
 /**
- * Writes data to the socket.
+ * Opens the socket in MACRAW mode. Only socket 0 supports this mode. The MAC
+ * filter is enabled, so only broadcast frames and frames sent to the MAC
+ * address of the W5500 are received.
+ *
+ * @return true if the socket has been opened successfully.
+ */
+bool socket_t::open_macraw(){
+    assert(no == 0);
+    assert(get_status() == socket_status_t::closed);
+    // MACRAW mode with MAC filter enabled (MFEN)
+    dev->write_u8(w5500_reg_t::sn_mr, no, (1 << 7) | 0x04);
+    command(socket_command_t::open);
+    tx_reset();
+    return get_status() == socket_status_t::macraw;
+}
+
+
+/**
+ * Receives an Ethernet frame from a socket in MACRAW mode. Frames larger than
+ * the destination buffer are truncated.
+ *
+ * @param dst Buffer where the frame is written, starting with the destination
+ *     MAC address.
+ * @param len Size of the destination buffer.
+ * @return Number of bytes written in the buffer. 0 if no frame is available,
+ *     or if the frame length is invalid.
+ */
+size_t socket_t::recv_frame(uint8_t* dst, size_t len){
+    if (avail() < 2)
+        return 0;
+    uint16_t rdp = dev->read_u16(w5500_reg_t::sn_rx_rd0, no);
+    uint32_t rx_buf_addr = (uint32_t)w5500_reg_t::rx_buf + (uint32_t)rdp;
+    // Each frame is preceded by its length, which includes the length field
+    // itself.
+    uint8_t info[2];
+    dev->read((w5500_reg_t)rx_buf_addr, no, info, 2);
+    uint16_t frame_len = ((uint16_t)info[0] << 8) | info[1];
+    // An invalid length would make the read pointer lose the frame
+    // boundaries: all the received data is dropped instead.
+    size_t rx_buf_size = dev->read_u8(w5500_reg_t::sn_rxbuf_size, no) * 1024;
+    if ((frame_len < 2) || (frame_len > rx_buf_size)){
+        dev->write_u16(w5500_reg_t::sn_rx_rd0, no,
+            dev->read_u16_stable(w5500_reg_t::sn_rx_wr0, no));
+        command(socket_command_t::recv);
+        return 0;
+    }
+    frame_len -= 2;
+    size_t n = min((size_t)frame_len, len);
+    dev->read((w5500_reg_t)((uint32_t)w5500_reg_t::rx_buf +
+        (uint16_t)(rdp + 2)), no, dst, n);
+    dev->write_u16(w5500_reg_t::sn_rx_rd0, no, rdp + 2 + frame_len);
+    command(socket_command_t::recv);
+    return n;
+}
+
+
+/**
+ * Writes data to the socket. The data is sent immediately, unless a batch has
+ * been started with batch_begin: it is then queued in the TX buffer, and sent
+ * by flush, batch_end, or when the buffer is full. In MACRAW mode, each
+ * send is one frame.
+ *
+ * Data is dropped if the connection is lost, or if there is still no room in
+ * the buffer after tx_timeout.
  *
  * @param src Data buffer.
  * @param len Number of bytes to be written.
  */
 void socket_t::write(const uint8_t* src, size_t len){
-    uint16_t free = dev->read_u16_stable(w5500_reg_t::sn_tx_fsr0, no);
-    assert(free > len);
-    uint16_t tx_pointer = dev->read_u16_stable(w5500_reg_t::sn_tx_rd0, no);
-    uint16_t chunk_size = (uint16_t)len;
-    uint32_t tx_buf_addr = (uint32_t)w5500_reg_t::tx_buf + (uint32_t)tx_pointer;
-    dev->write((w5500_reg_t)tx_buf_addr, no, src, chunk_size);
-    // Update TX pointer
-    tx_pointer += chunk_size;
-    dev->write_u16(w5500_reg_t::sn_tx_wr0, no, tx_pointer);
+    socket_tx_t& tx = dev->tx_state(no);
+    uint32_t start = ticks();
+    while (len){
+        uint16_t free = dev->read_u16_stable(w5500_reg_t::sn_tx_fsr0, no) -
+            tx.queued;
+        if (free == 0){
+            // Send the queued data, and wait for the peer to acknowledge it.
+            flush();
+            if (!connected() || ticks_elapsed(start, tx_timeout))
+                return;
+            continue;
+        }
+        if (tx.queued == 0)
+            tx.wr = dev->read_u16_stable(w5500_reg_t::sn_tx_wr0, no);
+        uint16_t chunk_size = (uint16_t)min(len, (size_t)free);
+        uint32_t tx_buf_addr = (uint32_t)w5500_reg_t::tx_buf +
+            (uint32_t)tx.wr;
+        dev->write((w5500_reg_t)tx_buf_addr, no, src, chunk_size);
+        tx.wr += chunk_size;
+        tx.queued += chunk_size;
+        src += chunk_size;
+        len -= chunk_size;
+        if (!tx.batch)
+            flush();
+    }
+}
+
+
+/**
+ * Sends the data queued by write. The previous SEND command must be complete
+ * before the next one: it is waited for at most tx_timeout, then the queued
+ * data is dropped.
+ */
+void socket_t::flush(){
+    socket_tx_t& tx = dev->tx_state(no);
+    if (tx.queued == 0)
+        return;
+    if (tx.send_pending){
+        uint32_t start = ticks();
+        while (!(dev->read_u8(w5500_reg_t::sn_ir, no) & sn_ir_sendok)){
+            if (!connected() || ticks_elapsed(start, tx_timeout)){
+                tx.queued = 0;
+                return;
+            }
+        }
+    }
+    dev->write_u8(w5500_reg_t::sn_ir, no, sn_ir_sendok);
+    dev->write_u16(w5500_reg_t::sn_tx_wr0, no, tx.wr);
     command(socket_command_t::send);
+    tx.send_pending = true;
+    tx.queued = 0;
+}
+
+
+/**
+ * Starts queuing the written data, so a response printed in several parts
+ * goes out in one segment.
+ */
+void socket_t::batch_begin(){
+    dev->tx_state(no).batch = true;
+}
+
+
+/**
+ * Sends the data queued since batch_begin, and goes back to sending each
+ * write immediately.
+ */
+void socket_t::batch_end(){
+    dev->tx_state(no).batch = false;
+    flush();
 }
 
 
@@ -476,6 +694,90 @@ size_t socket_t::read_avail(uint8_t* dst, size_t len){
 }
 
 
+/**
+ * Reads a line from the socket. Data is consumed from the W5500 RX buffer as it
+ * arrives, so a request split across many TCP segments is reassembled. Only
+ * the bytes up to and including the line return are consumed: following data
+ * is left in the RX buffer for the next call.
+ *
+ * @param dst Buffer where the data is written.
+ * @param len Maximum number of bytes to be read.
+ * @param timeout Maximum duration of the reception, in CPU cycles.
+ * @return Number of bytes read. The line return is included if it has been
+ *     received before the buffer is full, the peer closes the connection or
+ *     the timeout expires.
+ */
+size_t socket_t::read_line(uint8_t* dst, size_t len, uint32_t timeout){
+    uint32_t start = ticks();
+    size_t received = 0;
+    // Data is read in a scratch buffer first, so the commands pipelined after
+    // the line are not written to dst.
+    uint8_t chunk[64];
+    while (received < len) {
+        size_t n = min(min(avail(), len - received), sizeof(chunk));
+        if (n) {
+            uint16_t rdp = dev->read_u16(w5500_reg_t::sn_rx_rd0, no);
+            uint32_t rx_buf_addr = (uint32_t)w5500_reg_t::rx_buf +
+                (uint32_t)rdp;
+            dev->read((w5500_reg_t)rx_buf_addr, no, chunk, n);
+            // Search for the end of line in the new data, and consume only
+            // what belongs to the current line.
+            size_t consumed = n;
+            for (size_t i = 0; i < n; ++i) {
+                if (chunk[i] == '\n') {
+                    consumed = i + 1;
+                    break;
+                }
+            }
+            for (size_t i = 0; i < consumed; ++i)
+                dst[received + i] = chunk[i];
+            dev->write_u16(w5500_reg_t::sn_rx_rd0, no, rdp + consumed);
+            command(socket_command_t::recv);
+            received += consumed;
+            if (dst[received - 1] == '\n')
+                return received;
+        } else {
+            // Data queued in a batch is sent before waiting.
+            flush();
+            // The peer may have closed its side of the connection after
+            // sending its last bytes.
+            if (get_status() != socket_status_t::established)
+                return received;
+            if (ticks_elapsed(start, timeout))
+                return received;
+        }
+    }
+    return received;
+}
+
+
+/**
+ * Reads data from the socket, until len bytes are received, the peer closes
+ * the connection or the timeout expires.
+ *
+ * @param dst Buffer where the data is written.
+ * @param len Number of bytes to be read.
+ * @param timeout Maximum duration of the reception, in CPU cycles.
+ * @return Number of bytes read.
+ */
+size_t socket_t::read(uint8_t* dst, size_t len, uint32_t timeout){
+    uint32_t start = ticks();
+    size_t received = 0;
+    while (received < len){
+        size_t n = min(avail(), len - received);
+        if (n){
+            received += read_exact(dst + received, n);
+        } else {
+            flush();
+            if ((get_status() != socket_status_t::established) ||
+                ticks_elapsed(start, timeout))
+                return received;
+        }
+    }
+    return received;
+}
+
+
 /**
  * @return Socket status.
  */
@@ -497,6 +799,7 @@ void socket_t::close() {
  * Disconnect the TCP connection and close socket.
  */
 void socket_t::disconnect() {
+    flush();
     command(socket_command_t::discon);
     for (;;){
         socket_status_t st = get_status();
@@ -525,6 +828,28 @@ void socket_t::command(socket_command_t command){
 }
 
 
+/**
+ * Forget the queued data, after the socket is opened.
+ */
+void socket_t::tx_reset(){
+    socket_tx_t& tx = dev->tx_state(no);
+    tx.queued = 0;
+    tx.batch = false;
+    tx.send_pending = false;
+}
+
+
+/**
+ * @return true if data can still be sent to the peer.
+ */
+bool socket_t::connected(){
+    socket_status_t st = get_status();
+    return (st == socket_status_t::established) ||
+        (st == socket_status_t::close_wait) ||
+        (st == socket_status_t::macraw);
+}
+
+
 /**
  * Print a null terminated string.
  *
@@ -534,3 +859,14 @@ void socket_t::print(const char* s){
     write((const uint8_t*)s, strlen(s));
 }
 
+
+/**
+ * Print an unsigned 32-bits number.
+ *
+ * @param x Value to be printed.
+ */
+void socket_t::print_u32(uint32_t x){
+    char s[11];
+    u32_to_str(x, s);
+    print(s);
+}
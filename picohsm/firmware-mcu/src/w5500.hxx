@@ -23,6 +23,7 @@
 
 #include <unistd.h>
 #include "stm32f205.hxx"
+#include "system.hxx"
 
 
 /**
@@ -129,6 +130,49 @@ enum class w5500_reg_t: uint32_t {
 };
 
 
+/**
+ * Operation modes of the W5500 PHY (OPMDC field of PHYCFGR).
+ */
+enum class phy_mode_t: uint8_t {
+    base10_half = 0b000,
+    base10_full = 0b001,
+    base100_half = 0b010,
+    base100_full = 0b011,
+    base100_half_auto = 0b100,
+    power_down = 0b110,
+    auto_all = 0b111
+};
+
+
+/**
+ * Link state reported by the W5500 PHY.
+ */
+struct phy_status_t {
+    /** true if the link is up. */
+    bool link;
+    /** true for 100 Mb/s, false for 10 Mb/s. */
+    bool speed_100;
+    /** true for full duplex, false for half duplex. */
+    bool full_duplex;
+};
+
+
+/**
+ * Transmission state of a socket, kept by the controller so socket_t objects
+ * stay plain handles.
+ */
+struct socket_tx_t {
+    /** TX write pointer, after the queued data. */
+    uint16_t wr;
+    /** Bytes written in the TX buffer and not sent yet. */
+    uint16_t queued;
+    /** true between batch_begin and batch_end. */
+    bool batch;
+    /** true if a SEND command may not be complete. */
+    bool send_pending;
+};
+
+
 class w5500_t {
     public:
         /** Number of maximum supported sockets by the W5500. */
@@ -140,24 +184,39 @@ class w5500_t {
         void set_gateway(uint8_t[4]);
         void set_ip(uint8_t[4]);
         void set_mask(uint8_t[4]);
-        void write(w5500_reg_t, uint8_t, const uint8_t*, size_t);
+        RAMFUNC void write(w5500_reg_t, uint8_t, const uint8_t*, size_t);
         void write_u8(w5500_reg_t, uint8_t, uint8_t);
         void write_u16(w5500_reg_t, uint8_t, uint16_t);
-        void read(w5500_reg_t, uint8_t, uint8_t*, size_t);
+        RAMFUNC void read(w5500_reg_t, uint8_t, uint8_t*, size_t);
         uint8_t read_u8(w5500_reg_t, uint8_t);
         uint16_t read_u16(w5500_reg_t, uint8_t);
         uint16_t read_u16_stable(w5500_reg_t, uint8_t);
+        void set_phy_mode(phy_mode_t);
+        phy_status_t get_phy_status();
+        bool poll_link();
+        uint32_t get_link_flaps() const;
+        socket_tx_t& tx_state(uint8_t);
         
     private:
         /** SPI peripheral used for the communication with the Ethernet
          * controller. */
         volatile spi_regs_t* spi;
+        /** PHY mode set with set_phy_mode. */
+        phy_mode_t phy_mode;
+        /** true if set_phy_mode has been called. */
+        bool phy_mode_set;
+        /** Link state at the last call of poll_link. */
+        bool link_up;
+        /** Number of times the link went down. */
+        uint32_t link_flaps;
+        /** Transmission state of each socket. */
+        socket_tx_t tx[max_sockets];
 
         void rst(bool) const;
         void sel(bool) const;
-        void spi_wait_txe() const;
-        void spi_wait_rxne() const;
-        uint8_t spi_byte(uint8_t);
+        RAMFUNC void spi_wait_txe() const;
+        RAMFUNC void spi_wait_rxne() const;
+        RAMFUNC uint8_t spi_byte(uint8_t);
         void frame_head(w5500_reg_t, uint8_t, bool, size_t);
 };
 
@@ -201,6 +260,14 @@ enum class socket_command_t: uint8_t {
 };
 
 
+/** Socket interrupt flags (Sn_IR). */
+const uint8_t sn_ir_con = 1 << 0;
+const uint8_t sn_ir_discon = 1 << 1;
+const uint8_t sn_ir_recv = 1 << 2;
+const uint8_t sn_ir_timeout = 1 << 3;
+const uint8_t sn_ir_sendok = 1 << 4;
+
+
 class socket_t {
     public:
         socket_t(w5500_t*, uint8_t);
@@ -209,11 +276,19 @@ class socket_t {
         uint8_t get_no() const;
         bool listen(uint16_t);
         bool connect(uint8_t*, uint16_t);
+        bool open_macraw();
+        size_t recv_frame(uint8_t*, size_t);
         void write(const uint8_t*, size_t);
+        void flush();
+        void batch_begin();
+        void batch_end();
         size_t avail();
         size_t read_exact(uint8_t*, size_t);
         size_t read_avail(uint8_t*, size_t);
+        size_t read_line(uint8_t*, size_t, uint32_t);
+        size_t read(uint8_t*, size_t, uint32_t);
         void print(const char*);
+        void print_u32(uint32_t);
         void close();
         void disconnect();
 
@@ -224,6 +299,8 @@ class socket_t {
         uint8_t no;
 
         void command(socket_command_t);
+        void tx_reset();
+        bool connected();
 };
 
 
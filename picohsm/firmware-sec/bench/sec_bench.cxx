@@ -0,0 +1,470 @@
+/**
+ * This file is part of picoHSM
+ * 
+ * picoHSM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Ledger SAS, written by Olivier Hériveaux
+ */
+
+/**
+ * Cycle benchmark of the secure MCU firmware. The firmware ELF runs in simavr,
+ * with its UART driven by this program the way the STM32 drives it. The number
+ * of AVR cycles taken by each instruction is printed, and every result is
+ * checked against tiny-AES compiled for the host, with the keys of keys.hxx
+ * expanded at runtime.
+ *
+ * Usage: sec-bench FIRMWARE [F_CPU]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <deque>
+#include <vector>
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "sim_io.h"
+#include "avr_uart.h"
+#include "aes.hxx"
+#include "keys.hxx"
+#include "pin.hxx"
+#include "sec_protocol.hxx"
+
+
+/** Block counts of the two measurements giving the cost of one block. */
+const uint16_t few_blocks = 1;
+const uint16_t many_blocks = 32;
+
+/** Simulated time after which a missing answer is an error, in seconds. */
+const uint32_t answer_timeout = 5;
+
+
+/** Keys of keys.hxx, for the reference AES. */
+static const struct {
+    const uint8_t* key;
+    uint8_t len;
+} keys[KEY_COUNT] = {
+    {aes_key_0, sizeof(aes_key_0)},
+    {aes_key_1, sizeof(aes_key_1)},
+    {aes_key_2, sizeof(aes_key_2)},
+    {aes_key_3, sizeof(aes_key_3)},
+    {aes_key_4, sizeof(aes_key_4)},
+    {aes_key_5, sizeof(aes_key_5)},
+    {aes_key_6, sizeof(aes_key_6)},
+    {aes_key_7, sizeof(aes_key_7)},
+};
+
+
+/**
+ * Stop the benchmark with an error message.
+ *
+ * @param msg Error message.
+ */
+[[noreturn]] static void fail(const char* msg){
+    fprintf(stderr, "sec-bench: %s\n", msg);
+    exit(1);
+}
+
+
+/**
+ * Plays the role of the STM32 on the UART of the simulated AVR. Bytes are sent
+ * when the simulated UART can take them, so they arrive at the baudrate set by
+ * the firmware.
+ */
+class driver_t {
+    public:
+        driver_t(avr_t*);
+        void send(const uint8_t*, size_t);
+        void send_u8(uint8_t);
+        uint8_t recv();
+        void recv_buf(uint8_t*, size_t);
+        void run_for(uint64_t);
+        uint64_t now() const;
+        uint64_t last_rx() const;
+        uint64_t byte_cycles() const;
+
+    private:
+        avr_t* avr;
+        avr_irq_t* irq_input;
+        /** Bytes waiting to be taken by the UART. */
+        std::deque<uint8_t> tx_queue;
+        /** Received bytes not consumed yet. */
+        std::deque<uint8_t> rx_queue;
+        /** false while the UART reception FIFO is full. */
+        bool xon;
+        /** Cycle count when the last byte was received. */
+        uint64_t rx_cycle;
+        /** Smallest number of cycles seen between two received bytes. */
+        uint64_t rx_min_gap;
+
+        void step();
+        static void on_output(avr_irq_t*, uint32_t, void*);
+        static void on_xon(avr_irq_t*, uint32_t, void*);
+        static void on_xoff(avr_irq_t*, uint32_t, void*);
+};
+
+
+/**
+ * Constructor. Connects to UART0 of the simulated AVR.
+ *
+ * @param avr_ Simulated AVR, with the firmware loaded.
+ */
+driver_t::driver_t(avr_t* avr_):
+    avr(avr_),
+    xon(true),
+    rx_cycle(0),
+    rx_min_gap(UINT64_MAX){
+    // UART output goes to this driver only, not to the console
+    uint32_t flags = 0;
+    avr_ioctl(avr, AVR_IOCTL_UART_GET_FLAGS('0'), &flags);
+    flags &= ~AVR_UART_FLAG_STDIO;
+    avr_ioctl(avr, AVR_IOCTL_UART_SET_FLAGS('0'), &flags);
+    irq_input = avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'),
+        UART_IRQ_INPUT);
+    avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'),
+        UART_IRQ_OUTPUT), on_output, this);
+    avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'),
+        UART_IRQ_OUT_XON), on_xon, this);
+    avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'),
+        UART_IRQ_OUT_XOFF), on_xoff, this);
+}
+
+
+/**
+ * Queue bytes to be sent to the AVR.
+ *
+ * @param buf Bytes.
+ * @param len Number of bytes.
+ */
+void driver_t::send(const uint8_t* buf, size_t len){
+    tx_queue.insert(tx_queue.end(), buf, buf + len);
+}
+
+
+/**
+ * Queue a byte to be sent to the AVR.
+ *
+ * @param x Byte.
+ */
+void driver_t::send_u8(uint8_t x){
+    send(&x, 1);
+}
+
+
+/**
+ * Run the simulation until a byte is received from the AVR. Fails if nothing
+ * comes within the answer timeout.
+ *
+ * @return Received byte.
+ */
+uint8_t driver_t::recv(){
+    uint64_t deadline = avr->cycle + (uint64_t)avr->frequency * answer_timeout;
+    while (rx_queue.empty()){
+        if (avr->cycle > deadline)
+            fail("no answer from the firmware");
+        step();
+    }
+    uint8_t x = rx_queue.front();
+    rx_queue.pop_front();
+    return x;
+}
+
+
+/**
+ * Receive many bytes from the AVR.
+ *
+ * @param buf Where the bytes are written.
+ * @param len Number of bytes.
+ */
+void driver_t::recv_buf(uint8_t* buf, size_t len){
+    for (size_t i = 0; i < len; ++i)
+        buf[i] = recv();
+}
+
+
+/**
+ * Run the simulation for a given number of cycles.
+ *
+ * @param cycles Number of cycles.
+ */
+void driver_t::run_for(uint64_t cycles){
+    uint64_t end = avr->cycle + cycles;
+    while (avr->cycle < end)
+        step();
+}
+
+
+/**
+ * @return Current cycle count of the AVR.
+ */
+uint64_t driver_t::now() const {
+    return avr->cycle;
+}
+
+
+/**
+ * @return Cycle count when the last byte was received.
+ */
+uint64_t driver_t::last_rx() const {
+    return rx_cycle;
+}
+
+
+/**
+ * @return Smallest number of cycles seen between two bytes sent by the AVR:
+ *     the duration of a byte on the line when it sends back to back.
+ */
+uint64_t driver_t::byte_cycles() const {
+    return rx_min_gap;
+}
+
+
+/**
+ * Feed the UART and run one step of the simulation.
+ */
+void driver_t::step(){
+    // Raising the input IRQ may raise XOFF, which stops the loop.
+    while (xon && !tx_queue.empty()){
+        avr_raise_irq(irq_input, tx_queue.front());
+        tx_queue.pop_front();
+    }
+    int state = avr_run(avr);
+    if ((state == cpu_Done) || (state == cpu_Crashed))
+        fail("the firmware stopped");
+}
+
+
+void driver_t::on_output(avr_irq_t*, uint32_t value, void* param){
+    driver_t* d = (driver_t*)param;
+    uint64_t now = d->avr->cycle;
+    if (d->rx_cycle && (now - d->rx_cycle < d->rx_min_gap))
+        d->rx_min_gap = now - d->rx_cycle;
+    d->rx_cycle = now;
+    d->rx_queue.push_back((uint8_t)value);
+}
+
+
+void driver_t::on_xon(avr_irq_t*, uint32_t, void* param){
+    ((driver_t*)param)->xon = true;
+}
+
+
+void driver_t::on_xoff(avr_irq_t*, uint32_t, void* param){
+    ((driver_t*)param)->xon = false;
+}
+
+
+/** Number of blocks checked against the reference AES. */
+static uint32_t checked_blocks = 0;
+
+
+/**
+ * Print a measurement.
+ *
+ * @param name Name of the measurement.
+ * @param cycles Number of AVR cycles.
+ * @param f_cpu AVR clock frequency.
+ */
+static void print_cycles(const char* name, uint64_t cycles, uint32_t f_cpu){
+    printf("%-28s %10llu cycles %10.1f us\n", name, (unsigned long long)cycles,
+        cycles * 1e6 / f_cpu);
+}
+
+
+/**
+ * Verify the PIN, which opens a session.
+ *
+ * @param d Driver.
+ * @return Number of cycles taken, until the status is received.
+ */
+static uint64_t verify_pin(driver_t& d){
+    uint64_t start = d.now();
+    d.send_u8(SEC_INS_VERIFY_PIN);
+    d.send((const uint8_t*)pin, 8);
+    if (d.recv() != SEC_STATUS_OK)
+        fail("PIN verification failed");
+    return d.last_rx() - start;
+}
+
+
+/**
+ * Encrypt or decrypt blocks in the session, sending them ahead as allowed by
+ * the credits, like the STM32 does.
+ *
+ * @param d Driver.
+ * @param ins SEC_INS_SESSION_ENCRYPT or SEC_INS_SESSION_DECRYPT.
+ * @param key_id Key number.
+ * @param in Input blocks.
+ * @param out Output blocks.
+ * @param block_count Number of blocks.
+ * @return Number of cycles taken, until the last block is received. 0 if the
+ *     key is locked.
+ */
+static uint64_t session_crypt(driver_t& d, uint8_t ins, uint8_t key_id,
+    const uint8_t* in, uint8_t* out, uint16_t block_count){
+    uint64_t start = d.now();
+    d.send_u8(ins);
+    d.send_u8(key_id);
+    d.send_u8(block_count & 0xff);
+    d.send_u8(block_count >> 8);
+    uint8_t status = d.recv();
+    if (status == SEC_STATUS_KEY_LOCKED)
+        return 0;
+    if (status != SEC_STATUS_OK)
+        fail("unexpected status");
+    uint16_t credits = d.recv();
+    if (credits == 0)
+        fail("no credit granted");
+    uint16_t sent = 0;
+    for (uint16_t i = 0; i < block_count; ++i){
+        for (; (sent < block_count) && (sent - i < credits); ++sent)
+            d.send(in + 16 * sent, 16);
+        d.recv_buf(out + 16 * i, 16);
+    }
+    return d.last_rx() - start;
+}
+
+
+/**
+ * Compare blocks processed by the firmware with the reference AES (CBC with
+ * a zero IV, as done by the firmware for each instruction).
+ *
+ * @param key_id Key number.
+ * @param enc true if the firmware encrypted the blocks.
+ * @param in Input blocks.
+ * @param out Output blocks of the firmware.
+ * @param block_count Number of blocks.
+ */
+static void check(uint8_t key_id, bool enc, const uint8_t* in,
+    const uint8_t* out, uint16_t block_count){
+    std::vector<uint8_t> ref(in, in + 16 * block_count);
+    AES_ctx ctx;
+    AES_init_ctx_len(&ctx, keys[key_id].key, keys[key_id].len);
+    if (enc)
+        AES_CBC_encrypt_buffer(&ctx, ref.data(), ref.size());
+    else
+        AES_CBC_decrypt_buffer(&ctx, ref.data(), ref.size());
+    if (memcmp(ref.data(), out, ref.size()) != 0){
+        fprintf(stderr, "sec-bench: key %u: %s output differs from the "
+            "reference AES\n", key_id, enc ? "encryption" : "decryption");
+        exit(1);
+    }
+    checked_blocks += block_count;
+}
+
+
+/**
+ * Check the reference AES itself, with the FIPS-197 appendix C.3 vector.
+ */
+static void check_reference(){
+    uint8_t key[32];
+    for (int i = 0; i < 32; ++i)
+        key[i] = i;
+    uint8_t block[16] = {
+        0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
+        0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff };
+    static const uint8_t expected[16] = {
+        0x8e, 0xa2, 0xb7, 0xca, 0x51, 0x67, 0x45, 0xbf,
+        0xea, 0xfc, 0x49, 0x90, 0x4b, 0x49, 0x60, 0x89 };
+    AES_ctx ctx;
+    AES_init_ctx_len(&ctx, key, 32);
+    AES_ECB_encrypt(&ctx, block);
+    if (memcmp(block, expected, 16) != 0)
+        fail("reference AES fails the FIPS-197 test vector");
+}
+
+
+int main(int argc, char** argv){
+    if ((argc < 2) || (argc > 3)){
+        fprintf(stderr, "Usage: %s FIRMWARE [F_CPU]\n", argv[0]);
+        return 2;
+    }
+    uint32_t f_cpu = (argc > 2) ? strtoul(argv[2], 0, 0) : F_CPU;
+    check_reference();
+
+    elf_firmware_t firmware;
+    memset(&firmware, 0, sizeof(firmware));
+    if (elf_read_firmware(argv[1], &firmware) != 0)
+        fail("cannot read the firmware");
+    avr_t* avr = avr_make_mcu_by_name("atmega1284p");
+    if (!avr)
+        fail("simavr does not support the ATmega1284P");
+    avr_init(avr);
+    avr_load_firmware(avr, &firmware);
+    avr->frequency = f_cpu;
+    driver_t d(avr);
+    // Let the firmware configure its UART
+    d.run_for(f_cpu / 1000);
+
+    // Key slots, as reported by the firmware
+    d.send_u8(SEC_INS_KEY_INFO);
+    if (d.recv() != SEC_STATUS_OK)
+        fail("key information failed");
+    uint8_t key_info[KEY_COUNT];
+    d.recv_buf(key_info, KEY_COUNT);
+    for (uint8_t i = 0; i < KEY_COUNT; ++i){
+        if ((key_info[i] & 0x7f) != keys[i].len)
+            fail("key length reported by the firmware differs from keys.hxx");
+    }
+
+    printf("F_CPU %lu Hz\n", (unsigned long)f_cpu);
+    print_cycles("verify_pin", verify_pin(d), f_cpu);
+
+    // Random blocks, the same for each run
+    std::vector<uint8_t> plain(16 * many_blocks);
+    srand(1);
+    for (uint8_t& x: plain)
+        x = rand();
+    std::vector<uint8_t> cipher(plain.size());
+    std::vector<uint8_t> decrypted(plain.size());
+
+    for (uint8_t key_id = 0; key_id < KEY_COUNT; ++key_id){
+        bool locked = key_info[key_id] & SEC_KEY_LOCKED;
+        uint64_t c = session_crypt(d, SEC_INS_SESSION_ENCRYPT, key_id,
+            plain.data(), cipher.data(), few_blocks);
+        if (locked != (c == 0))
+            fail("key lock differs from the key information");
+        if (locked)
+            continue;
+        char name[64];
+        printf("key %u: AES-%u\n", key_id, keys[key_id].len * 8);
+        check(key_id, true, plain.data(), cipher.data(), few_blocks);
+        print_cycles("  encrypt 1 block", c, f_cpu);
+        uint64_t c_many = session_crypt(d, SEC_INS_SESSION_ENCRYPT, key_id,
+            plain.data(), cipher.data(), many_blocks);
+        check(key_id, true, plain.data(), cipher.data(), many_blocks);
+        snprintf(name, sizeof(name), "  encrypt %u blocks", many_blocks);
+        print_cycles(name, c_many, f_cpu);
+        print_cycles("  encrypt per block", (c_many - c) /
+            (many_blocks - few_blocks), f_cpu);
+
+        c = session_crypt(d, SEC_INS_SESSION_DECRYPT, key_id, cipher.data(),
+            decrypted.data(), few_blocks);
+        check(key_id, false, cipher.data(), decrypted.data(), few_blocks);
+        print_cycles("  decrypt 1 block", c, f_cpu);
+        c_many = session_crypt(d, SEC_INS_SESSION_DECRYPT, key_id, cipher.data(),
+            decrypted.data(), many_blocks);
+        check(key_id, false, cipher.data(), decrypted.data(), many_blocks);
+        snprintf(name, sizeof(name), "  decrypt %u blocks", many_blocks);
+        print_cycles(name, c_many, f_cpu);
+        print_cycles("  decrypt per block", (c_many - c) /
+            (many_blocks - few_blocks), f_cpu);
+    }
+
+    print_cycles("UART byte", d.byte_cycles(), f_cpu);
+    printf("%lu blocks checked against the reference AES.\n",
+        (unsigned long)checked_blocks);
+    avr_terminate(avr);
+    return 0;
+}
@@ -0,0 +1,599 @@
+/**
+ * This file is part of picoHSM
+ * 
+ * picoHSM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Ledger SAS, written by Olivier Hériveaux
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <chrono>
+#include "sec_model.hxx"
+#include "aes.hxx"
+#include "round_keys.hxx"
+#include "pin.hxx"
+#include "key_locks.hxx"
+#include "ctr.hxx"
+#include "cmac.hxx"
+
+
+/** Session lifetime after a successful PIN verification, in nanoseconds. */
+const uint64_t session_lifetime = 30ull * 1000000000;
+
+/**
+ * Output may be sent this long before the modeled time, in nanoseconds: the
+ * sleep granularity of the host is coarser than a byte.
+ */
+const uint64_t max_early = 20000;
+
+
+/**
+ * @return Host monotonic time, in nanoseconds.
+ */
+static uint64_t now_ns(){
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+/**
+ * Default configuration: the UART of the board, without processing time.
+ */
+sec_model_config_t::sec_model_config_t():
+    baudrate(625000),
+    byte_ns(0),
+    block_ns(0),
+    rx_buffer_size(256),
+    startup_ns(65000000){}
+
+
+/**
+ * Constructor. Starts the model out of reset, ready to process instructions.
+ *
+ * @param fd_ Connection to the peer, read and written. Stays open.
+ * @param config_ Timing parameters.
+ */
+sec_model_t::sec_model_t(int fd_, const sec_model_config_t& config_):
+    config(config_),
+    fd(fd_),
+    in_reset(false),
+    generation(0),
+    ready_time(0),
+    rx_buffer(config_.rx_buffer_size),
+    rx_write(0),
+    rx_read(0),
+    rx_drops(0),
+    run_generation(0),
+    busy_until(0),
+    session_end(0){
+    memset(cbc_contexts, 0, sizeof(cbc_contexts));
+    rx_thread = std::thread(&sec_model_t::rx_loop, this);
+    rx_thread.detach();
+    cpu_thread = std::thread(&sec_model_t::cpu_loop, this);
+    cpu_thread.detach();
+}
+
+
+/**
+ * Drive the reset pin. Asserting it aborts the instruction being processed.
+ * Releasing it clears the reception buffer and the state of the firmware, and
+ * starts the start-up time.
+ *
+ * @param asserted true to hold the secure MCU in reset.
+ */
+void sec_model_t::set_reset(bool asserted){
+    std::lock_guard<std::mutex> lock(mutex);
+    if (asserted == in_reset)
+        return;
+    in_reset = asserted;
+    if (asserted){
+        ++generation;
+    } else {
+        ready_time = now_ns() + config.startup_ns;
+        rx_write = 0;
+        rx_read = 0;
+        rx_drops = 0;
+    }
+    cond.notify_all();
+}
+
+
+/**
+ * Receive bytes from the peer into the ring buffer, no faster than the
+ * baudrate. Bytes are lost during the reset and the start-up, and when the
+ * buffer is full.
+ */
+void sec_model_t::rx_loop(){
+    uint64_t byte_time = config.baudrate ?
+        10ull * 1000000000 / config.baudrate : 0;
+    uint64_t slot = 0;
+    for (;;){
+        uint8_t buf[64];
+        ssize_t n = ::read(fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return;
+        for (ssize_t i = 0; i < n; ++i){
+            uint64_t now = now_ns();
+            if (slot < now){
+                slot = now;
+            } else if (slot - now > 100000){
+                std::this_thread::sleep_for(
+                    std::chrono::nanoseconds(slot - now));
+            }
+            slot += byte_time;
+            std::lock_guard<std::mutex> lock(mutex);
+            if (in_reset || (now_ns() < ready_time))
+                continue;
+            uint16_t next = (rx_write + 1) % rx_buffer.size();
+            if (next == rx_read){
+                ++rx_drops;
+                continue;
+            }
+            rx_buffer[rx_write] = buf[i];
+            rx_write = next;
+            cond.notify_all();
+        }
+    }
+}
+
+
+/**
+ * Run the firmware each time the reset is released, until it is asserted.
+ */
+void sec_model_t::cpu_loop(){
+    for (;;){
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cond.wait(lock, [this]{ return !in_reset; });
+            run_generation = generation;
+        }
+        firmware_reset();
+        try {
+            firmware_loop();
+        } catch (const reset_t&){}
+    }
+}
+
+
+/**
+ * Account for processing time. The time is only waited for by sync, so
+ * consecutive small durations do not each pay the sleep granularity.
+ *
+ * @param ns Duration in nanoseconds.
+ */
+void sec_model_t::spend(uint64_t ns){
+    busy_until += ns;
+}
+
+
+/**
+ * Wait until the processing accounted for by spend is done. Throws reset_t if
+ * the reset is asserted.
+ */
+void sec_model_t::sync(){
+    std::unique_lock<std::mutex> lock(mutex);
+    if (busy_until > now_ns() + max_early){
+        cond.wait_until(lock, std::chrono::steady_clock::time_point(
+            std::chrono::nanoseconds(busy_until)),
+            [this]{ return generation != run_generation; });
+    }
+    if (generation != run_generation)
+        throw reset_t();
+}
+
+
+/**
+ * @return Number of received bytes waiting in the ring buffer.
+ */
+uint16_t sec_model_t::rx_avail(){
+    std::lock_guard<std::mutex> lock(mutex);
+    return (rx_write + rx_buffer.size() - rx_read) % rx_buffer.size();
+}
+
+
+/**
+ * @return Number of bytes which can still be received without loss.
+ */
+uint16_t sec_model_t::rx_free(){
+    return rx_buffer.size() - 1 - rx_avail();
+}
+
+
+/**
+ * Read a byte from the ring buffer, waiting for it if needed. Time spent
+ * waiting is idle time, not added to the processing time. Throws reset_t if
+ * the reset is asserted.
+ */
+uint8_t sec_model_t::read_u8(){
+    uint8_t value;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (rx_read == rx_write){
+            cond.wait(lock, [this]{
+                return (rx_read != rx_write) ||
+                    (generation != run_generation); });
+            uint64_t now = now_ns();
+            if (busy_until < now)
+                busy_until = now;
+        }
+        if (generation != run_generation)
+            throw reset_t();
+        value = rx_buffer[rx_read];
+        rx_read = (rx_read + 1) % rx_buffer.size();
+    }
+    spend(config.byte_ns);
+    return value;
+}
+
+
+void sec_model_t::read_buf(uint8_t* buf, uint8_t len){
+    for (uint8_t i = 0; i < len; ++i)
+        buf[i] = read_u8();
+}
+
+
+/**
+ * Send a byte to the peer once the processing before it is done.
+ */
+void sec_model_t::write_u8(uint8_t data){
+    spend(config.byte_ns);
+    sync();
+    while ((::write(fd, &data, 1) < 0) && (errno == EINTR)){}
+}
+
+
+/**
+ * Send a 32-bit value, little-endian.
+ */
+void sec_model_t::write_u32(uint32_t data){
+    for (uint8_t i = 0; i < 4; ++i){
+        write_u8(data & 0xff);
+        data >>= 8;
+    }
+}
+
+
+void sec_model_t::write_buf(const uint8_t* buf, uint8_t len){
+    for (uint8_t i = 0; i < len; ++i)
+        write_u8(buf[i]);
+}
+
+
+/**
+ * Clear the state of the firmware, like a reset clears the RAM.
+ */
+void sec_model_t::firmware_reset(){
+    busy_until = now_ns();
+    session_end = 0;
+    memset(cbc_contexts, 0, sizeof(cbc_contexts));
+    ctr_reset();
+}
+
+
+/**
+ * Main loop of the firmware: precompute CTR keystream while idle, then
+ * process the next instruction.
+ */
+void sec_model_t::firmware_loop(){
+    for (;;){
+        while (rx_avail() == 0){
+            uint32_t fills = ctr_stats.fills;
+            ctr_fill_idle();
+            if (ctr_stats.fills == fills)
+                break;
+            spend(config.block_ns);
+            sync();
+        }
+        execute(read_u8());
+    }
+}
+
+
+/**
+ * Read 8 PIN digits and compare with the PIN of the firmware.
+ *
+ * @return true if the PIN is correct.
+ */
+bool sec_model_t::verify_pin(){
+    uint8_t buffer[SEC_PIN_SIZE];
+    read_buf(buffer, SEC_PIN_SIZE);
+    return memcmp(buffer, pin, SEC_PIN_SIZE) == 0;
+}
+
+
+/**
+ * @return true if a session is open and has not expired.
+ */
+bool sec_model_t::session_valid(){
+    return (session_end != 0) && (now_ns() < session_end);
+}
+
+
+/**
+ * Send the number of blocks the peer can send ahead.
+ *
+ * @return Number of credits granted.
+ */
+uint8_t sec_model_t::grant_credits(){
+    uint16_t free_blocks = rx_free() / SEC_CREDIT_SIZE;
+    uint8_t credits = free_blocks > SEC_MAX_CREDITS ?
+        SEC_MAX_CREDITS : free_blocks;
+    write_u8(credits);
+    return credits;
+}
+
+
+/**
+ * Encrypt or decrypt blocks in CBC mode, as they are received.
+ *
+ * @param key_id Key number. Must not be locked.
+ * @param enc true to encrypt, false to decrypt.
+ * @param block_count Number of blocks to be processed.
+ * @param iv CBC IV. Updated to chain with the next blocks.
+ */
+void sec_model_t::crypt_blocks(uint8_t key_id, bool enc,
+    uint16_t block_count, uint8_t* iv){
+    AES_ctx ctx;
+    AES_init_ctx_rk_iv(&ctx, aes_round_keys[key_id], aes_key_lengths[key_id],
+        iv);
+    for (uint16_t i = 0; i < block_count; ++i){
+        uint8_t buf[16];
+        read_buf(buf, 16);
+        if (enc)
+            AES_CBC_encrypt_buffer(&ctx, buf, 16);
+        else
+            AES_CBC_decrypt_buffer(&ctx, buf, 16);
+        spend(config.block_ns);
+        write_buf(buf, 16);
+    }
+    memcpy(iv, ctx.Iv, 16);
+}
+
+
+/**
+ * Encrypt or decrypt blocks in CTR mode, refilling the keystream pool of the
+ * key while waiting for data.
+ *
+ * @param key_id Key number. A nonce must have been set.
+ * @param block_count Number of blocks to be processed.
+ */
+void sec_model_t::ctr_xcrypt_blocks(uint8_t key_id, uint16_t block_count){
+    for (uint16_t i = 0; i < block_count; ++i){
+        while ((rx_avail() < 16) && ctr_fill(key_id)){
+            spend(config.block_ns);
+            sync();
+        }
+        uint8_t buf[16];
+        read_buf(buf, 16);
+        uint32_t misses = ctr_stats.misses;
+        uint8_t keystream[16];
+        ctr_keystream(key_id, keystream);
+        if (ctr_stats.misses != misses)
+            spend(config.block_ns);
+        for (uint8_t j = 0; j < 16; ++j)
+            buf[j] ^= keystream[j];
+        write_buf(buf, 16);
+    }
+}
+
+
+/**
+ * Compute the AES-CMAC of a message, sending a credit byte after each group of
+ * half the initial credits consumed, then the tag.
+ *
+ * @param key_id Key number. Must not be locked.
+ * @param len Message length in bytes.
+ */
+void sec_model_t::cmac_blocks(uint8_t key_id, uint16_t len){
+    uint8_t group = (grant_credits() + 1) / 2;
+    uint16_t block_count = (len + 15) / 16;
+    cmac_ctx_t ctx;
+    cmac_init(&ctx, aes_round_keys[key_id], aes_key_lengths[key_id]);
+    uint8_t buf[16];
+    uint8_t last_len = 0;
+    for (uint16_t i = 0; i < block_count; ++i){
+        if (i + 1 < block_count){
+            read_buf(buf, 16);
+            cmac_update(&ctx, buf);
+            spend(config.block_ns);
+            if ((i + 1) % group == 0)
+                write_u8(group);
+        } else {
+            last_len = len - 16 * i;
+            read_buf(buf, last_len);
+        }
+    }
+    uint8_t tag[16];
+    cmac_final(&ctx, buf, last_len, tag);
+    // Subkey and last block
+    spend(2 * config.block_ns);
+    write_buf(tag, 16);
+}
+
+
+/**
+ * Process an instruction, as the main loop of the firmware does.
+ *
+ * @param ins Instruction byte.
+ */
+void sec_model_t::execute(uint8_t ins){
+    switch (ins){
+        case SEC_INS_VERIFY_PIN: {
+            bool good = verify_pin();
+            session_end = good ? now_ns() + session_lifetime : 0;
+            write_u8(good ? SEC_STATUS_OK : SEC_STATUS_BAD_PIN);
+            break;
+        }
+
+        case SEC_INS_ENCRYPT:
+        case SEC_INS_DECRYPT:
+        case SEC_INS_ENCRYPT_STREAM:
+        case SEC_INS_DECRYPT_STREAM: {
+            if (!verify_pin()){
+                write_u8(SEC_STATUS_BAD_PIN);
+                break;
+            }
+            write_u8(SEC_STATUS_OK);
+            uint8_t key_id = read_u8() % KEY_COUNT;
+            if (aes_key_locked[key_id]){
+                write_u8(SEC_STATUS_KEY_LOCKED);
+                break;
+            }
+            write_u8(SEC_STATUS_OK);
+            bool stream = (ins == SEC_INS_ENCRYPT_STREAM) ||
+                (ins == SEC_INS_DECRYPT_STREAM);
+            uint16_t block_count = read_u8();
+            if (stream){
+                block_count |= (uint16_t)read_u8() << 8;
+                grant_credits();
+            }
+            uint8_t iv[16] = {0};
+            crypt_blocks(key_id, (ins == SEC_INS_ENCRYPT) ||
+                (ins == SEC_INS_ENCRYPT_STREAM), block_count, iv);
+            break;
+        }
+
+        case SEC_INS_SESSION_ENCRYPT:
+        case SEC_INS_SESSION_DECRYPT: {
+            uint8_t key_id = read_u8() % KEY_COUNT;
+            uint16_t block_count = read_u8();
+            block_count |= (uint16_t)read_u8() << 8;
+            if (!session_valid()){
+                write_u8(SEC_STATUS_NO_SESSION);
+            } else if (aes_key_locked[key_id]){
+                write_u8(SEC_STATUS_KEY_LOCKED);
+            } else {
+                write_u8(SEC_STATUS_OK);
+                grant_credits();
+                uint8_t iv[16] = {0};
+                crypt_blocks(key_id, ins == SEC_INS_SESSION_ENCRYPT,
+                    block_count, iv);
+            }
+            break;
+        }
+
+        case SEC_INS_CTR_NONCE: {
+            uint8_t key_id = read_u8() % KEY_COUNT;
+            uint8_t nonce[16];
+            read_buf(nonce, 16);
+            if (!session_valid()){
+                write_u8(SEC_STATUS_NO_SESSION);
+            } else if (aes_key_locked[key_id]){
+                write_u8(SEC_STATUS_KEY_LOCKED);
+            } else {
+                ctr_set_nonce(key_id, aes_round_keys[key_id],
+                    aes_key_lengths[key_id], nonce);
+                write_u8(SEC_STATUS_OK);
+            }
+            break;
+        }
+
+        case SEC_INS_CTR_XCRYPT: {
+            uint8_t key_id = read_u8() % KEY_COUNT;
+            uint16_t block_count = read_u8();
+            block_count |= (uint16_t)read_u8() << 8;
+            if (!session_valid()){
+                write_u8(SEC_STATUS_NO_SESSION);
+            } else if (!ctr_active(key_id)){
+                write_u8(SEC_STATUS_NO_NONCE);
+            } else {
+                write_u8(SEC_STATUS_OK);
+                grant_credits();
+                ctr_xcrypt_blocks(key_id, block_count);
+            }
+            break;
+        }
+
+        case SEC_INS_CBC_INIT: {
+            uint8_t ctx_id = read_u8() % CBC_CONTEXT_COUNT;
+            uint8_t key_id = read_u8() % KEY_COUNT;
+            uint8_t iv[16];
+            read_buf(iv, 16);
+            if (!session_valid()){
+                write_u8(SEC_STATUS_NO_SESSION);
+            } else if (aes_key_locked[key_id]){
+                write_u8(SEC_STATUS_KEY_LOCKED);
+            } else {
+                cbc_context_t* c = &cbc_contexts[ctx_id];
+                c->active = true;
+                c->key_id = key_id;
+                memcpy(c->iv, iv, 16);
+                write_u8(SEC_STATUS_OK);
+            }
+            break;
+        }
+
+        case SEC_INS_CBC_ENCRYPT:
+        case SEC_INS_CBC_DECRYPT: {
+            uint8_t ctx_id = read_u8() % CBC_CONTEXT_COUNT;
+            uint16_t block_count = read_u8();
+            block_count |= (uint16_t)read_u8() << 8;
+            cbc_context_t* c = &cbc_contexts[ctx_id];
+            if (!session_valid()){
+                write_u8(SEC_STATUS_NO_SESSION);
+            } else if (!c->active){
+                write_u8(SEC_STATUS_NO_CONTEXT);
+            } else {
+                write_u8(SEC_STATUS_OK);
+                grant_credits();
+                crypt_blocks(c->key_id, ins == SEC_INS_CBC_ENCRYPT,
+                    block_count, c->iv);
+            }
+            break;
+        }
+
+        case SEC_INS_CMAC: {
+            uint8_t key_id = read_u8() % KEY_COUNT;
+            uint16_t len = read_u8();
+            len |= (uint16_t)read_u8() << 8;
+            if (!session_valid()){
+                write_u8(SEC_STATUS_NO_SESSION);
+            } else if (aes_key_locked[key_id]){
+                write_u8(SEC_STATUS_KEY_LOCKED);
+            } else {
+                write_u8(SEC_STATUS_OK);
+                cmac_blocks(key_id, len);
+            }
+            break;
+        }
+
+        case SEC_INS_KEY_INFO: {
+            write_u8(SEC_STATUS_OK);
+            for (uint8_t i = 0; i < KEY_COUNT; ++i)
+                write_u8(aes_key_lengths[i] |
+                    (aes_key_locked[i] ? SEC_KEY_LOCKED : 0));
+            break;
+        }
+
+        case SEC_INS_STATS: {
+            uint16_t drops;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                drops = rx_drops;
+            }
+            write_u8(SEC_STATUS_OK);
+            write_u32(drops);
+            write_u32(ctr_stats.fills);
+            write_u32(ctr_stats.hits);
+            write_u32(ctr_stats.misses);
+            break;
+        }
+
+        default:;
+    }
+}
@@ -0,0 +1,144 @@
+/**
+ * This file is part of picoHSM
+ * 
+ * picoHSM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Ledger SAS, written by Olivier Hériveaux
+ */
+
+#ifndef _SEC_MODEL_HXX_
+#define _SEC_MODEL_HXX_
+
+
+#include <stdint.h>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "sec_protocol.hxx"
+
+
+/**
+ * Timing parameters of the secure MCU model. The defaults have no processing
+ * time, so only the line rate and the reception buffer limit the throughput.
+ */
+struct sec_model_config_t {
+    /** Line rate of the reception, in bauds. 0 to receive bytes as fast as
+     * they arrive. */
+    uint32_t baudrate;
+    /** Processing time of each byte read from or written to the UART, in
+     * nanoseconds. */
+    uint32_t byte_ns;
+    /** Processing time of each AES block, in nanoseconds. */
+    uint32_t block_ns;
+    /** Size of the reception ring buffer in bytes, like UART_RX_BUFFER_SIZE.
+     * One byte is never used. */
+    uint16_t rx_buffer_size;
+    /** Start-up time after the reset is released, in nanoseconds. Bytes
+     * received meanwhile are lost. */
+    uint32_t startup_ns;
+
+    sec_model_config_t();
+};
+
+
+/**
+ * Model of the ATMEGA1284P running firmware-sec, talking through a file
+ * descriptor instead of its UART. It implements every instruction of
+ * sec_protocol.hxx with the keys, PIN and key locks of the firmware, and uses
+ * its AES, CTR and CMAC code, so its output is the reference for the board.
+ *
+ * A reception thread fills the ring buffer, like the UART interrupt, and a
+ * processing thread runs the main loop of the firmware. Processing waits for
+ * the configured time per byte and per AES block, so a host peer sees the
+ * latencies of the board, or of a hypothetical faster one.
+ *
+ * The CTR state is global in ctr.cxx, so there must be only one model per
+ * process. The threads are detached and the model must never be destroyed.
+ */
+class sec_model_t {
+    public:
+        sec_model_t(int, const sec_model_config_t&);
+        void set_reset(bool);
+
+    private:
+        /** Thrown in the processing thread when the reset is asserted. */
+        struct reset_t {};
+
+        /**
+         * CBC context, kept between instructions.
+         */
+        struct cbc_context_t {
+            bool active;
+            uint8_t key_id;
+            uint8_t iv[16];
+        };
+
+        const sec_model_config_t config;
+        /** Connection to the peer. */
+        const int fd;
+
+        /** Protects the fields below, shared between the threads. */
+        std::mutex mutex;
+        /** Signaled when bytes are received or the reset changes. */
+        std::condition_variable cond;
+        /** true while the reset is asserted. */
+        bool in_reset;
+        /** Incremented each time the reset is asserted. */
+        uint32_t generation;
+        /** Time before which received bytes are lost. */
+        uint64_t ready_time;
+        /** Reception ring buffer. */
+        std::vector<uint8_t> rx_buffer;
+        uint16_t rx_write;
+        uint16_t rx_read;
+        /** Bytes dropped because the ring buffer was full. */
+        uint16_t rx_drops;
+
+        // Used by the processing thread only
+        /** Generation the firmware runs in. A different one aborts it. */
+        uint32_t run_generation;
+        /** Time when the firmware is done with what it has processed. */
+        uint64_t busy_until;
+        /** End of the session. 0 when there is no session. */
+        uint64_t session_end;
+        cbc_context_t cbc_contexts[CBC_CONTEXT_COUNT];
+
+        std::thread rx_thread;
+        std::thread cpu_thread;
+
+        void rx_loop();
+        void cpu_loop();
+        void spend(uint64_t);
+        void sync();
+        uint16_t rx_avail();
+        uint16_t rx_free();
+        uint8_t read_u8();
+        void read_buf(uint8_t*, uint8_t);
+        void write_u8(uint8_t);
+        void write_u32(uint32_t);
+        void write_buf(const uint8_t*, uint8_t);
+        void firmware_reset();
+        void firmware_loop();
+        bool verify_pin();
+        bool session_valid();
+        uint8_t grant_credits();
+        void crypt_blocks(uint8_t, bool, uint16_t, uint8_t*);
+        void ctr_xcrypt_blocks(uint8_t, uint16_t);
+        void cmac_blocks(uint8_t, uint16_t);
+        void execute(uint8_t);
+};
+
+
+#endif
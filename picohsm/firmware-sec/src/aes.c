@@ -37,6 +37,9 @@ NOTE:   String length must be evenly divisible by 16byte (str_len % 16 == 0)
 /*****************************************************************************/
 #include <string.h> // CBC mode, for memset
 #include "aes.h"
+#if AES_EXTERNAL_ROUNDKEY && defined(__AVR__)
+#include <avr/pgmspace.h>
+#endif
 
 /*****************************************************************************/
 /* Defines:                                                                  */
@@ -44,16 +47,8 @@ NOTE:   String length must be evenly divisible by 16byte (str_len % 16 == 0)
 // The number of columns comprising a state in AES. This is a constant in AES. Value=4
 #define Nb 4
 
-#if defined(AES256) && (AES256 == 1)
-    #define Nk 8
-    #define Nr 14
-#elif defined(AES192) && (AES192 == 1)
-    #define Nk 6
-    #define Nr 12
-#else
-    #define Nk 4        // The number of 32 bit words in a key.
-    #define Nr 10       // The number of rounds in AES Cipher.
-#endif
+// The number of 32 bit words in a key (Nk) and the number of rounds (Nr)
+// depend on the key length, which is set per context.
 
 // jcallan@github points out that declaring Multiply as a function 
 // reduces code size considerably with the Keil ARM compiler.
@@ -113,10 +108,12 @@ static const uint8_t rsbox[256] = {
   0xa0, 0xe0, 0x3b, 0x4d, 0xae, 0x2a, 0xf5, 0xb0, 0xc8, 0xeb, 0xbb, 0x3c, 0x83, 0x53, 0x99, 0x61,
   0x17, 0x2b, 0x04, 0x7e, 0xba, 0x77, 0xd6, 0x26, 0xe1, 0x69, 0x14, 0x63, 0x55, 0x21, 0x0c, 0x7d };
 
+#if !AES_EXTERNAL_ROUNDKEY
 // The round constant word array, Rcon[i], contains the values given by 
 // x to the power (i-1) being powers of x (x is denoted as {02}) in the field GF(2^8)
 static const uint8_t Rcon[11] = {
   0x8d, 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1b, 0x36 };
+#endif // !AES_EXTERNAL_ROUNDKEY
 
 /*
  * Jordan Goulder points out in PR #12 (https://github.com/kokke/tiny-AES-C/pull/12),
@@ -147,9 +144,18 @@ static uint8_t getSBoxInvert(uint8_t num)
 */
 #define getSBoxInvert(num) (rsbox[(num)])
 
+// Round keys expanded in advance are in program memory on AVR
+#if AES_EXTERNAL_ROUNDKEY && defined(__AVR__)
+  #define getRoundKey(p) pgm_read_byte(p)
+#else
+  #define getRoundKey(p) (*(p))
+#endif
+
+#if !AES_EXTERNAL_ROUNDKEY
 // This function produces Nb(Nr+1) round keys. The round keys are used in each round to decrypt the states. 
-static void KeyExpansion(uint8_t* RoundKey, const uint8_t* Key)
+static void KeyExpansion(uint8_t* RoundKey, const uint8_t* Key, uint8_t Nk)
 {
+  const uint8_t Nr = Nk + 6;
   unsigned i, j, k;
   uint8_t tempa[4]; // Used for the column/row operations
   
@@ -201,8 +207,7 @@ static void KeyExpansion(uint8_t* RoundKey, const uint8_t* Key)
 
       tempa[0] = tempa[0] ^ Rcon[i/Nk];
     }
-#if defined(AES256) && (AES256 == 1)
-    if (i % Nk == 4)
+    if ((Nk > 6) && (i % Nk == 4))
     {
       // Function Subword()
       {
@@ -212,7 +217,6 @@ static void KeyExpansion(uint8_t* RoundKey, const uint8_t* Key)
         tempa[3] = getSBoxValue(tempa[3]);
       }
     }
-#endif
     j = i * 4; k=(i - Nk) * 4;
     RoundKey[j + 0] = RoundKey[k + 0] ^ tempa[0];
     RoundKey[j + 1] = RoundKey[k + 1] ^ tempa[1];
@@ -221,16 +225,38 @@ static void KeyExpansion(uint8_t* RoundKey, const uint8_t* Key)
   }
 }
 
+void AES_init_ctx_len(struct AES_ctx* ctx, const uint8_t* key, uint8_t key_len)
+{
+  ctx->Nr = AES_ROUNDS(key_len);
+  KeyExpansion(ctx->RoundKey, key, key_len / 4);
+}
 void AES_init_ctx(struct AES_ctx* ctx, const uint8_t* key)
 {
-  KeyExpansion(ctx->RoundKey, key);
+  AES_init_ctx_len(ctx, key, AES_KEYLEN);
 }
 #if (defined(CBC) && (CBC == 1)) || (defined(CTR) && (CTR == 1))
 void AES_init_ctx_iv(struct AES_ctx* ctx, const uint8_t* key, const uint8_t* iv)
 {
-  KeyExpansion(ctx->RoundKey, key);
+  AES_init_ctx_len(ctx, key, AES_KEYLEN);
   memcpy (ctx->Iv, iv, AES_BLOCKLEN);
 }
+#endif
+#else // !AES_EXTERNAL_ROUNDKEY
+void AES_init_ctx_rk(struct AES_ctx* ctx, const uint8_t* round_key, uint8_t key_len)
+{
+  ctx->RoundKey = round_key;
+  ctx->Nr = AES_ROUNDS(key_len);
+}
+#if (defined(CBC) && (CBC == 1)) || (defined(CTR) && (CTR == 1))
+void AES_init_ctx_rk_iv(struct AES_ctx* ctx, const uint8_t* round_key, uint8_t key_len, const uint8_t* iv)
+{
+  ctx->RoundKey = round_key;
+  ctx->Nr = AES_ROUNDS(key_len);
+  memcpy (ctx->Iv, iv, AES_BLOCKLEN);
+}
+#endif
+#endif // !AES_EXTERNAL_ROUNDKEY
+#if (defined(CBC) && (CBC == 1)) || (defined(CTR) && (CTR == 1))
 void AES_ctx_set_iv(struct AES_ctx* ctx, const uint8_t* iv)
 {
   memcpy (ctx->Iv, iv, AES_BLOCKLEN);
@@ -246,7 +272,7 @@ static void AddRoundKey(uint8_t round, state_t* state, const uint8_t* RoundKey)
   {
     for (j = 0; j < 4; ++j)
     {
-      (*state)[i][j] ^= RoundKey[(round * Nb * 4) + (i * Nb) + j];
+      (*state)[i][j] ^= getRoundKey(&RoundKey[(round * Nb * 4) + (i * Nb) + j]);
     }
   }
 }
@@ -407,7 +433,7 @@ static void InvShiftRows(state_t* state)
 #endif // #if (defined(CBC) && CBC == 1) || (defined(ECB) && ECB == 1)
 
 // Cipher is the main function that encrypts the PlainText.
-static void Cipher(state_t* state, const uint8_t* RoundKey)
+static void Cipher(state_t* state, const uint8_t* RoundKey, uint8_t Nr)
 {
   uint8_t round = 0;
 
@@ -433,7 +459,7 @@ static void Cipher(state_t* state, const uint8_t* RoundKey)
 }
 
 #if (defined(CBC) && CBC == 1) || (defined(ECB) && ECB == 1)
-static void InvCipher(state_t* state, const uint8_t* RoundKey)
+static void InvCipher(state_t* state, const uint8_t* RoundKey, uint8_t Nr)
 {
   uint8_t round = 0;
 
@@ -467,13 +493,13 @@ static void InvCipher(state_t* state, const uint8_t* RoundKey)
 void AES_ECB_encrypt(const struct AES_ctx* ctx, uint8_t* buf)
 {
   // The next function call encrypts the PlainText with the Key using AES algorithm.
-  Cipher((state_t*)buf, ctx->RoundKey);
+  Cipher((state_t*)buf, ctx->RoundKey, ctx->Nr);
 }
 
 void AES_ECB_decrypt(const struct AES_ctx* ctx, uint8_t* buf)
 {
   // The next function call decrypts the PlainText with the Key using AES algorithm.
-  InvCipher((state_t*)buf, ctx->RoundKey);
+  InvCipher((state_t*)buf, ctx->RoundKey, ctx->Nr);
 }
 
 
@@ -502,7 +528,7 @@ void AES_CBC_encrypt_buffer(struct AES_ctx *ctx, uint8_t* buf, uint32_t length)
   for (i = 0; i < length; i += AES_BLOCKLEN)
   {
     XorWithIv(buf, Iv);
-    Cipher((state_t*)buf, ctx->RoundKey);
+    Cipher((state_t*)buf, ctx->RoundKey, ctx->Nr);
     Iv = buf;
     buf += AES_BLOCKLEN;
   }
@@ -517,7 +543,7 @@ void AES_CBC_decrypt_buffer(struct AES_ctx* ctx, uint8_t* buf,  uint32_t length)
   for (i = 0; i < length; i += AES_BLOCKLEN)
   {
     memcpy(storeNextIv, buf, AES_BLOCKLEN);
-    InvCipher((state_t*)buf, ctx->RoundKey);
+    InvCipher((state_t*)buf, ctx->RoundKey, ctx->Nr);
     XorWithIv(buf, ctx->Iv);
     memcpy(ctx->Iv, storeNextIv, AES_BLOCKLEN);
     buf += AES_BLOCKLEN;
@@ -544,7 +570,7 @@ void AES_CTR_xcrypt_buffer(struct AES_ctx* ctx, uint8_t* buf, uint32_t length)
     {
       
       memcpy(buffer, ctx->Iv, AES_BLOCKLEN);
-      Cipher((state_t*)buffer,ctx->RoundKey);
+      Cipher((state_t*)buffer,ctx->RoundKey, ctx->Nr);
 
       /* Increment Iv and handle overflow */
       for (bi = (AES_BLOCKLEN - 1); bi >= 0; --bi)
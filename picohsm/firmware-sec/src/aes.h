@@ -27,30 +27,61 @@
 //#define AES192 1
 #define AES256 1
 
+// Define AES_EXTERNAL_ROUNDKEY to 1 to have the contexts reference round keys
+// expanded in advance (for instance at build time, see gen_round_keys.py)
+// instead of running the key schedule. On AVR, these round keys are read from
+// program memory.
+#ifndef AES_EXTERNAL_ROUNDKEY
+  #define AES_EXTERNAL_ROUNDKEY 0
+#endif
+
 #define AES_BLOCKLEN 16 // Block length in bytes - AES is 128b block only
 
+// AES128/AES192/AES256 only select the key length of AES_init_ctx and
+// AES_init_ctx_iv. The key length of a context is set at runtime, so contexts
+// always have room for the largest key schedule.
 #if defined(AES256) && (AES256 == 1)
     #define AES_KEYLEN 32
-    #define AES_keyExpSize 240
 #elif defined(AES192) && (AES192 == 1)
     #define AES_KEYLEN 24
-    #define AES_keyExpSize 208
 #else
     #define AES_KEYLEN 16   // Key length in bytes
-    #define AES_keyExpSize 176
 #endif
+#define AES_keyExpSize 240
+
+// Number of rounds for a key length in bytes (16, 24 or 32)
+#define AES_ROUNDS(key_len) ((key_len) / 4 + 6)
 
 struct AES_ctx
 {
+#if AES_EXTERNAL_ROUNDKEY
+  const uint8_t* RoundKey;
+#else
   uint8_t RoundKey[AES_keyExpSize];
+#endif
 #if (defined(CBC) && (CBC == 1)) || (defined(CTR) && (CTR == 1))
   uint8_t Iv[AES_BLOCKLEN];
 #endif
+  uint8_t Nr; // Number of rounds
 };
 
+#if AES_EXTERNAL_ROUNDKEY
+// round_key points to AES_keyExpSize bytes of expanded key, which must stay
+// valid as long as the context is used.
+// key_len is the length in bytes of the key it was expanded from (16, 24 or 32).
+void AES_init_ctx_rk(struct AES_ctx* ctx, const uint8_t* round_key, uint8_t key_len);
+#if (defined(CBC) && (CBC == 1)) || (defined(CTR) && (CTR == 1))
+void AES_init_ctx_rk_iv(struct AES_ctx* ctx, const uint8_t* round_key, uint8_t key_len, const uint8_t* iv);
+#endif
+#else
+// key_len is the key length in bytes: 16, 24 or 32.
+void AES_init_ctx_len(struct AES_ctx* ctx, const uint8_t* key, uint8_t key_len);
 void AES_init_ctx(struct AES_ctx* ctx, const uint8_t* key);
 #if (defined(CBC) && (CBC == 1)) || (defined(CTR) && (CTR == 1))
 void AES_init_ctx_iv(struct AES_ctx* ctx, const uint8_t* key, const uint8_t* iv);
+#endif
+#endif
+#if (defined(CBC) && (CBC == 1)) || (defined(CTR) && (CTR == 1))
 void AES_ctx_set_iv(struct AES_ctx* ctx, const uint8_t* iv);
 #endif
 
@@ -0,0 +1,351 @@
+/*
+
+AES implementation tuned for 8-bit AVR microcontrollers. It implements the
+same API as tiny-AES (aes.h) and produces the same output, so both can be
+swapped in CMakeLists.txt (AES_AVR option).
+
+Differences with tiny-AES:
+- S-boxes and the multiplication by {02} are tables in program memory, read
+  with LPM. Table reads take constant time on AVR.
+- SubBytes and ShiftRows are merged in a single pass over the state.
+- InvMixColumns is computed as a light preprocessing step followed by
+  MixColumns, instead of four generic multiplications per byte.
+
+*/
+
+#include <string.h>
+#include "aes.h"
+
+#ifdef __AVR__
+#include <avr/pgmspace.h>
+#define read_table(t, i) pgm_read_byte(&(t)[(i)])
+#else
+#define PROGMEM
+#define read_table(t, i) ((t)[(i)])
+#endif
+
+// Round keys expanded in advance are in program memory on AVR
+#if AES_EXTERNAL_ROUNDKEY && defined(__AVR__)
+#define read_round_key(p) pgm_read_byte(p)
+#else
+#define read_round_key(p) (*(p))
+#endif
+
+
+static const uint8_t sbox[256] PROGMEM = {
+  //0     1    2      3     4    5     6     7      8    9     A      B    C     D     E     F
+  0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+  0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+  0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+  0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+  0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+  0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+  0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+  0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+  0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+  0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+  0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+  0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+  0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+  0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+  0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+  0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16 };
+
+static const uint8_t rsbox[256] PROGMEM = {
+  0x52, 0x09, 0x6a, 0xd5, 0x30, 0x36, 0xa5, 0x38, 0xbf, 0x40, 0xa3, 0x9e, 0x81, 0xf3, 0xd7, 0xfb,
+  0x7c, 0xe3, 0x39, 0x82, 0x9b, 0x2f, 0xff, 0x87, 0x34, 0x8e, 0x43, 0x44, 0xc4, 0xde, 0xe9, 0xcb,
+  0x54, 0x7b, 0x94, 0x32, 0xa6, 0xc2, 0x23, 0x3d, 0xee, 0x4c, 0x95, 0x0b, 0x42, 0xfa, 0xc3, 0x4e,
+  0x08, 0x2e, 0xa1, 0x66, 0x28, 0xd9, 0x24, 0xb2, 0x76, 0x5b, 0xa2, 0x49, 0x6d, 0x8b, 0xd1, 0x25,
+  0x72, 0xf8, 0xf6, 0x64, 0x86, 0x68, 0x98, 0x16, 0xd4, 0xa4, 0x5c, 0xcc, 0x5d, 0x65, 0xb6, 0x92,
+  0x6c, 0x70, 0x48, 0x50, 0xfd, 0xed, 0xb9, 0xda, 0x5e, 0x15, 0x46, 0x57, 0xa7, 0x8d, 0x9d, 0x84,
+  0x90, 0xd8, 0xab, 0x00, 0x8c, 0xbc, 0xd3, 0x0a, 0xf7, 0xe4, 0x58, 0x05, 0xb8, 0xb3, 0x45, 0x06,
+  0xd0, 0x2c, 0x1e, 0x8f, 0xca, 0x3f, 0x0f, 0x02, 0xc1, 0xaf, 0xbd, 0x03, 0x01, 0x13, 0x8a, 0x6b,
+  0x3a, 0x91, 0x11, 0x41, 0x4f, 0x67, 0xdc, 0xea, 0x97, 0xf2, 0xcf, 0xce, 0xf0, 0xb4, 0xe6, 0x73,
+  0x96, 0xac, 0x74, 0x22, 0xe7, 0xad, 0x35, 0x85, 0xe2, 0xf9, 0x37, 0xe8, 0x1c, 0x75, 0xdf, 0x6e,
+  0x47, 0xf1, 0x1a, 0x71, 0x1d, 0x29, 0xc5, 0x89, 0x6f, 0xb7, 0x62, 0x0e, 0xaa, 0x18, 0xbe, 0x1b,
+  0xfc, 0x56, 0x3e, 0x4b, 0xc6, 0xd2, 0x79, 0x20, 0x9a, 0xdb, 0xc0, 0xfe, 0x78, 0xcd, 0x5a, 0xf4,
+  0x1f, 0xdd, 0xa8, 0x33, 0x88, 0x07, 0xc7, 0x31, 0xb1, 0x12, 0x10, 0x59, 0x27, 0x80, 0xec, 0x5f,
+  0x60, 0x51, 0x7f, 0xa9, 0x19, 0xb5, 0x4a, 0x0d, 0x2d, 0xe5, 0x7a, 0x9f, 0x93, 0xc9, 0x9c, 0xef,
+  0xa0, 0xe0, 0x3b, 0x4d, 0xae, 0x2a, 0xf5, 0xb0, 0xc8, 0xeb, 0xbb, 0x3c, 0x83, 0x53, 0x99, 0x61,
+  0x17, 0x2b, 0x04, 0x7e, 0xba, 0x77, 0xd6, 0x26, 0xe1, 0x69, 0x14, 0x63, 0x55, 0x21, 0x0c, 0x7d };
+
+// Multiplication by {02} in GF(2^8)
+static const uint8_t xtime_table[256] PROGMEM = {
+  0x00, 0x02, 0x04, 0x06, 0x08, 0x0a, 0x0c, 0x0e, 0x10, 0x12, 0x14, 0x16, 0x18, 0x1a, 0x1c, 0x1e,
+  0x20, 0x22, 0x24, 0x26, 0x28, 0x2a, 0x2c, 0x2e, 0x30, 0x32, 0x34, 0x36, 0x38, 0x3a, 0x3c, 0x3e,
+  0x40, 0x42, 0x44, 0x46, 0x48, 0x4a, 0x4c, 0x4e, 0x50, 0x52, 0x54, 0x56, 0x58, 0x5a, 0x5c, 0x5e,
+  0x60, 0x62, 0x64, 0x66, 0x68, 0x6a, 0x6c, 0x6e, 0x70, 0x72, 0x74, 0x76, 0x78, 0x7a, 0x7c, 0x7e,
+  0x80, 0x82, 0x84, 0x86, 0x88, 0x8a, 0x8c, 0x8e, 0x90, 0x92, 0x94, 0x96, 0x98, 0x9a, 0x9c, 0x9e,
+  0xa0, 0xa2, 0xa4, 0xa6, 0xa8, 0xaa, 0xac, 0xae, 0xb0, 0xb2, 0xb4, 0xb6, 0xb8, 0xba, 0xbc, 0xbe,
+  0xc0, 0xc2, 0xc4, 0xc6, 0xc8, 0xca, 0xcc, 0xce, 0xd0, 0xd2, 0xd4, 0xd6, 0xd8, 0xda, 0xdc, 0xde,
+  0xe0, 0xe2, 0xe4, 0xe6, 0xe8, 0xea, 0xec, 0xee, 0xf0, 0xf2, 0xf4, 0xf6, 0xf8, 0xfa, 0xfc, 0xfe,
+  0x1b, 0x19, 0x1f, 0x1d, 0x13, 0x11, 0x17, 0x15, 0x0b, 0x09, 0x0f, 0x0d, 0x03, 0x01, 0x07, 0x05,
+  0x3b, 0x39, 0x3f, 0x3d, 0x33, 0x31, 0x37, 0x35, 0x2b, 0x29, 0x2f, 0x2d, 0x23, 0x21, 0x27, 0x25,
+  0x5b, 0x59, 0x5f, 0x5d, 0x53, 0x51, 0x57, 0x55, 0x4b, 0x49, 0x4f, 0x4d, 0x43, 0x41, 0x47, 0x45,
+  0x7b, 0x79, 0x7f, 0x7d, 0x73, 0x71, 0x77, 0x75, 0x6b, 0x69, 0x6f, 0x6d, 0x63, 0x61, 0x67, 0x65,
+  0x9b, 0x99, 0x9f, 0x9d, 0x93, 0x91, 0x97, 0x95, 0x8b, 0x89, 0x8f, 0x8d, 0x83, 0x81, 0x87, 0x85,
+  0xbb, 0xb9, 0xbf, 0xbd, 0xb3, 0xb1, 0xb7, 0xb5, 0xab, 0xa9, 0xaf, 0xad, 0xa3, 0xa1, 0xa7, 0xa5,
+  0xdb, 0xd9, 0xdf, 0xdd, 0xd3, 0xd1, 0xd7, 0xd5, 0xcb, 0xc9, 0xcf, 0xcd, 0xc3, 0xc1, 0xc7, 0xc5,
+  0xfb, 0xf9, 0xff, 0xfd, 0xf3, 0xf1, 0xf7, 0xf5, 0xeb, 0xe9, 0xef, 0xed, 0xe3, 0xe1, 0xe7, 0xe5 };
+
+#define S(x) read_table(sbox, (x))
+#define RS(x) read_table(rsbox, (x))
+#define X(x) read_table(xtime_table, (x))
+
+
+#if !AES_EXTERNAL_ROUNDKEY
+static void KeyExpansion(uint8_t* RoundKey, const uint8_t* Key, uint8_t Nk)
+{
+  const uint8_t Nr = Nk + 6;
+  static const uint8_t Rcon[11] = {
+    0x8d, 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1b, 0x36 };
+  uint8_t i;
+  uint8_t t[4];
+
+  memcpy(RoundKey, Key, Nk * 4);
+  for (i = Nk; i < 4 * (Nr + 1); ++i)
+  {
+    uint8_t* w = RoundKey + i * 4;
+    memcpy(t, w - 4, 4);
+    if (i % Nk == 0)
+    {
+      uint8_t u = t[0];
+      t[0] = S(t[1]) ^ Rcon[i / Nk];
+      t[1] = S(t[2]);
+      t[2] = S(t[3]);
+      t[3] = S(u);
+    }
+    else if ((Nk > 6) && (i % Nk == 4))
+    {
+      t[0] = S(t[0]);
+      t[1] = S(t[1]);
+      t[2] = S(t[2]);
+      t[3] = S(t[3]);
+    }
+    w[0] = w[0 - Nk * 4] ^ t[0];
+    w[1] = w[1 - Nk * 4] ^ t[1];
+    w[2] = w[2 - Nk * 4] ^ t[2];
+    w[3] = w[3 - Nk * 4] ^ t[3];
+  }
+}
+
+void AES_init_ctx_len(struct AES_ctx* ctx, const uint8_t* key, uint8_t key_len)
+{
+  ctx->Nr = AES_ROUNDS(key_len);
+  KeyExpansion(ctx->RoundKey, key, key_len / 4);
+}
+void AES_init_ctx(struct AES_ctx* ctx, const uint8_t* key)
+{
+  AES_init_ctx_len(ctx, key, AES_KEYLEN);
+}
+#if (defined(CBC) && (CBC == 1)) || (defined(CTR) && (CTR == 1))
+void AES_init_ctx_iv(struct AES_ctx* ctx, const uint8_t* key, const uint8_t* iv)
+{
+  AES_init_ctx_len(ctx, key, AES_KEYLEN);
+  memcpy(ctx->Iv, iv, AES_BLOCKLEN);
+}
+#endif
+#else // !AES_EXTERNAL_ROUNDKEY
+void AES_init_ctx_rk(struct AES_ctx* ctx, const uint8_t* round_key, uint8_t key_len)
+{
+  ctx->RoundKey = round_key;
+  ctx->Nr = AES_ROUNDS(key_len);
+}
+#if (defined(CBC) && (CBC == 1)) || (defined(CTR) && (CTR == 1))
+void AES_init_ctx_rk_iv(struct AES_ctx* ctx, const uint8_t* round_key, uint8_t key_len, const uint8_t* iv)
+{
+  ctx->RoundKey = round_key;
+  ctx->Nr = AES_ROUNDS(key_len);
+  memcpy(ctx->Iv, iv, AES_BLOCKLEN);
+}
+#endif
+#endif // !AES_EXTERNAL_ROUNDKEY
+#if (defined(CBC) && (CBC == 1)) || (defined(CTR) && (CTR == 1))
+void AES_ctx_set_iv(struct AES_ctx* ctx, const uint8_t* iv)
+{
+  memcpy(ctx->Iv, iv, AES_BLOCKLEN);
+}
+#endif
+
+
+// The state is stored column by column: s[4 * c + r] is row r of column c.
+
+static void AddRoundKey(uint8_t* s, const uint8_t* rk)
+{
+  uint8_t i;
+  for (i = 0; i < AES_BLOCKLEN; ++i)
+  {
+    s[i] ^= read_round_key(rk + i);
+  }
+}
+
+// SubBytes followed by ShiftRows
+static void SubShift(uint8_t* s)
+{
+  uint8_t t;
+  s[0] = S(s[0]); s[4] = S(s[4]); s[8] = S(s[8]); s[12] = S(s[12]);
+  t = s[1]; s[1] = S(s[5]); s[5] = S(s[9]); s[9] = S(s[13]); s[13] = S(t);
+  t = s[2]; s[2] = S(s[10]); s[10] = S(t);
+  t = s[6]; s[6] = S(s[14]); s[14] = S(t);
+  t = s[3]; s[3] = S(s[15]); s[15] = S(s[11]); s[11] = S(s[7]); s[7] = S(t);
+}
+
+// InvShiftRows followed by InvSubBytes
+static void InvShiftSub(uint8_t* s)
+{
+  uint8_t t;
+  s[0] = RS(s[0]); s[4] = RS(s[4]); s[8] = RS(s[8]); s[12] = RS(s[12]);
+  t = s[13]; s[13] = RS(s[9]); s[9] = RS(s[5]); s[5] = RS(s[1]); s[1] = RS(t);
+  t = s[2]; s[2] = RS(s[10]); s[10] = RS(t);
+  t = s[6]; s[6] = RS(s[14]); s[14] = RS(t);
+  t = s[3]; s[3] = RS(s[7]); s[7] = RS(s[11]); s[11] = RS(s[15]); s[15] = RS(t);
+}
+
+static void MixColumns(uint8_t* s)
+{
+  uint8_t c;
+  for (c = 0; c < 4; ++c, s += 4)
+  {
+    uint8_t a0 = s[0], a1 = s[1], a2 = s[2], a3 = s[3];
+    uint8_t t = a0 ^ a1 ^ a2 ^ a3;
+    s[0] = a0 ^ t ^ X(a0 ^ a1);
+    s[1] = a1 ^ t ^ X(a1 ^ a2);
+    s[2] = a2 ^ t ^ X(a2 ^ a3);
+    s[3] = a3 ^ t ^ X(a3 ^ a0);
+  }
+}
+
+// InvMixColumns = MixColumns applied after multiplying each column by
+// {04}x^2 + {05}, which only needs two doublings per pair of bytes.
+static void InvMixColumns(uint8_t* s)
+{
+  uint8_t c;
+  uint8_t* p = s;
+  for (c = 0; c < 4; ++c, p += 4)
+  {
+    uint8_t u = X(X(p[0] ^ p[2]));
+    uint8_t v = X(X(p[1] ^ p[3]));
+    p[0] ^= u;
+    p[1] ^= v;
+    p[2] ^= u;
+    p[3] ^= v;
+  }
+  MixColumns(s);
+}
+
+static void Cipher(uint8_t* s, const uint8_t* rk, uint8_t Nr)
+{
+  uint8_t round;
+  AddRoundKey(s, rk);
+  for (round = 1; round < Nr; ++round)
+  {
+    rk += AES_BLOCKLEN;
+    SubShift(s);
+    MixColumns(s);
+    AddRoundKey(s, rk);
+  }
+  SubShift(s);
+  AddRoundKey(s, rk + AES_BLOCKLEN);
+}
+
+static void InvCipher(uint8_t* s, const uint8_t* rk, uint8_t Nr)
+{
+  uint8_t round;
+  const uint8_t* k = rk + Nr * AES_BLOCKLEN;
+  AddRoundKey(s, k);
+  for (round = Nr - 1; round > 0; --round)
+  {
+    k -= AES_BLOCKLEN;
+    InvShiftSub(s);
+    AddRoundKey(s, k);
+    InvMixColumns(s);
+  }
+  InvShiftSub(s);
+  AddRoundKey(s, rk);
+}
+
+
+#if defined(ECB) && (ECB == 1)
+
+void AES_ECB_encrypt(const struct AES_ctx* ctx, uint8_t* buf)
+{
+  Cipher(buf, ctx->RoundKey, ctx->Nr);
+}
+
+void AES_ECB_decrypt(const struct AES_ctx* ctx, uint8_t* buf)
+{
+  InvCipher(buf, ctx->RoundKey, ctx->Nr);
+}
+
+#endif // #if defined(ECB) && (ECB == 1)
+
+
+#if defined(CBC) && (CBC == 1)
+
+static void XorWithIv(uint8_t* buf, const uint8_t* Iv)
+{
+  uint8_t i;
+  for (i = 0; i < AES_BLOCKLEN; ++i)
+  {
+    buf[i] ^= Iv[i];
+  }
+}
+
+void AES_CBC_encrypt_buffer(struct AES_ctx* ctx, uint8_t* buf, uint32_t length)
+{
+  uint32_t i;
+  const uint8_t* Iv = ctx->Iv;
+  for (i = 0; i < length; i += AES_BLOCKLEN)
+  {
+    XorWithIv(buf, Iv);
+    Cipher(buf, ctx->RoundKey, ctx->Nr);
+    Iv = buf;
+    buf += AES_BLOCKLEN;
+  }
+  memcpy(ctx->Iv, Iv, AES_BLOCKLEN);
+}
+
+void AES_CBC_decrypt_buffer(struct AES_ctx* ctx, uint8_t* buf, uint32_t length)
+{
+  uint32_t i;
+  uint8_t next_iv[AES_BLOCKLEN];
+  for (i = 0; i < length; i += AES_BLOCKLEN)
+  {
+    memcpy(next_iv, buf, AES_BLOCKLEN);
+    InvCipher(buf, ctx->RoundKey, ctx->Nr);
+    XorWithIv(buf, ctx->Iv);
+    memcpy(ctx->Iv, next_iv, AES_BLOCKLEN);
+    buf += AES_BLOCKLEN;
+  }
+}
+
+#endif // #if defined(CBC) && (CBC == 1)
+
+
+#if defined(CTR) && (CTR == 1)
+
+void AES_CTR_xcrypt_buffer(struct AES_ctx* ctx, uint8_t* buf, uint32_t length)
+{
+  uint8_t keystream[AES_BLOCKLEN];
+  uint32_t i;
+  uint8_t bi = AES_BLOCKLEN;
+  for (i = 0; i < length; ++i, ++bi)
+  {
+    if (bi == AES_BLOCKLEN)
+    {
+      int8_t j;
+      memcpy(keystream, ctx->Iv, AES_BLOCKLEN);
+      Cipher(keystream, ctx->RoundKey, ctx->Nr);
+      // Increment the counter (big-endian)
+      for (j = AES_BLOCKLEN - 1; j >= 0; --j)
+      {
+        if (++ctx->Iv[j] != 0)
+          break;
+      }
+      bi = 0;
+    }
+    buf[i] ^= keystream[bi];
+  }
+}
+
+#endif // #if defined(CTR) && (CTR == 1)
@@ -0,0 +1,207 @@
+/**
+ * This file is part of picoHSM
+ * 
+ * picoHSM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Ledger SAS, written by Olivier Hériveaux
+ */
+
+/**
+ * AES benchmark for the secure MCU. Measures the number of CPU cycles taken by
+ * the AES implementation linked in the firmware (tiny-AES or the AVR
+ * optimized one), after checking it against the FIPS-197 AES-256 test vector.
+ * Results are printed as text on the UART.
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include "uart.hxx"
+#include "aes.hxx"
+#include "round_keys.hxx"
+
+
+/** Number of blocks processed for each measurement. */
+const uint8_t bench_blocks = 16;
+
+
+/** FIPS-197 appendix C.3 key (00 01 02 ... 1f), expanded. */
+static const uint8_t fips_round_keys[240] PROGMEM = {
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+    0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f,
+    0xa5, 0x73, 0xc2, 0x9f, 0xa1, 0x76, 0xc4, 0x98, 0xa9, 0x7f, 0xce, 0x93, 0xa5, 0x72, 0xc0, 0x9c,
+    0x16, 0x51, 0xa8, 0xcd, 0x02, 0x44, 0xbe, 0xda, 0x1a, 0x5d, 0xa4, 0xc1, 0x06, 0x40, 0xba, 0xde,
+    0xae, 0x87, 0xdf, 0xf0, 0x0f, 0xf1, 0x1b, 0x68, 0xa6, 0x8e, 0xd5, 0xfb, 0x03, 0xfc, 0x15, 0x67,
+    0x6d, 0xe1, 0xf1, 0x48, 0x6f, 0xa5, 0x4f, 0x92, 0x75, 0xf8, 0xeb, 0x53, 0x73, 0xb8, 0x51, 0x8d,
+    0xc6, 0x56, 0x82, 0x7f, 0xc9, 0xa7, 0x99, 0x17, 0x6f, 0x29, 0x4c, 0xec, 0x6c, 0xd5, 0x59, 0x8b,
+    0x3d, 0xe2, 0x3a, 0x75, 0x52, 0x47, 0x75, 0xe7, 0x27, 0xbf, 0x9e, 0xb4, 0x54, 0x07, 0xcf, 0x39,
+    0x0b, 0xdc, 0x90, 0x5f, 0xc2, 0x7b, 0x09, 0x48, 0xad, 0x52, 0x45, 0xa4, 0xc1, 0x87, 0x1c, 0x2f,
+    0x45, 0xf5, 0xa6, 0x60, 0x17, 0xb2, 0xd3, 0x87, 0x30, 0x0d, 0x4d, 0x33, 0x64, 0x0a, 0x82, 0x0a,
+    0x7c, 0xcf, 0xf7, 0x1c, 0xbe, 0xb4, 0xfe, 0x54, 0x13, 0xe6, 0xbb, 0xf0, 0xd2, 0x61, 0xa7, 0xdf,
+    0xf0, 0x1a, 0xfa, 0xfe, 0xe7, 0xa8, 0x29, 0x79, 0xd7, 0xa5, 0x64, 0x4a, 0xb3, 0xaf, 0xe6, 0x40,
+    0x25, 0x41, 0xfe, 0x71, 0x9b, 0xf5, 0x00, 0x25, 0x88, 0x13, 0xbb, 0xd5, 0x5a, 0x72, 0x1c, 0x0a,
+    0x4e, 0x5a, 0x66, 0x99, 0xa9, 0xf2, 0x4f, 0xe0, 0x7e, 0x57, 0x2b, 0xaa, 0xcd, 0xf8, 0xcd, 0xea,
+    0x24, 0xfc, 0x79, 0xcc, 0xbf, 0x09, 0x79, 0xe9, 0x37, 0x1a, 0xc2, 0x3c, 0x6d, 0x68, 0xde, 0x36,
+};
+
+
+static const uint8_t fips_plaintext[16] = {
+    0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
+    0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff };
+
+
+static const uint8_t fips_ciphertext[16] = {
+    0x8e, 0xa2, 0xb7, 0xca, 0x51, 0x67, 0x45, 0xbf,
+    0xea, 0xfc, 0x49, 0x90, 0x4b, 0x49, 0x60, 0x89 };
+
+
+static const uint8_t iv_zero[16] = {0};
+
+
+/** Upper 16 bits of the cycle counter. */
+volatile uint16_t timer1_overflows;
+
+
+ISR(TIMER1_OVF_vect)
+{
+    ++timer1_overflows;
+}
+
+
+/**
+ * Starts Timer1 without prescaler, so it counts CPU cycles.
+ */
+void cycles_init(){
+    TCCR1A = 0;
+    TCCR1B = (1 << CS10);
+    TIMSK1 = (1 << TOIE1);
+    TCNT1 = 0;
+    timer1_overflows = 0;
+}
+
+
+/**
+ * @return Number of CPU cycles since cycles_init was called.
+ */
+uint32_t cycles(){
+    uint8_t sreg = SREG;
+    cli();
+    uint16_t low = TCNT1;
+    uint16_t high = timer1_overflows;
+    // Overflow happened but its interrupt has not been serviced yet.
+    if ((TIFR1 & (1 << TOV1)) && (low < 0x8000))
+        ++high;
+    SREG = sreg;
+    return ((uint32_t)high << 16) | low;
+}
+
+
+void print_str(const char* s){
+    while (*s != '\0')
+        uart_write_u8((uint8_t)(*s++));
+}
+
+
+void print_u32(uint32_t value){
+    char buf[11];
+    uint8_t i = sizeof(buf) - 1;
+    buf[i] = '\0';
+    do {
+        buf[--i] = '0' + (value % 10);
+        value /= 10;
+    } while (value);
+    print_str(buf + i);
+}
+
+
+/**
+ * Prints a measurement line: "<name>: <cycles per block> cycles/block".
+ */
+void print_result(const char* name, uint32_t elapsed){
+    print_str(name);
+    print_str(": ");
+    print_u32(elapsed / bench_blocks);
+    print_str(" cycles/block\r\n");
+}
+
+
+/**
+ * @return true if the AES implementation gives the expected FIPS-197
+ *     ciphertext, and decrypts it back.
+ */
+bool known_answer_test(){
+    AES_ctx ctx;
+    AES_init_ctx_rk(&ctx, fips_round_keys, 32);
+    uint8_t buf[16];
+    for (uint8_t i = 0; i < 16; ++i)
+        buf[i] = fips_plaintext[i];
+    AES_ECB_encrypt(&ctx, buf);
+    for (uint8_t i = 0; i < 16; ++i)
+        if (buf[i] != fips_ciphertext[i])
+            return false;
+    AES_ECB_decrypt(&ctx, buf);
+    for (uint8_t i = 0; i < 16; ++i)
+        if (buf[i] != fips_plaintext[i])
+            return false;
+    return true;
+}
+
+
+int main()
+{
+    uart_init(625000);
+    cycles_init();
+    sei();
+
+    print_str("AES benchmark\r\n");
+    if (!known_answer_test()){
+        print_str("KAT: FAIL\r\n");
+        for (;;){}
+    }
+    print_str("KAT: OK\r\n");
+
+    uint8_t buf[16 * bench_blocks] = {0};
+    AES_ctx ctx;
+    AES_init_ctx_rk_iv(&ctx, aes_round_keys[0], aes_key_lengths[0],
+        iv_zero);
+    uint32_t start;
+
+    // Overhead of the measurement itself
+    start = cycles();
+    uint32_t overhead = cycles() - start;
+
+    start = cycles();
+    for (uint8_t i = 0; i < bench_blocks; ++i)
+        AES_ECB_encrypt(&ctx, buf + 16 * i);
+    print_result("ECB encrypt", cycles() - start - overhead);
+
+    start = cycles();
+    for (uint8_t i = 0; i < bench_blocks; ++i)
+        AES_ECB_decrypt(&ctx, buf + 16 * i);
+    print_result("ECB decrypt", cycles() - start - overhead);
+
+    // Same per-block calls as the firmware main loop
+    start = cycles();
+    for (uint8_t i = 0; i < bench_blocks; ++i)
+        AES_CBC_encrypt_buffer(&ctx, buf + 16 * i, 16);
+    print_result("CBC encrypt", cycles() - start - overhead);
+
+    AES_ctx_set_iv(&ctx, iv_zero);
+    start = cycles();
+    for (uint8_t i = 0; i < bench_blocks; ++i)
+        AES_CBC_decrypt_buffer(&ctx, buf + 16 * i, 16);
+    print_result("CBC decrypt", cycles() - start - overhead);
+
+    for (;;){}
+}
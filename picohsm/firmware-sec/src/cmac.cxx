@@ -0,0 +1,88 @@
+/**
+ * This file is part of picoHSM
+ * 
+ * picoHSM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Ledger SAS, written by Olivier Hériveaux
+ */
+
+#include "cmac.hxx"
+
+
+/**
+ * Multiply by x in GF(2^128), used to derive the subkeys.
+ */
+static void cmac_double(uint8_t* b){
+    uint8_t carry = b[0] >> 7;
+    for (uint8_t i = 0; i < 15; ++i)
+        b[i] = (b[i] << 1) | (b[i + 1] >> 7);
+    b[15] = (b[15] << 1) ^ (carry ? 0x87 : 0);
+}
+
+
+/**
+ * Start a CMAC computation.
+ *
+ * @param ctx CMAC state.
+ * @param round_key Expanded key.
+ * @param key_len Key length in bytes.
+ */
+void cmac_init(cmac_ctx_t* ctx, const uint8_t* round_key, uint8_t key_len){
+    AES_init_ctx_rk(&ctx->aes, round_key, key_len);
+    for (uint8_t i = 0; i < 16; ++i)
+        ctx->x[i] = 0;
+}
+
+
+/**
+ * Absorb a full block which is not the last block of the message.
+ *
+ * @param ctx CMAC state.
+ * @param block 16 bytes.
+ */
+void cmac_update(cmac_ctx_t* ctx, const uint8_t* block){
+    for (uint8_t i = 0; i < 16; ++i)
+        ctx->x[i] ^= block[i];
+    AES_ECB_encrypt(&ctx->aes, ctx->x);
+}
+
+
+/**
+ * Absorb the last block of the message and compute the tag.
+ *
+ * @param ctx CMAC state.
+ * @param last Last block of the message.
+ * @param len Length of the last block, 0 to 16. 0 only for an empty message.
+ * @param tag Where the 16-byte tag is written.
+ */
+void cmac_final(cmac_ctx_t* ctx, const uint8_t* last, uint8_t len,
+    uint8_t* tag){
+    // Subkey K1 for a complete last block, K2 for a padded one.
+    uint8_t k[16] = {0};
+    AES_ECB_encrypt(&ctx->aes, k);
+    cmac_double(k);
+    if (len < 16)
+        cmac_double(k);
+    for (uint8_t i = 0; i < 16; ++i){
+        uint8_t m;
+        if (i < len)
+            m = last[i];
+        else if (i == len)
+            m = 0x80;
+        else
+            m = 0;
+        tag[i] = ctx->x[i] ^ m ^ k[i];
+    }
+    AES_ECB_encrypt(&ctx->aes, tag);
+}
@@ -0,0 +1,43 @@
+/**
+ * This file is part of picoHSM
+ * 
+ * picoHSM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Ledger SAS, written by Olivier Hériveaux
+ */
+
+#ifndef _CMAC_HXX_
+#define _CMAC_HXX_
+
+
+#include <stdint.h>
+#include "aes.hxx"
+
+
+/**
+ * AES-CMAC computation state (NIST SP 800-38B).
+ */
+struct cmac_ctx_t {
+    AES_ctx aes;
+    /** Chaining value. */
+    uint8_t x[16];
+};
+
+
+void cmac_init(cmac_ctx_t*, const uint8_t*, uint8_t);
+void cmac_update(cmac_ctx_t*, const uint8_t*);
+void cmac_final(cmac_ctx_t*, const uint8_t*, uint8_t, uint8_t*);
+
+
+#endif
@@ -0,0 +1,171 @@
+/**
+ * This file is part of picoHSM
+ * 
+ * picoHSM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Ledger SAS, written by Olivier Hériveaux
+ */
+
+#include "ctr.hxx"
+#include "aes.hxx"
+
+
+/**
+ * CTR state of a key slot. The pool is a ring of keystream blocks for the
+ * counters following the one of the next data block.
+ */
+struct ctr_slot_t {
+    /** Expanded key of the slot. Null until a nonce is set. */
+    const uint8_t* round_key;
+    /** Key length in bytes. */
+    uint8_t key_len;
+    /** Counter of the next keystream block to be computed. */
+    uint8_t counter[16];
+    /** Precomputed keystream blocks. */
+    uint8_t pool[CTR_POOL_BLOCKS][16];
+    /** Index in pool of the keystream for the next data block. */
+    uint8_t head;
+    /** Number of precomputed blocks in pool. */
+    uint8_t count;
+};
+
+
+static ctr_slot_t ctr_slots[CTR_SLOT_COUNT];
+ctr_stats_t ctr_stats;
+
+
+/**
+ * Increment a big-endian counter block, as AES_CTR_xcrypt_buffer does.
+ */
+static void ctr_increment(uint8_t* counter){
+    for (int8_t i = 15; i >= 0; --i){
+        if (++counter[i] != 0)
+            break;
+    }
+}
+
+
+/**
+ * Compute the keystream block for the counter of a slot, and increment it.
+ */
+static void ctr_compute(ctr_slot_t* slot, uint8_t* out){
+    AES_ctx ctx;
+    AES_init_ctx_rk(&ctx, slot->round_key, slot->key_len);
+    for (uint8_t i = 0; i < 16; ++i)
+        out[i] = slot->counter[i];
+    AES_ECB_encrypt(&ctx, out);
+    ctr_increment(slot->counter);
+}
+
+
+/**
+ * Set the initial counter block of a key slot. Discards the precomputed
+ * keystream.
+ *
+ * @param slot Key slot number.
+ * @param round_key Expanded key of the slot.
+ * @param key_len Key length in bytes.
+ * @param nonce Initial counter block, 16 bytes.
+ */
+void ctr_set_nonce(uint8_t slot, const uint8_t* round_key, uint8_t key_len,
+    const uint8_t* nonce){
+    ctr_slot_t* s = &ctr_slots[slot];
+    s->round_key = round_key;
+    s->key_len = key_len;
+    for (uint8_t i = 0; i < 16; ++i)
+        s->counter[i] = nonce[i];
+    s->head = 0;
+    s->count = 0;
+}
+
+
+/**
+ * @return true if a nonce has been set for the slot.
+ */
+bool ctr_active(uint8_t slot){
+    return ctr_slots[slot].round_key != 0;
+}
+
+
+/**
+ * Get the keystream block for the next data block of a slot. Taken from the
+ * pool when available, computed otherwise.
+ *
+ * @param slot Key slot number. Must be active.
+ * @param out Keystream block.
+ */
+void ctr_keystream(uint8_t slot, uint8_t* out){
+    ctr_slot_t* s = &ctr_slots[slot];
+    if (s->count){
+        for (uint8_t i = 0; i < 16; ++i)
+            out[i] = s->pool[s->head][i];
+        s->head = (s->head + 1) % CTR_POOL_BLOCKS;
+        --s->count;
+        ++ctr_stats.hits;
+    } else {
+        ctr_compute(s, out);
+        ++ctr_stats.misses;
+    }
+}
+
+
+/**
+ * Precompute one keystream block for a slot.
+ *
+ * @param slot Key slot number.
+ * @return false if the slot is not active or its pool is full.
+ */
+bool ctr_fill(uint8_t slot){
+    ctr_slot_t* s = &ctr_slots[slot];
+    if ((s->round_key == 0) || (s->count == CTR_POOL_BLOCKS))
+        return false;
+    uint8_t tail = (s->head + s->count) % CTR_POOL_BLOCKS;
+    ctr_compute(s, s->pool[tail]);
+    ++s->count;
+    ++ctr_stats.fills;
+    return true;
+}
+
+
+/**
+ * Precompute one keystream block for the next slot needing it, round robin.
+ * Called while the UART is idle, so it only delays the processing of an
+ * incoming instruction by one AES block at most.
+ */
+void ctr_fill_idle(){
+    static uint8_t next = 0;
+    for (uint8_t i = 0; i < CTR_SLOT_COUNT; ++i){
+        uint8_t slot = (next + i) % CTR_SLOT_COUNT;
+        if (ctr_fill(slot)){
+            next = (slot + 1) % CTR_SLOT_COUNT;
+            return;
+        }
+    }
+}
+
+
+/**
+ * Forget the nonces, the precomputed keystream and the statistics, as a reset
+ * does. Only needed by the host model: the firmware starts with zeroed RAM.
+ */
+void ctr_reset(){
+    for (uint8_t slot = 0; slot < CTR_SLOT_COUNT; ++slot){
+        ctr_slots[slot].round_key = 0;
+        ctr_slots[slot].head = 0;
+        ctr_slots[slot].count = 0;
+    }
+    ctr_stats.fills = 0;
+    ctr_stats.hits = 0;
+    ctr_stats.misses = 0;
+}
@@ -0,0 +1,58 @@
+/**
+ * This file is part of picoHSM
+ * 
+ * picoHSM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Ledger SAS, written by Olivier Hériveaux
+ */
+
+#ifndef _CTR_HXX_
+#define _CTR_HXX_
+
+
+#include <stdint.h>
+
+
+/** Number of keystream blocks precomputed for each key slot. */
+#ifndef CTR_POOL_BLOCKS
+#define CTR_POOL_BLOCKS 16
+#endif
+
+#define CTR_SLOT_COUNT 8
+
+
+/**
+ * Keystream pool statistics.
+ */
+struct ctr_stats_t {
+    /** Keystream blocks computed in advance. */
+    uint32_t fills;
+    /** Data blocks served from the pool. */
+    uint32_t hits;
+    /** Data blocks whose keystream had to be computed on demand. */
+    uint32_t misses;
+};
+
+
+extern ctr_stats_t ctr_stats;
+
+void ctr_set_nonce(uint8_t, const uint8_t*, uint8_t, const uint8_t*);
+bool ctr_active(uint8_t);
+void ctr_keystream(uint8_t, uint8_t*);
+bool ctr_fill(uint8_t);
+void ctr_fill_idle();
+void ctr_reset();
+
+
+#endif
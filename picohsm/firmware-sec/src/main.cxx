@@ -19,44 +19,85 @@
 
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <util/atomic.h>
 #include "uart.hxx"
 #include "aes.hxx"
-#include "keys.hxx"
+#include "round_keys.hxx"
 #include "pin.hxx"
+#include "key_locks.hxx"
+#include "sec_protocol.hxx"
+#include "ctr.hxx"
+#include "cmac.hxx"
 
 
-static const uint8_t* aes_keys[8] = {
-    aes_key_0,
-    aes_key_1,
-    aes_key_2,
-    aes_key_3,
-    aes_key_4,
-    aes_key_5,
-    aes_key_6,
-    aes_key_7
+/**
+ * CBC context, keeping the IV between instructions so a message can be
+ * processed in several parts.
+ */
+struct cbc_context_t {
+    /** Set by SEC_INS_CBC_INIT. */
+    bool active;
+    /** Key number. */
+    uint8_t key_id;
+    /** IV for the next block: initial IV, then the last ciphertext block. */
+    uint8_t iv[16];
 };
 
 
-static const bool aes_key_locked[8] = {
-    false, false, true, false, false, false, false, false
-};
+cbc_context_t cbc_contexts[CBC_CONTEXT_COUNT];
 
 
-static const uint8_t aes_iv_zero[16] = {0};
+/** Session lifetime after a successful PIN verification, in Timer1 ticks. */
+#define SESSION_LIFETIME (30 * 100)
 
+/** Remaining lifetime of the session. 0 when there is no session. */
+volatile uint16_t session_ticks;
 
-enum instruction_t {
-    INS_VERIFY_PIN = 1,
-    INS_ENCRYPT = 2,
-    INS_DECRYPT = 3
-};
+
+/**
+ * Timer1 compare interrupt, 100 times per second. Counts down the session
+ * lifetime.
+ */
+ISR(TIMER1_COMPA_vect)
+{
+    if (session_ticks)
+        --session_ticks;
+}
 
 
-enum status_t {
-    STATUS_OK = 1,
-    STATUS_BAD_PIN = 2,
-    STATUS_KEY_LOCKED = 3
-};
+/**
+ * Configure Timer1 to tick 100 times per second.
+ */
+void session_timer_init(){
+    OCR1A = (F_CPU / 1024 / 100) - 1;
+    TCCR1A = 0;
+    TCCR1B = (1 << WGM12) | (1 << CS12) | (1 << CS10); // CTC, clk/1024
+    TIMSK1 = (1 << OCIE1A);
+}
+
+
+/**
+ * Open a session, or close it.
+ *
+ * @param open true after a successful PIN verification, false otherwise.
+ */
+void session_set(bool open){
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+        session_ticks = open ? SESSION_LIFETIME : 0;
+    }
+}
+
+
+/**
+ * @return true if a session is open and has not expired.
+ */
+bool session_valid(){
+    uint16_t ticks;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+        ticks = session_ticks;
+    }
+    return ticks != 0;
+}
 
 
 /**
@@ -81,67 +122,315 @@ uint8_t verify_pin(){
 }
 
 
+/**
+ * Send the number of blocks the peer can send ahead (credits). Each returned
+ * block gives back one credit.
+ *
+ * @return Number of credits granted.
+ */
+uint8_t grant_credits(){
+    uint16_t free_blocks = uart_rx_free() / SEC_CREDIT_SIZE;
+    uint8_t credits = free_blocks > SEC_MAX_CREDITS ?
+        SEC_MAX_CREDITS : free_blocks;
+    uart_write_u8(credits);
+    return credits;
+}
+
+
+/**
+ * Encrypt or decrypt blocks received from the UART, and send back the results.
+ * While a block is processed, the next ones are being received in the UART
+ * ring buffer and the previous results are being sent from the transmit
+ * buffer, so AES runs back to back as long as the peer keeps sending.
+ *
+ * @param key_id Key number. Must not be locked.
+ * @param enc true to encrypt, false to decrypt.
+ * @param block_count Number of blocks to be processed.
+ * @param iv CBC IV. Updated to chain with the next blocks.
+ */
+void crypt_blocks(uint8_t key_id, bool enc, uint16_t block_count,
+    uint8_t* iv){
+    AES_ctx ctx;
+    AES_init_ctx_rk_iv(&ctx, aes_round_keys[key_id], aes_key_lengths[key_id],
+        iv);
+    for (uint16_t i = 0; i < block_count; ++i){
+        uint8_t buf[16];
+        uart_read_buf(buf, 16);
+        if (enc)
+            AES_CBC_encrypt_buffer(&ctx, buf, 16);
+        else
+            AES_CBC_decrypt_buffer(&ctx, buf, 16);
+        uart_write_buf(buf, 16);
+    }
+    for (uint8_t i = 0; i < 16; ++i)
+        iv[i] = ctx.Iv[i];
+}
+
+
+/**
+ * Encrypt or decrypt blocks received from the UART in CTR mode, with the
+ * keystream precomputed for the key slot. While waiting for data, the pool of
+ * the slot is refilled.
+ *
+ * @param key_id Key number. A nonce must have been set.
+ * @param block_count Number of blocks to be processed.
+ */
+void ctr_xcrypt_blocks(uint8_t key_id, uint16_t block_count){
+    for (uint16_t i = 0; i < block_count; ++i){
+        while ((uart_rx_avail() < 16) && ctr_fill(key_id)){}
+        uint8_t buf[16];
+        uart_read_buf(buf, 16);
+        uint8_t keystream[16];
+        ctr_keystream(key_id, keystream);
+        for (uint8_t j = 0; j < 16; ++j)
+            buf[j] ^= keystream[j];
+        uart_write_buf(buf, 16);
+    }
+}
+
+
+/**
+ * Compute the AES-CMAC of a message received from the UART, and send back
+ * only the 16-byte tag.
+ *
+ * Since no block is returned, credits are given back explicitly: after each
+ * group of half the initial credits consumed (except at the end of the
+ * message), a byte with the number of blocks granted is sent.
+ *
+ * @param key_id Key number. Must not be locked.
+ * @param len Message length in bytes.
+ */
+void cmac_blocks(uint8_t key_id, uint16_t len){
+    uint8_t group = (grant_credits() + 1) / 2;
+    uint16_t block_count = (len + 15) / 16;
+    cmac_ctx_t ctx;
+    cmac_init(&ctx, aes_round_keys[key_id], aes_key_lengths[key_id]);
+    uint8_t buf[16];
+    uint8_t last_len = 0;
+    for (uint16_t i = 0; i < block_count; ++i){
+        if (i + 1 < block_count){
+            uart_read_buf(buf, 16);
+            cmac_update(&ctx, buf);
+            if ((i + 1) % group == 0)
+                uart_write_u8(group);
+        } else {
+            last_len = len - 16 * i;
+            uart_read_buf(buf, last_len);
+        }
+    }
+    uint8_t tag[16];
+    cmac_final(&ctx, buf, last_len, tag);
+    uart_write_buf(tag, 16);
+}
+
+
 int main()
 {
     DDRA = 1;
     PORTA = 0;
 
     uart_init(625000);
+    session_timer_init();
     sei();
 
     for (;;)
     {
         PORTA &= ~1; // Turn LED ON
+        // Precompute CTR keystream until an instruction arrives
+        while (uart_rx_avail() == 0)
+            ctr_fill_idle();
         uint8_t ins = uart_read_u8();
         PORTA |= 1; // Turn LED OFF
         switch (ins) {
-            case INS_VERIFY_PIN: {
+            case SEC_INS_VERIFY_PIN: {
                 // Verify pin
                 uint8_t good = verify_pin();
+                // Successful verification opens a session for the
+                // SESSION instructions, a failed one closes it.
+                session_set(good == 1);
                 if (good == 1){
-                    uart_write_u8(STATUS_OK);
+                    uart_write_u8(SEC_STATUS_OK);
                 } else {
-                    uart_write_u8(STATUS_BAD_PIN);
+                    uart_write_u8(SEC_STATUS_BAD_PIN);
                 }
                 break;
             }
 
-            case INS_ENCRYPT:
-            case INS_DECRYPT: {
+            case SEC_INS_ENCRYPT:
+            case SEC_INS_DECRYPT:
+            case SEC_INS_ENCRYPT_STREAM:
+            case SEC_INS_DECRYPT_STREAM: {
                 // Verify pin
                 uint8_t good = verify_pin();
                 if (good){
-                    uart_write_u8(STATUS_OK);
+                    uart_write_u8(SEC_STATUS_OK);
                     // Get key number.
                     // Protect with modulo (quick and dirty)
                     uint8_t key_id = uart_read_u8() % 8;
                     // Verify key is enabled
                     if (!aes_key_locked[key_id]){
-                        uart_write_u8(STATUS_OK); // Send ack
-                        AES_ctx ctx;
-                        AES_init_ctx_iv(&ctx, aes_keys[key_id], aes_iv_zero);
-                        // Get the number of blocks to be encrypted
-                        uint8_t block_count = uart_read_u8();
+                        uart_write_u8(SEC_STATUS_OK); // Send ack
+                        // Get the number of blocks to be encrypted. Stream
+                        // instructions have a 16-bit little-endian count.
+                        uint16_t block_count = uart_read_u8();
+                        if ((ins == SEC_INS_ENCRYPT_STREAM) ||
+                            (ins == SEC_INS_DECRYPT_STREAM))
+                            block_count |= (uint16_t)uart_read_u8() << 8;
+                        // Stream instructions use flow control
+                        if ((ins == SEC_INS_ENCRYPT_STREAM) ||
+                            (ins == SEC_INS_DECRYPT_STREAM))
+                            grant_credits();
                         // Encrypt and return on the fly
-                        for (uint8_t i = 0; i < block_count; ++i){
-                            uint8_t buf[16];
-                            uart_read_buf(buf, 16);
-                            if (ins == INS_ENCRYPT)
-                                AES_CBC_encrypt_buffer(&ctx, buf, 16);
-                            else
-                                AES_CBC_decrypt_buffer(&ctx, buf, 16);
-                            uart_write_buf(buf, 16);
-                        }
+                        uint8_t iv[16] = {0};
+                        crypt_blocks(key_id, (ins == SEC_INS_ENCRYPT) ||
+                            (ins == SEC_INS_ENCRYPT_STREAM), block_count, iv);
                     } else {
                         // Send error byte to indicate key is locked
-                        uart_write_u8(STATUS_KEY_LOCKED);
+                        uart_write_u8(SEC_STATUS_KEY_LOCKED);
                     }
                 } else {
-                    uart_write_u8(STATUS_BAD_PIN);
+                    uart_write_u8(SEC_STATUS_BAD_PIN);
                 }
                 break;
             }
 
+            case SEC_INS_SESSION_ENCRYPT:
+            case SEC_INS_SESSION_DECRYPT: {
+                // Single frame: key number and 16-bit little-endian block
+                // count. The PIN has been verified when opening the session.
+                uint8_t key_id = uart_read_u8() % 8;
+                uint16_t block_count = uart_read_u8();
+                block_count |= (uint16_t)uart_read_u8() << 8;
+                if (!session_valid()){
+                    uart_write_u8(SEC_STATUS_NO_SESSION);
+                } else if (aes_key_locked[key_id]){
+                    uart_write_u8(SEC_STATUS_KEY_LOCKED);
+                } else {
+                    uart_write_u8(SEC_STATUS_OK);
+                    grant_credits();
+                    uint8_t iv[16] = {0};
+                    crypt_blocks(key_id, ins == SEC_INS_SESSION_ENCRYPT,
+                        block_count, iv);
+                }
+                break;
+            }
+
+            case SEC_INS_CTR_NONCE: {
+                // Key number and initial counter block. Requires a session.
+                uint8_t key_id = uart_read_u8() % 8;
+                uint8_t nonce[16];
+                uart_read_buf(nonce, 16);
+                if (!session_valid()){
+                    uart_write_u8(SEC_STATUS_NO_SESSION);
+                } else if (aes_key_locked[key_id]){
+                    uart_write_u8(SEC_STATUS_KEY_LOCKED);
+                } else {
+                    ctr_set_nonce(key_id, aes_round_keys[key_id],
+                        aes_key_lengths[key_id], nonce);
+                    uart_write_u8(SEC_STATUS_OK);
+                }
+                break;
+            }
+
+            case SEC_INS_CTR_XCRYPT: {
+                // Same frame as the session instructions. The counter
+                // continues from the previous call for this key.
+                uint8_t key_id = uart_read_u8() % 8;
+                uint16_t block_count = uart_read_u8();
+                block_count |= (uint16_t)uart_read_u8() << 8;
+                if (!session_valid()){
+                    uart_write_u8(SEC_STATUS_NO_SESSION);
+                } else if (!ctr_active(key_id)){
+                    uart_write_u8(SEC_STATUS_NO_NONCE);
+                } else {
+                    uart_write_u8(SEC_STATUS_OK);
+                    grant_credits();
+                    ctr_xcrypt_blocks(key_id, block_count);
+                }
+                break;
+            }
+
+            case SEC_INS_CBC_INIT: {
+                // Context number, key number and IV. Requires a session.
+                uint8_t ctx_id = uart_read_u8() % CBC_CONTEXT_COUNT;
+                uint8_t key_id = uart_read_u8() % 8;
+                uint8_t iv[16];
+                uart_read_buf(iv, 16);
+                if (!session_valid()){
+                    uart_write_u8(SEC_STATUS_NO_SESSION);
+                } else if (aes_key_locked[key_id]){
+                    uart_write_u8(SEC_STATUS_KEY_LOCKED);
+                } else {
+                    cbc_context_t* c = &cbc_contexts[ctx_id];
+                    c->active = true;
+                    c->key_id = key_id;
+                    for (uint8_t i = 0; i < 16; ++i)
+                        c->iv[i] = iv[i];
+                    uart_write_u8(SEC_STATUS_OK);
+                }
+                break;
+            }
+
+            case SEC_INS_CBC_ENCRYPT:
+            case SEC_INS_CBC_DECRYPT: {
+                // Same frame as the session instructions, with a context
+                // number instead of a key number. Chains with the previous
+                // blocks processed in this context.
+                uint8_t ctx_id = uart_read_u8() % CBC_CONTEXT_COUNT;
+                uint16_t block_count = uart_read_u8();
+                block_count |= (uint16_t)uart_read_u8() << 8;
+                cbc_context_t* c = &cbc_contexts[ctx_id];
+                if (!session_valid()){
+                    uart_write_u8(SEC_STATUS_NO_SESSION);
+                } else if (!c->active){
+                    uart_write_u8(SEC_STATUS_NO_CONTEXT);
+                } else {
+                    uart_write_u8(SEC_STATUS_OK);
+                    grant_credits();
+                    crypt_blocks(c->key_id, ins == SEC_INS_CBC_ENCRYPT,
+                        block_count, c->iv);
+                }
+                break;
+            }
+
+            case SEC_INS_CMAC: {
+                // Key number and 16-bit little-endian message length in
+                // bytes. Requires a session.
+                uint8_t key_id = uart_read_u8() % 8;
+                uint16_t len = uart_read_u8();
+                len |= (uint16_t)uart_read_u8() << 8;
+                if (!session_valid()){
+                    uart_write_u8(SEC_STATUS_NO_SESSION);
+                } else if (aes_key_locked[key_id]){
+                    uart_write_u8(SEC_STATUS_KEY_LOCKED);
+                } else {
+                    uart_write_u8(SEC_STATUS_OK);
+                    cmac_blocks(key_id, len);
+                }
+                break;
+            }
+
+            case SEC_INS_KEY_INFO: {
+                // Type of each key slot: key length in bytes, with bit 7 set
+                // if the key is locked. Does not require a session.
+                uart_write_u8(SEC_STATUS_OK);
+                for (uint8_t i = 0; i < 8; ++i)
+                    uart_write_u8(aes_key_lengths[i] |
+                        (aes_key_locked[i] ? SEC_KEY_LOCKED : 0));
+                break;
+            }
+
+            case SEC_INS_STATS: {
+                // Number of bytes dropped by the reception ring buffer,
+                // then CTR keystream pool statistics.
+                uart_write_u8(SEC_STATUS_OK);
+                uart_write_u32(uart_rx_drop_count());
+                uart_write_u32(ctr_stats.fills);
+                uart_write_u32(ctr_stats.hits);
+                uart_write_u32(ctr_stats.misses);
+                break;
+            }
+
             default:;
         }
     }
@@ -19,12 +19,42 @@
 
 #include "uart.hxx"
 #include <avr/interrupt.h>
-
-
-#define UART_RING_BUFFER_SIZE 64
-uint8_t uart_ring_buffer[UART_RING_BUFFER_SIZE];
-volatile uint8_t uart_ring_write;
-volatile uint8_t uart_ring_read;
+#include <util/atomic.h>
+
+
+/* Size of the reception ring buffer. Can be set from CMake. Must be a power of
+ * two. The peer is granted credits from the free space of this buffer. */
+#ifndef UART_RX_BUFFER_SIZE
+#define UART_RX_BUFFER_SIZE 256
+#endif
+#if UART_RX_BUFFER_SIZE & (UART_RX_BUFFER_SIZE - 1)
+#error UART_RX_BUFFER_SIZE must be a power of two
+#endif
+#if UART_RX_BUFFER_SIZE < 32
+#error UART_RX_BUFFER_SIZE must hold at least one AES block
+#endif
+
+#if UART_RX_BUFFER_SIZE > 256
+typedef uint16_t uart_index_t;
+/* 16-bit indexes shared with the interrupt must be accessed atomically */
+#define UART_INDEX_ATOMIC ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+#else
+typedef uint8_t uart_index_t;
+#define UART_INDEX_ATOMIC
+#endif
+
+uint8_t uart_ring_buffer[UART_RX_BUFFER_SIZE];
+volatile uart_index_t uart_ring_write;
+volatile uart_index_t uart_ring_read;
+/* Number of received bytes dropped because the ring buffer was full */
+volatile uint16_t uart_rx_drops;
+
+/* Bytes waiting to be transmitted. Emptied by the UDRE interrupt, so callers
+ * can compute while previous output is being sent. */
+#define UART_TX_BUFFER_SIZE 64
+uint8_t uart_tx_buffer[UART_TX_BUFFER_SIZE];
+volatile uint8_t uart_tx_write;
+volatile uint8_t uart_tx_read;
 
 
 void uart_ring_buffer_put(uint8_t);
@@ -41,31 +71,93 @@ ISR(USART0_RX_vect)
 }
 
 
+/**
+ * Interrupt for USART data register empty. Send the next byte of the transmit
+ * buffer, or disable the interrupt when there is nothing left to send.
+ */
+ISR(USART0_UDRE_vect)
+{
+    if (uart_tx_read == uart_tx_write){
+        UCSR0B &= ~(1 << UDRIE0);
+        return;
+    }
+    UCSR0A |= (1 << TXC0);
+    UDR0 = uart_tx_buffer[uart_tx_read];
+    uart_tx_read = (uart_tx_read + 1) % UART_TX_BUFFER_SIZE;
+}
+
+
 void uart_ring_buffer_put(uint8_t data)
 {
-    uint8_t write_next = (uart_ring_write + 1) % UART_RING_BUFFER_SIZE;
-    if (write_next == uart_ring_read)
+    uart_index_t write_next = (uart_ring_write + 1) % UART_RX_BUFFER_SIZE;
+    if (write_next == uart_ring_read){
         /* Buffer is full. Drop byte. */
+        ++uart_rx_drops;
         return;
+    }
     uart_ring_buffer[uart_ring_write] = data;
     uart_ring_write = write_next;
 }
 
 
+/**
+ * @return Number of received bytes waiting in the ring buffer.
+ */
+uint16_t uart_rx_avail()
+{
+    uart_index_t write;
+    UART_INDEX_ATOMIC {
+        write = uart_ring_write;
+    }
+    return (uart_index_t)(write - uart_ring_read) % UART_RX_BUFFER_SIZE;
+}
+
+
 uint8_t uart_ring_buffer_pop()
 {
-    while (uart_ring_read == uart_ring_write){};
+    while (uart_rx_avail() == 0){};
     uint8_t value = uart_ring_buffer[uart_ring_read];
-    uart_ring_read = (uart_ring_read + 1) % UART_RING_BUFFER_SIZE;
+    uart_index_t read_next = (uart_ring_read + 1) % UART_RX_BUFFER_SIZE;
+    UART_INDEX_ATOMIC {
+        uart_ring_read = read_next;
+    }
     return value;
 }
 
 
+/**
+ * @return Number of bytes which can still be received without loss. This is
+ *     what the peer may send ahead.
+ */
+uint16_t uart_rx_free()
+{
+    return UART_RX_BUFFER_SIZE - 1 - uart_rx_avail();
+}
+
+
+/**
+ * @return Number of received bytes dropped since initialization.
+ */
+uint16_t uart_rx_drop_count()
+{
+    uint16_t drops;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+        drops = uart_rx_drops;
+    }
+    return drops;
+}
+
+
+/**
+ * Queue a byte for transmission. Only waits if the transmit buffer is full.
+ */
 void uart_write_u8(uint8_t data)
 {
-    while ((UCSR0A & (1 << UDRE0)) == 0){};
-    UCSR0A |= (1 << TXC0);
-    UDR0 = data;
+    uint8_t write_next = (uart_tx_write + 1) % UART_TX_BUFFER_SIZE;
+    while (write_next == uart_tx_read){};
+    uart_tx_buffer[uart_tx_write] = data;
+    uart_tx_write = write_next;
+    UCSR0B |= (1 << UDRIE0);
 }
 
 
@@ -98,9 +190,12 @@ void uart_init(uint32_t baudrate)
      * Enable interrupts on byte reception. */
     UCSR0A = (1 << U2X0);
     UCSR0B = (1 << RXCIE0) | (1 << RXEN0) | (1 << TXEN0);
-    /* Initialize ring buffer */
+    /* Initialize ring buffers */
     uart_ring_write = 0;
     uart_ring_read = 0;
+    uart_rx_drops = 0;
+    uart_tx_write = 0;
+    uart_tx_read = 0;
 }
 
 
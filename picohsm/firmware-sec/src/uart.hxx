@@ -29,6 +29,9 @@ uint8_t uart_ring_buffer_pop();
 void uart_write_u8(uint8_t);
 void uart_write_u32(uint32_t);
 uint8_t uart_read_u8();
+uint16_t uart_rx_avail();
+uint16_t uart_rx_free();
+uint16_t uart_rx_drop_count();
 void uart_init(uint32_t);
 void uart_write_buf(uint8_t*, uint8_t);
 void uart_write_str(char*);
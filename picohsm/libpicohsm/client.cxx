@@ -0,0 +1,856 @@
+/**
+ * This file is part of picoHSM
+ * 
+ * picoHSM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Ledger SAS, written by Olivier Hériveaux
+ */
+
+#include "picohsm.hxx"
+#include "connection.hxx"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include <mutex>
+#include <system_error>
+#include <thread>
+
+
+namespace picohsm {
+
+
+typedef std::vector<command_t> commands_t;
+
+
+/** Completion of a request, shared by its commands. */
+struct request_t {
+    result_t result;
+    /** Number of commands not answered yet. */
+    size_t remaining;
+    callback_t callback;
+    std::atomic<size_t>* outstanding;
+};
+
+typedef std::shared_ptr<request_t> request_ptr_t;
+
+/**
+ * Check the response of a command and add it to the result.
+ *
+ * @return false if the response is an error message.
+ */
+typedef std::function<bool(std::vector<std::string>&, result_t&)> parser_t;
+
+/**
+ * Build the commands of a request.
+ *
+ * @return Error message if the request is invalid, empty string otherwise.
+ */
+typedef std::function<std::string(const request_ptr_t&, commands_t&)>
+    builder_t;
+
+
+struct client_t::impl_t {
+    options_t options;
+    std::vector<std::unique_ptr<connection_t>> conns;
+    std::thread thread;
+    /** Protects tasks and stopping. */
+    std::mutex mutex;
+    /** Functions to be called by the thread. */
+    std::vector<std::function<void()>> tasks;
+    bool stopping;
+    /** Pipe waking the thread up when a task is posted. */
+    int wake[2];
+    /** Number of requests not completed. */
+    std::atomic<size_t> outstanding;
+    /** Where the search of the least loaded connection starts. */
+    size_t next;
+
+    impl_t(const std::vector<endpoint_t>&, const options_t&);
+    ~impl_t();
+    void post(std::function<void()>);
+    void run();
+    size_t pick() const;
+    void request(const std::shared_ptr<session_t>&, const builder_t&,
+        callback_t);
+    void dispatch(const std::shared_ptr<session_t>&, commands_t&);
+};
+
+
+/**
+ * Add a command to a request.
+ *
+ * @param req Request.
+ * @param commands Commands of the request.
+ * @param line Command line.
+ * @param parse Response handler.
+ */
+static void add_command(const request_ptr_t& req, commands_t& commands,
+    const std::string& line, parser_t parse){
+
+    command_t c;
+    c.line = line;
+    c.multi_line = command_framing(line) == framing_t::multi_line;
+    c.done = [req, parse](status_t status, const char* error,
+        std::vector<std::string>& lines){
+
+        result_t& r = req->result;
+        if (status != status_t::ok){
+            if ((r.status != status_t::io_error) &&
+                (r.status != status_t::session_lost)){
+                r.status = status;
+                r.message = error;
+            }
+        } else if ((r.status == status_t::ok) && !parse(lines, r)){
+            r.status = status_t::error;
+            r.message = lines.empty() ? "Empty response." : lines[0];
+        }
+        if (--req->remaining == 0){
+            --*req->outstanding;
+            req->callback(std::move(r));
+        }
+    };
+    commands.push_back(std::move(c));
+}
+
+
+/**
+ * @return Parser expecting a response of exactly one line.
+ * @param expected Expected line.
+ */
+static parser_t expect_line(const char* expected){
+    return [expected](std::vector<std::string>& lines, result_t&){
+        return (lines.size() == 1) && (lines[0] == expected);
+    };
+}
+
+
+/**
+ * @return Parser expecting hexadecimal data, appended to the result.
+ * @param len Expected number of bytes.
+ */
+static parser_t expect_data(size_t len){
+    return [len](std::vector<std::string>& lines, result_t& r){
+        return (lines.size() == 1) && (lines[0].size() == 2 * len) &&
+            from_hex(lines[0], &r.data);
+    };
+}
+
+
+/**
+ * Verify the arguments common to most requests.
+ *
+ * @param pin PIN.
+ * @param id Key id or CBC context.
+ * @param id_count Number of valid ids.
+ * @return Error message, empty if arguments are valid.
+ */
+static std::string check_pin_id(const std::string& pin, uint8_t id,
+    uint8_t id_count){
+
+    if (!valid_pin(pin))
+        return "PIN must have 8 characters.";
+    if (id >= id_count)
+        return "Key or context must be in [0, " +
+            std::to_string(id_count - 1) + "].";
+    return "";
+}
+
+
+/**
+ * Build a request sending data by chunks, one command per chunk.
+ *
+ * @param name Command name.
+ * @param pin PIN.
+ * @param id Key id or CBC context.
+ * @param id_count Number of valid ids.
+ * @param data Data. Size must be a multiple of the block size.
+ * @param chunk_blocks Number of blocks per command.
+ * @param req Request.
+ * @param commands Where commands are added.
+ * @return Error message, empty if the request is valid.
+ */
+static std::string build_blocks(const char* name, const std::string& pin,
+    uint8_t id, uint8_t id_count, const bytes_t& data, size_t chunk_blocks,
+    const request_ptr_t& req, commands_t& commands){
+
+    std::string err = check_pin_id(pin, id, id_count);
+    if (!err.empty())
+        return err;
+    if (data.size() % block_size)
+        return "Data size must be a multiple of 16.";
+    req->result.data.reserve(data.size());
+    std::string prefix = std::string(name) + " " + pin + " " +
+        std::to_string(id) + " ";
+    const size_t chunk = chunk_blocks * block_size;
+    for (size_t i = 0; i < data.size(); i += chunk){
+        size_t n = std::min(chunk, data.size() - i);
+        add_command(req, commands, prefix + to_hex(data.data() + i, n),
+            expect_data(n));
+    }
+    return "";
+}
+
+
+/**
+ * Build an encrypt or decrypt request. These commands are CBC with a zero IV.
+ * Up to chunk_blocks blocks, this is one command. Above, the data is
+ * processed with the CBC context reserved by the library, initialized with a
+ * zero IV, which gives the result of a single command.
+ *
+ * @param encrypt true for encryption, false for decryption.
+ * @param pin PIN.
+ * @param key Key id.
+ * @param data Data. Size must be a multiple of the block size.
+ * @param chunk_blocks Number of blocks per command.
+ * @param req Request.
+ * @param commands Where commands are added.
+ * @return Error message, empty if the request is valid.
+ */
+static std::string build_crypt(bool encrypt, const std::string& pin,
+    uint8_t key, const bytes_t& data, size_t chunk_blocks,
+    const request_ptr_t& req, commands_t& commands){
+
+    if (data.size() <= chunk_blocks * block_size)
+        return build_blocks(encrypt ? "encrypt" : "decrypt", pin, key,
+            key_count, data, chunk_blocks, req, commands);
+    std::string err = check_pin_id(pin, key, key_count);
+    if (!err.empty())
+        return err;
+    const uint8_t context = context_count - 1;
+    add_command(req, commands, "cbcinit " + pin + " " +
+        std::to_string(context) + " " + std::to_string(key) + " " +
+        std::string(2 * block_size, '0'), expect_line(context_set_response));
+    return build_blocks(encrypt ? "cbcenc" : "cbcdec", pin, context,
+        context_count, data, chunk_blocks, req, commands);
+}
+
+
+/**
+ * Build a text command request. The response lines are returned as they are.
+ *
+ * @param line Command line.
+ * @param req Request.
+ * @param commands Where commands are added.
+ * @return Error message, empty if the request is valid.
+ */
+static std::string build_command(const std::string& line,
+    const request_ptr_t& req, commands_t& commands){
+
+    if (command_framing(line) == framing_t::unknown)
+        return "Unknown command.";
+    if ((line.size() > max_line_length) ||
+        (line.find_first_of("\r\n") != std::string::npos))
+        return "Invalid command line.";
+    add_command(req, commands, line,
+        [](std::vector<std::string>& lines, result_t& r){
+            r.lines = std::move(lines);
+            return true;
+        });
+    return "";
+}
+
+
+/**
+ * Build a mac request.
+ *
+ * @param pin PIN.
+ * @param key Key id.
+ * @param data Message, up to max_mac_bytes bytes.
+ * @param req Request.
+ * @param commands Where commands are added.
+ * @return Error message, empty if the request is valid.
+ */
+static std::string build_mac(const std::string& pin, uint8_t key,
+    const bytes_t& data, const request_ptr_t& req, commands_t& commands){
+
+    std::string err = check_pin_id(pin, key, key_count);
+    if (!err.empty())
+        return err;
+    if (data.size() > max_mac_bytes)
+        return "Data too long.";
+    add_command(req, commands, "mac " + pin + " " + std::to_string(key) +
+        " " + to_hex(data.data(), data.size()), expect_data(block_size));
+    return "";
+}
+
+
+/**
+ * Build a command taking a 16 bytes parameter: nonce or cbcinit.
+ *
+ * @param line Command line, without the parameter.
+ * @param param Parameter.
+ * @param expected Response when successful.
+ * @param req Request.
+ * @param commands Where commands are added.
+ * @return Error message, empty if the request is valid.
+ */
+static std::string build_block_param(const std::string& line,
+    const bytes_t& param, const char* expected, const request_ptr_t& req,
+    commands_t& commands){
+
+    if (param.size() != block_size)
+        return "Parameter must have 16 bytes.";
+    add_command(req, commands, line + " " + to_hex(param.data(), block_size),
+        expect_line(expected));
+    return "";
+}
+
+
+/**
+ * @return A future set by the callback given to a function.
+ * @param f Function starting a request, given its callback.
+ */
+template <typename F> static std::future<result_t> to_future(F f){
+    std::shared_ptr<std::promise<result_t>> p =
+        std::make_shared<std::promise<result_t>>();
+    f([p](result_t r){ p->set_value(std::move(r)); });
+    return p->get_future();
+}
+
+
+/**
+ * Constructor. Starts the thread, which opens the connections.
+ *
+ * @param endpoints Boards, or proxies.
+ * @param options Options.
+ */
+client_t::impl_t::impl_t(const std::vector<endpoint_t>& endpoints,
+    const options_t& options):
+    options(options),
+    stopping(false),
+    outstanding(0),
+    next(0){
+
+    for (const endpoint_t& e: endpoints){
+        for (unsigned i = 0; i < options.connections_per_endpoint; ++i)
+            conns.emplace_back(new connection_t(e, this->options));
+    }
+    if (pipe2(wake, O_NONBLOCK | O_CLOEXEC))
+        throw std::system_error(errno, std::generic_category(), "pipe2");
+    thread = std::thread(&impl_t::run, this);
+}
+
+
+/**
+ * Destructor. Fails the requests not completed yet.
+ */
+client_t::impl_t::~impl_t(){
+    post([this](){ stopping = true; });
+    thread.join();
+    ::close(wake[0]);
+    ::close(wake[1]);
+}
+
+
+/**
+ * Call a function from the thread of the client.
+ *
+ * @param f Function.
+ */
+void client_t::impl_t::post(std::function<void()> f){
+    std::lock_guard<std::mutex> lock(mutex);
+    tasks.push_back(std::move(f));
+    char c = 0;
+    if (write(wake[1], &c, 1)){}
+}
+
+
+/**
+ * Thread of the client: runs the posted tasks and the connections.
+ */
+void client_t::impl_t::run(){
+    std::vector<pollfd> fds;
+    std::vector<size_t> fd_conns;
+    for (;;){
+        std::vector<std::function<void()>> todo;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            todo.swap(tasks);
+        }
+        for (std::function<void()>& f: todo)
+            f();
+        if (stopping)
+            break;
+
+        uint64_t now = now_ms();
+        uint64_t deadline = std::numeric_limits<uint64_t>::max();
+        fds.assign(1, pollfd{wake[0], POLLIN, 0});
+        fd_conns.clear();
+        for (size_t i = 0; i < conns.size(); ++i){
+            conns[i]->process(0, now);
+            deadline = std::min(deadline, conns[i]->deadline());
+            short events;
+            int fd = conns[i]->poll_fd(&events);
+            if (fd != -1){
+                fds.push_back(pollfd{fd, events, 0});
+                fd_conns.push_back(i);
+            }
+        }
+        int timeout = (deadline <= now) ? 0 :
+            (int)std::min<uint64_t>(deadline - now, 1000);
+        poll(fds.data(), fds.size(), timeout);
+
+        if (fds[0].revents){
+            char buf[64];
+            while (read(wake[0], buf, sizeof(buf)) > 0){}
+        }
+        now = now_ms();
+        for (size_t i = 1; i < fds.size(); ++i){
+            if (fds[i].revents)
+                conns[fd_conns[i - 1]]->process(fds[i].revents, now);
+        }
+    }
+    for (std::unique_ptr<connection_t>& c: conns)
+        c->close("Client destroyed.");
+}
+
+
+/**
+ * @return Index of the connection with the least outstanding commands,
+ *     preferring the connections ready to send.
+ */
+size_t client_t::impl_t::pick() const {
+    size_t best = 0;
+    size_t best_load = std::numeric_limits<size_t>::max();
+    for (size_t j = 0; j < conns.size(); ++j){
+        size_t i = (next + j) % conns.size();
+        size_t load = conns[i]->outstanding();
+        if (!conns[i]->ready())
+            load += std::numeric_limits<size_t>::max() / 2;
+        if (load < best_load){
+            best = i;
+            best_load = load;
+        }
+    }
+    return best;
+}
+
+
+/**
+ * Build a request and send its commands.
+ *
+ * @param session Session of the request, null for any connection.
+ * @param build Function building the commands.
+ * @param callback Completion callback, always called from the thread of the
+ *     client.
+ */
+void client_t::impl_t::request(const std::shared_ptr<session_t>& session,
+    const builder_t& build, callback_t callback){
+
+    request_ptr_t req = std::make_shared<request_t>();
+    req->callback = std::move(callback);
+    req->outstanding = &outstanding;
+    std::shared_ptr<commands_t> commands = std::make_shared<commands_t>();
+    std::string err = build(req, *commands);
+    if (!err.empty() || commands->empty()){
+        if (!err.empty()){
+            req->result.status = status_t::error;
+            req->result.message = err;
+        }
+        post([req](){ req->callback(std::move(req->result)); });
+        return;
+    }
+    req->remaining = commands->size();
+    ++outstanding;
+    post([this, session, commands](){ dispatch(session, *commands); });
+}
+
+
+/**
+ * Submit the commands of a request to a connection. Called from the thread
+ * of the client.
+ *
+ * @param session Session of the request, null for any connection.
+ * @param commands Commands.
+ */
+void client_t::impl_t::dispatch(const std::shared_ptr<session_t>& session,
+    commands_t& commands){
+
+    if (!session){
+        size_t i = pick();
+        next = (i + 1) % conns.size();
+        conns[i]->submit(commands);
+        return;
+    }
+    connection_t& conn = *conns[session->conn];
+    if (!session->generation)
+        session->generation = conn.generation();
+    if (session->generation != conn.generation()){
+        std::vector<std::string> none;
+        for (command_t& c: commands)
+            c.done(status_t::session_lost, "Session lost.", none);
+        return;
+    }
+    for (command_t& c: commands)
+        c.generation = session->generation;
+    conn.submit(commands);
+}
+
+
+/**
+ * Constructor. Connections are opened in the background.
+ *
+ * @param endpoints Boards, or proxies. Must not be empty.
+ * @param options Options.
+ */
+client_t::client_t(const std::vector<endpoint_t>& endpoints,
+    const options_t& options):
+    impl(new impl_t(endpoints, options)){}
+
+
+/**
+ * Destructor. Requests not completed yet fail with io_error.
+ */
+client_t::~client_t(){}
+
+
+/**
+ * Send a text command: help, info, stats, keys, getflag or pin.
+ *
+ * @param line Command line.
+ * @param callback Called with the response lines.
+ */
+void client_t::command(const std::string& line, callback_t callback){
+    impl->request(nullptr, [line](const request_ptr_t& req, commands_t& c){
+        return build_command(line, req, c);
+    }, std::move(callback));
+}
+
+
+/**
+ * Encrypt data with AES-CBC and a zero IV. Data of any length is accepted
+ * and split in several commands.
+ *
+ * @param pin PIN.
+ * @param key Key id.
+ * @param data Data. Size must be a multiple of 16.
+ * @param callback Called with the encrypted data.
+ */
+void client_t::encrypt(const std::string& pin, uint8_t key,
+    const bytes_t& data, callback_t callback){
+
+    size_t chunk = impl->options.command_blocks;
+    impl->request(nullptr, [&](const request_ptr_t& req, commands_t& c){
+        return build_crypt(true, pin, key, data, chunk, req, c);
+    }, std::move(callback));
+}
+
+
+/**
+ * Decrypt data with AES-CBC and a zero IV. Data of any length is accepted
+ * and split in several commands.
+ *
+ * @param pin PIN.
+ * @param key Key id.
+ * @param data Data. Size must be a multiple of 16.
+ * @param callback Called with the decrypted data.
+ */
+void client_t::decrypt(const std::string& pin, uint8_t key,
+    const bytes_t& data, callback_t callback){
+
+    size_t chunk = impl->options.command_blocks;
+    impl->request(nullptr, [&](const request_ptr_t& req, commands_t& c){
+        return build_crypt(false, pin, key, data, chunk, req, c);
+    }, std::move(callback));
+}
+
+
+/**
+ * Compute the AES-CMAC of a message.
+ *
+ * @param pin PIN.
+ * @param key Key id.
+ * @param data Message, up to max_mac_bytes bytes.
+ * @param callback Called with the tag.
+ */
+void client_t::mac(const std::string& pin, uint8_t key, const bytes_t& data,
+    callback_t callback){
+
+    impl->request(nullptr, [&](const request_ptr_t& req, commands_t& c){
+        return build_mac(pin, key, data, req, c);
+    }, std::move(callback));
+}
+
+
+std::future<result_t> client_t::command(const std::string& line){
+    return to_future([&](callback_t cb){ command(line, cb); });
+}
+
+
+std::future<result_t> client_t::encrypt(const std::string& pin, uint8_t key,
+    const bytes_t& data){
+
+    return to_future([&](callback_t cb){ encrypt(pin, key, data, cb); });
+}
+
+
+std::future<result_t> client_t::decrypt(const std::string& pin, uint8_t key,
+    const bytes_t& data){
+
+    return to_future([&](callback_t cb){ decrypt(pin, key, data, cb); });
+}
+
+
+std::future<result_t> client_t::mac(const std::string& pin, uint8_t key,
+    const bytes_t& data){
+
+    return to_future([&](callback_t cb){ mac(pin, key, data, cb); });
+}
+
+
+/**
+ * @return A new session, on the connection with the least outstanding
+ *     commands. Must not be called from a callback.
+ */
+std::shared_ptr<session_t> client_t::session(){
+    std::promise<size_t> conn;
+    impl->post([&](){ conn.set_value(impl->pick()); });
+    return std::shared_ptr<session_t>(
+        new session_t(impl.get(), conn.get_future().get()));
+}
+
+
+/**
+ * @return Number of requests not completed.
+ */
+size_t client_t::outstanding() const {
+    return impl->outstanding;
+}
+
+
+session_t::session_t(client_t::impl_t* client, size_t conn):
+    client(client),
+    conn(conn),
+    generation(0){}
+
+
+void session_t::command(const std::string& line, callback_t callback){
+    client->request(shared_from_this(),
+        [&](const request_ptr_t& req, commands_t& c){
+            return build_command(line, req, c);
+        }, std::move(callback));
+}
+
+
+void session_t::encrypt(const std::string& pin, uint8_t key,
+    const bytes_t& data, callback_t callback){
+
+    size_t chunk = client->options.command_blocks;
+    client->request(shared_from_this(),
+        [&](const request_ptr_t& req, commands_t& c){
+            return build_crypt(true, pin, key, data, chunk, req, c);
+        }, std::move(callback));
+}
+
+
+void session_t::decrypt(const std::string& pin, uint8_t key,
+    const bytes_t& data, callback_t callback){
+
+    size_t chunk = client->options.command_blocks;
+    client->request(shared_from_this(),
+        [&](const request_ptr_t& req, commands_t& c){
+            return build_crypt(false, pin, key, data, chunk, req, c);
+        }, std::move(callback));
+}
+
+
+void session_t::mac(const std::string& pin, uint8_t key, const bytes_t& data,
+    callback_t callback){
+
+    client->request(shared_from_this(),
+        [&](const request_ptr_t& req, commands_t& c){
+            return build_mac(pin, key, data, req, c);
+        }, std::move(callback));
+}
+
+
+/**
+ * Set the initial counter block of a key for ctr().
+ *
+ * @param pin PIN.
+ * @param key Key id.
+ * @param nonce Initial counter block, 16 bytes.
+ * @param callback Completion callback.
+ */
+void session_t::nonce(const std::string& pin, uint8_t key,
+    const bytes_t& nonce, callback_t callback){
+
+    client->request(shared_from_this(),
+        [&](const request_ptr_t& req, commands_t& c){
+            std::string err = check_pin_id(pin, key, key_count);
+            return !err.empty() ? err : build_block_param("nonce " + pin +
+                " " + std::to_string(key), nonce, nonce_set_response, req, c);
+        }, std::move(callback));
+}
+
+
+/**
+ * Encrypt or decrypt with AES-CTR. The counter of the key continues from the
+ * previous call, or from the nonce.
+ *
+ * @param pin PIN.
+ * @param key Key id.
+ * @param data Data. Size must be a multiple of 16.
+ * @param callback Called with the processed data.
+ */
+void session_t::ctr(const std::string& pin, uint8_t key, const bytes_t& data,
+    callback_t callback){
+
+    size_t chunk = client->options.command_blocks;
+    client->request(shared_from_this(),
+        [&](const request_ptr_t& req, commands_t& c){
+            return build_blocks("ctr", pin, key, key_count, data, chunk, req,
+                c);
+        }, std::move(callback));
+}
+
+
+/**
+ * Set the key and IV of a CBC context.
+ *
+ * @param pin PIN.
+ * @param context CBC context. The last one is reserved.
+ * @param key Key id.
+ * @param iv IV, 16 bytes.
+ * @param callback Completion callback.
+ */
+void session_t::cbc_init(const std::string& pin, uint8_t context,
+    uint8_t key, const bytes_t& iv, callback_t callback){
+
+    client->request(shared_from_this(),
+        [&](const request_ptr_t& req, commands_t& c){
+            std::string err = check_pin_id(pin, context, context_count - 1);
+            if (err.empty())
+                err = check_pin_id(pin, key, key_count);
+            return !err.empty() ? err : build_block_param("cbcinit " + pin +
+                " " + std::to_string(context) + " " + std::to_string(key), iv,
+                context_set_response, req, c);
+        }, std::move(callback));
+}
+
+
+/**
+ * Encrypt with a CBC context, chaining from its previous call.
+ *
+ * @param pin PIN.
+ * @param context CBC context.
+ * @param data Data. Size must be a multiple of 16.
+ * @param callback Called with the encrypted data.
+ */
+void session_t::cbc_encrypt(const std::string& pin, uint8_t context,
+    const bytes_t& data, callback_t callback){
+
+    size_t chunk = client->options.command_blocks;
+    client->request(shared_from_this(),
+        [&](const request_ptr_t& req, commands_t& c){
+            return build_blocks("cbcenc", pin, context, context_count - 1,
+                data, chunk, req, c);
+        }, std::move(callback));
+}
+
+
+/**
+ * Decrypt with a CBC context, chaining from its previous call.
+ *
+ * @param pin PIN.
+ * @param context CBC context.
+ * @param data Data. Size must be a multiple of 16.
+ * @param callback Called with the decrypted data.
+ */
+void session_t::cbc_decrypt(const std::string& pin, uint8_t context,
+    const bytes_t& data, callback_t callback){
+
+    size_t chunk = client->options.command_blocks;
+    client->request(shared_from_this(),
+        [&](const request_ptr_t& req, commands_t& c){
+            return build_blocks("cbcdec", pin, context, context_count - 1,
+                data, chunk, req, c);
+        }, std::move(callback));
+}
+
+
+std::future<result_t> session_t::command(const std::string& line){
+    return to_future([&](callback_t cb){ command(line, cb); });
+}
+
+
+std::future<result_t> session_t::encrypt(const std::string& pin,
+    uint8_t key, const bytes_t& data){
+
+    return to_future([&](callback_t cb){ encrypt(pin, key, data, cb); });
+}
+
+
+std::future<result_t> session_t::decrypt(const std::string& pin,
+    uint8_t key, const bytes_t& data){
+
+    return to_future([&](callback_t cb){ decrypt(pin, key, data, cb); });
+}
+
+
+std::future<result_t> session_t::mac(const std::string& pin, uint8_t key,
+    const bytes_t& data){
+
+    return to_future([&](callback_t cb){ mac(pin, key, data, cb); });
+}
+
+
+std::future<result_t> session_t::nonce(const std::string& pin, uint8_t key,
+    const bytes_t& nonce){
+
+    return to_future([&](callback_t cb){
+        this->nonce(pin, key, nonce, cb);
+    });
+}
+
+
+std::future<result_t> session_t::ctr(const std::string& pin, uint8_t key,
+    const bytes_t& data){
+
+    return to_future([&](callback_t cb){ ctr(pin, key, data, cb); });
+}
+
+
+std::future<result_t> session_t::cbc_init(const std::string& pin,
+    uint8_t context, uint8_t key, const bytes_t& iv){
+
+    return to_future([&](callback_t cb){
+        cbc_init(pin, context, key, iv, cb);
+    });
+}
+
+
+std::future<result_t> session_t::cbc_encrypt(const std::string& pin,
+    uint8_t context, const bytes_t& data){
+
+    return to_future([&](callback_t cb){
+        cbc_encrypt(pin, context, data, cb);
+    });
+}
+
+
+std::future<result_t> session_t::cbc_decrypt(const std::string& pin,
+    uint8_t context, const bytes_t& data){
+
+    return to_future([&](callback_t cb){
+        cbc_decrypt(pin, context, data, cb);
+    });
+}
+
+
+} // namespace picohsm
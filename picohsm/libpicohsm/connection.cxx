@@ -0,0 +1,422 @@
+/**
+ * This file is part of picoHSM
+ * 
+ * picoHSM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Ledger SAS, written by Olivier Hériveaux
+ */
+
+#include "connection.hxx"
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <chrono>
+#include <algorithm>
+#include <limits>
+
+
+namespace picohsm {
+
+
+/**
+ * @return Monotonic time, in milliseconds.
+ */
+uint64_t now_ms(){
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+/**
+ * Constructor. The connection is opened by the first call to process().
+ *
+ * @param endpoint Address of the board.
+ * @param options Options of the client, which must outlive the connection.
+ */
+connection_t::connection_t(const endpoint_t& endpoint,
+    const options_t& options):
+    endpoint(endpoint),
+    options(options),
+    state(state_t::closed),
+    fd(-1),
+    gen(0),
+    greeting_left(0),
+    timeout_at(0),
+    opened_at(0),
+    draining(false){}
+
+
+connection_t::~connection_t(){
+    if (fd != -1)
+        ::close(fd);
+}
+
+
+/**
+ * Queue commands. They are sent in order and without other commands between
+ * them.
+ *
+ * @param commands Commands. Moved from.
+ */
+void connection_t::submit(std::vector<command_t>& commands){
+    for (command_t& c: commands)
+        queue.push_back(std::move(c));
+    commands.clear();
+}
+
+
+/**
+ * @return File descriptor to be polled, -1 if none.
+ * @param events Where the poll events are written.
+ */
+int connection_t::poll_fd(short* events) const {
+    switch (state){
+        case state_t::closed: return -1;
+        case state_t::connecting:
+            *events = POLLOUT;
+            break;
+        default:
+            *events = POLLIN | (out.empty() ? 0 : POLLOUT);
+    }
+    return fd;
+}
+
+
+/**
+ * Handle poll events and timers, and send queued commands.
+ *
+ * @param revents Events returned by poll for the file descriptor. 0 if not
+ *     polled.
+ * @param now Current time, from now_ms().
+ */
+void connection_t::process(short revents, uint64_t now){
+    switch (state){
+        case state_t::closed:
+            if (now >= timeout_at)
+                open(now);
+            return;
+        case state_t::connecting:
+            if (revents){
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err){
+                    fail(strerror(err), now);
+                    return;
+                }
+                state = state_t::greeting;
+                greeting_left = greeting_lines;
+                opened_at = now;
+            }
+            break;
+        default:
+            if ((revents & (POLLIN | POLLHUP | POLLERR)) && !receive(now))
+                return;
+    }
+
+    bool waiting = (state != state_t::ready) || !in_flight.empty();
+    if (waiting && (now >= timeout_at)){
+        fail((state == state_t::ready) ? "Command timed out." :
+            "Connection timed out.", now);
+        return;
+    }
+
+    if (state == state_t::ready){
+        // The firmware closes the connection connection_lifetime_ms after
+        // the accept: it is opened again before, once idle.
+        if (now - opened_at >= options.connection_ms)
+            draining = true;
+        if (draining && in_flight.empty()){
+            reopen(now);
+            return;
+        }
+        if (!draining)
+            send_queued(now);
+        if (!flush())
+            fail(strerror(errno), now);
+    }
+}
+
+
+/**
+ * @return Time when process() must be called even if there is no event.
+ */
+uint64_t connection_t::deadline() const {
+    if (state != state_t::ready)
+        return timeout_at;
+    uint64_t t = std::numeric_limits<uint64_t>::max();
+    if (!in_flight.empty())
+        t = timeout_at;
+    if (!draining)
+        t = std::min(t, opened_at + options.connection_ms);
+    return t;
+}
+
+
+/**
+ * Close the connection and fail its commands. It is opened again by
+ * process() after reconnect_delay_ms.
+ *
+ * @param reason Error message given to the commands.
+ */
+void connection_t::close(const char* reason){
+    fail(reason, now_ms());
+}
+
+
+/**
+ * @return true if the connection is established, its greeting received and
+ *     the sentinel command checked.
+ */
+bool connection_t::ready() const {
+    return (state == state_t::ready) && !draining;
+}
+
+
+/**
+ * @return Number of commands queued or waiting for their response.
+ */
+size_t connection_t::outstanding() const {
+    return queue.size() + in_flight.size();
+}
+
+
+/**
+ * @return Number of times the connection was opened, including the next
+ *     opening if it is closed. Commands submitted now are sent on this
+ *     opening.
+ */
+uint64_t connection_t::generation() const {
+    return ((state == state_t::closed) || draining) ? gen + 1 : gen;
+}
+
+
+/**
+ * Start connecting to the endpoint.
+ *
+ * @param now Current time.
+ */
+void connection_t::open(uint64_t now){
+    ++gen;
+    timeout_at = now + options.connect_timeout_ms;
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* res;
+    std::string port = std::to_string(endpoint.port);
+    int err = getaddrinfo(endpoint.host.c_str(), port.c_str(), &hints, &res);
+    if (err){
+        fail(gai_strerror(err), now);
+        return;
+    }
+    fd = socket(res->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+        0);
+    if ((fd == -1) || ((connect(fd, res->ai_addr, res->ai_addrlen) == -1) &&
+        (errno != EINPROGRESS))){
+        freeaddrinfo(res);
+        fail(strerror(errno), now);
+        return;
+    }
+    freeaddrinfo(res);
+    state = state_t::connecting;
+}
+
+
+/**
+ * Close the socket and fail all commands. The connection is opened again
+ * after reconnect_delay_ms.
+ *
+ * @param reason Error message given to the commands.
+ * @param now Current time.
+ */
+void connection_t::fail(const char* reason, uint64_t now){
+    if (fd != -1)
+        ::close(fd);
+    fd = -1;
+    state = state_t::closed;
+    draining = false;
+    timeout_at = now + options.reconnect_delay_ms;
+    out.clear();
+    in.clear();
+    lines.clear();
+    std::deque<command_t> failed;
+    failed.swap(in_flight);
+    for (command_t& c: queue)
+        failed.push_back(std::move(c));
+    queue.clear();
+    std::string message = std::string(endpoint.host) + ":" +
+        std::to_string(endpoint.port) + ": " + reason;
+    std::vector<std::string> none;
+    for (command_t& c: failed)
+        c.done(status_t::io_error, message.c_str(), none);
+}
+
+
+/**
+ * Close the socket once all the commands sent have been answered, and open
+ * the connection again right away. The queued commands are kept.
+ *
+ * @param now Current time.
+ */
+void connection_t::reopen(uint64_t now){
+    ::close(fd);
+    fd = -1;
+    state = state_t::closed;
+    draining = false;
+    timeout_at = now;
+    out.clear();
+    in.clear();
+}
+
+
+/**
+ * Move queued commands to the output buffer, up to max_in_flight commands
+ * waiting for a response.
+ *
+ * @param now Current time.
+ */
+void connection_t::send_queued(uint64_t now){
+    while (!queue.empty() && (in_flight.size() < options.max_in_flight)){
+        command_t& c = queue.front();
+        if (c.generation && (c.generation != gen)){
+            // Queued by a session of the previous opening.
+            command_t lost = std::move(c);
+            queue.pop_front();
+            std::vector<std::string> none;
+            lost.done(status_t::session_lost, "Session lost.", none);
+            continue;
+        }
+        if (in_flight.empty())
+            timeout_at = now + options.command_timeout_ms;
+        out += c.line;
+        out += '\n';
+        if (c.multi_line){
+            out += sentinel_command;
+            out += '\n';
+        }
+        in_flight.push_back(std::move(c));
+        queue.pop_front();
+    }
+}
+
+
+/**
+ * Send as much of the output buffer as the socket accepts.
+ *
+ * @return false if the socket failed.
+ */
+bool connection_t::flush(){
+    while (!out.empty()){
+        ssize_t n = send(fd, out.data(), out.size(), MSG_NOSIGNAL);
+        if (n == -1)
+            return (errno == EAGAIN) || (errno == EWOULDBLOCK);
+        out.erase(0, n);
+    }
+    return true;
+}
+
+
+/**
+ * Read available data and handle the complete lines.
+ *
+ * @param now Current time.
+ * @return false if the connection failed.
+ */
+bool connection_t::receive(uint64_t now){
+    char buf[4096];
+    for (;;){
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n == 0){
+            fail("Connection closed by peer.", now);
+            return false;
+        }
+        if (n == -1){
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+                return true;
+            fail(strerror(errno), now);
+            return false;
+        }
+        in.append(buf, n);
+        size_t start = 0;
+        size_t end;
+        while ((end = in.find('\n', start)) != std::string::npos){
+            size_t len = end - start;
+            if (len && (in[end - 1] == '\r'))
+                --len;
+            if (!on_line(in.substr(start, len), now))
+                return false;
+            start = end + 1;
+        }
+        in.erase(0, start);
+    }
+}
+
+
+/**
+ * Handle a received line.
+ *
+ * @param line Line, without the line return.
+ * @param now Current time.
+ * @return false if the connection failed.
+ */
+bool connection_t::on_line(const std::string& line, uint64_t now){
+    if (state == state_t::greeting){
+        if (--greeting_left == 0){
+            // Check that multi-line responses can be delimited, see
+            // protocol.hxx.
+            state = state_t::probe;
+            out += sentinel_command;
+            out += '\n';
+            if (!flush()){
+                fail(strerror(errno), now);
+                return false;
+            }
+        }
+        return true;
+    }
+    if (state == state_t::probe){
+        if (line != sentinel_response){
+            fail(sentinel_mismatch, now);
+            return false;
+        }
+        state = state_t::ready;
+        return true;
+    }
+    if (in_flight.empty()){
+        fail("Unexpected response.", now);
+        return false;
+    }
+    command_t& c = in_flight.front();
+    if (c.multi_line && (line != sentinel_response)){
+        lines.push_back(line);
+        return true;
+    }
+    if (!c.multi_line)
+        lines.push_back(line);
+    command_t done = std::move(c);
+    in_flight.pop_front();
+    timeout_at = now + options.command_timeout_ms;
+    std::vector<std::string> response;
+    response.swap(lines);
+    done.done(status_t::ok, 0, response);
+    return true;
+}
+
+
+} // namespace picohsm
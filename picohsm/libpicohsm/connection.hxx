@@ -0,0 +1,121 @@
+/**
+ * This file is part of picoHSM
+ * 
+ * picoHSM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Ledger SAS, written by Olivier Hériveaux
+ */
+
+#ifndef _PICOHSM_CONNECTION_HXX_
+#define _PICOHSM_CONNECTION_HXX_
+
+
+#include <stdint.h>
+#include <deque>
+#include <functional>
+#include <string>
+#include <vector>
+#include "picohsm.hxx"
+
+
+namespace picohsm {
+
+
+/** A command line and the handling of its response. */
+struct command_t {
+    std::string line;
+    /** true if the response ends with sentinel_response. */
+    bool multi_line;
+    /** Opening of the connection the command must be sent on, 0 for any. */
+    uint64_t generation;
+    /**
+     * Called with status_t::ok and the response lines, or with an error
+     * status and message if the response will not be received.
+     */
+    std::function<void(status_t, const char*, std::vector<std::string>&)>
+        done;
+
+    command_t(): multi_line(false), generation(0){}
+};
+
+
+/**
+ * Persistent connection to an endpoint, operated by the thread of a client.
+ * Commands are queued, then sent as long as less than max_in_flight are
+ * waiting for their response. The connection is opened again after a failure,
+ * which fails all its commands, and connection_ms after it has been opened:
+ * the queued commands then wait until the commands sent are answered.
+ */
+class connection_t {
+    public:
+        connection_t(const endpoint_t&, const options_t&);
+        ~connection_t();
+        connection_t(const connection_t&) = delete;
+        connection_t& operator=(const connection_t&) = delete;
+
+        void submit(std::vector<command_t>&);
+        int poll_fd(short*) const;
+        void process(short, uint64_t);
+        uint64_t deadline() const;
+        void close(const char*);
+        bool ready() const;
+        size_t outstanding() const;
+        uint64_t generation() const;
+
+    private:
+        enum class state_t { closed, connecting, greeting, probe, ready };
+
+        endpoint_t endpoint;
+        const options_t& options;
+        state_t state;
+        int fd;
+        /** Incremented each time the connection is opened. */
+        uint64_t gen;
+        /** Commands not sent yet. */
+        std::deque<command_t> queue;
+        /** Commands sent, waiting for their response. */
+        std::deque<command_t> in_flight;
+        /** Lines of the response being received. */
+        std::vector<std::string> lines;
+        /** Data to be sent. */
+        std::string out;
+        /** Received data, after the last complete line. */
+        std::string in;
+        /** Number of greeting lines still expected. */
+        size_t greeting_left;
+        /** Time when the pending connection, greeting or command response
+         * times out. When closed, time of the next connection attempt. */
+        uint64_t timeout_at;
+        /** Time when the connection has been established. */
+        uint64_t opened_at;
+        /** true once connection_ms has elapsed: no more commands are sent. */
+        bool draining;
+
+        void open(uint64_t);
+        void reopen(uint64_t);
+        void fail(const char*, uint64_t);
+        void send_queued(uint64_t);
+        bool flush();
+        bool receive(uint64_t);
+        bool on_line(const std::string&, uint64_t);
+};
+
+
+uint64_t now_ms();
+
+
+} // namespace picohsm
+
+
+#endif
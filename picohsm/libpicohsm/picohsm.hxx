@@ -0,0 +1,216 @@
+/**
+ * This file is part of picoHSM
+ * 
+ * picoHSM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Ledger SAS, written by Olivier Hériveaux
+ */
+
+#ifndef _PICOHSM_HXX_
+#define _PICOHSM_HXX_
+
+
+#include <stdint.h>
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+#include "protocol.hxx"
+
+
+/**
+ * Asynchronous client of the picoHSM text protocol.
+ *
+ * A client_t keeps persistent connections to one or more boards and runs them
+ * in a background thread. Requests are dispatched to the connection with the
+ * least outstanding commands, and pipelined: several commands can be waiting
+ * for their response on the same connection. Each request completes either
+ * through a callback, called from the background thread, or through a
+ * std::future.
+ *
+ * Boards accept only one connection at a time, so connections_per_endpoint
+ * should be 1 unless the endpoint is a proxy.
+ */
+namespace picohsm {
+
+
+/** Address of a board. */
+struct endpoint_t {
+    std::string host;
+    uint16_t port;
+
+    endpoint_t(const std::string& host, uint16_t port = default_port):
+        host(host), port(port){}
+};
+
+
+/** Tuning of a client_t. */
+struct options_t {
+    /** Number of connections opened to each endpoint. */
+    unsigned connections_per_endpoint;
+    /** Maximum number of commands sent and not answered on a connection. */
+    unsigned max_in_flight;
+    /** Time allowed to connect and receive the greeting, in milliseconds. */
+    unsigned connect_timeout_ms;
+    /** Time allowed to answer a command, in milliseconds. */
+    unsigned command_timeout_ms;
+    /** Delay before reconnecting after a failure, in milliseconds. */
+    unsigned reconnect_delay_ms;
+    /**
+     * A connection stops sending commands this long after it has been opened,
+     * in milliseconds. It is opened again once they are answered, before the
+     * firmware closes it (connection_lifetime_ms).
+     */
+    unsigned connection_ms;
+    /**
+     * Maximum number of blocks sent in one command. Longer data is split in
+     * several commands. Above max_command_blocks, the commands overflow the
+     * line buffer of the firmware: only for a proxy.
+     */
+    size_t command_blocks;
+
+    options_t():
+        connections_per_endpoint(1),
+        max_in_flight(8),
+        connect_timeout_ms(5000),
+        command_timeout_ms(10000),
+        reconnect_delay_ms(1000),
+        connection_ms(12000),
+        command_blocks(max_command_blocks){}
+};
+
+
+enum class status_t {
+    /** Request succeeded. */
+    ok,
+    /** Request was refused by the firmware or the library. */
+    error,
+    /** Connection failed or timed out. The request may have been executed. */
+    io_error,
+    /** The connection of the session has been opened again, losing the state
+     * kept on the board. The request has not been sent. */
+    session_lost
+};
+
+
+/** Outcome of a request. */
+struct result_t {
+    status_t status;
+    /** Error message, from the firmware when status is error. */
+    std::string message;
+    /** Output of encryption, decryption and MAC requests. */
+    std::vector<uint8_t> data;
+    /** Response lines of text commands. */
+    std::vector<std::string> lines;
+
+    result_t(): status(status_t::ok){}
+    bool ok() const { return status == status_t::ok; }
+};
+
+
+typedef std::function<void(result_t)> callback_t;
+typedef std::vector<uint8_t> bytes_t;
+class session_t;
+
+
+class client_t {
+    public:
+        client_t(const std::vector<endpoint_t>&,
+            const options_t& = options_t());
+        ~client_t();
+        client_t(const client_t&) = delete;
+        client_t& operator=(const client_t&) = delete;
+
+        void command(const std::string&, callback_t);
+        void encrypt(const std::string&, uint8_t, const bytes_t&, callback_t);
+        void decrypt(const std::string&, uint8_t, const bytes_t&, callback_t);
+        void mac(const std::string&, uint8_t, const bytes_t&, callback_t);
+        std::future<result_t> command(const std::string&);
+        std::future<result_t> encrypt(const std::string&, uint8_t,
+            const bytes_t&);
+        std::future<result_t> decrypt(const std::string&, uint8_t,
+            const bytes_t&);
+        std::future<result_t> mac(const std::string&, uint8_t,
+            const bytes_t&);
+        std::shared_ptr<session_t> session();
+        size_t outstanding() const;
+
+    private:
+        struct impl_t;
+        friend class session_t;
+        std::unique_ptr<impl_t> impl;
+};
+
+
+/**
+ * Requests bound to one connection, for the commands which keep a state in
+ * the secure MCU: the CTR counters of the keys and the CBC contexts. This
+ * state is lost when the connection is opened again, at the latest
+ * options_t::connection_ms after it has been opened, or when it fails. The
+ * following requests of the session then fail with session_lost.
+ *
+ * Sessions sharing a connection share its CTR counters and CBC contexts. The
+ * last CBC context is reserved by the library. A session must not outlive its
+ * client.
+ */
+class session_t: public std::enable_shared_from_this<session_t> {
+    public:
+        void command(const std::string&, callback_t);
+        void encrypt(const std::string&, uint8_t, const bytes_t&, callback_t);
+        void decrypt(const std::string&, uint8_t, const bytes_t&, callback_t);
+        void mac(const std::string&, uint8_t, const bytes_t&, callback_t);
+        void nonce(const std::string&, uint8_t, const bytes_t&, callback_t);
+        void ctr(const std::string&, uint8_t, const bytes_t&, callback_t);
+        void cbc_init(const std::string&, uint8_t, uint8_t, const bytes_t&,
+            callback_t);
+        void cbc_encrypt(const std::string&, uint8_t, const bytes_t&,
+            callback_t);
+        void cbc_decrypt(const std::string&, uint8_t, const bytes_t&,
+            callback_t);
+        std::future<result_t> command(const std::string&);
+        std::future<result_t> encrypt(const std::string&, uint8_t,
+            const bytes_t&);
+        std::future<result_t> decrypt(const std::string&, uint8_t,
+            const bytes_t&);
+        std::future<result_t> mac(const std::string&, uint8_t,
+            const bytes_t&);
+        std::future<result_t> nonce(const std::string&, uint8_t,
+            const bytes_t&);
+        std::future<result_t> ctr(const std::string&, uint8_t,
+            const bytes_t&);
+        std::future<result_t> cbc_init(const std::string&, uint8_t, uint8_t,
+            const bytes_t&);
+        std::future<result_t> cbc_encrypt(const std::string&, uint8_t,
+            const bytes_t&);
+        std::future<result_t> cbc_decrypt(const std::string&, uint8_t,
+            const bytes_t&);
+
+    private:
+        friend class client_t;
+        friend struct client_t::impl_t;
+        session_t(client_t::impl_t*, size_t);
+        client_t::impl_t* client;
+        /** Index of the connection in the client. */
+        size_t conn;
+        /** Generation of the connection when the session was first used. 0
+         * until then. */
+        uint64_t generation;
+};
+
+
+} // namespace picohsm
+
+
+#endif
@@ -0,0 +1,121 @@
+/**
+ * This file is part of picoHSM
+ * 
+ * picoHSM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Ledger SAS, written by Olivier Hériveaux
+ */
+
+#include "protocol.hxx"
+
+
+namespace picohsm {
+
+
+const char sentinel_command[] = "?";
+const char sentinel_response[] = "Unknown command. Use help to get help...";
+const char sentinel_mismatch[] = "Unexpected response to the sentinel command.";
+const char nonce_set_response[] = "Nonce set.";
+const char context_set_response[] = "Context initialized.";
+
+
+/**
+ * @return How the response of a command ends.
+ * @param line Command line. Only the command name, before the first space, is
+ *     considered.
+ */
+framing_t command_framing(const std::string& line){
+    static const char* const single[] = {"encrypt", "decrypt", "ctr", "cbcenc",
+        "cbcdec", "mac", "nonce", "cbcinit"};
+    static const char* const multi[] = {"help", "info", "stats", "keys",
+        "getflag", "pin", "mem", "batch"};
+    std::string name = line.substr(0, line.find(' '));
+    for (const char* s: single){
+        if (name == s)
+            return framing_t::single_line;
+    }
+    for (const char* s: multi){
+        if (name == s)
+            return framing_t::multi_line;
+    }
+    return framing_t::unknown;
+}
+
+
+/**
+ * Convert bytes to lowercase hexadecimal.
+ *
+ * @param data Bytes.
+ * @param len Number of bytes.
+ * @return Hexadecimal string.
+ */
+std::string to_hex(const uint8_t* data, size_t len){
+    static const char digits[] = "0123456789abcdef";
+    std::string s(2 * len, '0');
+    for (size_t i = 0; i < len; ++i){
+        s[2 * i] = digits[data[i] >> 4];
+        s[2 * i + 1] = digits[data[i] & 0x0f];
+    }
+    return s;
+}
+
+
+/**
+ * Convert an hexadecimal string to bytes.
+ *
+ * @param s String. Uppercase and lowercase digits are accepted.
+ * @param dest Where the bytes are appended.
+ * @return false if the string is not hexadecimal.
+ */
+bool from_hex(const std::string& s, std::vector<uint8_t>* dest){
+    if (s.size() % 2)
+        return false;
+    dest->reserve(dest->size() + s.size() / 2);
+    for (size_t i = 0; i < s.size(); i += 2){
+        uint8_t x = 0;
+        for (size_t j = i; j < i + 2; ++j){
+            char c = s[j];
+            x <<= 4;
+            if ((c >= '0') && (c <= '9'))
+                x |= c - '0';
+            else if ((c >= 'a') && (c <= 'f'))
+                x |= c - 'a' + 10;
+            else if ((c >= 'A') && (c <= 'F'))
+                x |= c - 'A' + 10;
+            else
+                return false;
+        }
+        dest->push_back(x);
+    }
+    return true;
+}
+
+
+/**
+ * @return true if a PIN can be sent as a command argument: pin_length
+ *     characters, none of them being a separator.
+ * @param pin PIN.
+ */
+bool valid_pin(const std::string& pin){
+    if (pin.size() != pin_length)
+        return false;
+    for (char c: pin){
+        if ((c == ' ') || (c == '\n') || (c == '\r') || (c == 0))
+            return false;
+    }
+    return true;
+}
+
+
+} // namespace picohsm
@@ -0,0 +1,112 @@
+/**
+ * This file is part of picoHSM
+ * 
+ * picoHSM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Ledger SAS, written by Olivier Hériveaux
+ */
+
+#ifndef _PICOHSM_PROTOCOL_HXX_
+#define _PICOHSM_PROTOCOL_HXX_
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+
+/**
+ * Text protocol of the picoHSM, served on TCP port 1234 by firmware-mcu.
+ *
+ * After the connection, the firmware sends greeting_lines lines. Commands are
+ * then sent one per line, and answered in order. An empty line ends the
+ * connection, and the firmware closes it connection_lifetime_ms after the
+ * accept, whatever it receives. Commands processing data
+ * (encrypt, decrypt, ctr, cbcenc, cbcdec, mac) and the nonce and cbcinit
+ * commands are answered with exactly one line: the result or an error
+ * message. Other commands have a variable number of lines, so the client sends
+ * sentinel_command after them and reads up to sentinel_response.
+ *
+ * The firmware has no end marker for these responses, and its output is kept
+ * as is for the users typing commands by hand. Relying on the message of an
+ * unknown command is a deliberate workaround: after the greeting, a
+ * connection sends sentinel_command once and fails if the answer is not
+ * exactly sentinel_response, rather than waiting for the command timeout on
+ * each multi-line response. A command with a variable number of lines which is
+ * not listed by command_framing is rejected as unknown.
+ */
+namespace picohsm {
+
+
+/** Default TCP port of the service. */
+const uint16_t default_port = 1234;
+/** Size of an AES block, in bytes. */
+const size_t block_size = 16;
+/** Number of key slots. */
+const uint8_t key_count = 8;
+/** Number of CBC contexts of a connection. */
+const uint8_t context_count = 8;
+/** Time after which the firmware closes a connection, counted from the
+ * accept, in milliseconds. */
+const unsigned connection_lifetime_ms = 15000;
+/** Number of lines sent by the firmware when the connection is accepted. */
+const size_t greeting_lines = 3;
+/**
+ * Maximum number of AES blocks sent in one command. The firmware reads
+ * commands in a 768-byte buffer, and a longer line overflows it.
+ */
+const size_t max_command_blocks = 16;
+/** Maximum message length of the mac command, for the same reason. */
+const size_t max_mac_bytes = 256;
+/** Length of a PIN, in characters. */
+const size_t pin_length = 8;
+/** Maximum length of a command line, without the line return. */
+const size_t max_line_length = 767;
+
+/** Unknown command, answered with sentinel_response. */
+extern const char sentinel_command[];
+/** Response of the firmware to sentinel_command. */
+extern const char sentinel_response[];
+/** Error of a connection whose firmware does not answer sentinel_command with
+ * sentinel_response. */
+extern const char sentinel_mismatch[];
+/** Response of the nonce command when successful. */
+extern const char nonce_set_response[];
+/** Response of the cbcinit command when successful. */
+extern const char context_set_response[];
+
+
+/** How the end of the response of a command is found. */
+enum class framing_t {
+    /** Not a command of the firmware. */
+    unknown,
+    /** Response is one line. */
+    single_line,
+    /** Response has a variable number of lines, ended by sending
+     * sentinel_command after the command. */
+    multi_line
+};
+
+
+framing_t command_framing(const std::string&);
+std::string to_hex(const uint8_t*, size_t);
+bool from_hex(const std::string&, std::vector<uint8_t>*);
+bool valid_pin(const std::string&);
+
+
+} // namespace picohsm
+
+
+#endif
@@ -0,0 +1,717 @@
+/**
+ * This file is part of picoHSM
+ * 
+ * picoHSM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Ledger SAS, written by Olivier Hériveaux
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <random>
+#include "protocol.hxx"
+#include "results.hxx"
+
+
+static const char usage[] =
+    "Usage: picohsm-loadgen [OPTIONS] HOST[:PORT]\n"
+    "\n"
+    "Send picoHSM commands to a board, the host simulation or the proxy, and\n"
+    "report the throughput and the latency percentiles of the connection,\n"
+    "first response byte and response completion.\n"
+    "\n"
+    "  -c, --connections N    connections opened (1). A board serves one\n"
+    "                         connection at a time: use --pipeline instead\n"
+    "  -p, --pipeline N       commands sent ahead on each connection (1)\n"
+    "  -C, --command NAME     help, info, pin, encrypt or decrypt. Repeat to\n"
+    "                         send a mix of commands (encrypt)\n"
+    "  -s, --size BYTES       encrypt and decrypt data size, multiple of 16.\n"
+    "                         Repeat to send a mix of sizes (16)\n"
+    "  -P, --pin PIN          PIN (13372020)\n"
+    "  -k, --key N            key id (0)\n"
+    "  -d, --duration S       sending time, after the warm-up (10)\n"
+    "  -n, --requests N       stop after N measured commands\n"
+    "  -w, --warmup S         commands of the first S seconds are not\n"
+    "                         measured (1)\n"
+    "  -r, --reconnect N      reopen the connections every N commands\n"
+    "  -t, --timeout MS       command timeout (10000)\n"
+    "  -L, --long-lines       allow commands longer than a board accepts,\n"
+    "                         for the proxy\n"
+    "  -o, --output FILE      save the results as JSON\n"
+    "  -b, --baseline FILE    compare with saved results, and exit with an\n"
+    "                         error on regressions\n"
+    "  -T, --threshold PCT    tolerance of the comparison (5)\n";
+
+
+/** Settings of a run. */
+struct settings_t {
+    std::string host;
+    uint16_t port;
+    unsigned connections;
+    unsigned pipeline;
+    std::vector<std::string> commands;
+    std::vector<size_t> sizes;
+    std::string pin;
+    unsigned key;
+    double duration;
+    uint64_t requests;
+    double warmup;
+    unsigned reconnect;
+    unsigned timeout_ms;
+    bool long_lines;
+};
+
+
+/** A command sent, waiting for its response. */
+struct pending_t {
+    /** Time when the command was sent, in microseconds. */
+    uint64_t sent;
+    /** Time when the first byte of the response was received, 0 if not
+     * yet. */
+    uint64_t first_byte;
+    bool multi_line;
+    /** Size of the data returned by encrypt and decrypt, 0 for text
+     * commands. */
+    size_t data_size;
+    /** true for the pin command. */
+    bool pin;
+    /** false if sent during the warm-up. */
+    bool measured;
+};
+
+
+/** A connection to the target. */
+struct conn_t {
+    enum class state_t { closed, connecting, greeting, probe, ready };
+    state_t state;
+    int fd;
+    /** Time of the connection start, or of the next attempt when closed. */
+    uint64_t start;
+    size_t greeting_left;
+    /** Commands sent on this connection. */
+    unsigned sent;
+    std::string in;
+    std::string out;
+    std::deque<pending_t> pending;
+    std::vector<std::string> lines;
+};
+
+
+/** Runs the load and collects the measurements. */
+class loadgen_t {
+    public:
+        loadgen_t(const settings_t&);
+        void run();
+        void report(results_t*);
+
+    private:
+        const settings_t& settings;
+        std::vector<conn_t> conns;
+        /** Command lines, by command and size index. */
+        std::vector<std::vector<std::string>> lines;
+        /** Number of commands sent. */
+        uint64_t issued;
+        /** Number of measured commands sent. */
+        uint64_t measured_issued;
+        uint64_t start;
+        uint64_t warmup_end;
+        uint64_t last_completion;
+        bool sending;
+        /** true once the target answered the sentinel command as expected. */
+        bool framing_checked;
+        uint64_t completed;
+        uint64_t errors;
+        uint64_t timeouts;
+        uint64_t connection_errors;
+        uint64_t data_bytes;
+        samples_t connect;
+        samples_t first_byte;
+        samples_t completion;
+
+        void open(conn_t&, uint64_t);
+        void fail(conn_t&, uint64_t, bool);
+        void send_commands(conn_t&, uint64_t);
+        void receive(conn_t&, uint64_t);
+        void on_line(conn_t&, const std::string&, uint64_t);
+        void complete(conn_t&, bool, uint64_t);
+};
+
+
+/**
+ * @return Monotonic time, in microseconds.
+ */
+static uint64_t now_us(){
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+/**
+ * Constructor. Prepares the command lines.
+ *
+ * @param settings Settings, which must outlive the object.
+ */
+loadgen_t::loadgen_t(const settings_t& settings):
+    settings(settings),
+    conns(settings.connections),
+    issued(0),
+    measured_issued(0),
+    start(0),
+    warmup_end(0),
+    last_completion(0),
+    sending(true),
+    framing_checked(false),
+    completed(0),
+    errors(0),
+    timeouts(0),
+    connection_errors(0),
+    data_bytes(0){
+
+    std::mt19937 rng(1);
+    for (const std::string& name: settings.commands){
+        lines.emplace_back();
+        for (size_t size: settings.sizes){
+            std::string line = name;
+            if (name == "pin")
+                line += " " + settings.pin;
+            if ((name == "encrypt") || (name == "decrypt")){
+                std::vector<uint8_t> data(size);
+                for (uint8_t& x: data)
+                    x = (uint8_t)rng();
+                line += " " + settings.pin + " " +
+                    std::to_string(settings.key) + " " +
+                    picohsm::to_hex(data.data(), data.size());
+            }
+            lines.back().push_back(line);
+        }
+    }
+    for (conn_t& c: conns){
+        c.state = conn_t::state_t::closed;
+        c.fd = -1;
+        c.start = 0;
+    }
+}
+
+
+/**
+ * Send the commands until the duration or the number of requests is reached,
+ * then wait for the responses.
+ */
+void loadgen_t::run(){
+    start = now_us();
+    warmup_end = start + (uint64_t)(settings.warmup * 1e6);
+    uint64_t end = warmup_end + (uint64_t)(settings.duration * 1e6);
+    std::vector<pollfd> fds(conns.size());
+    for (;;){
+        uint64_t now = now_us();
+        if (sending && ((settings.duration && (now >= end)) ||
+            (settings.requests && (measured_issued >= settings.requests))))
+            sending = false;
+        bool busy = false;
+        for (size_t i = 0; i < conns.size(); ++i){
+            conn_t& c = conns[i];
+            if ((c.state == conn_t::state_t::closed) && sending &&
+                (now >= c.start))
+                open(c, now);
+            if (!c.pending.empty() &&
+                (now - c.pending.front().sent >
+                settings.timeout_ms * 1000ull)){
+                timeouts += c.pending.size();
+                fail(c, now, false);
+            } else if ((c.state != conn_t::state_t::closed) &&
+                (c.state != conn_t::state_t::connecting) &&
+                (now - c.start > settings.timeout_ms * 1000ull) &&
+                ((c.state == conn_t::state_t::greeting) ||
+                (c.state == conn_t::state_t::probe))){
+                fail(c, now, true);
+            }
+            if (c.state == conn_t::state_t::ready)
+                send_commands(c, now);
+            busy |= !c.pending.empty();
+            fds[i].fd = c.fd;
+            fds[i].events = (c.state == conn_t::state_t::connecting) ?
+                POLLOUT : (POLLIN | (c.out.empty() ? 0 : POLLOUT));
+            fds[i].revents = 0;
+        }
+        if (!sending && !busy)
+            break;
+        poll(fds.data(), fds.size(), 10);
+
+        now = now_us();
+        for (size_t i = 0; i < conns.size(); ++i){
+            conn_t& c = conns[i];
+            short revents = fds[i].revents;
+            if ((c.fd == -1) || !revents)
+                continue;
+            if (c.state == conn_t::state_t::connecting){
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err){
+                    fail(c, now, true);
+                    continue;
+                }
+                c.state = conn_t::state_t::greeting;
+                c.greeting_left = picohsm::greeting_lines;
+                continue;
+            }
+            if (revents & (POLLIN | POLLHUP | POLLERR))
+                receive(c, now);
+            if ((c.fd != -1) && !c.out.empty()){
+                ssize_t n = send(c.fd, c.out.data(), c.out.size(),
+                    MSG_NOSIGNAL);
+                if (n > 0)
+                    c.out.erase(0, n);
+                else if ((n == -1) && (errno != EAGAIN))
+                    fail(c, now, true);
+            }
+        }
+    }
+    for (conn_t& c: conns){
+        if (c.fd != -1)
+            close(c.fd);
+    }
+}
+
+
+/**
+ * Start connecting.
+ *
+ * @param c Connection.
+ * @param now Current time.
+ */
+void loadgen_t::open(conn_t& c, uint64_t now){
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* res;
+    std::string port = std::to_string(settings.port);
+    if (getaddrinfo(settings.host.c_str(), port.c_str(), &hints, &res)){
+        fprintf(stderr, "picohsm-loadgen: cannot resolve %s\n",
+            settings.host.c_str());
+        exit(1);
+    }
+    c.start = now;
+    c.sent = 0;
+    c.fd = socket(res->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+        0);
+    int r = ::connect(c.fd, res->ai_addr, res->ai_addrlen);
+    freeaddrinfo(res);
+    c.state = conn_t::state_t::connecting;
+    if ((r == -1) && (errno != EINPROGRESS))
+        fail(c, now, true);
+}
+
+
+/**
+ * Close a connection, counting its commands as errors, and open it again
+ * after 100 ms.
+ *
+ * @param c Connection.
+ * @param now Current time.
+ * @param error true if this is a connection error.
+ */
+void loadgen_t::fail(conn_t& c, uint64_t now, bool error){
+    if (error){
+        ++connection_errors;
+        errors += c.pending.size();
+    }
+    if (c.fd != -1)
+        close(c.fd);
+    c.fd = -1;
+    c.state = conn_t::state_t::closed;
+    c.start = now + 100000;
+    c.in.clear();
+    c.out.clear();
+    c.lines.clear();
+    c.pending.clear();
+}
+
+
+/**
+ * Send commands up to the pipeline depth. Once the connection has sent the
+ * commands set by --reconnect and got their responses, it is closed with an
+ * empty line and opened again.
+ *
+ * @param c Connection.
+ * @param now Current time.
+ */
+void loadgen_t::send_commands(conn_t& c, uint64_t now){
+    while (sending && (c.pending.size() < settings.pipeline) &&
+        (!settings.reconnect || (c.sent < settings.reconnect))){
+
+        size_t n = settings.commands.size();
+        const std::string& name = settings.commands[issued % n];
+        size_t size_index = (issued / n) % settings.sizes.size();
+        const std::string& line = lines[issued % n][size_index];
+        pending_t p;
+        p.sent = now;
+        p.first_byte = 0;
+        p.multi_line = picohsm::command_framing(line) ==
+            picohsm::framing_t::multi_line;
+        p.data_size = ((name == "encrypt") || (name == "decrypt")) ?
+            settings.sizes[size_index] : 0;
+        p.pin = name == "pin";
+        p.measured = now >= warmup_end;
+        c.out += line + "\n";
+        if (p.multi_line)
+            c.out += std::string(picohsm::sentinel_command) + "\n";
+        c.pending.push_back(p);
+        ++c.sent;
+        ++issued;
+        measured_issued += p.measured;
+        if (settings.requests && (measured_issued >= settings.requests))
+            break;
+    }
+    if (settings.reconnect && (c.sent >= settings.reconnect) &&
+        c.pending.empty() && c.out.empty()){
+        // An empty line ends the connection
+        if (send(c.fd, "\n", 1, MSG_NOSIGNAL)){}
+        close(c.fd);
+        c.fd = -1;
+        c.state = conn_t::state_t::closed;
+        c.start = now;
+    }
+}
+
+
+/**
+ * Read the available data and handle the complete lines.
+ *
+ * @param c Connection.
+ * @param now Current time.
+ */
+void loadgen_t::receive(conn_t& c, uint64_t now){
+    char buf[4096];
+    ssize_t n = recv(c.fd, buf, sizeof(buf), 0);
+    if ((n == 0) || ((n == -1) && (errno != EAGAIN))){
+        fail(c, now, true);
+        return;
+    }
+    if (n == -1)
+        return;
+    c.in.append(buf, n);
+    size_t pos = 0;
+    size_t end;
+    for (;;){
+        // The response of the first command waiting starts here.
+        if (!c.pending.empty() && !c.pending.front().first_byte &&
+            (pos < c.in.size()))
+            c.pending.front().first_byte = now;
+        if ((end = c.in.find('\n', pos)) == std::string::npos)
+            break;
+        size_t len = end - pos;
+        if (len && (c.in[end - 1] == '\r'))
+            --len;
+        on_line(c, c.in.substr(pos, len), now);
+        if (c.fd == -1)
+            return;
+        pos = end + 1;
+    }
+    c.in.erase(0, pos);
+}
+
+
+/**
+ * Handle a received line.
+ *
+ * @param c Connection.
+ * @param line Line, without the line return.
+ * @param now Current time.
+ */
+void loadgen_t::on_line(conn_t& c, const std::string& line, uint64_t now){
+    if (c.state == conn_t::state_t::greeting){
+        if (--c.greeting_left == 0){
+            connect.add(now - c.start);
+            if (framing_checked){
+                c.state = conn_t::state_t::ready;
+            } else {
+                // Multi-line responses are delimited with the sentinel
+                // command, see protocol.hxx: check it once.
+                c.state = conn_t::state_t::probe;
+                c.out += std::string(picohsm::sentinel_command) + "\n";
+            }
+        }
+        return;
+    }
+    if (c.state == conn_t::state_t::probe){
+        if (line != picohsm::sentinel_response){
+            fprintf(stderr, "picohsm-loadgen: unexpected response to the "
+                "sentinel command: %s\n", line.c_str());
+            exit(1);
+        }
+        framing_checked = true;
+        c.state = conn_t::state_t::ready;
+        return;
+    }
+    if (c.pending.empty()){
+        fail(c, now, true);
+        return;
+    }
+    pending_t& p = c.pending.front();
+    if (p.multi_line && (line != picohsm::sentinel_response)){
+        c.lines.push_back(line);
+        return;
+    }
+    bool ok;
+    if (p.multi_line){
+        ok = !c.lines.empty() && (!p.pin || (c.lines[0] == "PIN OK"));
+    } else {
+        std::vector<uint8_t> data;
+        ok = (line.size() == 2 * p.data_size) &&
+            picohsm::from_hex(line, &data);
+    }
+    c.lines.clear();
+    complete(c, ok, now);
+}
+
+
+/**
+ * Record the measurements of the first command waiting for its response,
+ * which has been received.
+ *
+ * @param c Connection.
+ * @param ok false if the response is an error.
+ * @param now Current time.
+ */
+void loadgen_t::complete(conn_t& c, bool ok, uint64_t now){
+    pending_t p = c.pending.front();
+    c.pending.pop_front();
+    if (!p.measured)
+        return;
+    ++completed;
+    last_completion = now;
+    if (!ok){
+        ++errors;
+        return;
+    }
+    data_bytes += p.data_size;
+    first_byte.add(p.first_byte - p.sent);
+    completion.add(now - p.sent);
+}
+
+
+/**
+ * Print the measurements, and store them in results.
+ *
+ * @param results Where the measurements are added.
+ */
+void loadgen_t::report(results_t* results){
+    double elapsed = (last_completion > warmup_end) ?
+        (last_completion - warmup_end) / 1e6 : 0;
+    double rps = elapsed ? completed / elapsed : 0;
+    double bps = elapsed ? data_bytes / elapsed : 0;
+    printf("%llu commands in %.2f s: %.1f commands/s, %.0f B/s of data\n",
+        (unsigned long long)completed, elapsed, rps, bps);
+    printf("%llu errors, %llu timeouts, %llu connection errors\n",
+        (unsigned long long)errors, (unsigned long long)timeouts,
+        (unsigned long long)connection_errors);
+    results->add("commands_per_second", rps, "cmd/s");
+    results->add("data_bytes_per_second", bps, "B/s");
+    results->add("errors", (double)(errors + timeouts), "count");
+
+    printf("%-12s %10s %10s %10s %10s %10s\n", "latency (us)", "samples",
+        "p50", "p99", "p999", "max");
+    struct {
+        const char* name;
+        samples_t* samples;
+    } phases[] = {{"connect", &connect}, {"first_byte", &first_byte},
+        {"completion", &completion}};
+    for (auto& phase: phases){
+        samples_t& s = *phase.samples;
+        printf("%-12s %10zu %10llu %10llu %10llu %10llu\n", phase.name,
+            s.size(), (unsigned long long)s.percentile(0.5),
+            (unsigned long long)s.percentile(0.99),
+            (unsigned long long)s.percentile(0.999),
+            (unsigned long long)s.max());
+        std::string prefix = phase.name;
+        results->add(prefix + "_p50", (double)s.percentile(0.5), "us");
+        results->add(prefix + "_p99", (double)s.percentile(0.99), "us");
+        results->add(prefix + "_p999", (double)s.percentile(0.999), "us");
+    }
+}
+
+
+/**
+ * @return Value of a numeric option. Exits if it is not a number.
+ * @param s Option value.
+ */
+static double parse_number(const char* s){
+    char* end;
+    double x = strtod(s, &end);
+    if ((*s == 0) || *end || (x < 0)){
+        fprintf(stderr, "picohsm-loadgen: invalid number %s\n", s);
+        exit(1);
+    }
+    return x;
+}
+
+
+int main(int argc, char** argv){
+    static const option long_options[] = {
+        {"connections", required_argument, 0, 'c'},
+        {"pipeline", required_argument, 0, 'p'},
+        {"command", required_argument, 0, 'C'},
+        {"size", required_argument, 0, 's'},
+        {"pin", required_argument, 0, 'P'},
+        {"key", required_argument, 0, 'k'},
+        {"duration", required_argument, 0, 'd'},
+        {"requests", required_argument, 0, 'n'},
+        {"warmup", required_argument, 0, 'w'},
+        {"reconnect", required_argument, 0, 'r'},
+        {"timeout", required_argument, 0, 't'},
+        {"long-lines", no_argument, 0, 'L'},
+        {"output", required_argument, 0, 'o'},
+        {"baseline", required_argument, 0, 'b'},
+        {"threshold", required_argument, 0, 'T'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+    settings_t settings;
+    settings.port = picohsm::default_port;
+    settings.connections = 1;
+    settings.pipeline = 1;
+    settings.pin = "13372020";
+    settings.key = 0;
+    settings.duration = 10;
+    settings.requests = 0;
+    settings.warmup = 1;
+    settings.reconnect = 0;
+    settings.timeout_ms = 10000;
+    settings.long_lines = false;
+    std::string output;
+    std::string baseline;
+    double threshold = 5;
+    bool duration_set = false;
+
+    int c;
+    while ((c = getopt_long(argc, argv, "c:p:C:s:P:k:d:n:w:r:t:Lo:b:T:h",
+        long_options, 0)) != -1){
+        switch (c){
+            case 'c': settings.connections = parse_number(optarg); break;
+            case 'p': settings.pipeline = parse_number(optarg); break;
+            case 'C': settings.commands.push_back(optarg); break;
+            case 's': settings.sizes.push_back(parse_number(optarg)); break;
+            case 'P': settings.pin = optarg; break;
+            case 'k': settings.key = parse_number(optarg); break;
+            case 'd':
+                settings.duration = parse_number(optarg);
+                duration_set = true;
+                break;
+            case 'n': settings.requests = parse_number(optarg); break;
+            case 'w': settings.warmup = parse_number(optarg); break;
+            case 'r': settings.reconnect = parse_number(optarg); break;
+            case 't': settings.timeout_ms = parse_number(optarg); break;
+            case 'L': settings.long_lines = true; break;
+            case 'o': output = optarg; break;
+            case 'b': baseline = optarg; break;
+            case 'T': threshold = parse_number(optarg); break;
+            case 'h':
+                fputs(usage, stdout);
+                return 0;
+            default:
+                fputs(usage, stderr);
+                return 1;
+        }
+    }
+    if (optind + 1 != argc){
+        fputs(usage, stderr);
+        return 1;
+    }
+    std::string target = argv[optind];
+    size_t colon = target.rfind(':');
+    settings.host = target.substr(0, colon);
+    if (colon != std::string::npos)
+        settings.port = (uint16_t)parse_number(target.c_str() + colon + 1);
+    if (settings.requests && !duration_set)
+        settings.duration = 0;
+    if (settings.commands.empty())
+        settings.commands.push_back("encrypt");
+    if (settings.sizes.empty())
+        settings.sizes.push_back(picohsm::block_size);
+    if (!settings.connections || !settings.pipeline){
+        fputs("picohsm-loadgen: connections and pipeline must not be 0\n",
+            stderr);
+        return 1;
+    }
+    for (const std::string& name: settings.commands){
+        if ((name != "help") && (name != "info") && (name != "pin") &&
+            (name != "encrypt") && (name != "decrypt")){
+            fprintf(stderr, "picohsm-loadgen: unknown command %s\n",
+                name.c_str());
+            return 1;
+        }
+    }
+    for (size_t size: settings.sizes){
+        // "decrypt PIN K " and the hexadecimal data
+        size_t len = 13 + std::to_string(settings.key).size() + 2 * size;
+        if (!size || (size % picohsm::block_size) ||
+            ((len > picohsm::max_line_length) && !settings.long_lines)){
+            fprintf(stderr, "picohsm-loadgen: invalid size %zu\n", size);
+            return 1;
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    loadgen_t loadgen(settings);
+    loadgen.run();
+
+    results_t results;
+    results.config["target"] = target;
+    std::string commands;
+    for (const std::string& name: settings.commands)
+        commands += (commands.empty() ? "" : ",") + name;
+    results.config["commands"] = commands;
+    std::string sizes;
+    for (size_t size: settings.sizes)
+        sizes += (sizes.empty() ? "" : ",") + std::to_string(size);
+    results.config["sizes"] = sizes;
+    results.config["connections"] = std::to_string(settings.connections);
+    results.config["pipeline"] = std::to_string(settings.pipeline);
+    results.config["reconnect"] = std::to_string(settings.reconnect);
+    loadgen.report(&results);
+
+    if (!output.empty() && !results.save(output)){
+        fprintf(stderr, "picohsm-loadgen: cannot write %s\n", output.c_str());
+        return 1;
+    }
+    if (!baseline.empty()){
+        results_t ref;
+        std::string err;
+        if (!ref.load(baseline, &err)){
+            fprintf(stderr, "picohsm-loadgen: %s\n", err.c_str());
+            return 1;
+        }
+        printf("\n");
+        int regressions = compare(ref, results, threshold);
+        fflush(stdout);
+        if (regressions){
+            fprintf(stderr, "picohsm-loadgen: %d regression(s)\n",
+                regressions);
+            return 1;
+        }
+    }
+    return 0;
+}
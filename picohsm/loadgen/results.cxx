@@ -0,0 +1,294 @@
+/**
+ * This file is part of picoHSM
+ * 
+ * picoHSM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Ledger SAS, written by Olivier Hériveaux
+ */
+
+#include "results.hxx"
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+
+samples_t::samples_t():
+    sorted(true){}
+
+
+/**
+ * Add a sample.
+ *
+ * @param us Duration, in microseconds.
+ */
+void samples_t::add(uint64_t us){
+    values.push_back(us);
+    sorted = false;
+}
+
+
+/**
+ * @return Number of samples.
+ */
+size_t samples_t::size() const {
+    return values.size();
+}
+
+
+/**
+ * @return Sample below which a fraction of the samples are, 0 if there is no
+ *     sample.
+ * @param p Fraction, between 0 and 1.
+ */
+uint64_t samples_t::percentile(double p){
+    if (values.empty())
+        return 0;
+    if (!sorted){
+        std::sort(values.begin(), values.end());
+        sorted = true;
+    }
+    size_t i = (size_t)(p * values.size());
+    return values[std::min(i, values.size() - 1)];
+}
+
+
+/**
+ * @return Largest sample, 0 if there is no sample.
+ */
+uint64_t samples_t::max(){
+    return percentile(1);
+}
+
+
+/**
+ * Add a measurement.
+ *
+ * @param name Name.
+ * @param value Value.
+ * @param unit Unit. Measurements in us or count are better when lower,
+ *     others when higher.
+ */
+void results_t::add(const std::string& name, double value,
+    const char* unit){
+
+    if (!measures.count(name))
+        order.push_back(name);
+    measures[name] = measure_t{value, unit};
+}
+
+
+/**
+ * @return A string as a JSON string literal.
+ * @param s String.
+ */
+static std::string json_string(const std::string& s){
+    std::string r = "\"";
+    for (char c: s){
+        if ((c == '"') || (c == '\\'))
+            r += '\\';
+        r += c;
+    }
+    return r + "\"";
+}
+
+
+/**
+ * Save as JSON, in the format of firmware-mcu/src/bench.py.
+ *
+ * @param path File path.
+ * @return false if the file cannot be written.
+ */
+bool results_t::save(const std::string& path) const {
+    std::ofstream f(path);
+    f << "{\n    \"version\": " << results_version << ",\n";
+    f << "    \"config\": {";
+    const char* sep = "\n";
+    for (auto& it: config){
+        f << sep << "        " << json_string(it.first) << ": "
+            << json_string(it.second);
+        sep = ",\n";
+    }
+    f << "\n    },\n    \"results\": {";
+    sep = "\n";
+    for (const std::string& name: order){
+        const measure_t& m = measures.at(name);
+        f << sep << "        " << json_string(name) << ": {\"value\": "
+            << m.value << ", \"unit\": " << json_string(m.unit) << "}";
+        sep = ",\n";
+    }
+    f << "\n    }\n}\n";
+    return f.good();
+}
+
+
+/** Reader of the JSON subset written by results_t::save. */
+class json_reader_t {
+    public:
+        json_reader_t(const std::string& s): s(s), pos(0){}
+
+        /** @return true if the next character is c, which is skipped. */
+        bool next(char c){
+            while ((pos < s.size()) && isspace((unsigned char)s[pos]))
+                ++pos;
+            if ((pos < s.size()) && (s[pos] == c)){
+                ++pos;
+                return true;
+            }
+            return false;
+        }
+
+        /** Read a string. Fails if there is none. */
+        std::string string(){
+            if (!next('"'))
+                throw std::runtime_error("string expected");
+            std::string r;
+            while ((pos < s.size()) && (s[pos] != '"')){
+                if ((s[pos] == '\\') && (pos + 1 < s.size()))
+                    ++pos;
+                r += s[pos++];
+            }
+            if (!next('"'))
+                throw std::runtime_error("unterminated string");
+            return r;
+        }
+
+        /** Read a number. Fails if there is none. */
+        double number(){
+            next(' ');
+            const char* start = s.c_str() + pos;
+            char* end;
+            double x = strtod(start, &end);
+            if (end == start)
+                throw std::runtime_error("number expected");
+            pos += end - start;
+            return x;
+        }
+
+        /**
+         * Read an object, calling f with each key. f reads the value.
+         */
+        template <typename F> void object(F f){
+            if (!next('{'))
+                throw std::runtime_error("object expected");
+            if (next('}'))
+                return;
+            do {
+                std::string key = string();
+                if (!next(':'))
+                    throw std::runtime_error("':' expected");
+                f(key);
+            } while (next(','));
+            if (!next('}'))
+                throw std::runtime_error("'}' expected");
+        }
+
+    private:
+        const std::string& s;
+        size_t pos;
+};
+
+
+/**
+ * Load results saved by save().
+ *
+ * @param path File path.
+ * @param error Where the error message is written.
+ * @return false on error.
+ */
+bool results_t::load(const std::string& path, std::string* error){
+    std::ifstream f(path);
+    if (!f){
+        *error = path + ": cannot be read";
+        return false;
+    }
+    std::stringstream buf;
+    buf << f.rdbuf();
+    std::string s = buf.str();
+    json_reader_t r(s);
+    try {
+        int version = -1;
+        r.object([&](const std::string& key){
+            if (key == "version"){
+                version = (int)r.number();
+            } else if (key == "config"){
+                r.object([&](const std::string& name){
+                    config[name] = r.string();
+                });
+            } else if (key == "results"){
+                r.object([&](const std::string& name){
+                    measure_t m;
+                    r.object([&](const std::string& field){
+                        if (field == "value")
+                            m.value = r.number();
+                        else
+                            m.unit = r.string();
+                    });
+                    add(name, m.value, m.unit.c_str());
+                });
+            } else {
+                throw std::runtime_error("unknown key " + key);
+            }
+        });
+        if (version != results_version)
+            throw std::runtime_error("results of another version");
+    } catch (const std::runtime_error& e){
+        *error = path + ": " + e.what();
+        return false;
+    }
+    return true;
+}
+
+
+/**
+ * Print the measurements of a run next to the reference ones.
+ *
+ * @param ref Reference results.
+ * @param cur Results of the run.
+ * @param threshold Tolerance, in percent.
+ * @return Number of measurements worse than the reference by more than the
+ *     threshold.
+ */
+int compare(const results_t& ref, const results_t& cur, double threshold){
+    for (auto& it: ref.config){
+        auto c = cur.config.find(it.first);
+        if ((c != cur.config.end()) && (c->second != it.second)){
+            printf("warning: %s differs: %s, was %s\n", it.first.c_str(),
+                c->second.c_str(), it.second.c_str());
+        }
+    }
+    int regressions = 0;
+    for (const std::string& name: ref.order){
+        auto c = cur.measures.find(name);
+        if (c == cur.measures.end())
+            continue;
+        const measure_t& r = ref.measures.at(name);
+        double a = r.value;
+        double b = c->second.value;
+        double change = a ? (b - a) / a * 100 : (b ? 100 : 0);
+        bool lower_better = (r.unit == "us") || (r.unit == "count");
+        double worse = lower_better ? change : -change;
+        const char* flag = "";
+        if (worse > threshold){
+            flag = " REGRESSION";
+            ++regressions;
+        }
+        printf("%-22s %12.1f %12.1f %-6s %+7.1f%%%s\n", name.c_str(), a, b,
+            r.unit.c_str(), change, flag);
+    }
+    return regressions;
+}
@@ -0,0 +1,73 @@
+/**
+ * This file is part of picoHSM
+ * 
+ * picoHSM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Ledger SAS, written by Olivier Hériveaux
+ */
+
+#ifndef _RESULTS_HXX_
+#define _RESULTS_HXX_
+
+
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+
+
+/** Version of the results file format. Results of different versions are not
+ * compared. */
+const int results_version = 1;
+
+
+/** Latency samples of one phase of the requests, in microseconds. */
+class samples_t {
+    public:
+        samples_t();
+        void add(uint64_t);
+        size_t size() const;
+        uint64_t percentile(double);
+        uint64_t max();
+
+    private:
+        std::vector<uint64_t> values;
+        bool sorted;
+};
+
+
+/** A measurement and its unit. */
+struct measure_t {
+    double value;
+    std::string unit;
+};
+
+
+/** Measurements of a run, with the settings they depend on. */
+struct results_t {
+    std::map<std::string, std::string> config;
+    std::map<std::string, measure_t> measures;
+    /** Names of the measurements, in the order they were added. */
+    std::vector<std::string> order;
+
+    void add(const std::string&, double, const char*);
+    bool save(const std::string&) const;
+    bool load(const std::string&, std::string*);
+};
+
+
+int compare(const results_t&, const results_t&, double);
+
+
+#endif
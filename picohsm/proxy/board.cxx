@@ -0,0 +1,78 @@
+/**
+ * This file is part of picoHSM
+ * 
+ * picoHSM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Ledger SAS, written by Olivier Hériveaux
+ */
+
+#include "board.hxx"
+
+
+const double histogram_t::bounds[bucket_count] = {0.001, 0.002, 0.005,
+    0.01, 0.02, 0.05, 0.1, 0.2, 0.5, 1, 2, 5};
+
+
+histogram_t::histogram_t():
+    counts(),
+    sum(0),
+    count(0){}
+
+
+/**
+ * Add a sample.
+ *
+ * @param seconds Duration, in seconds.
+ */
+void histogram_t::add(double seconds){
+    size_t i = 0;
+    while ((i < bucket_count) && (seconds > bounds[i]))
+        ++i;
+    ++counts[i];
+    sum += seconds;
+    ++count;
+}
+
+
+/**
+ * Constructor. The connection to the board is opened in the background.
+ *
+ * @param endpoint Address of the board.
+ * @param options Options of the connection.
+ */
+board_t::board_t(const picohsm::endpoint_t& endpoint,
+    const picohsm::options_t& options):
+    endpoint(endpoint),
+    client(new picohsm::client_t({endpoint}, options)),
+    session(client->session()),
+    healthy(false),
+    probing(false),
+    probe_time(0),
+    probe_duration(0),
+    outstanding_work(0),
+    counter_owner(),
+    context_owner(),
+    requests_ok(0),
+    requests_error(0),
+    requests_io_error(0),
+    failovers(0),
+    blocks(0){}
+
+
+/**
+ * @return Address of the board, as host:port.
+ */
+std::string board_t::name() const {
+    return endpoint.host + ":" + std::to_string(endpoint.port);
+}
@@ -0,0 +1,82 @@
+/**
+ * This file is part of picoHSM
+ * 
+ * picoHSM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Ledger SAS, written by Olivier Hériveaux
+ */
+
+#ifndef _BOARD_HXX_
+#define _BOARD_HXX_
+
+
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include "picohsm.hxx"
+
+
+/** Latency histogram, with the buckets exported as Prometheus metrics. */
+struct histogram_t {
+    static const size_t bucket_count = 12;
+    /** Upper bounds of the buckets, in seconds. */
+    static const double bounds[bucket_count];
+    /** Number of samples per bucket, the last one being unbounded. */
+    uint64_t counts[bucket_count + 1];
+    double sum;
+    uint64_t count;
+
+    histogram_t();
+    void add(double);
+};
+
+
+/** A board of the fleet, and its health and metrics. */
+struct board_t {
+    picohsm::endpoint_t endpoint;
+    std::unique_ptr<picohsm::client_t> client;
+    /** Session of the stateful commands sent to this board. Replaced when
+     * its connection fails or is renewed. */
+    std::shared_ptr<picohsm::session_t> session;
+    /** false if the last health check or a request failed. */
+    bool healthy;
+    /** true while a health check is running. */
+    bool probing;
+    /** Start time of the running health check, or time of the next one. */
+    uint64_t probe_time;
+    /** Duration of the last successful health check, in seconds. */
+    double probe_duration;
+    /** Blocks of the requests dispatched and not completed, plus one per
+     * request. */
+    uint64_t outstanding_work;
+    /** Client owning the CTR counter of each key, 0 if none. */
+    uint64_t counter_owner[picohsm::key_count];
+    /** Client owning each CBC context usable by sessions, 0 if none. */
+    uint64_t context_owner[picohsm::context_count - 1];
+
+    uint64_t requests_ok;
+    uint64_t requests_error;
+    uint64_t requests_io_error;
+    /** Requests sent again to another board after failing on this one. */
+    uint64_t failovers;
+    /** Blocks processed successfully. */
+    uint64_t blocks;
+    histogram_t latency;
+
+    board_t(const picohsm::endpoint_t&, const picohsm::options_t&);
+    std::string name() const;
+};
+
+
+#endif
@@ -0,0 +1,137 @@
+/**
+ * This file is part of picoHSM
+ * 
+ * picoHSM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Ledger SAS, written by Olivier Hériveaux
+ */
+
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "proxy.hxx"
+
+
+static const char usage[] =
+    "Usage: picohsm-proxy [OPTIONS] [HOST[:PORT]...]\n"
+    "\n"
+    "Serve picoHSM commands on one endpoint and forward them to a fleet of\n"
+    "boards, 192.168.60.11 to 192.168.60.20 if none is given.\n"
+    "\n"
+    "  -l, --listen HOST:PORT     address of the service (0.0.0.0:1234)\n"
+    "  -m, --metrics HOST:PORT    serve Prometheus metrics over HTTP\n"
+    "  -s, --split-blocks N       decryptions of 2N blocks or more are split\n"
+    "                             across boards (32)\n"
+    "  -a, --max-attempts N       boards tried by a failing request (3)\n"
+    "  -i, --health-interval MS   period of the health checks (1000)\n"
+    "  -t, --probe-timeout MS     slower health checks fail (2000)\n"
+    "  -p, --pipeline N           commands sent ahead to each board (8)\n";
+
+
+/**
+ * Parse an address. Exits on error.
+ *
+ * @param s Address, as HOST or HOST:PORT.
+ * @param port Port used if s has none.
+ * @return Address.
+ */
+static picohsm::endpoint_t parse_endpoint(const std::string& s,
+    uint16_t port){
+
+    size_t colon = s.rfind(':');
+    if (colon == std::string::npos)
+        return picohsm::endpoint_t(s, port);
+    char* end;
+    unsigned long x = strtoul(s.c_str() + colon + 1, &end, 10);
+    if ((colon + 1 == s.size()) || *end || (x == 0) || (x > 0xffff)){
+        fprintf(stderr, "picohsm-proxy: invalid address %s\n", s.c_str());
+        exit(1);
+    }
+    return picohsm::endpoint_t(s.substr(0, colon), (uint16_t)x);
+}
+
+
+/**
+ * @return Value of a numeric option. Exits if it is not a positive number.
+ */
+static unsigned parse_u32(const char* s){
+    char* end;
+    unsigned long x = strtoul(s, &end, 10);
+    if ((*s == 0) || *end || (x == 0)){
+        fprintf(stderr, "picohsm-proxy: invalid number %s\n", s);
+        exit(1);
+    }
+    return (unsigned)x;
+}
+
+
+int main(int argc, char** argv){
+    static const option long_options[] = {
+        {"listen", required_argument, 0, 'l'},
+        {"metrics", required_argument, 0, 'm'},
+        {"split-blocks", required_argument, 0, 's'},
+        {"max-attempts", required_argument, 0, 'a'},
+        {"health-interval", required_argument, 0, 'i'},
+        {"probe-timeout", required_argument, 0, 't'},
+        {"pipeline", required_argument, 0, 'p'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+    proxy_options_t options;
+    int c;
+    while ((c = getopt_long(argc, argv, "l:m:s:a:i:t:p:h", long_options, 0))
+        != -1){
+        switch (c){
+            case 'l': {
+                picohsm::endpoint_t e = parse_endpoint(optarg,
+                    options.listen_port);
+                options.listen_host = e.host;
+                options.listen_port = e.port;
+                break;
+            }
+            case 'm': {
+                picohsm::endpoint_t e = parse_endpoint(optarg, 9134);
+                options.metrics_host = e.host;
+                options.metrics_port = e.port;
+                break;
+            }
+            case 's': options.split_blocks = parse_u32(optarg); break;
+            case 'a': options.max_attempts = parse_u32(optarg); break;
+            case 'i': options.health_interval_ms = parse_u32(optarg); break;
+            case 't': options.probe_timeout_ms = parse_u32(optarg); break;
+            case 'p': options.board.max_in_flight = parse_u32(optarg); break;
+            case 'h':
+                fputs(usage, stdout);
+                return 0;
+            default:
+                fputs(usage, stderr);
+                return 1;
+        }
+    }
+
+    std::vector<picohsm::endpoint_t> boards;
+    for (int i = optind; i < argc; ++i)
+        boards.push_back(parse_endpoint(argv[i], picohsm::default_port));
+    if (boards.empty()){
+        // Boards flashed with the firmware-mcu-ipNN images
+        for (int i = 11; i <= 20; ++i)
+            boards.push_back(picohsm::endpoint_t("192.168.60." +
+                std::to_string(i)));
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    proxy_t proxy(boards, options);
+    proxy.run();
+}
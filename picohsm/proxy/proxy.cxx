@@ -0,0 +1,996 @@
+/**
+ * This file is part of picoHSM
+ * 
+ * picoHSM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Ledger SAS, written by Olivier Hériveaux
+ */
+
+#include "proxy.hxx"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <limits>
+#include <sstream>
+
+
+/** Request forwarded to a board. */
+struct proxy_t::op_t {
+    enum class kind_t { command, encrypt, decrypt, mac, nonce, ctr, cbc_init,
+        cbc_encrypt, cbc_decrypt };
+    kind_t kind;
+    /** Command line, for kind_t::command. */
+    std::string line;
+    std::string pin;
+    /** Key id, or board CBC context. */
+    uint8_t id;
+    /** Key id, for kind_t::cbc_init. */
+    uint8_t key;
+    picohsm::bytes_t data;
+    /** Board the request must be sent to, with its session. -1 for any
+     * board. */
+    ssize_t pinned;
+    /** Boards which failed this request. */
+    std::vector<size_t> tried;
+    /** Board processing the request. */
+    size_t board;
+    /** Session of the board when the request was sent. */
+    std::shared_ptr<picohsm::session_t> session;
+    /** Time when the request was sent, in microseconds. */
+    uint64_t start;
+    /** Called with the result from the last board. */
+    std::function<void(picohsm::result_t&)> done;
+
+    op_t(kind_t kind): kind(kind), id(0), key(0), pinned(-1), board(0),
+        start(0){}
+    /** @return Outstanding work of the request, for load balancing. */
+    uint64_t work() const { return data.size() / picohsm::block_size + 1; }
+};
+
+
+/**
+ * Stop the proxy because of an error.
+ *
+ * @param msg Error message.
+ */
+static void proxy_fail(const std::string& msg){
+    fprintf(stderr, "picohsm-proxy: %s\n", msg.c_str());
+    exit(1);
+}
+
+
+/**
+ * @return Monotonic time, in microseconds.
+ */
+static uint64_t now_us(){
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+/**
+ * Open a listening TCP socket. Fails on error.
+ *
+ * @param host IPv4 address.
+ * @param port TCP port.
+ * @return Socket, non-blocking.
+ */
+static int listen_tcp(const std::string& host, uint16_t port){
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1)
+        proxy_fail("invalid address " + host);
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if ((fd == -1) || bind(fd, (sockaddr*)&addr, sizeof(addr)) ||
+        listen(fd, 64))
+        proxy_fail(host + ":" + std::to_string(port) + ": " +
+            strerror(errno));
+    return fd;
+}
+
+
+/**
+ * Split a command line in arguments, as parse_args of the firmware does.
+ *
+ * @param line Command line.
+ * @return Arguments, at most 8.
+ */
+static std::vector<std::string> split_args(const std::string& line){
+    std::vector<std::string> args;
+    std::istringstream s(line);
+    std::string arg;
+    while ((args.size() < 8) && (s >> arg))
+        args.push_back(arg);
+    return args;
+}
+
+
+/**
+ * Parse a PIN and a key id or CBC context, as parse_pin_key of the firmware
+ * does.
+ *
+ * @param pin PIN argument.
+ * @param arg Key id or CBC context argument.
+ * @param context true for a CBC context.
+ * @param id Where the parsed value is written.
+ * @return Error message, empty if arguments are valid.
+ */
+static std::string parse_pin_id(const std::string& pin, const std::string& arg,
+    bool context, uint8_t* id){
+
+    if (pin.size() != picohsm::pin_length)
+        return "PIN must have 8 characters.";
+    char* end;
+    unsigned long x = strtoul(arg.c_str(), &end, 10);
+    if (arg.empty() || *end || (arg[0] == '-'))
+        return context ? "Invalid context format." : "Invalid key format.";
+    if (x >= (context ? picohsm::context_count : picohsm::key_count))
+        return context ? "Context must be in [0, 7]." :
+            "Key must be in [0, 7].";
+    *id = (uint8_t)x;
+    return "";
+}
+
+
+/**
+ * Parse an hexadecimal argument, with the error messages of the firmware.
+ *
+ * @param arg Argument.
+ * @param blocks true if the size must be a multiple of the AES block size.
+ * @param data Where the bytes are written.
+ * @return Error message, empty if the argument is valid.
+ */
+static std::string parse_data(const std::string& arg, bool blocks,
+    picohsm::bytes_t* data){
+
+    if (blocks && (arg.size() % (2 * picohsm::block_size)))
+        return "Data size must be a multiple of 16.";
+    if (arg.size() % 2)
+        return "Invalid data length.";
+    if (!picohsm::from_hex(arg, data))
+        return "Invalid data format.";
+    return "";
+}
+
+
+/**
+ * @return Response line of a request.
+ * @param r Result.
+ */
+static std::string format_result(const picohsm::result_t& r){
+    switch (r.status){
+        case picohsm::status_t::ok:
+            break;
+        case picohsm::status_t::error:
+            return r.message + "\n";
+        default:
+            return "Board unavailable.\n";
+    }
+    if (!r.lines.empty()){
+        std::string s;
+        for (const std::string& l: r.lines)
+            s += l + "\n";
+        return s;
+    }
+    return picohsm::to_hex(r.data.data(), r.data.size()) + "\n";
+}
+
+
+/**
+ * Constructor. Starts connecting to the boards and opens the listening
+ * sockets. Fails on error.
+ *
+ * @param endpoints Boards.
+ * @param options Settings.
+ */
+proxy_t::proxy_t(const std::vector<picohsm::endpoint_t>& endpoints,
+    const proxy_options_t& options):
+    options(options),
+    metrics_fd(-1),
+    next_client(1){
+
+    for (const picohsm::endpoint_t& e: endpoints)
+        boards.emplace_back(new board_t(e, options.board));
+    listen_fd = listen_tcp(options.listen_host, options.listen_port);
+    if (options.metrics_port)
+        metrics_fd = listen_tcp(options.metrics_host, options.metrics_port);
+    if (pipe2(wake, O_NONBLOCK | O_CLOEXEC))
+        proxy_fail(strerror(errno));
+}
+
+
+/**
+ * Call a function from the thread of run().
+ *
+ * @param f Function.
+ */
+void proxy_t::post(std::function<void()> f){
+    std::lock_guard<std::mutex> lock(mutex);
+    tasks.push_back(std::move(f));
+    char c = 0;
+    if (write(wake[1], &c, 1)){}
+}
+
+
+/**
+ * Serve the clients. Never returns.
+ */
+void proxy_t::run(){
+    std::vector<pollfd> fds;
+    std::vector<uint64_t> fd_clients;
+    for (;;){
+        std::vector<std::function<void()>> todo;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            todo.swap(tasks);
+        }
+        for (std::function<void()>& f: todo)
+            f();
+
+        uint64_t now = now_us();
+        check_health(now);
+        std::vector<uint64_t> ids;
+        for (auto& it: clients)
+            ids.push_back(it.first);
+        for (uint64_t id: ids)
+            read_client(id);
+
+        fds.clear();
+        fd_clients.clear();
+        fds.push_back(pollfd{wake[0], POLLIN, 0});
+        fds.push_back(pollfd{listen_fd, POLLIN, 0});
+        fds.push_back(pollfd{metrics_fd, POLLIN, 0});
+        for (auto& it: clients){
+            client_conn_t& c = it.second;
+            short events = 0;
+            if (!c.closing && (c.replies.size() < options.max_pending))
+                events |= POLLIN;
+            if (!c.out.empty())
+                events |= POLLOUT;
+            fds.push_back(pollfd{c.fd, events, 0});
+            fd_clients.push_back(it.first);
+        }
+        size_t http_start = fds.size();
+        for (http_conn_t& h: http_conns){
+            fds.push_back(pollfd{h.fd,
+                (short)(h.out.empty() ? POLLIN : POLLOUT), 0});
+        }
+        poll(fds.data(), fds.size(), 100);
+
+        if (fds[0].revents){
+            char buf[64];
+            while (read(wake[0], buf, sizeof(buf)) > 0){}
+        }
+        if (fds[1].revents)
+            accept_client();
+        if (fds[2].revents)
+            accept_http();
+        for (size_t i = 0; i < fd_clients.size(); ++i){
+            short revents = fds[3 + i].revents;
+            uint64_t id = fd_clients[i];
+            if (revents & POLLOUT)
+                write_client(id);
+            if (revents & (POLLIN | POLLHUP | POLLERR)){
+                client_conn_t& c = clients[id];
+                if (c.closing && c.replies.empty() && c.out.empty())
+                    continue;
+                char buf[4096];
+                ssize_t n = recv(c.fd, buf, sizeof(buf), 0);
+                if ((n == 0) || ((n == -1) && (errno != EAGAIN))){
+                    close_client(id);
+                    continue;
+                }
+                if (n > 0)
+                    c.in.append(buf, n);
+                read_client(id);
+            }
+        }
+        for (size_t i = http_start; i < fds.size(); ++i){
+            if (fds[i].revents)
+                process_http(http_conns[i - http_start]);
+        }
+        http_conns.erase(std::remove_if(http_conns.begin(), http_conns.end(),
+            [](const http_conn_t& h){ return h.fd == -1; }),
+            http_conns.end());
+    }
+}
+
+
+/**
+ * Accept a client, and send the greeting of the boards.
+ */
+void proxy_t::accept_client(){
+    int fd = accept4(listen_fd, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd == -1)
+        return;
+    client_conn_t& c = clients[next_client++];
+    c.fd = fd;
+    c.out =
+        "Hello from picoHSM!\n"
+        "Waiting for command...\n"
+        "Timeout in 15 seconds...\n";
+    c.last_command = now_us();
+    c.closing = false;
+}
+
+
+/**
+ * Execute the complete command lines received from a client, up to
+ * max_pending commands waiting for their response, and close the client if
+ * it is done or timed out.
+ *
+ * @param id Client.
+ */
+void proxy_t::read_client(uint64_t id){
+    client_conn_t& c = clients[id];
+    size_t start = 0;
+    size_t end;
+    while (!c.closing && (c.replies.size() < options.max_pending) &&
+        ((end = c.in.find('\n', start)) != std::string::npos)){
+        std::string line = c.in.substr(start, end - start);
+        start = end + 1;
+        if (split_args(line).empty())
+            c.closing = true; // An empty line ends the connection
+        else
+            execute(id, line);
+    }
+    c.in.erase(0, start);
+    if (!c.closing && (c.in.size() > options.max_line))
+        c.closing = true;
+    if (!c.closing && c.replies.empty() &&
+        (now_us() - c.last_command > options.client_timeout_ms * 1000ull))
+        c.closing = true;
+    if (c.closing && c.replies.empty() && c.out.empty())
+        close_client(id);
+}
+
+
+/**
+ * Send buffered responses to a client. On error, the client is closed by the
+ * next call to read_client.
+ *
+ * @param id Client.
+ */
+void proxy_t::write_client(uint64_t id){
+    client_conn_t& c = clients[id];
+    while (!c.out.empty()){
+        ssize_t n = send(c.fd, c.out.data(), c.out.size(), MSG_NOSIGNAL);
+        if (n == -1){
+            if (errno != EAGAIN){
+                // Closed by read_client, which may be running.
+                c.closing = true;
+                c.replies.clear();
+                c.out.clear();
+            }
+            return;
+        }
+        c.out.erase(0, n);
+    }
+}
+
+
+/**
+ * Close a client, and release the CTR counters and CBC contexts it holds.
+ * Its requests still running complete without response.
+ *
+ * @param id Client.
+ */
+void proxy_t::close_client(uint64_t id){
+    client_conn_t& c = clients[id];
+    for (auto& it: c.counters){
+        uint64_t& owner = boards[it.second]->counter_owner[it.first];
+        if (owner == id)
+            owner = 0;
+    }
+    for (auto& it: c.contexts){
+        uint64_t& owner =
+            boards[it.second.board]->context_owner[it.second.context];
+        if (owner == id)
+            owner = 0;
+    }
+    close(c.fd);
+    clients.erase(id);
+}
+
+
+/**
+ * Move the completed responses at the head of a client's queue to its output
+ * buffer, and send them.
+ *
+ * @param id Client.
+ */
+void proxy_t::send_replies(uint64_t id){
+    auto it = clients.find(id);
+    if (it == clients.end())
+        return;
+    client_conn_t& c = it->second;
+    while (!c.replies.empty() && c.replies.front()->done){
+        c.out += c.replies.front()->text;
+        c.replies.pop_front();
+    }
+    write_client(id);
+}
+
+
+/**
+ * Set the response of a command.
+ *
+ * @param id Client.
+ * @param reply Response.
+ * @param text Response text, with its line returns.
+ */
+void proxy_t::complete(uint64_t id, const reply_ptr_t& reply,
+    const std::string& text){
+
+    reply->done = true;
+    reply->text = text;
+    send_replies(id);
+}
+
+
+/**
+ * Execute a command of a client.
+ *
+ * @param id Client.
+ * @param line Command line.
+ */
+void proxy_t::execute(uint64_t id, const std::string& line){
+    client_conn_t& c = clients[id];
+    c.last_command = now_us();
+    reply_ptr_t reply = std::make_shared<reply_t>();
+    reply->done = false;
+    c.replies.push_back(reply);
+
+    std::vector<std::string> args = split_args(line);
+    const std::string& name = args[0];
+    if ((name == "nonce") || (name == "ctr") || (name == "cbcinit") ||
+        (name == "cbcenc") || (name == "cbcdec")){
+        execute_stateful(id, name, args, reply);
+        return;
+    }
+
+    op_ptr_t op;
+    if ((name == "encrypt") || (name == "decrypt") || (name == "mac")){
+        op = std::make_shared<op_t>((name == "encrypt") ?
+            op_t::kind_t::encrypt : (name == "decrypt") ?
+            op_t::kind_t::decrypt : op_t::kind_t::mac);
+        std::string err;
+        if (args.size() != 4)
+            err = "Expected 3 arguments.";
+        if (err.empty())
+            err = parse_pin_id(args[1], args[2], false, &op->id);
+        if (err.empty())
+            err = parse_data(args[3], op->kind != op_t::kind_t::mac,
+                &op->data);
+        if (!err.empty()){
+            complete(id, reply, err + "\n");
+            return;
+        }
+        op->pin = args[1];
+    } else if (picohsm::command_framing(line) == picohsm::framing_t::unknown){
+        complete(id, reply, std::string(picohsm::sentinel_response) + "\n");
+        return;
+    } else {
+        op = std::make_shared<op_t>(op_t::kind_t::command);
+        op->line = line;
+    }
+    op->done = [this, id, reply](picohsm::result_t& r){
+        complete(id, reply, format_result(r));
+    };
+    if ((op->kind == op_t::kind_t::decrypt) &&
+        (op->data.size() >= 2 * options.split_blocks * picohsm::block_size))
+        decrypt_split(op);
+    else
+        dispatch(op);
+}
+
+
+/**
+ * Execute a command using a CTR counter or a CBC context. They are allocated
+ * on a board by the nonce and cbcinit commands, and the following commands
+ * are sent to that board.
+ *
+ * @param id Client.
+ * @param name Command name.
+ * @param args Arguments, including the command name.
+ * @param reply Response.
+ */
+void proxy_t::execute_stateful(uint64_t id, const std::string& name,
+    std::vector<std::string>& args, const reply_ptr_t& reply){
+
+    client_conn_t& c = clients[id];
+    op_ptr_t op;
+    std::string err;
+    bool init = (name == "nonce") || (name == "cbcinit");
+    bool cbc = (name == "cbcinit") || (name == "cbcenc") || (name == "cbcdec");
+    uint8_t slot = 0;
+    if (args.size() != (name == "cbcinit" ? 5u : 4u))
+        err = (name == "cbcinit") ? "Expected 4 arguments." :
+            "Expected 3 arguments.";
+    if (err.empty())
+        err = parse_pin_id(args[1], args[2], cbc, &slot);
+
+    if (name == "nonce"){
+        op = std::make_shared<op_t>(op_t::kind_t::nonce);
+        if (err.empty() && (args[3].size() != 2 * picohsm::block_size))
+            err = "Nonce must have 16 bytes.";
+    } else if (name == "cbcinit"){
+        op = std::make_shared<op_t>(op_t::kind_t::cbc_init);
+        if (err.empty())
+            err = parse_pin_id(args[1], args[3], false, &op->key);
+        if (err.empty() && (args[4].size() != 2 * picohsm::block_size))
+            err = "IV must have 16 bytes.";
+    } else {
+        op = std::make_shared<op_t>((name == "ctr") ? op_t::kind_t::ctr :
+            (name == "cbcenc") ? op_t::kind_t::cbc_encrypt :
+            op_t::kind_t::cbc_decrypt);
+    }
+    if (err.empty())
+        err = parse_data(args.back(), true, &op->data);
+
+    // Find the board holding the counter or context, or allocate one.
+    if (err.empty()){
+        auto counter = c.counters.find(slot);
+        auto context = c.contexts.find(slot);
+        if (!cbc && (counter != c.counters.end())){
+            op->pinned = counter->second;
+            op->id = slot;
+        } else if (cbc && (context != c.contexts.end())){
+            op->pinned = context->second.board;
+            op->id = context->second.context;
+        } else if (!init){
+            err = cbc ? "CBC context is not initialized." :
+                "No nonce set for this key.";
+        } else {
+            uint64_t best = std::numeric_limits<uint64_t>::max();
+            for (size_t i = 0; i < boards.size(); ++i){
+                board_t& b = *boards[i];
+                uint64_t work = b.outstanding_work +
+                    (b.healthy ? 0 : std::numeric_limits<uint64_t>::max() / 2);
+                if (work >= best)
+                    continue;
+                if (!cbc && !b.counter_owner[slot]){
+                    op->pinned = i;
+                    op->id = slot;
+                    best = work;
+                }
+                for (uint8_t j = 0; cbc && (j < picohsm::context_count - 1);
+                    ++j){
+                    if (!b.context_owner[j]){
+                        op->pinned = i;
+                        op->id = j;
+                        best = work;
+                        break;
+                    }
+                }
+            }
+            if (op->pinned < 0){
+                err = cbc ? "No CBC context available." :
+                    "No CTR counter available for this key.";
+            } else if (cbc){
+                boards[op->pinned]->context_owner[op->id] = id;
+                c.contexts[slot] = context_t{(size_t)op->pinned, op->id};
+            } else {
+                boards[op->pinned]->counter_owner[slot] = id;
+                c.counters[slot] = op->pinned;
+            }
+        }
+    }
+    if (!err.empty()){
+        complete(id, reply, err + "\n");
+        return;
+    }
+    op->pin = args[1];
+    op->done = [this, id, name, args, reply, op, init, cbc](
+        picohsm::result_t& r){
+
+        std::string text = format_result(r);
+        if ((r.status == picohsm::status_t::session_lost) && init &&
+            clients.count(id)){
+            // Allocate again on the new session of the board.
+            std::vector<std::string> again = args;
+            execute_stateful(id, name, again, reply);
+            return;
+        } else if (r.status == picohsm::status_t::session_lost){
+            text = cbc ? "CBC context is not initialized.\n" :
+                "No nonce set for this key.\n";
+        }
+        if (r.ok() && (op->kind == op_t::kind_t::nonce))
+            text = std::string(picohsm::nonce_set_response) + "\n";
+        else if (r.ok() && (op->kind == op_t::kind_t::cbc_init))
+            text = std::string(picohsm::context_set_response) + "\n";
+        complete(id, reply, text);
+    };
+    dispatch(op);
+}
+
+
+/**
+ * @return Index of the board with the least outstanding work, preferring
+ *     the healthy ones. -1 if all boards have been tried.
+ * @param tried Boards to be avoided.
+ */
+ssize_t proxy_t::pick(const std::vector<size_t>& tried) const {
+    ssize_t best = -1;
+    uint64_t best_work = std::numeric_limits<uint64_t>::max();
+    for (size_t i = 0; i < boards.size(); ++i){
+        if (std::find(tried.begin(), tried.end(), i) != tried.end())
+            continue;
+        uint64_t work = boards[i]->outstanding_work;
+        if (!boards[i]->healthy)
+            work += std::numeric_limits<uint64_t>::max() / 2;
+        if (work < best_work){
+            best = i;
+            best_work = work;
+        }
+    }
+    return best;
+}
+
+
+/**
+ * Send a request to a board.
+ *
+ * @param op Request.
+ */
+void proxy_t::dispatch(const op_ptr_t& op){
+    ssize_t i = (op->pinned >= 0) ? op->pinned : pick(op->tried);
+    if (i < 0){
+        picohsm::result_t r;
+        r.status = picohsm::status_t::io_error;
+        op->done(r);
+        return;
+    }
+    board_t& b = *boards[i];
+    op->board = i;
+    op->start = now_us();
+    op->session = b.session;
+    b.outstanding_work += op->work();
+    picohsm::callback_t cb = [this, op](picohsm::result_t r){
+        post([this, op, r]() mutable { on_result(op, r); });
+    };
+    picohsm::session_t& s = *b.session;
+    switch (op->kind){
+        case op_t::kind_t::command:
+            b.client->command(op->line, cb);
+            break;
+        case op_t::kind_t::encrypt:
+            b.client->encrypt(op->pin, op->id, op->data, cb);
+            break;
+        case op_t::kind_t::decrypt:
+            b.client->decrypt(op->pin, op->id, op->data, cb);
+            break;
+        case op_t::kind_t::mac:
+            b.client->mac(op->pin, op->id, op->data, cb);
+            break;
+        case op_t::kind_t::nonce:
+            s.nonce(op->pin, op->id, op->data, cb);
+            break;
+        case op_t::kind_t::ctr:
+            s.ctr(op->pin, op->id, op->data, cb);
+            break;
+        case op_t::kind_t::cbc_init:
+            s.cbc_init(op->pin, op->id, op->key, op->data, cb);
+            break;
+        case op_t::kind_t::cbc_encrypt:
+            s.cbc_encrypt(op->pin, op->id, op->data, cb);
+            break;
+        case op_t::kind_t::cbc_decrypt:
+            s.cbc_decrypt(op->pin, op->id, op->data, cb);
+            break;
+    }
+}
+
+
+/**
+ * Forget the CTR counters and CBC contexts allocated on a board, after its
+ * session is lost, and start a new session.
+ *
+ * @param board Board.
+ */
+void proxy_t::forget_state(size_t board){
+    board_t& b = *boards[board];
+    b.session = b.client->session();
+    for (auto& it: clients){
+        client_conn_t& c = it.second;
+        for (auto j = c.counters.begin(); j != c.counters.end();)
+            j = (j->second == board) ? c.counters.erase(j) : std::next(j);
+        for (auto j = c.contexts.begin(); j != c.contexts.end();)
+            j = (j->second.board == board) ? c.contexts.erase(j) : std::next(j);
+    }
+    std::fill_n(b.counter_owner, picohsm::key_count, 0);
+    std::fill_n(b.context_owner, picohsm::context_count - 1, 0);
+}
+
+
+/**
+ * Handle the result of a request from a board. Failed stateless requests
+ * are sent to another board.
+ *
+ * @param op Request.
+ * @param r Result.
+ */
+void proxy_t::on_result(const op_ptr_t& op, picohsm::result_t& r){
+    board_t& b = *boards[op->board];
+    b.outstanding_work -= op->work();
+    b.latency.add((now_us() - op->start) / 1e6);
+    switch (r.status){
+        case picohsm::status_t::ok:
+            ++b.requests_ok;
+            if (op->kind != op_t::kind_t::mac)
+                b.blocks += op->data.size() / picohsm::block_size;
+            break;
+        case picohsm::status_t::error:
+            ++b.requests_error;
+            break;
+        case picohsm::status_t::session_lost:
+            // The connection was renewed before the firmware deadline: the
+            // board is fine, but the state of the old session is lost.
+            ++b.requests_error;
+            if (op->session == b.session)
+                forget_state(op->board);
+            break;
+        case picohsm::status_t::io_error:
+            ++b.requests_io_error;
+            b.healthy = false;
+            if (op->pinned >= 0){
+                // The state of the board is lost with its connection.
+                if (op->session == b.session)
+                    forget_state(op->board);
+                break;
+            }
+            op->tried.push_back(op->board);
+            if ((op->tried.size() < options.max_attempts) &&
+                (pick(op->tried) >= 0)){
+                ++b.failovers;
+                dispatch(op);
+                return;
+            }
+            break;
+    }
+    op->done(r);
+}
+
+
+/**
+ * Split a decryption across the healthy boards. In CBC, a block is decrypted
+ * from itself and the previous ciphertext block, so each part is decrypted
+ * with a zero IV and its first block is then XORed with the last ciphertext
+ * block of the previous part.
+ *
+ * @param op Decryption request.
+ */
+void proxy_t::decrypt_split(const op_ptr_t& op){
+    const size_t bs = picohsm::block_size;
+    size_t n = op->data.size() / bs;
+    size_t healthy = 0;
+    for (const std::unique_ptr<board_t>& b: boards)
+        healthy += b->healthy;
+    size_t parts = std::min(healthy, n / options.split_blocks);
+    if (parts < 2){
+        dispatch(op);
+        return;
+    }
+    // Parts are multiples of the blocks of a command.
+    const size_t m = picohsm::max_command_blocks;
+    size_t per = ((n + parts - 1) / parts + m - 1) / m * m;
+
+    struct split_t {
+        size_t remaining;
+        picohsm::result_t result;
+    };
+    std::shared_ptr<split_t> split = std::make_shared<split_t>();
+    split->remaining = (n + per - 1) / per;
+    split->result.data.resize(op->data.size());
+    for (size_t a = 0; a < n; a += per){
+        size_t count = std::min(per, n - a);
+        op_ptr_t part = std::make_shared<op_t>(op_t::kind_t::decrypt);
+        part->pin = op->pin;
+        part->id = op->id;
+        part->data.assign(op->data.begin() + a * bs,
+            op->data.begin() + (a + count) * bs);
+        part->done = [op, split, a, bs](picohsm::result_t& r){
+            picohsm::result_t& res = split->result;
+            if (r.ok() && res.ok()){
+                std::copy(r.data.begin(), r.data.end(),
+                    res.data.begin() + a * bs);
+                for (size_t i = 0; a && (i < bs); ++i)
+                    res.data[a * bs + i] ^= op->data[(a - 1) * bs + i];
+            } else if (res.ok()){
+                res.status = r.status;
+                res.message = r.message;
+            }
+            if (--split->remaining == 0){
+                if (!res.ok())
+                    res.data.clear();
+                op->done(res);
+            }
+        };
+        dispatch(part);
+    }
+}
+
+
+/**
+ * Send the periodic health checks: a keys command, which goes through both
+ * MCUs of the board. As it is queued behind the other commands of the board,
+ * an overloaded board is also marked unhealthy.
+ *
+ * @param now Current time, in microseconds.
+ */
+void proxy_t::check_health(uint64_t now){
+    for (size_t i = 0; i < boards.size(); ++i){
+        board_t& b = *boards[i];
+        if (b.probing){
+            if (now - b.probe_time > options.probe_timeout_ms * 1000ull)
+                b.healthy = false;
+            continue;
+        }
+        if (now < b.probe_time)
+            continue;
+        b.probing = true;
+        b.probe_time = now;
+        b.client->command("keys", [this, i](picohsm::result_t r){
+            post([this, i, r](){
+                board_t& b = *boards[i];
+                uint64_t t = now_us();
+                b.probing = false;
+                // The firmware cannot be used at all, see protocol.hxx.
+                if (r.message.find(picohsm::sentinel_mismatch) !=
+                    std::string::npos)
+                    fprintf(stderr, "picohsm-proxy: %s\n", r.message.c_str());
+                b.healthy = r.ok() &&
+                    (r.lines.size() == picohsm::key_count);
+                if (b.healthy)
+                    b.probe_duration = (t - b.probe_time) / 1e6;
+                b.probe_time = t + options.health_interval_ms * 1000ull;
+            });
+        });
+    }
+}
+
+
+/**
+ * Accept a connection to the metrics server.
+ */
+void proxy_t::accept_http(){
+    int fd = accept4(metrics_fd, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd != -1)
+        http_conns.push_back(http_conn_t{fd, "", ""});
+}
+
+
+/**
+ * Read the request of a metrics client, and send the metrics back whatever
+ * the request is. The connection is closed once they are sent.
+ *
+ * @param h Connection. Its file descriptor is set to -1 when closed.
+ */
+void proxy_t::process_http(http_conn_t& h){
+    if (h.out.empty()){
+        char buf[1024];
+        ssize_t n = recv(h.fd, buf, sizeof(buf), 0);
+        if ((n <= 0) || (h.in.size() > 8192)){
+            close(h.fd);
+            h.fd = -1;
+            return;
+        }
+        h.in.append(buf, n);
+        if (h.in.find("\r\n\r\n") == std::string::npos)
+            return;
+        std::string body = metrics();
+        h.out = "HTTP/1.0 200 OK\r\n"
+            "Content-Type: text/plain; version=0.0.4\r\n"
+            "Content-Length: " + std::to_string(body.size()) + "\r\n"
+            "Connection: close\r\n\r\n" + body;
+    }
+    ssize_t n = send(h.fd, h.out.data(), h.out.size(), MSG_NOSIGNAL);
+    if (n > 0)
+        h.out.erase(0, n);
+    if (h.out.empty() || ((n == -1) && (errno != EAGAIN))){
+        close(h.fd);
+        h.fd = -1;
+    }
+}
+
+
+/**
+ * @return Metrics of the boards, in the Prometheus text format. Throughput is
+ *     the rate of picohsm_board_blocks_total.
+ */
+std::string proxy_t::metrics() const {
+    std::ostringstream s;
+    auto family = [&](const char* name, const char* type, const char* help){
+        s << "# HELP " << name << " " << help << "\n# TYPE " << name << " "
+            << type << "\n";
+    };
+    auto label = [](const board_t& b){
+        return "{board=\"" + b.name() + "\"";
+    };
+
+    family("picohsm_board_up", "gauge",
+        "1 if the board passed its last health check.");
+    for (const std::unique_ptr<board_t>& b: boards)
+        s << "picohsm_board_up" << label(*b) << "} " << b->healthy << "\n";
+    family("picohsm_board_outstanding_blocks", "gauge",
+        "Blocks of the requests sent to the board and not completed.");
+    for (const std::unique_ptr<board_t>& b: boards){
+        s << "picohsm_board_outstanding_blocks" << label(*b) << "} "
+            << b->outstanding_work << "\n";
+    }
+    family("picohsm_board_requests_total", "counter",
+        "Requests completed by the board, by result.");
+    for (const std::unique_ptr<board_t>& b: boards){
+        s << "picohsm_board_requests_total" << label(*b)
+            << ",result=\"ok\"} " << b->requests_ok << "\n";
+        s << "picohsm_board_requests_total" << label(*b)
+            << ",result=\"error\"} " << b->requests_error << "\n";
+        s << "picohsm_board_requests_total" << label(*b)
+            << ",result=\"io_error\"} " << b->requests_io_error << "\n";
+    }
+    family("picohsm_board_failovers_total", "counter",
+        "Requests sent to another board after failing on this one.");
+    for (const std::unique_ptr<board_t>& b: boards){
+        s << "picohsm_board_failovers_total" << label(*b) << "} "
+            << b->failovers << "\n";
+    }
+    family("picohsm_board_blocks_total", "counter",
+        "AES blocks processed by the board.");
+    for (const std::unique_ptr<board_t>& b: boards){
+        s << "picohsm_board_blocks_total" << label(*b) << "} " << b->blocks
+            << "\n";
+    }
+    family("picohsm_board_probe_seconds", "gauge",
+        "Duration of the last successful health check.");
+    for (const std::unique_ptr<board_t>& b: boards){
+        s << "picohsm_board_probe_seconds" << label(*b) << "} "
+            << b->probe_duration << "\n";
+    }
+    family("picohsm_board_request_seconds", "histogram",
+        "Time from sending a request to the board to its result.");
+    for (const std::unique_ptr<board_t>& b: boards){
+        const histogram_t& h = b->latency;
+        uint64_t count = 0;
+        for (size_t i = 0; i <= histogram_t::bucket_count; ++i){
+            count += h.counts[i];
+            s << "picohsm_board_request_seconds_bucket" << label(*b)
+                << ",le=\"";
+            if (i < histogram_t::bucket_count)
+                s << histogram_t::bounds[i];
+            else
+                s << "+Inf";
+            s << "\"} " << count << "\n";
+        }
+        s << "picohsm_board_request_seconds_sum" << label(*b) << "} "
+            << h.sum << "\n";
+        s << "picohsm_board_request_seconds_count" << label(*b) << "} "
+            << h.count << "\n";
+    }
+    family("picohsm_proxy_clients", "gauge", "Connected clients.");
+    s << "picohsm_proxy_clients " << clients.size() << "\n";
+    return s.str();
+}
@@ -0,0 +1,174 @@
+/**
+ * This file is part of picoHSM
+ * 
+ * picoHSM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Ledger SAS, written by Olivier Hériveaux
+ */
+
+#ifndef _PROXY_HXX_
+#define _PROXY_HXX_
+
+
+#include <stdint.h>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "board.hxx"
+
+
+/** Settings of the proxy. */
+struct proxy_options_t {
+    std::string listen_host;
+    uint16_t listen_port;
+    /** Address of the HTTP server of the metrics. Disabled if the port is
+     * 0. */
+    std::string metrics_host;
+    uint16_t metrics_port;
+    /** Period of the health checks of each board, in milliseconds. */
+    unsigned health_interval_ms;
+    /** A board is unhealthy if a health check takes longer, in
+     * milliseconds. */
+    unsigned probe_timeout_ms;
+    /** A decryption is split across boards if it has at least twice this
+     * number of blocks. */
+    unsigned split_blocks;
+    /** Maximum number of boards a request is sent to when they fail. */
+    unsigned max_attempts;
+    /** A client is disconnected if it sends no command during this time,
+     * in milliseconds, as the boards do. */
+    unsigned client_timeout_ms;
+    /** Maximum length of a command line. */
+    size_t max_line;
+    /** Maximum number of commands of a client waiting for their response.
+     * Commands are not read from the client above this number. */
+    size_t max_pending;
+    /** Options of the connections to the boards. */
+    picohsm::options_t board;
+
+    proxy_options_t():
+        listen_host("0.0.0.0"),
+        listen_port(picohsm::default_port),
+        metrics_host("0.0.0.0"),
+        metrics_port(0),
+        health_interval_ms(1000),
+        probe_timeout_ms(2000),
+        split_blocks(32),
+        max_attempts(3),
+        client_timeout_ms(15000),
+        max_line(1 << 20),
+        max_pending(64){}
+};
+
+
+/**
+ * Serves the text protocol of the boards on one endpoint, and forwards the
+ * commands to a fleet of boards. Everything runs in the thread calling run(),
+ * the callbacks of the boards being posted back to it.
+ *
+ * Stateless commands go to the healthy board with the least outstanding work,
+ * and are sent to another board if the first one fails. Long decryptions are
+ * split across boards. The CTR counters and CBC contexts used by a client are
+ * allocated on a board, where the following commands using them are sent.
+ */
+class proxy_t {
+    public:
+        proxy_t(const std::vector<picohsm::endpoint_t>&,
+            const proxy_options_t&);
+        void run();
+
+    private:
+        struct op_t;
+        typedef std::shared_ptr<op_t> op_ptr_t;
+
+        /** Response to a command of a client, sent when it is complete and
+         * all the previous ones are sent. */
+        struct reply_t {
+            bool done;
+            std::string text;
+        };
+        typedef std::shared_ptr<reply_t> reply_ptr_t;
+
+        /** A board CBC context allocated to a client. */
+        struct context_t {
+            size_t board;
+            uint8_t context;
+        };
+
+        struct client_conn_t {
+            int fd;
+            std::string in;
+            std::string out;
+            std::deque<reply_ptr_t> replies;
+            /** Time of the last command, or of the connection. */
+            uint64_t last_command;
+            /** true when the connection is closed once out is sent. */
+            bool closing;
+            /** Board holding the CTR counter of each key used. */
+            std::map<uint8_t, size_t> counters;
+            /** Board contexts allocated to the CBC contexts used. */
+            std::map<uint8_t, context_t> contexts;
+        };
+
+        /** Connection to the metrics HTTP server. */
+        struct http_conn_t {
+            int fd;
+            std::string in;
+            std::string out;
+        };
+
+        proxy_options_t options;
+        std::vector<std::unique_ptr<board_t>> boards;
+        int listen_fd;
+        int metrics_fd;
+        /** Clients, by identifier. Identifiers are never reused. */
+        std::map<uint64_t, client_conn_t> clients;
+        uint64_t next_client;
+        std::vector<http_conn_t> http_conns;
+        /** Protects tasks. */
+        std::mutex mutex;
+        /** Functions posted by the threads of the boards. */
+        std::vector<std::function<void()>> tasks;
+        /** Pipe waking run() up when a task is posted. */
+        int wake[2];
+
+        void post(std::function<void()>);
+        void accept_client();
+        void read_client(uint64_t);
+        void write_client(uint64_t);
+        void close_client(uint64_t);
+        void send_replies(uint64_t);
+        void execute(uint64_t, const std::string&);
+        void execute_stateful(uint64_t, const std::string&,
+            std::vector<std::string>&, const reply_ptr_t&);
+        void complete(uint64_t, const reply_ptr_t&, const std::string&);
+        ssize_t pick(const std::vector<size_t>&) const;
+        void dispatch(const op_ptr_t&);
+        void forget_state(size_t);
+        void on_result(const op_ptr_t&, picohsm::result_t&);
+        void decrypt_split(const op_ptr_t&);
+        void on_session_result(size_t,
+            const std::shared_ptr<picohsm::session_t>&, picohsm::result_t&);
+        void check_health(uint64_t);
+        void accept_http();
+        void process_http(http_conn_t&);
+        std::string metrics() const;
+};
+
+
+#endif